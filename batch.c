@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "common.h"
+#include "store.h"
+#include "wal.h"
+#include "stats.h"
+
+#define EOD_MAGIC 0x31444f45u           // "EOD1"
+#define MAX_BATCH_THREADS 64
+
+typedef struct {
+    double rate;                // daily interest, percent
+    double fee;
+    double waive;               // no fee at or above this balance
+    int at;                     // minutes after midnight; -1 = on demand only
+    int threads;
+    int statements;
+} EodSpec;
+
+/* data/eod.state: the last run started, with the terms it runs under so a
+   resumed run finishes the way it began. */
+typedef struct {
+    uint32_t magic;
+    uint32_t day;
+    uint32_t done;              // 0 while unfinished
+    uint32_t statements;
+    uint64_t start_lsn;         // no change of the run is logged before it
+    double rate, fee, waive;
+} EodState;
+
+typedef struct {
+    double interest, fees;
+    long credited, charged;
+    long dropped;               // statement lines lost: no memory for them
+    char *out;                  // statement lines not yet written
+    size_t len, cap;
+} __attribute__((aligned(64))) EodPart;
+
+typedef struct {
+    EodState st;
+    int threads;
+    int resumed;                // accounts an earlier attempt already changed
+    FILE *statements;
+    pthread_mutex_t out_lock;
+    uint64_t started;
+    EodPart part[MAX_BATCH_THREADS];
+} EodRun;
+
+typedef struct {
+    uint32_t day;
+    long changed, credited, charged, dropped;
+    double interest, fees;
+    double secs;
+    int threads, resumed;
+} EodResult;
+
+static EodSpec spec = { .at = -1 };
+static int configured;
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static EodState state;          // as on disk
+static EodRun *current;         // the run in progress
+static EodResult last;
+static uint64_t hold_lsn;       // start of an unfinished run
+
+// Accounts an interrupted run had changed, found by recovery; only read
+// once the resumed run is under way.
+static int *resumed_ids;
+static size_t resumed_cap, resumed_n;
+static pthread_mutex_t resumed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int batch_configure(const char *text) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", text);
+    spec.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        const char *val = eq ? eq + 1 : "";
+        if (eq) *eq = 0;
+        int h, m;
+        if (strcmp(tok, "interest") == 0) spec.rate = atof(val);
+        else if (strcmp(tok, "fee") == 0) spec.fee = atof(val);
+        else if (strcmp(tok, "waive") == 0) spec.waive = atof(val);
+        else if (strcmp(tok, "threads") == 0) spec.threads = atoi(val);
+        else if (strcmp(tok, "statements") == 0 && !eq) spec.statements = 1;
+        else if (strcmp(tok, "at") == 0 && sscanf(val, "%d:%d", &h, &m) == 2 &&
+                 h >= 0 && h < 24 && m >= 0 && m < 60) spec.at = h * 60 + m;
+        else return -1;
+    }
+    if (spec.rate < 0 || spec.fee < 0 || spec.threads < 1) return -1;
+    if (spec.threads > MAX_BATCH_THREADS) spec.threads = MAX_BATCH_THREADS;
+    configured = 1;
+    return 0;
+}
+
+static uint32_t today(void) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+// Same pattern as the WAL checkpoint: write beside it, rename over.
+static int state_write(const EodState *st) {
+    const char *tmp = EOD_STATE_FILE ".tmp";
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(tmp); return -1; }
+    int ok = write(fd, st, sizeof(*st)) == sizeof(*st) && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, EOD_STATE_FILE) < 0) { perror("write " EOD_STATE_FILE); return -1; }
+    int dir = open("data", O_RDONLY | O_DIRECTORY);
+    if (dir >= 0) { fsync(dir); close(dir); }
+    return 0;
+}
+
+int batch_open(void) {
+    int fd = open(EOD_STATE_FILE, O_RDONLY);
+    if (fd < 0) return 0;
+    EodState st;
+    ssize_t n = read(fd, &st, sizeof(st));
+    close(fd);
+    if (n != sizeof(st) || st.magic != EOD_MAGIC) {
+        fprintf(stderr, "Ignoring damaged %s\n", EOD_STATE_FILE);
+        return 0;
+    }
+    state = st;
+    if (!st.done) hold_lsn = st.start_lsn;
+    return 0;
+}
+
+// ---------------- resumed runs ----------------
+
+static int resumed_has(int id) {
+    if (!resumed_n) return 0;
+    size_t mask = resumed_cap - 1;
+    for (size_t i = (uint32_t)id * 2654435761u & mask; resumed_ids[i]; i = (i + 1) & mask)
+        if (resumed_ids[i] == id) return 1;
+    return 0;
+}
+
+static void resumed_put(int id) {
+    if ((resumed_n + 1) * 2 > resumed_cap) {
+        size_t cap = resumed_cap ? resumed_cap * 2 : 4096;
+        int *ids = calloc(cap, sizeof(int));
+        if (!ids) { perror("end-of-day resume"); exit(1); }
+        for (size_t k = 0; k < resumed_cap; k++) {
+            if (!resumed_ids[k]) continue;
+            size_t i = (uint32_t)resumed_ids[k] * 2654435761u & (cap - 1);
+            while (ids[i]) i = (i + 1) & (cap - 1);
+            ids[i] = resumed_ids[k];
+        }
+        free(resumed_ids);
+        resumed_ids = ids;
+        resumed_cap = cap;
+    }
+    size_t mask = resumed_cap - 1, i = (uint32_t)id * 2654435761u & mask;
+    for (; resumed_ids[i]; i = (i + 1) & mask)
+        if (resumed_ids[i] == id) return;
+    resumed_ids[i] = id;
+    resumed_n++;
+}
+
+void batch_replay(int id, uint64_t lsn) {
+    if (!hold_lsn || lsn < hold_lsn) return;
+    pthread_mutex_lock(&resumed_lock);
+    resumed_put(id);
+    pthread_mutex_unlock(&resumed_lock);
+}
+
+uint64_t batch_oldest_lsn(void) {
+    return __atomic_load_n(&hold_lsn, __ATOMIC_ACQUIRE);
+}
+
+// ---------------- the run ----------------
+
+static double cents(double x) {
+    return (double)(int64_t)(x * 100 + (x < 0 ? -0.5 : 0.5)) / 100;
+}
+
+static void statement_line(EodPart *p, uint32_t day, const Account *a, double interest, double fee) {
+    char line[512];
+    int n = snprintf(line, sizeof(line), "%u,%d,%s,%.2f,%.2f,%.2f,%.2f\n",
+                     day, a->id, a->username, a->balance, interest, fee,
+                     (float)(a->balance + interest - fee));
+    if (n < 0 || (size_t)n >= sizeof(line)) { p->dropped++; return; }
+    if (p->cap - p->len < (size_t)n) {
+        size_t cap = p->cap ? p->cap * 2 : 1 << 20;
+        char *out = realloc(p->out, cap);
+        if (!out) { p->dropped++; return; }
+        p->out = out;
+        p->cap = cap;
+    }
+    memcpy(p->out + p->len, line, n);
+    p->len += n;
+}
+
+// Under the record's stripe lock: keep it short.
+static double eod_delta(const Account *a, void *arg, int part) {
+    EodRun *r = arg;
+    if (strcmp(a->role, "CUSTOMER") != 0 || resumed_has(a->id)) return 0;
+    double bal = a->balance;
+    double interest = bal > 0 ? cents(bal * r->st.rate / 100) : 0;
+    double fee = bal < r->st.waive ? r->st.fee : 0;
+    if (fee > bal + interest)           // never overdraw for a fee
+        fee = bal + interest > 0 ? (double)(int64_t)((bal + interest) * 100) / 100 : 0;
+    if (interest == 0 && fee == 0) return 0;
+
+    EodPart *p = &r->part[part];
+    if (interest) { p->interest += interest; p->credited++; }
+    if (fee) { p->fees += fee; p->charged++; }
+    if (r->statements) statement_line(p, r->st.day, a, interest, fee);
+    return interest - fee;
+}
+
+static void eod_flush(void *arg, int part) {
+    EodRun *r = arg;
+    EodPart *p = &r->part[part];
+    if (!p->len) return;
+    pthread_mutex_lock(&r->out_lock);
+    fwrite(p->out, 1, p->len, r->statements);
+    pthread_mutex_unlock(&r->out_lock);
+    p->len = 0;
+}
+
+static void *run_main(void *arg) {
+    EodRun *r = arg;
+    StoreBatch b = { eod_delta, r->statements ? eod_flush : NULL, r, r->threads };
+    uint64_t lsn = 0;
+    long changed = store_batch(&b, &lsn);
+    if (r->statements) {
+        fflush(r->statements);
+        fdatasync(fileno(r->statements));
+        fclose(r->statements);
+    }
+    // Done only once every change it made may be acknowledged.
+    wal_wait_ack(lsn);
+
+    EodResult res = { .day = r->st.day, .changed = changed, .threads = r->threads,
+                      .resumed = r->resumed, .secs = (stats_now() - r->started) / 1e9 };
+    for (int k = 0; k < r->threads; k++) {
+        res.interest += r->part[k].interest;
+        res.fees += r->part[k].fees;
+        res.credited += r->part[k].credited;
+        res.charged += r->part[k].charged;
+        res.dropped += r->part[k].dropped;
+        free(r->part[k].out);
+    }
+    free(resumed_ids);
+    resumed_ids = NULL;
+    resumed_cap = resumed_n = 0;
+    r->st.done = 1;
+    int saved = state_write(&r->st) == 0;
+
+    pthread_mutex_lock(&batch_lock);
+    state = r->st;
+    last = res;
+    current = NULL;
+    // Until the state file says done, a restart must still find the changes.
+    if (saved) __atomic_store_n(&hold_lsn, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&batch_lock);
+
+    printf("End-of-day run for %u: %ld accounts changed in %.2f s (interest %.2f, fees %.2f)\n",
+           res.day, changed, res.secs, res.interest, res.fees);
+    pthread_mutex_destroy(&r->out_lock);
+    free(r);
+    return NULL;
+}
+
+// Caller holds batch_lock and has checked nothing is running.
+static int start_run(const EodState *st, int resume, char *msg, size_t cap) {
+    EodRun *r = calloc(1, sizeof(EodRun));
+    if (!r) { snprintf(msg, cap, "Out of memory."); return -1; }
+    r->st = *st;
+    r->threads = spec.threads > 0 ? spec.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (r->threads > MAX_BATCH_THREADS) r->threads = MAX_BATCH_THREADS;
+    r->resumed = resumed_n;
+    r->started = stats_now();
+    pthread_mutex_init(&r->out_lock, NULL);
+
+    if (r->st.statements) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%u.csv", EOD_DIR, r->st.day);
+        if ((mkdir(EOD_DIR, 0755) < 0 && errno != EEXIST) || !(r->statements = fopen(path, "a"))) {
+            snprintf(msg, cap, "Cannot open %s.", path);
+            free(r);
+            return -1;
+        }
+        if (ftell(r->statements) == 0)
+            fprintf(r->statements, "day,id,username,opening,interest,fee,closing\n");
+    }
+    if (!resume) {
+        // Held before the state is written, so no checkpoint can pass it.
+        r->st.start_lsn = wal_last_lsn() + 1;
+        __atomic_store_n(&hold_lsn, r->st.start_lsn, __ATOMIC_RELEASE);
+        if (state_write(&r->st) < 0) {
+            __atomic_store_n(&hold_lsn, 0, __ATOMIC_RELEASE);
+            if (r->statements) fclose(r->statements);
+            snprintf(msg, cap, "Cannot write %s.", EOD_STATE_FILE);
+            free(r);
+            return -1;
+        }
+        state = r->st;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_main, r) != 0) {
+        // The state stays unfinished; the next start resumes it.
+        if (r->statements) fclose(r->statements);
+        snprintf(msg, cap, "Cannot start the end-of-day run.");
+        free(r);
+        return -1;
+    }
+    pthread_detach(tid);
+    current = r;
+    snprintf(msg, cap, "End-of-day run for %u %s on %d threads.", r->st.day,
+             resume ? "resumed" : "started", r->threads);
+    return 0;
+}
+
+int batch_run_eod(char *msg, size_t cap) {
+    if (!configured) { snprintf(msg, cap, "No end-of-day job configured (--eod)."); return -1; }
+    uint32_t day = today();
+    int rc = -1;
+    pthread_mutex_lock(&batch_lock);
+    if (current) {
+        snprintf(msg, cap, "End-of-day run for %u is still running.", current->st.day);
+    } else if (state.magic == EOD_MAGIC && state.day >= day) {
+        snprintf(msg, cap, "End-of-day run for %u is already done.", state.day);
+    } else {
+        EodState st = { .magic = EOD_MAGIC, .day = day, .statements = spec.statements,
+                        .rate = spec.rate, .fee = spec.fee, .waive = spec.waive };
+        rc = start_run(&st, 0, msg, cap);
+    }
+    pthread_mutex_unlock(&batch_lock);
+    return rc;
+}
+
+static void *timer_main(void *arg) {
+    for (;;) {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        int secs = (spec.at - (tm.tm_hour * 60 + tm.tm_min)) * 60 - tm.tm_sec;
+        if (secs <= 0) secs += 24 * 3600;
+        sleep(secs);
+        char msg[128];
+        batch_run_eod(msg, sizeof(msg));
+        printf("%s\n", msg);
+    }
+    return NULL;
+}
+
+int batch_start(void) {
+    if (configured || state.magic == EOD_MAGIC) stats_add_report_hook(batch_report);
+    if (state.magic == EOD_MAGIC && !state.done) {
+        char msg[128];
+        pthread_mutex_lock(&batch_lock);
+        int rc = start_run(&state, 1, msg, sizeof(msg));
+        pthread_mutex_unlock(&batch_lock);
+        printf("%s (%zu accounts were already done)\n", msg, resumed_n);
+        if (rc < 0) return -1;
+    }
+    if (configured && spec.at >= 0) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, timer_main, NULL) != 0) { perror("pthread_create"); return -1; }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+size_t batch_report(char *buf, size_t cap) {
+    size_t len = 0;
+    pthread_mutex_lock(&batch_lock);
+    if (configured) {
+        char at[16] = "on demand";
+        if (spec.at >= 0) snprintf(at, sizeof(at), "%02d:%02d", spec.at / 60, spec.at % 60);
+        len += snprintf(buf + len, cap - len, "eod: interest=%g%% fee=%.2f waive=%.2f at=%s%s\n",
+                        spec.rate, spec.fee, spec.waive, at, spec.statements ? " statements" : "");
+    }
+    if (current && len < cap) {
+        long credited = 0, charged = 0;
+        for (int k = 0; k < current->threads; k++) {
+            credited += current->part[k].credited;
+            charged += current->part[k].charged;
+        }
+        len += snprintf(buf + len, cap - len, "eod: running day=%u for %.1f s credited=%ld charged=%ld\n",
+                        current->st.day, (stats_now() - current->started) / 1e9, credited, charged);
+    }
+    if (last.day && len < cap) {
+        len += snprintf(buf + len, cap - len,
+                        "eod: last day=%u changed=%ld credited=%ld interest=%.2f charged=%ld fees=%.2f "
+                        "secs=%.2f threads=%d%s",
+                        last.day, last.changed, last.credited, last.interest, last.charged, last.fees,
+                        last.secs, last.threads, last.resumed ? " resumed" : "");
+        if (last.dropped && len < cap) len += snprintf(buf + len, cap - len, " statement_lines_dropped=%ld", last.dropped);
+        if (len < cap) len += snprintf(buf + len, cap - len, "\n");
+    } else if (!current && state.magic == EOD_MAGIC && len < cap) {
+        len += snprintf(buf + len, cap - len, "eod: last day=%u\n", state.day);
+    }
+    pthread_mutex_unlock(&batch_lock);
+    return len < cap ? len : cap;
+}
@@ -0,0 +1,46 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * End-of-day batch.
+ *
+ * A run goes over every CUSTOMER account once for a business day
+ * (YYYYMMDD) and applies, configured with --eod:
+ *   interest   balance * rate / 100 on positive balances, to the cent
+ *   fee        a flat charge, waived at or above a minimum balance and
+ *              never taking the balance below zero
+ * optionally writing one statement line per changed account to
+ * data/eod/<day>.csv (a crash can lose the lines of the chunks in flight;
+ * the log still has every change).  The work goes through store_batch(): all cores take
+ * chunks of the table in turn and commit each lock stripe's share of a
+ * chunk as one WAL record, while the reactors keep serving sessions.
+ *
+ * Runs start from RUN_EOD or daily at a set time and happen once per day.
+ * data/eod.state records the day and where in the log the run started;
+ * every change it makes is a WAL_EOD operation, and the checkpoint stays
+ * behind an unfinished run, so after a crash recovery sees which accounts
+ * it already changed (WAL_EOD from that LSN on) and the run resumes with
+ * the rest.
+ */
+
+/* Parse --eod: comma-separated interest=PCT (daily), fee=AMOUNT,
+   waive=BALANCE, at=HH:MM, threads=N, statements.  -1 if malformed. */
+int  batch_configure(const char *spec);
+
+int  batch_open(void);              // before store_recover: pick up an unfinished run
+int  batch_start(void);             // after recovery: resume it, start the daily timer
+
+/* Start today's run in the background.  Returns 0 if it started, -1 if not;
+   msg says which either way. */
+int  batch_run_eod(char *msg, size_t cap);
+
+void batch_replay(int id, uint64_t lsn);    // WAL_EOD during recovery
+uint64_t batch_oldest_lsn(void);            // first LSN of an unfinished run, else 0
+
+/* End-of-day part of the STATS report; returns the bytes written. */
+size_t batch_report(char *buf, size_t cap);
+
+#endif
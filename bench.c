@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "common.h"
+#include "store.h"
+#include "loans.h"
+#include "wal.h"
+#include "hist.h"
+
+/*
+ * Microbenchmarks for the account data-access functions, run in isolation
+ * (no sockets) against a generated accounts.dat of each requested size.
+ *
+ * Two backends are measured with the same operations and keys:
+ *   store  the server's store.c (mmap'ed table, hash indexes, WAL)
+ *   file   the original linear-scan stdio path: every call opens
+ *          accounts.dat and freads it record by record
+ *
+ * credit_acked also waits until the WAL lets the credit be acknowledged,
+ * which is what a client sees under the chosen --durability mode; the file
+ * backend has no WAL, so it is not run there.
+ * store_batch is one end-of-day style pass (interest on every account) over
+ * the whole table on all cores, acknowledged; the file backend has none.
+ *
+ * Each (backend, size) runs in a forked child inside a scratch directory,
+ * so every run starts from a freshly loaded table.  Each operation is
+ * repeated until --time seconds have passed (and at least MIN_OPS times).
+ * Results go to stdout as one JSON object per line; progress to stderr.
+ */
+
+#define MIN_OPS 3
+#define MAX_DELETES 1000        // a file delete copies the whole file; keep the run bounded
+
+static double op_time = 1.0;
+static char *sizes_spec = "1000,100000,10000000";
+static const char *backend_spec = "all";
+static const char *durability_spec = "group";
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rng = 88172645463325252ull;
+
+static int random_id(int n) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return 1 + (int)(rng % n);
+}
+
+static void make_account(int id, Account *a) {
+    memset(a, 0, sizeof(*a));
+    a->id = id;
+    snprintf(a->username, sizeof(a->username), "user%d", id);
+    snprintf(a->password, sizeof(a->password), "pass%d", id);
+    strcpy(a->role, "CUSTOMER");
+    a->balance = 1000;
+}
+
+// Write accounts 1..n in id order, in large chunks.
+static int generate(const char *path, int n) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) { perror(path); return -1; }
+    enum { CHUNK = 4096 };
+    Account *buf = malloc(sizeof(Account) * CHUNK);
+    for (int id = 1; id <= n; ) {
+        int k = 0;
+        for (; k < CHUNK && id <= n; k++, id++) make_account(id, &buf[k]);
+        if (fwrite(buf, sizeof(Account), k, fp) != (size_t)k) { perror(path); fclose(fp); free(buf); return -1; }
+    }
+    free(buf);
+    return fclose(fp);
+}
+
+/* ---------------- legacy linear-scan file path ---------------- */
+
+static int file_find_by_username(const char *username, Account *acc) {
+    FILE *fp = fopen(DB_ACC_FILE, "rb");
+    if (!fp) return 0;
+    while (fread(acc, sizeof(Account), 1, fp)) {
+        if (strcmp(acc->username, username) == 0) {
+            fclose(fp);
+            return 1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int file_find_by_id(int id, Account *acc_out) {
+    FILE *fp = fopen(DB_ACC_FILE, "rb");
+    if (!fp) return 0;
+    Account tmp;
+    int found = 0;
+    while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
+        if (tmp.id == id) {
+            *acc_out = tmp;
+            found = 1;
+            break;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void file_update_account(Account *acc) {
+    FILE *fp = fopen(DB_ACC_FILE, "r+b");
+    if (!fp) return;
+    Account tmp;
+    while (fread(&tmp, sizeof(Account), 1, fp)) {
+        if (tmp.id == acc->id) {
+            fseek(fp, -sizeof(Account), SEEK_CUR);
+            fwrite(acc, sizeof(Account), 1, fp);
+            break;
+        }
+    }
+    fclose(fp);
+}
+
+static int file_credit_account_by_id(int id, double amount) {
+    FILE *fp = fopen(DB_ACC_FILE, "r+b");
+    if (!fp) return -1;
+    Account tmp;
+    int rc = -1;
+    while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
+        if (tmp.id == id) {
+            tmp.balance += amount;
+            fseek(fp, -sizeof(Account), SEEK_CUR);
+            fwrite(&tmp, sizeof(Account), 1, fp);
+            rc = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+static int file_delete_account(int id) {
+    FILE *fp = fopen(DB_ACC_FILE, "rb");
+    FILE *temp = fopen("temp.dat", "wb");
+    if (!fp || !temp) { perror("delete"); exit(1); }
+    Account tmp;
+    int found = 0;
+    while (fread(&tmp, sizeof(Account), 1, fp)) {
+        if (tmp.id == id) found = 1;
+        else fwrite(&tmp, sizeof(tmp), 1, temp);
+    }
+    fclose(fp);
+    fclose(temp);
+    remove(DB_ACC_FILE);
+    rename("temp.dat", DB_ACC_FILE);
+    return found;
+}
+
+static void file_for_each_account(account_visit_fn fn, void *arg) {
+    FILE *fp = fopen(DB_ACC_FILE, "rb");
+    if (!fp) return;
+    Account tmp;
+    while (fread(&tmp, sizeof(Account), 1, fp))
+        if (fn(&tmp, arg)) break;
+    fclose(fp);
+}
+
+/* ---------------- measurement ---------------- */
+
+typedef struct {
+    const char *backend;
+    int n;                      // accounts in the table
+    int file;                   // 1 = legacy file path
+    uint64_t bytes;             // VIEW_ALL output, to keep the formatting live
+} Ctx;
+
+typedef void (*op_fn)(Ctx *ctx, int i);
+
+static void report(const Ctx *ctx, const char *op, const Hist *h, uint64_t elapsed) {
+    printf("{\"backend\":\"%s\",\"durability\":\"%s\",\"accounts\":%d,\"op\":\"%s\","
+           "\"ops\":%llu,\"secs\":%.3f,\"ops_per_sec\":%.1f,\"mean_ns\":%llu,\"p50_ns\":%llu,"
+           "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+           ctx->backend, ctx->file ? "-" : durability_spec, ctx->n, op, (unsigned long long)h->total, elapsed / 1e9,
+           h->total / (elapsed / 1e9), (unsigned long long)(h->sum / h->total),
+           (unsigned long long)hist_quantile(h, 0.50), (unsigned long long)hist_quantile(h, 0.99),
+           (unsigned long long)hist_quantile(h, 0.999), (unsigned long long)h->max);
+    fflush(stdout);
+}
+
+static void run(Ctx *ctx, const char *op, op_fn fn, int max_ops) {
+    fprintf(stderr, "  %s/%d %s\n", ctx->backend, ctx->n, op);
+    static Hist h;
+    hist_reset(&h);
+    uint64_t budget = (uint64_t)(op_time * 1e9);
+    uint64_t start = now_ns(), t = start;
+    for (int i = 0; i < max_ops && (i < MIN_OPS || t - start < budget); i++) {
+        fn(ctx, i);
+        uint64_t t1 = now_ns();
+        hist_record(&h, t1 - t);
+        t = t1;
+    }
+    report(ctx, op, &h, t - start);
+    // Let the log catch up so one operation's backlog is not billed to the next.
+    if (!ctx->file) wal_wait(wal_last_lsn());
+}
+
+static void op_find_by_username(Ctx *ctx, int i) {
+    char name[MAX_NAME];
+    Account a;
+    snprintf(name, sizeof(name), "user%d", random_id(ctx->n));
+    if (!(ctx->file ? file_find_by_username(name, &a) : find_account_by_username(name, &a))) {
+        fprintf(stderr, "%s not found\n", name);
+        exit(1);
+    }
+}
+
+static void op_find_by_id(Ctx *ctx, int i) {
+    Account a;
+    int id = random_id(ctx->n);
+    if (!(ctx->file ? file_find_by_id(id, &a) : find_account_by_id(id, &a))) {
+        fprintf(stderr, "id %d not found\n", id);
+        exit(1);
+    }
+}
+
+static void op_update(Ctx *ctx, int i) {
+    Account a;
+    make_account(random_id(ctx->n), &a);
+    a.balance += i;
+    if (ctx->file) file_update_account(&a);
+    else update_account(&a);
+}
+
+static void op_credit(Ctx *ctx, int i) {
+    int id = random_id(ctx->n);
+    if ((ctx->file ? file_credit_account_by_id(id, 1.0) : credit_account_by_id(id, 1.0)) != 0) {
+        fprintf(stderr, "credit %d failed\n", id);
+        exit(1);
+    }
+}
+
+static void op_credit_acked(Ctx *ctx, int i) {
+    op_credit(ctx, i);
+    wal_wait_ack(wal_thread_lsn());
+}
+
+// Formats every row the way the admin VIEW_ALL listing does.
+static int format_row(const Account *a, void *arg) {
+    char line[256];
+    *(uint64_t *)arg += snprintf(line, sizeof(line), "ID:%d User:%s Role:%s Bal:₹%.2f Loan:%d\n",
+                                 a->id, a->username, a->role, a->balance, a->loan_pending);
+    return 0;
+}
+
+// The store is listed the way the server streams VIEW_ALL: in id order,
+// one page of LIST_PAGE rows at a time.
+#define LIST_PAGE 256
+
+static void op_view_all(Ctx *ctx, int i) {
+    if (ctx->file) { file_for_each_account(format_row, &ctx->bytes); return; }
+    Account rows[LIST_PAGE];
+    int after = 0, more = 1;
+    while (more) {
+        int n = list_accounts(after, rows, LIST_PAGE, &more);
+        for (int k = 0; k < n; k++) format_row(&rows[k], &ctx->bytes);
+        if (n > 0) after = rows[n - 1].id;
+    }
+}
+
+static double interest_delta(const Account *a, void *arg, int part) {
+    return (double)(int64_t)(a->balance * 0.0137 + 0.5) / 100;
+}
+
+static void op_batch(Ctx *ctx, int i) {
+    if (ctx->file) return;
+    StoreBatch b = { interest_delta, NULL, NULL, sysconf(_SC_NPROCESSORS_ONLN) };
+    uint64_t lsn;
+    if (store_batch(&b, &lsn) != ctx->n) {
+        fprintf(stderr, "batch missed accounts\n");
+        exit(1);
+    }
+    wal_wait_ack(lsn);
+}
+
+// Deletes walk up from the middle of the table.  The file backend copies
+// the whole file without the record each time; the store only leaves a
+// tombstone for compaction to clear later.
+static void op_delete(Ctx *ctx, int i) {
+    int id = ctx->n / 2 + 1 + i;
+    if (!(ctx->file ? file_delete_account(id) : delete_account(id))) {
+        fprintf(stderr, "delete %d failed\n", id);
+        exit(1);
+    }
+}
+
+static int bench_one(const char *dir, const char *backend, int n) {
+    if (chdir(dir) < 0 || mkdir("data", 0755) < 0) { perror(dir); return 1; }
+    fprintf(stderr, "%s/%d: generating\n", backend, n);
+    if (generate(DB_ACC_FILE, n) < 0) return 1;
+
+    Ctx ctx = { backend, n, strcmp(backend, "file") == 0, 0 };
+    if (!ctx.file) {
+        static Hist h;
+        hist_reset(&h);
+        uint64_t t0 = now_ns();
+        int cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (store_load(DB_ACC_FILE, cores) < 0 || loans_load(DB_LOAN_FILE) < 0 ||
+            store_recover(cores) < 0 || wal_start() < 0 || store_start_writeback() < 0 ||
+            store_start_compactor() < 0)
+            return 1;
+        uint64_t t1 = now_ns();
+        hist_record(&h, t1 - t0);
+        report(&ctx, "load", &h, t1 - t0);
+    }
+
+    run(&ctx, "find_account_by_username", op_find_by_username, INT_MAX);
+    run(&ctx, "find_account_by_id", op_find_by_id, INT_MAX);
+    run(&ctx, "update_account", op_update, INT_MAX);
+    run(&ctx, "credit_account_by_id", op_credit, INT_MAX);
+    if (!ctx.file) run(&ctx, "credit_acked", op_credit_acked, INT_MAX);
+    run(&ctx, "view_all", op_view_all, INT_MAX);
+    if (!ctx.file) run(&ctx, "store_batch", op_batch, INT_MAX);
+    run(&ctx, "delete_account", op_delete, n / 2 < MAX_DELETES ? n / 2 : MAX_DELETES);
+    return 0;
+}
+
+// Remove the scratch directory of one run.
+static void clean_dir(const char *dir) {
+    const char *subs[] = { "data", "" };
+    char path[1024];
+    for (int k = 0; k < 2; k++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, subs[k]);
+        DIR *d = opendir(path);
+        if (!d) continue;
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] == '.') continue;
+            char f[2048];
+            snprintf(f, sizeof(f), "%s/%s", path, e->d_name);
+            if (unlink(f) < 0) rmdir(f);
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--sizes N,N,...] [--backend store|file|all] [--time SEC_PER_OP]\n"
+        "          [--dir SCRATCH_DIR] [--durability strict|group[:USEC]|relaxed]\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "sizes", required_argument, NULL, 's' },
+        { "backend", required_argument, NULL, 'b' },
+        { "time", required_argument, NULL, 't' },
+        { "dir", required_argument, NULL, 'd' },
+        { "durability", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *base = "/tmp";
+    int o;
+    while ((o = getopt_long(argc, argv, "s:b:t:d:D:", opts, NULL)) != -1) {
+        switch (o) {
+            case 's': sizes_spec = optarg; break;
+            case 'b': backend_spec = optarg; break;
+            case 't': op_time = atof(optarg); break;
+            case 'd': base = optarg; break;
+            case 'D':
+                durability_spec = optarg;
+                if (wal_set_durability(optarg) < 0) { usage(argv[0]); return 1; }
+                break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    const char *backends[] = { "store", "file" };
+    int all = strcmp(backend_spec, "all") == 0;
+    if (!(op_time > 0) || (!all && strcmp(backend_spec, "store") && strcmp(backend_spec, "file"))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (char *tok = strtok(sizes_spec, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 2) { fprintf(stderr, "bad size %s\n", tok); return 1; }
+        for (int b = 0; b < 2; b++) {
+            if (!all && strcmp(backend_spec, backends[b]) != 0) continue;
+            char dir[1024];
+            snprintf(dir, sizeof(dir), "%s/bench.XXXXXX", base);
+            if (!mkdtemp(dir)) { perror(dir); return 1; }
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0) { perror("fork"); return 1; }
+            if (pid == 0) exit(bench_one(dir, backends[b], n));
+            int status;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "%s/%d failed\n", backends[b], n);
+                failed = 1;
+            }
+            clean_dir(dir);
+        }
+    }
+    return failed;
+}
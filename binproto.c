@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "conn.h"
+#include "proto.h"
+#include "store.h"
+#include "loans.h"
+#include "stats.h"
+#include "repl.h"
+#include "shard.h"
+#include "batch.h"
+#include "ledger.h"
+#include "wal.h"
+#include "idem.h"
+
+/*
+ * Server side of the binary protocol (proto.h).  Frames are cut out of the
+ * input by the reactor; each one is handled to completion here and answered
+ * with exactly one response, so pipelined requests are answered in order.
+ */
+
+static const char *const role_names[] = { NULL, "CUSTOMER", "EMPLOYEE", "MANAGER", "ADMIN", "ROUTER" };
+#define ROLE_ROUTER 5
+
+// STATS command for each op; unknown ops count as STAT_INVALID.
+static int op_stat(int op) {
+    switch (op) {
+    case OP_LOGIN:         return STAT_LOGIN;
+    case OP_LOGOUT:        return STAT_LOGOUT;
+    case OP_BALANCE:       return STAT_BALANCE;
+    case OP_DEPOSIT:       return STAT_DEPOSIT;
+    case OP_WITHDRAW:      return STAT_WITHDRAW;
+    case OP_TRANSFER:      return STAT_TRANSFER;
+    case OP_APPLY_LOAN:    return STAT_APPLY_LOAN;
+    case OP_MY_LOANS:      return STAT_MY_LOANS;
+    case OP_STATEMENT:     return STAT_STATEMENT;
+    case OP_VIEW_PENDING:  return STAT_VIEW_PENDING;
+    case OP_MARK_REVIEW:   return STAT_MARK_REVIEW;
+    case OP_VIEW_ACCOUNT:  return STAT_VIEW_ACCOUNT;
+    case OP_LIST_REVIEWED: return STAT_LIST_REVIEWED;
+    case OP_APPROVE:       return STAT_APPROVE;
+    case OP_REJECT:        return STAT_REJECT;
+    case OP_ADD_ACCOUNT:   return STAT_ADD_ACCOUNT;
+    case OP_DELETE:        return STAT_DELETE_ACCOUNT;
+    case OP_SET_PASSWORD:  return STAT_MODIFY_ACCOUNT;
+    case OP_SEARCH:        return STAT_SEARCH_ACCOUNT;
+    case OP_VIEW_ALL:      return STAT_VIEW_ALL;
+    case OP_STATS:         return STAT_STATS;
+    case OP_RUN_EOD:       return STAT_RUN_EOD;
+    case OP_SHARD_LOGIN:   return STAT_LOGIN;
+    case OP_XA_PREPARE:
+    case OP_XA_COMMIT:
+    case OP_XA_ABORT:
+    case OP_XA_LIST:       return STAT_XA;
+    }
+    return STAT_INVALID;
+}
+
+static void reply(Conn *c, const Frame *req, int status, const void *body, uint32_t len) {
+    conn_stat(c, op_stat(req->op), status != RS_OK);
+    Frame h = { .len = len, .req_id = req->req_id, .op = req->op, .status = status };
+    conn_write(c, &h, sizeof(h));
+    if (len) conn_write(c, body, len);
+}
+
+// Growable response body for list replies.
+typedef struct {
+    char *p;
+    size_t len, cap;
+} Body;
+
+static int body_add(Body *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + len) cap *= 2;
+        char *p = realloc(b->p, cap);
+        if (!p) return 1;
+        b->p = p;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void to_bin(const Account *a, BinAccount *out) {
+    memset(out, 0, sizeof(*out));
+    out->id = a->id;
+    memcpy(out->username, a->username, sizeof(out->username));
+    memcpy(out->role, a->role, sizeof(out->role));
+    out->balance = a->balance;
+}
+
+static int add_loan(const Loan *l, void *arg) {
+    return body_add(arg, l, sizeof(Loan));
+}
+
+// Text that follows a BinArgs body, bounded by the frame.
+static void args_text(const char *body, uint32_t len, char *out, size_t n) {
+    size_t avail = len > sizeof(BinArgs) ? len - sizeof(BinArgs) : 0;
+    if (avail >= n) avail = n - 1;
+    memcpy(out, body + sizeof(BinArgs), avail);
+    out[avail] = 0;
+}
+
+// The idempotency key after BinArgs, or "" if none; -1 if it is too long.
+static int args_key(const char *body, uint32_t len, char *key) {
+    size_t avail = len > sizeof(BinArgs) ? len - sizeof(BinArgs) : 0;
+    if (strnlen(body + sizeof(BinArgs), avail) > IDEM_KEY_MAX) return -1;
+    args_text(body, len, key, IDEM_KEY_MAX + 1);
+    return 0;
+}
+
+// Answer a repeated keyed request from the cache; 0 if it is a new one.
+static int replay(Conn *c, const Frame *f, int seen, const IdemResult *r) {
+    if (seen == IDEM_NEW) return 0;
+    if (seen == IDEM_DONE) {
+        conn_hold_until(c, r->lsn);     // the original's reply may still be held
+        BinAmount b = { r->balance };
+        reply(c, f, r->status, &b, r->status == RS_OK ? sizeof(b) : 0);
+    } else {
+        reply(c, f, seen == IDEM_RUNNING ? RS_RUNNING : RS_KEY_REUSED, NULL, 0);
+    }
+    return 1;
+}
+
+// Keep the result of a keyed request for its repeats.
+static void remember(const IdemKey *k, int status, double balance) {
+    IdemResult r = { status, balance, wal_thread_lsn() };
+    idem_finish(k, &r);
+}
+
+struct balance_op { double amount; double balance; };
+
+static int withdraw_op(Account *a, void *arg) {
+    struct balance_op *op = arg;
+    if (a->balance < op->amount) return 1;
+    a->balance -= op->amount;
+    op->balance = a->balance;
+    return 0;
+}
+
+static int deposit_op(Account *a, void *arg) {
+    struct balance_op *op = arg;
+    a->balance += op->amount;
+    op->balance = a->balance;
+    return 0;
+}
+
+static int set_password_op(Account *a, void *arg) {
+    snprintf(a->password, sizeof(a->password), "%s", (const char *)arg);
+    return 0;
+}
+
+static int loan_status(int rc) {
+    return rc == LOAN_OK ? RS_OK : rc == LOAN_BAD_STATE ? RS_BAD_STATE :
+           rc == LOAN_INVALID ? RS_BAD_REQUEST : RS_NOT_FOUND;
+}
+
+static void do_login(Conn *c, const Frame *f, const char *body) {
+    if (f->len < sizeof(BinLogin)) { reply(c, f, RS_BAD_REQUEST, NULL, 0); return; }
+    BinLogin l;
+    memcpy(&l, body, sizeof(l));
+    l.username[sizeof(l.username) - 1] = l.password[sizeof(l.password) - 1] = 0;
+    if (l.role < 1 || l.role > 4 ||
+        !check_credentials(l.username, l.password, role_names[l.role], &c->acc)) {
+        reply(c, f, RS_AUTH_FAILED, NULL, 0);
+        return;
+    }
+    if (c->state != ST_SESSION) stats_session(1);
+    snprintf(c->role, sizeof(c->role), "%s", role_names[l.role]);
+    snprintf(c->username, sizeof(c->username), "%s", l.username);
+    c->state = ST_SESSION;
+    BinAccount b;
+    to_bin(&c->acc, &b);
+    reply(c, f, RS_OK, &b, sizeof(b));
+}
+
+// A router on a shard; its sessions carry no account.
+static void do_shard_login(Conn *c, const Frame *f, const char *body) {
+    BinShardLogin l;
+    memset(&l, 0, sizeof(l));
+    memcpy(&l, body, f->len < sizeof(l) ? f->len : sizeof(l));
+    l.key[sizeof(l.key) - 1] = 0;
+    if (!shard_key_ok(l.key)) { reply(c, f, RS_AUTH_FAILED, NULL, 0); return; }
+    if (c->state != ST_SESSION) stats_session(1);
+    memset(&c->acc, 0, sizeof(c->acc));
+    snprintf(c->role, sizeof(c->role), "%s", role_names[ROLE_ROUTER]);
+    c->state = ST_SESSION;
+    c->keep_alive = 1;          // it lives as long as the router's client session
+    reply(c, f, RS_OK, NULL, 0);
+}
+
+// Minimum role for each op; 0 = any logged-in session.
+static int op_role(int op) {
+    if (op >= OP_XA_PREPARE && op <= OP_XA_LIST) return ROLE_ROUTER;
+    if (op >= OP_BALANCE && op <= OP_STATEMENT) return 1;
+    if (op >= OP_VIEW_PENDING && op <= OP_VIEW_ACCOUNT) return 2;
+    if (op >= OP_LIST_REVIEWED && op <= OP_REJECT) return 3;
+    if (op >= OP_ADD_ACCOUNT && op <= OP_RUN_EOD) return 4;
+    return 0;
+}
+
+// Ops that change an account or loan; replicas refuse them.
+static int op_writes(int op) {
+    switch (op) {
+    case OP_DEPOSIT: case OP_WITHDRAW: case OP_TRANSFER: case OP_APPLY_LOAN:
+    case OP_MARK_REVIEW: case OP_APPROVE: case OP_REJECT:
+    case OP_ADD_ACCOUNT: case OP_DELETE: case OP_SET_PASSWORD: case OP_RUN_EOD:
+    case OP_XA_PREPARE: case OP_XA_COMMIT: case OP_XA_ABORT:
+        return 1;
+    }
+    return 0;
+}
+
+void conn_on_frame(Conn *c, const Frame *f, const char *body) {
+    if (f->op == OP_LOGIN) { do_login(c, f, body); return; }
+    if (f->op == OP_SHARD_LOGIN) { do_shard_login(c, f, body); return; }
+    if (c->state != ST_SESSION) { reply(c, f, RS_DENIED, NULL, 0); return; }
+
+    int need = op_role(f->op);
+    int router = strcmp(c->role, role_names[ROLE_ROUTER]) == 0;
+    if (need && strcmp(c->role, role_names[need]) != 0 && !(router && need > 1)) {
+        reply(c, f, RS_DENIED, NULL, 0);
+        return;
+    }
+    if (op_writes(f->op) && repl_read_only()) { reply(c, f, RS_READ_ONLY, NULL, 0); return; }
+
+    BinArgs a;
+    memset(&a, 0, sizeof(a));
+    memcpy(&a, body, f->len < sizeof(a) ? f->len : sizeof(a));
+    int id = c->acc.id;
+
+    switch (f->op) {
+    case OP_LOGOUT:
+        reply(c, f, RS_OK, NULL, 0);
+        conn_close_after_flush(c);
+        break;
+
+    case OP_BALANCE: {
+        Account cur;
+        if (!find_account_by_id(id, &cur)) { reply(c, f, RS_NOT_FOUND, NULL, 0); break; }
+        BinAmount r = { cur.balance };
+        reply(c, f, RS_OK, &r, sizeof(r));
+        break;
+    }
+
+    case OP_DEPOSIT:
+    case OP_WITHDRAW: {
+        char key[IDEM_KEY_MAX + 1];
+        IdemKey k;
+        IdemResult seen;
+        if (!(a.amount > 0) || isinf(a.amount) || args_key(body, f->len, key) < 0) { reply(c, f, RS_BAD_REQUEST, NULL, 0); break; }
+        if (replay(c, f, idem_begin(&k, id, key, f->op, 0, a.amount, &seen), &seen)) break;
+        struct balance_op op = { a.amount, 0 };
+        int rc = modify_account_by_id(id, f->op == OP_DEPOSIT ? deposit_op : withdraw_op, &op);
+        int status = rc == 0 ? RS_OK : rc < 0 ? RS_NOT_FOUND : RS_INSUFFICIENT;
+        BinAmount r = { op.balance };
+        remember(&k, status, op.balance);
+        reply(c, f, status, &r, status == RS_OK ? sizeof(r) : 0);
+        break;
+    }
+
+    case OP_TRANSFER: {
+        char key[IDEM_KEY_MAX + 1];
+        IdemKey k;
+        IdemResult seen;
+        if (!(a.amount > 0) || isinf(a.amount) || args_key(body, f->len, key) < 0) { reply(c, f, RS_BAD_REQUEST, NULL, 0); break; }
+        if (replay(c, f, idem_begin(&k, id, key, f->op, a.id, a.amount, &seen), &seen)) break;
+        int rc = transfer_funds(id, a.id, a.amount);
+        int status = rc == XFER_OK ? RS_OK : rc == XFER_INSUFFICIENT ? RS_INSUFFICIENT :
+                     rc == XFER_NO_ACCOUNT || rc == XFER_NO_SOURCE ? RS_NOT_FOUND : RS_BAD_REQUEST;
+        Account cur = { 0 };
+        if (status == RS_OK) find_account_by_id(id, &cur);
+        BinAmount r = { cur.balance };
+        remember(&k, status, cur.balance);
+        reply(c, f, status, &r, status == RS_OK ? sizeof(r) : 0);
+        break;
+    }
+
+    case OP_APPLY_LOAN: {
+        char purpose[sizeof(((Loan *)0)->purpose)];
+        args_text(body, f->len, purpose, sizeof(purpose));
+        int loan_id = loan_apply(id, a.amount, purpose);
+        if (loan_id > 0) {
+            BinArgs r = { .id = loan_id, .amount = a.amount };
+            reply(c, f, RS_OK, &r, sizeof(r));
+        } else {
+            reply(c, f, loan_status(loan_id), NULL, 0);
+        }
+        break;
+    }
+
+    case OP_MY_LOANS:
+    case OP_VIEW_PENDING:
+    case OP_LIST_REVIEWED: {
+        Body b = { NULL, 0, 0 };
+        if (f->op == OP_MY_LOANS) for_each_loan_of(id, add_loan, &b);
+        else for_each_loan_in_state(f->op == OP_VIEW_PENDING ? LOAN_PENDING : LOAN_REVIEWED, add_loan, &b);
+        reply(c, f, RS_OK, b.p, b.len);
+        free(b.p);
+        break;
+    }
+
+    case OP_STATEMENT: {
+        static __thread LedgerRow rows[BIN_MAX_PAGE_ROWS];
+        static __thread BinEntry out[BIN_MAX_PAGE_ROWS];
+        BinStatement s;
+        memset(&s, 0, sizeof(s));
+        memcpy(&s, body, f->len < sizeof(s) ? f->len : sizeof(s));
+        int want = s.count <= 0 ? BIN_PAGE_ROWS : s.count > BIN_MAX_PAGE_ROWS ? BIN_MAX_PAGE_ROWS : s.count;
+        int n = ledger_statement(id, s.from, s.to, s.before, rows, want, NULL);
+        if (n < 0) { reply(c, f, RS_FAILED, NULL, 0); break; }
+        for (int i = 0; i < n; i++)
+            out[i] = (BinEntry){ .seq = rows[i].seq, .other = rows[i].other, .amount = rows[i].amount,
+                                 .balance = rows[i].balance, .time = rows[i].time, .kind = rows[i].kind };
+        reply(c, f, RS_OK, out, n * sizeof(BinEntry));
+        break;
+    }
+
+    case OP_MARK_REVIEW:
+        reply(c, f, loan_status(loan_review(a.id)), NULL, 0);
+        break;
+
+    case OP_APPROVE: {
+        Loan l;
+        int rc = loan_approve(a.id, &l);
+        reply(c, f, loan_status(rc), &l, rc == LOAN_OK ? sizeof(l) : 0);
+        break;
+    }
+
+    case OP_REJECT:
+        reply(c, f, loan_status(loan_reject(a.id)), NULL, 0);
+        break;
+
+    case OP_VIEW_ACCOUNT:
+    case OP_SEARCH: {
+        Account t;
+        if (!find_account_by_id(a.id, &t)) { reply(c, f, RS_NOT_FOUND, NULL, 0); break; }
+        BinAccount b;
+        to_bin(&t, &b);
+        reply(c, f, RS_OK, &b, sizeof(b));
+        break;
+    }
+
+    case OP_ADD_ACCOUNT: {
+        if (f->len < sizeof(Account)) { reply(c, f, RS_BAD_REQUEST, NULL, 0); break; }
+        Account acc;
+        memcpy(&acc, body, sizeof(acc));
+        acc.username[sizeof(acc.username) - 1] = 0;
+        acc.password[sizeof(acc.password) - 1] = 0;
+        acc.role[sizeof(acc.role) - 1] = 0;
+        acc.balance = 0;
+        acc.loan_pending = 0;
+        if (!shard_owns(acc.id)) { reply(c, f, RS_WRONG_SHARD, NULL, 0); break; }
+        int rc = add_account(&acc);
+        reply(c, f, rc == 0 ? RS_OK : rc == -1 ? RS_EXISTS : RS_FAILED, NULL, 0);
+        break;
+    }
+
+    case OP_DELETE:
+        reply(c, f, delete_account(a.id) ? RS_OK : RS_NOT_FOUND, NULL, 0);
+        break;
+
+    case OP_SET_PASSWORD: {
+        char password[sizeof(((Account *)0)->password)];
+        args_text(body, f->len, password, sizeof(password));
+        reply(c, f, modify_account_by_id(a.id, set_password_op, password) == 0 ? RS_OK : RS_NOT_FOUND,
+              NULL, 0);
+        break;
+    }
+
+    case OP_VIEW_ALL: {
+        static __thread Account rows[BIN_MAX_PAGE_ROWS];
+        static __thread BinAccount out[BIN_MAX_PAGE_ROWS];
+        int want = a.count <= 0 ? BIN_PAGE_ROWS : a.count > BIN_MAX_PAGE_ROWS ? BIN_MAX_PAGE_ROWS : a.count;
+        int n = list_accounts(a.id, rows, want, NULL);
+        for (int i = 0; i < n; i++) to_bin(&rows[i], &out[i]);
+        reply(c, f, RS_OK, out, n * sizeof(BinAccount));
+        break;
+    }
+
+    case OP_STATS: {
+        char *report = stats_report();
+        reply(c, f, report ? RS_OK : RS_FAILED, report, report ? strlen(report) : 0);
+        free(report);
+        break;
+    }
+
+    case OP_RUN_EOD: {
+        char msg[128];
+        int rc = batch_run_eod(msg, sizeof(msg));
+        reply(c, f, rc == 0 ? RS_OK : RS_BAD_STATE, msg, strlen(msg));
+        break;
+    }
+
+    case OP_XA_PREPARE:
+    case OP_XA_COMMIT:
+    case OP_XA_ABORT: {
+        BinXa x;
+        memset(&x, 0, sizeof(x));
+        memcpy(&x, body, f->len < sizeof(x) ? f->len : sizeof(x));
+        int rc = f->op == OP_XA_PREPARE ? xa_prepare(x.txid, x.id, x.amount) :
+                 f->op == OP_XA_COMMIT ? xa_commit(x.txid) : xa_abort(x.txid);
+        reply(c, f, rc == XFER_OK ? RS_OK : rc == XFER_INSUFFICIENT ? RS_INSUFFICIENT :
+                    rc == XFER_NO_ACCOUNT ? RS_NOT_FOUND : RS_BAD_REQUEST, NULL, 0);
+        break;
+    }
+
+    case OP_XA_LIST: {
+        uint64_t ids[BIN_MAX_PAGE_ROWS];
+        int n = xa_list(ids, BIN_MAX_PAGE_ROWS);
+        reply(c, f, RS_OK, ids, n * sizeof(uint64_t));
+        break;
+    }
+
+    default:
+        reply(c, f, RS_BAD_REQUEST, NULL, 0);
+    }
+}
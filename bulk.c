@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "store.h"
+#include "loans.h"
+#include "wal.h"
+#include "batch.h"
+#include "ledger.h"
+#include "shard.h"
+
+/*
+ * Bulk loading and unloading of a data directory, for a stopped server.
+ *
+ *   export    every account and loan as the server would start with them
+ *             (after replaying the log), accounts in id order
+ *   import    add accounts and loans, or replace those with the same id
+ *   generate  a synthetic book of accounts and loans; needs no data directory
+ *
+ * Files are either the stream of WAL operations the replication snapshot
+ * sends (WalOp + Account as WAL_PUT, WalOp + Loan as WAL_LOAN; the default)
+ * or, with --format csv, one record per line:
+ *
+ *   account,<id>,<username>,<password>,<role>,<balance>
+ *   loan,<loan id>,<applicant id>,<amount>,<status>,<purpose>
+ *
+ * Lines starting with '#' are skipped.  "-" is stdin or stdout, so
+ * `bulk generate 10000000 - | bulk import -` needs no file in between.
+ *
+ * import recovers the directory like server startup, then applies records
+ * the way a follower applies a snapshot: straight into the mapped table and
+ * the loan store, without logging them, and flushes both files at the end.
+ * An account whose username belongs to another id is skipped, as is a loan
+ * whose applicant does not exist.  Because nothing is logged, the log must
+ * not still be needed by recovery (a prepared cross-shard transfer or an
+ * unfinished end-of-day run); start the server once to settle those.
+ * IMPORT_MARKER is kept while the files are being changed: if the import
+ * dies, or the input breaks off partway, the server refuses the directory
+ * until it is restored from a copy.
+ */
+
+#define IO_BUFFER (1 << 20)
+#define MAX_REPORTED 10         // bad CSV lines described on stderr
+#define LIST_PAGE 256
+
+enum { FMT_BIN, FMT_CSV };
+
+static int format = FMT_BIN;
+static int threads;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--workdir DIR] [--format bin|csv] [--threads N] COMMAND\n"
+            "  export FILE                write every account and loan\n"
+            "  import FILE                add or replace accounts and loans\n"
+            "  generate N FILE            N synthetic accounts (no data directory needed)\n"
+            "      [--start ID] [--loan-start ID] [--roles customer=96,employee=3,manager=1] [--seed S]\n"
+            "      [--loans PCT_OF_CUSTOMERS] [--loan-states pending=40,reviewed=20,approved=30,rejected=10]\n"
+            "FILE may be - for stdin/stdout.\n", prog);
+}
+
+// ---------------- files ----------------
+
+static FILE *open_file(const char *path, int out) {
+    FILE *f = strcmp(path, "-") == 0 ? (out ? stdout : stdin) : fopen(path, out ? "w" : "r");
+    if (!f) { perror(path); exit(1); }
+    setvbuf(f, NULL, _IOFBF, IO_BUFFER);
+    return f;
+}
+
+// A CSV field, quoted if it needs to be.
+static void put_field(FILE *f, const char *s) {
+    if (!strpbrk(s, ",\"\n\r")) { fputs(s, f); return; }
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"') fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void put_account(FILE *f, const Account *a) {
+    if (format == FMT_BIN) {
+        WalOp op = { .type = WAL_PUT, .len = sizeof(*a), .id = a->id };
+        fwrite(&op, sizeof(op), 1, f);
+        fwrite(a, sizeof(*a), 1, f);
+        return;
+    }
+    fprintf(f, "account,%d,", a->id);
+    put_field(f, a->username);
+    fputc(',', f);
+    put_field(f, a->password);
+    fprintf(f, ",%s,%.2f\n", a->role, a->balance);
+}
+
+static void put_loan(FILE *f, const Loan *l) {
+    if (format == FMT_BIN) {
+        WalOp op = { .type = WAL_LOAN, .len = sizeof(*l), .id = l->loan_id };
+        fwrite(&op, sizeof(op), 1, f);
+        fwrite(l, sizeof(*l), 1, f);
+        return;
+    }
+    fprintf(f, "loan,%d,%d,%.2f,%s,", l->loan_id, l->acc_no, l->amount, loan_status_name(l->status));
+    put_field(f, l->purpose);
+    fputc('\n', f);
+}
+
+static void close_output(FILE *f) {
+    if (fflush(f) != 0 || (f != stdout && fclose(f) != 0)) { perror("write"); exit(1); }
+}
+
+/* Split a CSV line in place; returns the number of fields (at most max). */
+static int split_csv(char *line, char **fields, int max) {
+    int n = 0;
+    char *r = line, *w = line;
+    while (n < max) {
+        fields[n++] = w;
+        if (*r == '"') {
+            for (r++; *r; r++) {
+                if (*r == '"' && r[1] == '"') r++;
+                else if (*r == '"') { r++; break; }
+                *w++ = *r;
+            }
+        }
+        while (*r && *r != ',' && *r != '\n' && *r != '\r') *w++ = *r++;
+        int more = *r == ',';
+        *w++ = 0;
+        if (!more) break;
+        r++;
+    }
+    return n;
+}
+
+static int parse_status(const char *s) {
+    for (int st = LOAN_PENDING; st <= LOAN_REJECTED; st++)
+        if (strcmp(s, loan_status_name(st)) == 0) return st;
+    return -1;
+}
+
+static int valid_role(const char *role) {
+    return strcmp(role, "CUSTOMER") == 0 || strcmp(role, "EMPLOYEE") == 0 ||
+           strcmp(role, "MANAGER") == 0 || strcmp(role, "ADMIN") == 0;
+}
+
+/* Next record from f: WAL_PUT (into *a), WAL_LOAN (into *l), 0 at the end.
+   A CSV line that cannot be read comes back as REC_BAD with *why set.  A
+   broken binary stream or a read error is REC_BROKEN: there is no finding
+   the next record, so the input did not end cleanly. */
+enum { REC_BAD = -1, REC_BROKEN = -2 };
+
+typedef struct {
+    FILE *f;
+    long line;                  // CSV line, or binary record number
+    char buf[1024];
+} Input;
+
+static int next_record(Input *in, Account *a, Loan *l, const char **why) {
+    if (format == FMT_BIN) {
+        WalOp op;
+        size_t n = fread(&op, 1, sizeof(op), in->f);
+        if (n == 0 && !ferror(in->f)) return 0;
+        in->line++;
+        void *body = op.type == WAL_PUT ? (void *)a : (void *)l;
+        size_t len = op.type == WAL_PUT ? sizeof(*a) : sizeof(*l);
+        if (n != sizeof(op) || (op.type != WAL_PUT && op.type != WAL_LOAN) || op.len != len ||
+            fread(body, len, 1, in->f) != 1) {
+            *why = ferror(in->f) ? "read error" : "not an account or loan record; stopping here";
+            return REC_BROKEN;
+        }
+        return op.type;
+    }
+
+    while (fgets(in->buf, sizeof(in->buf), in->f)) {
+        in->line++;
+        if (in->buf[0] == '#' || in->buf[0] == '\n' || in->buf[0] == '\r') continue;
+        if (!strchr(in->buf, '\n') && !feof(in->f)) {
+            int c;
+            while ((c = fgetc(in->f)) != EOF && c != '\n') {}
+            *why = "line too long";
+            return REC_BAD;
+        }
+        char *f[7];
+        int n = split_csv(in->buf, f, 7);
+        if (strcmp(f[0], "account") == 0) {
+            if (n != 6) { *why = "an account takes 6 fields"; return REC_BAD; }
+            memset(a, 0, sizeof(*a));
+            a->id = atoi(f[1]);
+            if (strlen(f[2]) >= sizeof(a->username) || strlen(f[3]) >= sizeof(a->password) ||
+                strlen(f[4]) >= sizeof(a->role)) { *why = "field too long"; return REC_BAD; }
+            strcpy(a->username, f[2]);
+            strcpy(a->password, f[3]);
+            strcpy(a->role, f[4]);
+            a->balance = atof(f[5]);
+            return WAL_PUT;
+        }
+        if (strcmp(f[0], "loan") == 0) {
+            if (n != 6) { *why = "a loan takes 6 fields"; return REC_BAD; }
+            memset(l, 0, sizeof(*l));
+            l->loan_id = atoi(f[1]);
+            l->acc_no = atoi(f[2]);
+            l->amount = atof(f[3]);
+            l->status = parse_status(f[4]);
+            if (strlen(f[5]) >= sizeof(l->purpose)) { *why = "purpose too long"; return REC_BAD; }
+            strcpy(l->purpose, f[5]);
+            return WAL_LOAN;
+        }
+        *why = "not an account or loan line";
+        return REC_BAD;
+    }
+    if (ferror(in->f)) { in->line++; *why = "read error"; return REC_BROKEN; }
+    return 0;
+}
+
+// ---------------- the data directory ----------------
+
+// Recover the directory the way the server does on startup.
+static void open_store(void) {
+    if (access(IMPORT_MARKER, F_OK) == 0) {
+        fprintf(stderr, "An import into this directory was interrupted; restore it from a copy\n");
+        exit(1);
+    }
+    if (mkdir("data", 0755) < 0 && access("data", F_OK) < 0) { perror("data"); exit(1); }
+    // The ledger and an unfinished batch keep the log they still need.
+    if (batch_open() < 0 || ledger_open() < 0) exit(1);
+    if (store_load(DB_ACC_FILE, threads) < 0 || loans_load(DB_LOAN_FILE) < 0 ||
+        store_recover(threads) < 0) {
+        fprintf(stderr, "Failed to load the data directory\n");
+        exit(1);
+    }
+}
+
+typedef struct {
+    FILE *f;
+    long n;
+} Export;
+
+static int export_loan(const Loan *l, void *arg) {
+    Export *e = arg;
+    put_loan(e->f, l);
+    e->n++;
+    return 0;
+}
+
+static int cmd_export(const char *path) {
+    uint64_t t0 = now_ns();
+    open_store();
+    FILE *f = open_file(path, 1);
+    if (format == FMT_CSV) {
+        fprintf(f, "# account,id,username,password,role,balance\n");
+        fprintf(f, "# loan,loan_id,acc_no,amount,status,purpose\n");
+    }
+    Account page[LIST_PAGE];
+    int after = 0, more = 1;
+    long accounts = 0;
+    while (more) {
+        int n = list_accounts(after, page, LIST_PAGE, &more);
+        for (int i = 0; i < n; i++) put_account(f, &page[i]);
+        if (n > 0) after = page[n - 1].id;
+        accounts += n;
+    }
+    Export loans = { f, 0 };
+    for (int s = LOAN_PENDING; s <= LOAN_REJECTED; s++) for_each_loan_in_state(s, export_loan, &loans);
+    close_output(f);
+    fprintf(stderr, "Exported %ld accounts and %ld loans in %.1f s\n", accounts, loans.n,
+            (now_ns() - t0) / 1e9);
+    return 0;
+}
+
+static void mark_importing(int on) {
+    if (on) {
+        int fd = open(IMPORT_MARKER, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0 || fsync(fd) < 0) { perror(IMPORT_MARKER); exit(1); }
+        close(fd);
+    } else {
+        unlink(IMPORT_MARKER);
+    }
+    int dfd = open("data", O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+}
+
+typedef struct {
+    long added, replaced, skipped;
+} Counts;
+
+static int cmd_import(const char *path) {
+    uint64_t t0 = now_ns();
+    open_store();
+    if (xa_oldest_lsn() || batch_oldest_lsn()) {
+        fprintf(stderr, "The log still holds a prepared transfer or an unfinished end-of-day run; "
+                        "start the server to settle it first\n");
+        return 1;
+    }
+    Input in = { .f = open_file(path, 0) };
+    mark_importing(1);
+
+    Counts acc = { 0 }, loan = { 0 };
+    long unreadable = 0, reported = 0;
+    Account a, cur;
+    Loan l, old;
+    const char *why = NULL;
+    int type;
+    while ((type = next_record(&in, &a, &l, &why)) != 0) {
+        if (type == WAL_PUT) {
+            a.username[sizeof(a.username) - 1] = a.password[sizeof(a.password) - 1] = 0;
+            a.role[sizeof(a.role) - 1] = 0;
+            a.loan_pending = 0;
+            if (a.id <= 0) why = "account id must be positive";
+            else if (!a.username[0]) why = "empty username";
+            else if (!valid_role(a.role)) why = "unknown role";
+            else if (find_account_by_username(a.username, &cur) && cur.id != a.id) why = "username taken by another id";
+            else {
+                int existed = find_account_by_id(a.id, NULL);
+                WalOp op = { .type = WAL_PUT, .len = sizeof(a), .id = a.id };
+                store_apply(0, &op, &a);
+                if (existed) acc.replaced++;
+                else acc.added++;
+                continue;
+            }
+            acc.skipped++;
+        } else if (type == WAL_LOAN) {
+            l.purpose[sizeof(l.purpose) - 1] = 0;
+            int had = loan_get(l.loan_id, &old) == LOAN_OK;
+            if (l.loan_id <= 0) why = "loan id must be positive";
+            else if (l.loan_id > MAX_LOAN_ID) why = "loan id too large";
+            else if (!(l.amount > 0) || isinf(l.amount)) why = "loan amount must be a positive number";
+            else if (l.status < LOAN_PENDING || l.status > LOAN_REJECTED) why = "unknown loan status";
+            else if (!find_account_by_id(l.acc_no, NULL)) why = "no such applicant";
+            else if (had && old.acc_no != l.acc_no) why = "loan id belongs to another applicant";
+            else {
+                loans_replay(0, &l);
+                if (had) loan.replaced++;
+                else loan.added++;
+                continue;
+            }
+            loan.skipped++;
+        } else {
+            unreadable++;
+        }
+        if (reported++ < MAX_REPORTED || type == REC_BROKEN)
+            fprintf(stderr, "%s %ld: %s\n", format == FMT_CSV ? "Line" : "Record", in.line, why);
+        if (type == REC_BROKEN) break;
+    }
+    if (in.f != stdin) fclose(in.f);
+    if (type == REC_BROKEN) {
+        // Part of the input is in the files; IMPORT_MARKER stays to say so.
+        fprintf(stderr, "The input did not end cleanly and only part of it was imported; "
+                        "restore the directory from a copy\n");
+        return 1;
+    }
+
+    // As at the end of a follower's snapshot: the files now hold everything.
+    if (store_flush() < 0) return 1;
+    loans_writeback(UINT64_MAX);
+    mark_importing(0);
+    printf("Imported accounts: %ld added, %ld replaced, %ld skipped; "
+           "loans: %ld added, %ld replaced, %ld skipped; %ld unreadable lines; in %.1f s\n",
+           acc.added, acc.replaced, acc.skipped, loan.added, loan.replaced, loan.skipped,
+           unreadable, (now_ns() - t0) / 1e9);
+    return 0;
+}
+
+// ---------------- generator ----------------
+
+static uint64_t seed = 88172645463325252ull;
+
+/* Draw k for account id (splitmix64 of both).  Every field is a function of
+   the id alone, so the loan pass can tell who is a customer without keeping
+   a list, however many accounts there are. */
+static uint64_t draw(int id, int k) {
+    uint64_t x = seed + ((uint64_t)id << 4 | k) * 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/* "name=weight,..." into weights[] by position in names[]. */
+static int parse_mix(const char *spec, const char *const *names, int n, int *weights) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (int i = 0; i < n; i++) weights[i] = 0;
+    for (char *save, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return -1;
+        *eq = 0;
+        int i = 0;
+        while (i < n && strcmp(tok, names[i]) != 0) i++;
+        if (i == n || atoi(eq + 1) < 0) return -1;
+        weights[i] = atoi(eq + 1);
+    }
+    int total = 0;
+    for (int i = 0; i < n; i++) total += weights[i];
+    return total > 0 ? 0 : -1;
+}
+
+static int pick(const int *weights, int n, uint64_t r) {
+    int total = 0;
+    for (int i = 0; i < n; i++) total += weights[i];
+    r %= total;
+    for (int i = 0; i < n; i++) {
+        if (r < (uint64_t)weights[i]) return i;
+        r -= weights[i];
+    }
+    return n - 1;
+}
+
+static const char *const role_names[] = { "customer", "employee", "manager" };
+static const char *const loan_state_names[] = { "pending", "reviewed", "approved", "rejected" };
+static const char *const purposes[] = {
+    "Home renovation", "Car", "Education", "Medical", "Small business", "Wedding", "Travel",
+};
+#define N_PURPOSES (int)(sizeof(purposes) / sizeof(purposes[0]))
+
+/* Draws per account */
+enum { D_ROLE, D_BALANCE, D_SCALE, D_HAS_LOAN, D_LOAN_AMOUNT, D_LOAN_STATE, D_PURPOSE };
+
+/* Accounts start..start+n-1, then one loan for about loan_pct% of the
+   customers, numbered from loan_start.  A run has at most one loan per
+   account, so with loan_start at start (the default) runs over separate
+   account ranges also get separate loan ids.  Users are named like create_accounts': cust<id>/pass<id>,
+   emp<id>/emp<id>, mgr<id>/mgr<id>; id 1, if generated, is admin123/1234.
+   Customer balances spread over cents to a million. */
+static int cmd_generate(long n, const char *path, int start, int loan_start, const int *roles,
+                        int loan_pct, const int *states) {
+    uint64_t t0 = now_ns();
+    FILE *f = open_file(path, 1);
+    if (format == FMT_CSV) fprintf(f, "# account,id,username,password,role,balance\n");
+
+    for (long i = 0; i < n; i++) {
+        Account a = { .id = start + i };
+        int r = pick(roles, 3, draw(a.id, D_ROLE));
+        if (a.id == 1) {
+            strcpy(a.username, "admin123");
+            strcpy(a.password, "1234");
+            strcpy(a.role, "ADMIN");
+        } else if (r == 0) {
+            snprintf(a.username, sizeof(a.username), "cust%d", a.id);
+            snprintf(a.password, sizeof(a.password), "pass%d", a.id);
+            strcpy(a.role, "CUSTOMER");
+            int64_t cents = draw(a.id, D_BALANCE) % 100000000;
+            for (int k = draw(a.id, D_SCALE) % 4; k > 0; k--) cents /= 10;
+            a.balance = cents / 100.0;
+        } else {
+            snprintf(a.username, sizeof(a.username), "%s%d", r == 1 ? "emp" : "mgr", a.id);
+            strcpy(a.password, a.username);
+            strcpy(a.role, r == 1 ? "EMPLOYEE" : "MANAGER");
+        }
+        put_account(f, &a);
+    }
+
+    long loans = 0;
+    if (loan_pct > 0 && format == FMT_CSV) fprintf(f, "# loan,loan_id,acc_no,amount,status,purpose\n");
+    for (long i = 0; loan_pct > 0 && i < n; i++) {
+        int id = start + i;
+        if (id == 1 || pick(roles, 3, draw(id, D_ROLE)) != 0 || (int)(draw(id, D_HAS_LOAN) % 100) >= loan_pct)
+            continue;
+        Loan l = { .loan_id = loan_start + loans++, .acc_no = id };
+        l.amount = 1000.0 * (1 + draw(id, D_LOAN_AMOUNT) % 500);
+        l.status = pick(states, 4, draw(id, D_LOAN_STATE));
+        snprintf(l.purpose, sizeof(l.purpose), "%s", purposes[draw(id, D_PURPOSE) % N_PURPOSES]);
+        put_loan(f, &l);
+    }
+    close_output(f);
+    fprintf(stderr, "Generated %ld accounts and %ld loans in %.1f s\n", n, loans, (now_ns() - t0) / 1e9);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *workdir = NULL;
+    int start = 1, loan_start = 0, loan_pct = 10;
+    int roles[3], states[4];
+    parse_mix("customer=96,employee=3,manager=1", role_names, 3, roles);
+    parse_mix("pending=40,reviewed=20,approved=30,rejected=10", loan_state_names, 4, states);
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    static const struct option opts[] = {
+        { "workdir", required_argument, NULL, 'w' },
+        { "format", required_argument, NULL, 'f' },
+        { "threads", required_argument, NULL, 't' },
+        { "start", required_argument, NULL, 's' },
+        { "loan-start", required_argument, NULL, 'i' },
+        { "roles", required_argument, NULL, 'r' },
+        { "loans", required_argument, NULL, 'l' },
+        { "loan-states", required_argument, NULL, 'L' },
+        { "seed", required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    int o;
+    while ((o = getopt_long(argc, argv, "w:f:t:s:i:r:l:L:S:", opts, NULL)) != -1) {
+        switch (o) {
+        case 'w': workdir = optarg; break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) format = FMT_CSV;
+            else if (strcmp(optarg, "bin") == 0) format = FMT_BIN;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 't': threads = atoi(optarg); break;
+        case 's': start = atoi(optarg); break;
+        case 'i': loan_start = atoi(optarg); break;
+        case 'r': if (parse_mix(optarg, role_names, 3, roles) < 0) { usage(argv[0]); return 1; } break;
+        case 'l': loan_pct = atoi(optarg); break;
+        case 'L': if (parse_mix(optarg, loan_state_names, 4, states) < 0) { usage(argv[0]); return 1; } break;
+        case 'S': seed = strtoull(optarg, NULL, 10); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+    if (optind >= argc) { usage(argv[0]); return 1; }
+    const char *cmd = argv[optind];
+
+    if (strcmp(cmd, "generate") == 0) {
+        long n = optind + 2 < argc ? atol(argv[optind + 1]) : 0;
+        if (!loan_start) loan_start = start;
+        if (n <= 0 || start < 1 || (long)start + n - 1 > 0x7fffffff || loan_start < 1 ||
+            loan_pct < 0 || loan_pct > 100) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (loan_pct > 0 && (long)loan_start + n - 1 > MAX_LOAN_ID) {
+            fprintf(stderr, "Loan ids could pass %d; pass a lower --loan-start or --loans 0\n", MAX_LOAN_ID);
+            return 1;
+        }
+        return cmd_generate(n, argv[optind + 2], start, loan_start, roles, loan_pct, states);
+    }
+    if (optind + 1 >= argc) { usage(argv[0]); return 1; }
+    if (workdir && chdir(workdir) < 0) { perror(workdir); return 1; }
+    if (strcmp(cmd, "export") == 0) return cmd_export(argv[optind + 1]);
+    if (strcmp(cmd, "import") == 0) return cmd_import(argv[optind + 1]);
+    usage(argv[0]);
+    return 1;
+}
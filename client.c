@@ -33,7 +33,9 @@ void show_customer_menu() {
     printf("3. Balance Enquiry\n");
     printf("4. Apply Loan\n");
     printf("5. View Details\n");
-    printf("6. Logout\n");
+    printf("6. Transfer\n");
+    printf("7. Mini Statement\n");
+    printf("8. Logout\n");
     printf("============================\nEnter choice: ");
 }
 
@@ -62,7 +64,9 @@ void show_admin_menu() {
     printf("3. Modify Account\n");
     printf("4. Search Account\n");
     printf("5. View All Accounts\n");
-    printf("6. Logout\n");
+    printf("6. Server Statistics\n");
+    printf("7. Run End-of-Day Batch\n");
+    printf("8. Logout\n");
     printf("=========================\nEnter choice: ");
 }
 
@@ -86,6 +90,7 @@ int main() {
     char buf[2048], role[32] = "";
     char extra_input[128];
     bool is_menu_prompt = false; // <-- State flag to fix Admin menu
+    bool statement = false;      // a statement can take several reads
 
     while (1) {
         // --- Read server message ---
@@ -97,15 +102,15 @@ int main() {
         buf[n] = '\0';
         is_menu_prompt = false; // Reset flag each time we get a message
 
-        if (strncmp(buf, "ROLE:", 5) == 0) {
-            char* role_start = buf + 5;
-            char* role_end = strpbrk(role_start, "\r\n"); // Find end of role
-            if (role_end) {
-                *role_end = '\0';
-            }
-            strcpy(role, role_start);
+        // The server sends "Login successful!", the role and the menu in one
+        // go, so they can all arrive in the same read.
+        char *role_line = strstr(buf, "ROLE:"), *rest = buf;
+        if (role_line) {
+            if (role_line > buf) printf("%.*s", (int)(role_line - buf), buf);
+            int len = strcspn(role_line + 5, "\r\n");
+            snprintf(role, sizeof(role), "%.*s", len, role_line + 5);
             printf("\nLogged in as %s\n", role);
-     
+            rest = role_line + 5 + len;
         }
 
       
@@ -117,14 +122,35 @@ int main() {
             else if (strcmp(role, "MANAGER") == 0) show_manager_menu();
             else if (strcmp(role, "ADMIN") == 0) {
                 // Admin menu is sent *by* the server, so just print it.
-                printf("%s", buf);
+                printf("%s", rest);
             }
-        } else if (strncmp(buf, "ROLE:", 5) != 0) {
+        } else if (!role_line) {
            
             printf("%s", buf);
-            if (buf[strlen(buf) - 1] != '\n') printf("\n");
+            if (buf[strlen(buf) - 1] != '\n' && !statement) printf("\n");
+        }
+
+        // Long admin listings arrive in pieces; keep printing until the
+        // server prompts for input again (every admin prompt ends in ':').
+        while (strcmp(role, "ADMIN") == 0 && buf[strlen(buf) - 1] != ':' &&
+               !strstr(buf, "Logging out")) {
+            n = recv(s, buf, sizeof(buf) - 1, 0);
+            if (n <= 0) break;
+            buf[n] = '\0';
+            printf("%s", buf);
+            if (strstr(buf, "MENU") != NULL) is_menu_prompt = true;
         }
 
+        // Statements end with a full stop ("End of statement.").
+        while (statement && buf[strlen(buf) - 1] != '.') {
+            n = recv(s, buf, sizeof(buf) - 1, 0);
+            if (n <= 0) break;
+            buf[n] = '\0';
+            printf("%s", buf);
+        }
+        if (statement) printf("\n");
+        statement = false;
+
         // --- Exit conditions ---
         if (strstr(buf, "Logging out") || strstr(buf, "Connection closed")) break;
 
@@ -167,9 +193,33 @@ int main() {
                     send(s, extra_input, strlen(extra_input), 0);
                     break;
                 case 3: send(s, "BALANCE\n", 8, 0); break;
-                case 4: send(s, "APPLY_LOAN\n", 11, 0); break;
+                case 4: // Apply Loan
+                    send(s, "APPLY_LOAN\n", 11, 0);
+                    printf("Enter loan amount: ");
+                    fgets(extra_input, sizeof(extra_input), stdin);
+                    send(s, extra_input, strlen(extra_input), 0);
+                    printf("Enter purpose: ");
+                    fgets(extra_input, sizeof(extra_input), stdin);
+                    send(s, extra_input, strlen(extra_input), 0);
+                    break;
                 case 5: send(s, "VIEW\n", 5, 0); break;
-                case 6: send(s, "LOGOUT\n", 7, 0); break;
+                case 6: // Transfer
+                    send(s, "TRANSFER\n", 9, 0);
+                    printf("Enter target Account ID: ");
+                    fgets(extra_input, sizeof(extra_input), stdin);
+                    send(s, extra_input, strlen(extra_input), 0);
+                    printf("Enter amount: ");
+                    fgets(extra_input, sizeof(extra_input), stdin);
+                    send(s, extra_input, strlen(extra_input), 0);
+                    break;
+                case 7: // Mini Statement
+                    send(s, "STATEMENT\n", 10, 0);
+                    statement = true;
+                    printf("Last N entries, or FROM TO (YYYY-MM-DD): ");
+                    fgets(extra_input, sizeof(extra_input), stdin);
+                    send(s, extra_input, strlen(extra_input), 0);
+                    break;
+                case 8: send(s, "LOGOUT\n", 7, 0); break;
                 default: send(s, "INVALID\n", 8, 0); break;
             }
         } else if (strcmp(role, "EMPLOYEE") == 0) {
@@ -177,7 +227,7 @@ int main() {
                 case 1: send(s, "VIEW_PENDING\n", 13, 0); break;
                 case 2: 
                     send(s, "MARK_REVIEW\n", 12, 0);
-                    printf("Enter Account ID to mark as reviewed: ");
+                    printf("Enter Loan ID to mark as reviewed: ");
                     fgets(extra_input, sizeof(extra_input), stdin);
                     send(s, extra_input, strlen(extra_input), 0);
                     break;
@@ -195,13 +245,13 @@ int main() {
                 case 1: send(s, "LIST_REVIEWED\n", 14, 0); break;
                 case 2:
                     send(s, "APPROVE\n", 8, 0);
-                    printf("Enter Account ID to approve: ");
+                    printf("Enter Loan ID to approve: ");
                     fgets(extra_input, sizeof(extra_input), stdin);
                     send(s, extra_input, strlen(extra_input), 0);
                     break;
                 case 3:
                     send(s, "REJECT\n", 7, 0);
-                    printf("Enter Account ID to reject: ");
+                    printf("Enter Loan ID to reject: ");
                     fgets(extra_input, sizeof(extra_input), stdin);
                     send(s, extra_input, strlen(extra_input), 0);
                     break;
@@ -215,8 +265,19 @@ int main() {
                 case 2: send(s, "DELETE_ACCOUNT\n", 15, 0); break;
                 case 3: send(s, "MODIFY_ACCOUNT\n", 15, 0); break;
                 case 4: send(s, "SEARCH_ACCOUNT\n", 15, 0); break;
-                case 5: send(s, "VIEW_ALL\n", 9, 0); break;
-                case 6: send(s, "LOGOUT\n", 7, 0); break;
+                case 5: { // View all, one page at a time
+                    char after[32], limit[32], cmd[96];
+                    printf("Start after Account ID (0 = from the first): ");
+                    fgets(after, sizeof(after), stdin);
+                    printf("How many accounts (0 = all): ");
+                    fgets(limit, sizeof(limit), stdin);
+                    snprintf(cmd, sizeof(cmd), "VIEW_ALL %d %d\n", atoi(after), atoi(limit));
+                    send(s, cmd, strlen(cmd), 0);
+                    break;
+                }
+                case 6: send(s, "STATS\n", 6, 0); break;
+                case 7: send(s, "RUN_EOD\n", 8, 0); break;
+                case 8: send(s, "LOGOUT\n", 7, 0); break;
                 default: send(s, "INVALID\n", 8, 0); break;
             }
         }
@@ -6,6 +6,12 @@
 #define DB_ACC_FILE "data/accounts.dat"
 #define DB_LOAN_FILE "data/loans.dat"
 #define WAL_FILE "data/wal.log"
+#define CHECKPOINT_FILE "data/checkpoint"
+#define EOD_STATE_FILE "data/eod.state"
+#define EOD_DIR "data/eod"
+#define LEDGER_DIR "data/ledger"
+#define LEDGER_HEADS_FILE "data/ledger/heads"
+#define IMPORT_MARKER "data/import.unfinished"   // present while bulk import changes the files
 
 #define MAX_NAME 64
 #define MAX_PASS 32
@@ -33,7 +39,7 @@ typedef struct {
     char password[50];
     char role[20];       // CUSTOMER, EMPLOYEE, MANAGER, ADMIN
     float balance;
-    int loan_pending;    // 0 = none, 1 = requested, 2 = approved
+    int loan_pending;    // legacy: loans now live in DB_LOAN_FILE (see loans.h)
 } Account;
 
 /* Loan record */
@@ -46,12 +52,9 @@ typedef struct {
     char padding[32];
 } Loan;
 
-/* WAL entry types: we'll store simple text entries:
-   BEGIN TXID
-   ACTION ... (e.g., DEBIT acc_no amount)
-   ACTION CREDIT ...
-   COMMIT TXID
-*/
+/* WAL: binary records, one per transaction (see wal.h).
+   WAL_FILE is the prefix of the segment files (wal.log.<first lsn>).
+   TX_BUF bounds the operations carried by a single transaction. */
 #define TX_BUF 1024
 
 #endif
@@ -0,0 +1,116 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "proto.h"
+#include "stats.h"
+#include "idem.h"
+
+#define CONN_INBUF 1024
+
+/* Admission and timeout defaults (--max-conns, --login-timeout,
+   --idle-timeout); 0 turns a limit off. */
+#define MAX_CONNS 10000
+#define LOGIN_TIMEOUT_S 60       // from accept to a completed login
+#define IDLE_TIMEOUT_S 600       // since the last byte read or written
+
+/* Why the server closes a connection on its own (conn_on_drop). */
+enum {
+    DROP_BUSY,               // over --max-conns, refused at accept
+    DROP_LOGIN_TIMEOUT,
+    DROP_IDLE_TIMEOUT
+};
+
+/* Per-reactor lists the timeouts are checked against, oldest first. */
+enum {
+    Q_IDLE,                  // every connection, by last activity
+    Q_LOGIN,                 // connections not logged in yet, by accept time
+    N_QUEUES
+};
+
+/* Session states */
+enum {
+    ST_ROLE,        // waiting for role choice
+    ST_USER,        // waiting for username
+    ST_PASS,        // waiting for password
+    ST_SESSION      // logged in, dispatching to the role handler
+};
+
+struct Reactor;
+
+/*
+ * One client connection.  A connection is owned by exactly one reactor
+ * thread for its whole life, so none of these fields need locking.
+ */
+typedef struct Conn {
+    int fd;
+    struct Reactor *r;
+    int binary;              // speaks the framed protocol (proto.h), not lines
+
+    int state;
+    void (*handler)(struct Conn *c, char *line);   // role dialogue once logged in
+    int cmd;                 // role command waiting for more input (0 = none)
+    int step;                // progress inside a multi-line command
+    char role[20];
+    char username[50];
+    Account acc;             // the logged-in account
+    Account pending;         // record being built by ADD_ACCOUNT
+    int arg_id;              // account id captured by an earlier step
+    double arg_amount;       // amount captured by an earlier step
+    char idem_key[IDEM_KEY_MAX + 1];    // idempotency key of the money command in progress
+    int list_after;          // VIEW_ALL cursor: last id sent
+    int list_left;           // rows still to send (-1 = no limit)
+    int list_rows;           // rows sent so far
+    uint64_t list_started;
+    int stat_cmd;            // STAT_* completed by the current line or frame
+    int stat_err;            // ... and whether it failed
+
+    char in[CONN_INBUF];
+    size_t in_len;
+
+    char *out;               // bytes not yet accepted by the socket
+    size_t out_off, out_len, out_cap;
+    int epout;               // socket is full; waiting for EPOLLOUT
+    uint32_t events;         // epoll events currently registered
+    void (*on_drain)(struct Conn *c);   // produces the next chunk of a streamed reply
+    uint64_t hold_lsn;       // output is held until this WAL LSN is durable
+    int held;                // on the reactor's held list
+    uint64_t held_since;     // when it was put on the held list
+    struct Conn *hold_prev, *hold_next;
+    uint64_t opened_at, active_at;
+    int queued;              // bit per Q_* list it is on
+    int keep_alive;          // never dropped for idleness (router sessions)
+    struct Conn *q_prev[N_QUEUES], *q_next[N_QUEUES];
+    int closing;             // close once the output has drained
+    int broken;              // write failed; drop the connection
+} Conn;
+
+void reactor_set_limits(int max_conns, int login_timeout_s, int idle_timeout_s);
+int  reactor_start(int nthreads);
+void reactor_add(int fd, int binary);
+
+void conn_write(Conn *c, const void *buf, size_t len);
+void send_msg(Conn *c, const char *msg);
+void conn_close_after_flush(Conn *c);
+
+/* Name the command the current line or frame completed, for STATS. */
+static inline void conn_stat(Conn *c, int cmd, int error) {
+    c->stat_cmd = cmd;
+    c->stat_err = error;
+}
+
+/* Hold the output until WAL record lsn is durable, as if this connection
+   had written it (a repeated request answered from idem.h). */
+static inline void conn_hold_until(Conn *c, uint64_t lsn) {
+    if (lsn > c->hold_lsn) c->hold_lsn = lsn;
+}
+
+/* Provided by the protocol layer (server.c). */
+void conn_on_open(Conn *c);
+void conn_on_line(Conn *c, char *line);
+void conn_on_drop(Conn *c, int why);    // last words before the server closes it
+void conn_on_frame(Conn *c, const Frame *f, const char *body);   // binproto.c
+
+#endif
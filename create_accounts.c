@@ -15,7 +15,7 @@ int main() {
 
     Account users[] = {
         {1, "cust101", "pass101", "CUSTOMER", 1500.0, 0},
-        {2, "cust102", "pass102", "CUSTOMER", 3000.0, 1}, // loan_pending = 1 (Pending)
+        {2, "cust102", "pass102", "CUSTOMER", 3000.0, 0}, // has a pending loan below
         {3, "emp201", "emp201", "EMPLOYEE", 0.0, 0},
         {4, "mgr301", "mgr301", "MANAGER", 0.0, 0},
         {5, "admin123", "1234", "ADMIN", 0.0, 0}
@@ -29,5 +29,18 @@ int main() {
     printf("%s created successfully with %zu users.\n", DB_ACC_FILE,
            sizeof(users) / sizeof(Account));
 
+    fp = fopen(DB_LOAN_FILE, "wb");
+    if (!fp) {
+        perror("Failed to create " DB_LOAN_FILE);
+        return 1;
+    }
+
+    Loan loan = { .loan_id = 1, .acc_no = 2, .amount = 5000.0, .status = LOAN_PENDING,
+                  .purpose = "Home renovation" };
+    fwrite(&loan, sizeof(Loan), 1, fp);
+    fclose(fp);
+
+    printf("%s created successfully with 1 pending loan.\n", DB_LOAN_FILE);
+
     return 0;
 }
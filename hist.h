@@ -0,0 +1,71 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: every power of
+ * two is split into HIST_SUB equal buckets, so any recorded value is known
+ * to within 1/HIST_SUB (~3%) over the whole uint64 range, in fixed memory.
+ * Record with hist_record(); histograms from several threads are combined
+ * with hist_merge() before reading percentiles.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, sum, max;
+} Hist;
+
+static inline int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+// Highest value that lands in bucket i.
+static inline uint64_t hist_bucket_max(int i) {
+    if (i < HIST_SUB) return i;
+    int shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+static inline void hist_record(Hist *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+static inline void hist_merge(Hist *into, const Hist *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+// Value at quantile q (0..1); 0 for an empty histogram.
+static inline uint64_t hist_quantile(const Hist *h, double q) {
+    if (h->total == 0) return 0;
+    uint64_t want = (uint64_t)(q * h->total + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            uint64_t v = hist_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static inline void hist_reset(Hist *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+#endif
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "idem.h"
+
+#define PENDING (-1)                    // status while the original runs
+#define DEAD    (-2)                    // cancelled; no slot points here
+
+/* Keys are kept as a 128-bit hash (mixed with the account), not as text. */
+typedef struct {
+    uint64_t h1, h2;
+    int32_t account, to;
+    uint32_t born;                      // monotonic seconds
+    int16_t op, status;
+    double amount, balance;
+    uint64_t lsn;
+} Entry;
+
+/* Open addressing with linear probing; the tag (low half of h1, which
+   also gives the home slot) spares most probes a look at the entry. */
+typedef struct {
+    uint32_t tag;
+    int32_t idx;                        // entry, -1 = empty
+} Slot;
+
+/* Entries are used in a ring: [head, head + used) from oldest to newest. */
+typedef struct {
+    pthread_mutex_t lock;
+    Entry *e;
+    Slot *slot;
+    uint32_t mask;                      // slots - 1
+    int cap, head, used;
+    uint64_t hits, running, mismatches, evicted;    // evicted: younger than the ttl
+} Stripe;
+
+static Stripe stripes[IDEM_STRIPES];
+static uint32_t ttl;
+static int enabled;
+
+static uint32_t now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ull;
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ull;
+    return x ^ (x >> 32);
+}
+
+// Two independent 64-bit chains over the key, eight bytes at a time.
+static void key_hash(int account, const char *key, size_t len, uint64_t *h1, uint64_t *h2) {
+    uint64_t a = 0x9e3779b97f4a7c15ull ^ (uint32_t)account ^ (uint64_t)len << 32;
+    uint64_t b = 0xc2b2ae3d27d4eb4full + (uint32_t)account;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, key + i, len - i < 8 ? len - i : 8);
+        a = mix(a ^ w);
+        b = mix(b + w * 0xff51afd7ed558ccdull);
+    }
+    *h1 = a;
+    *h2 = mix(b ^ len);
+}
+
+int idem_init(int entries, int ttl_s) {
+    if (entries <= 0) return 0;                 // keys are then ignored
+    int per = (entries + IDEM_STRIPES - 1) / IDEM_STRIPES;
+    uint32_t slots = 1;
+    while (slots < (uint32_t)per * 2) slots <<= 1;
+    for (int i = 0; i < IDEM_STRIPES; i++) {
+        Stripe *s = &stripes[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->e = malloc(per * sizeof(Entry));
+        s->slot = malloc(slots * sizeof(Slot));
+        if (!s->e || !s->slot) return -1;
+        memset(s->slot, 0xff, slots * sizeof(Slot));
+        s->mask = slots - 1;
+        s->cap = per;
+    }
+    ttl = ttl_s > 0 ? ttl_s : IDEM_TTL_S;
+    enabled = 1;
+    return 0;
+}
+
+static Stripe *stripe_of(const IdemKey *k) {
+    return &stripes[(k->h2 >> 58) % IDEM_STRIPES];
+}
+
+// Slot of the entry with this hash, or -1.
+static int64_t find(Stripe *s, uint64_t h1, uint64_t h2, int account) {
+    for (uint32_t i = h1 & s->mask;; i = (i + 1) & s->mask) {
+        Slot *sl = &s->slot[i];
+        if (sl->idx < 0) return -1;
+        if (sl->tag != (uint32_t)h1) continue;
+        Entry *e = &s->e[sl->idx];
+        if (e->h1 == h1 && e->h2 == h2 && e->account == account) return i;
+    }
+}
+
+// Empty slot i, moving later slots of the same run back into the gap so
+// that every entry stays reachable from its home slot.
+static void slot_delete(Stripe *s, uint32_t i) {
+    for (uint32_t j = i;;) {
+        j = (j + 1) & s->mask;
+        if (s->slot[j].idx < 0) break;
+        uint32_t home = s->slot[j].tag & s->mask;
+        if (((j - home) & s->mask) >= ((j - i) & s->mask)) {
+            s->slot[i] = s->slot[j];
+            i = j;
+        }
+    }
+    s->slot[i].idx = -1;
+}
+
+static void drop_oldest(Stripe *s) {
+    Entry *e = &s->e[s->head];
+    if (e->status != DEAD) {
+        uint32_t i = e->h1 & s->mask;
+        while (s->slot[i].idx != s->head) i = (i + 1) & s->mask;
+        slot_delete(s, i);
+    }
+    s->head = (s->head + 1) % s->cap;
+    s->used--;
+}
+
+int idem_begin(IdemKey *k, int account, const char *key, int op, int to, double amount,
+               IdemResult *out) {
+    size_t len = strlen(key);
+    k->used = enabled && len > 0;
+    if (!k->used) return IDEM_NEW;
+    key_hash(account, key, len, &k->h1, &k->h2);
+    k->account = account;
+    uint64_t h1 = k->h1, h2 = k->h2;
+    Stripe *s = stripe_of(k);
+    uint32_t now = now_s();
+
+    pthread_mutex_lock(&s->lock);
+    while (s->used > 0 && now - s->e[s->head].born >= ttl) drop_oldest(s);
+    int64_t i = find(s, h1, h2, account);
+    if (i >= 0) {
+        Entry *e = &s->e[s->slot[i].idx];
+        int rc = e->op != op || e->to != to || e->amount != amount ? IDEM_MISMATCH :
+                 e->status == PENDING ? IDEM_RUNNING : IDEM_DONE;
+        if (rc == IDEM_DONE) {
+            out->status = e->status;
+            out->balance = e->balance;
+            out->lsn = e->lsn;
+            s->hits++;
+        }
+        else if (rc == IDEM_RUNNING) s->running++;
+        else s->mismatches++;
+        pthread_mutex_unlock(&s->lock);
+        return rc;
+    }
+    if (s->used == s->cap) {
+        drop_oldest(s);
+        s->evicted++;
+    }
+    int32_t n = (s->head + s->used++) % s->cap;
+    s->e[n] = (Entry){ .h1 = h1, .h2 = h2, .account = account, .to = to, .born = now,
+                       .op = op, .status = PENDING, .amount = amount };
+    uint32_t j = h1 & s->mask;
+    while (s->slot[j].idx >= 0) j = (j + 1) & s->mask;
+    s->slot[j] = (Slot){ (uint32_t)h1, n };
+    pthread_mutex_unlock(&s->lock);
+    return IDEM_NEW;
+}
+
+void idem_finish(const IdemKey *k, const IdemResult *r) {
+    if (!k->used) return;
+    Stripe *s = stripe_of(k);
+    pthread_mutex_lock(&s->lock);
+    int64_t i = find(s, k->h1, k->h2, k->account);
+    if (i >= 0) {                       // gone only if the stripe wrapped meanwhile
+        Entry *e = &s->e[s->slot[i].idx];
+        e->status = r->status;
+        e->balance = r->balance;
+        e->lsn = r->lsn;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// The entry stays in the ring, which hands entries out in order, but
+// loses its slot.
+void idem_cancel(const IdemKey *k) {
+    if (!k->used) return;
+    Stripe *s = stripe_of(k);
+    pthread_mutex_lock(&s->lock);
+    int64_t i = find(s, k->h1, k->h2, k->account);
+    if (i >= 0) {
+        s->e[s->slot[i].idx].status = DEAD;
+        slot_delete(s, i);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+size_t idem_report(char *buf, size_t cap) {
+    if (!enabled) return 0;
+    uint64_t hits = 0, running = 0, mismatches = 0, evicted = 0;
+    long used = 0, total = 0;
+    uint32_t now = now_s(), oldest = 0;
+    for (int i = 0; i < IDEM_STRIPES; i++) {
+        Stripe *s = &stripes[i];
+        pthread_mutex_lock(&s->lock);
+        hits += s->hits;
+        running += s->running;
+        mismatches += s->mismatches;
+        evicted += s->evicted;
+        used += s->used;
+        total += s->cap;
+        if (s->used > 0 && now - s->e[s->head].born > oldest) oldest = now - s->e[s->head].born;
+        pthread_mutex_unlock(&s->lock);
+    }
+    int len = snprintf(buf, cap, "idempotency: keys=%ld/%ld oldest_s=%u ttl_s=%u repeats=%llu"
+                       " running=%llu mismatched=%llu evicted_early=%llu\n",
+                       used, total, oldest, ttl, (unsigned long long)hits,
+                       (unsigned long long)running, (unsigned long long)mismatches,
+                       (unsigned long long)evicted);
+    return len < 0 ? 0 : (size_t)len >= cap ? cap - 1 : (size_t)len;
+}
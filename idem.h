@@ -0,0 +1,61 @@
+#ifndef IDEM_H
+#define IDEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Idempotency keys for the requests that move money (DEPOSIT, WITHDRAW,
+ * TRANSFER).  A client may tag one with a key of its choosing; the first
+ * request with a given (account, key) runs, and its result is kept so that
+ * a retry with the same key gets the same answer without running again.
+ *
+ * The cache is a fixed pool of entries split over IDEM_STRIPES mutexes,
+ * with each key kept as a 128-bit hash in an open-addressed table.  A
+ * stripe reuses its entries oldest first, so an entry lives until it is
+ * ttl seconds old or its stripe needs the room, whichever comes first;
+ * STATS shows the age of the oldest entry.  Nothing is written to disk:
+ * a retry across a server restart runs again.
+ */
+
+#define IDEM_KEY_MAX 64                 // longer keys are refused
+#define IDEM_ENTRIES (1 << 19)          // default --idem-entries, ~40 MB
+#define IDEM_TTL_S 86400                // default --idem-ttl
+#define IDEM_STRIPES 64
+
+/* What a keyed request answered (status is an RS_* code, proto.h). */
+typedef struct {
+    int status;
+    double balance;                     // the balance it replied with
+    uint64_t lsn;                       // WAL record its reply waits for (0 = none)
+} IdemResult;
+
+/* A key as idem_begin hashed it, for idem_finish and idem_cancel. */
+typedef struct {
+    uint64_t h1, h2;
+    int account;
+    int used;                           // 0: no key, nothing to record
+} IdemKey;
+
+/* idem_begin outcomes */
+enum {
+    IDEM_NEW,           // first use: run the request, then idem_finish or idem_cancel
+    IDEM_DONE,          // a repeat: *out is the original result
+    IDEM_RUNNING,       // the original has not finished yet
+    IDEM_MISMATCH       // the key was used for a different request
+};
+
+int  idem_init(int entries, int ttl_s);
+
+/* Look key ("" = none) up for account, claiming it if it is new.  op, to
+   and amount describe the request, so that a key reused for another one
+   is caught. */
+int  idem_begin(IdemKey *k, int account, const char *key, int op, int to, double amount,
+                IdemResult *out);
+void idem_finish(const IdemKey *k, const IdemResult *r);
+void idem_cancel(const IdemKey *k);     // failed before doing anything; may be retried
+
+/* Cache part of the STATS report; returns the bytes written. */
+size_t idem_report(char *buf, size_t cap);
+
+#endif
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ledger.h"
+#include "common.h"
+#include "wal.h"
+#include "stats.h"
+#include "shard.h"
+
+#define HEADS_MAGIC 0x3147444cu         // "LDG1"
+#define HEADS_HEADER 4096               // the heads array starts after one page
+#define HEADS_PAGE_IDS 512              // heads per 4 KB page, the unit written back
+#define LEDGER_MAX_SEGMENTS 65536
+#define LEDGER_BATCH 4096               // entries buffered before they are written
+#define LEDGER_RECORDS 256              // WAL records taken per round under the lock
+#define MAX_RECORD (sizeof(WalRecord) + TX_BUF)
+#define MAX_RECORD_OPS (TX_BUF / sizeof(WalOp))
+
+/* On disk, 64 bytes; never changed once written.  Chains use 1-based
+   sequence numbers, 0 meaning none. */
+typedef struct {
+    uint64_t lsn;               // WAL record it came from; 0 = never written
+    uint64_t prev;              // the account's previous entry
+    uint64_t jump;              // an older one of its entries
+    int64_t  other;
+    double   amount;
+    float    balance;
+    uint32_t time;              // never before the previous entry's
+    int32_t  id;
+    uint32_t depth;             // entries of the account before this one
+    uint32_t jump_depth;        // depth of the jump entry
+    uint8_t  kind;
+    uint8_t  last;              // last entry made from its WAL record
+    uint16_t pad;
+} LedgerEntry;
+
+/* First page of data/ledger/heads; the heads follow at HEADS_HEADER. */
+typedef struct {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t entries;           // the heads cover entries 1..entries
+    uint64_t next_lsn;          // ... made from the log before this LSN
+    uint64_t n_ids;
+} HeadsHeader;
+
+/*
+ * ledger_lock guards the heads, the entry count and the segment list.  The
+ * ledger thread holds it while it turns a round of WAL records into entries
+ * and writes them; readers only take it to find where a chain starts.
+ * Written entries never change, so reading them needs no lock.
+ */
+static pthread_mutex_t ledger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ledger_moved = PTHREAD_COND_INITIALIZER;     // done_lsn advanced
+static int enabled;
+
+static int seg_fd[LEDGER_MAX_SEGMENTS];
+static int n_segs;
+static uint64_t written;                // entries in the segment files
+static uint64_t done_lsn;               // every record up to here is in them
+
+static uint64_t *heads;                 // by account id: its newest entry
+static unsigned char *heads_dirty;      // per HEADS_PAGE_IDS ids: changed since the last sync
+static size_t n_heads;
+
+// Ledger thread only.
+static LedgerEntry pending[LEDGER_BATCH];   // made, not written yet; [0] is entry written + 1
+static int n_pending;
+static uint32_t log_clock;              // latest commit time seen in the log
+static WalReader reader;
+static int retain = -1;
+static int heads_fd = -1;
+static uint64_t resume_lsn;             // where ledger_open found the log has to be read from
+static uint64_t synced, synced_lsn;     // what the heads file covers
+static int synced_seg;                  // first segment written since the last sync
+static int new_files;                   // segment files created since the last sync
+
+static void seg_path(char *out, size_t cap, int k) {
+    snprintf(out, cap, "%s/seg.%06d", LEDGER_DIR, k);
+}
+
+static int seg_create(int k) {
+    if (k >= LEDGER_MAX_SEGMENTS) { errno = EFBIG; return -1; }
+    char path[256];
+    seg_path(path, sizeof(path), k);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    seg_fd[k] = fd;
+    n_segs = k + 1;
+    new_files = 1;
+    return 0;
+}
+
+// Entry seq, from the files or, in the ledger thread, from what it has pending.
+static int entry_get(uint64_t seq, LedgerEntry *e) {
+    if (seq > written) {
+        if (seq - written > (uint64_t)n_pending) return -1;
+        *e = pending[seq - written - 1];
+        return 0;
+    }
+    int k = (seq - 1) / LEDGER_SEGMENT_ENTRIES;
+    off_t off = (off_t)((seq - 1) % LEDGER_SEGMENT_ENTRIES) * sizeof(LedgerEntry);
+    if (!seq || k >= n_segs || pread(seg_fd[k], e, sizeof(*e), off) != sizeof(*e) || !e->lsn) return -1;
+    return 0;
+}
+
+static int heads_reserve(int id) {
+    if ((size_t)id < n_heads) return 0;
+    size_t n = n_heads ? n_heads : 64 * HEADS_PAGE_IDS;
+    while (n <= (size_t)id) n *= 2;
+    uint64_t *h = realloc(heads, sizeof(uint64_t) * n);
+    if (!h) return -1;
+    heads = h;
+    unsigned char *d = realloc(heads_dirty, n / HEADS_PAGE_IDS);
+    if (!d) return -1;
+    heads_dirty = d;
+    memset(heads + n_heads, 0, sizeof(uint64_t) * (n - n_heads));
+    memset(heads_dirty + n_heads / HEADS_PAGE_IDS, 0, (n - n_heads) / HEADS_PAGE_IDS);
+    n_heads = n;
+    return 0;
+}
+
+static void heads_set(int id, uint64_t seq) {
+    if (heads_reserve(id) < 0) { perror("ledger heads"); exit(1); }
+    heads[id] = seq;
+    heads_dirty[id / HEADS_PAGE_IDS] = 1;
+}
+
+// ---------------- appending ----------------
+
+// Write the pending entries; caller holds ledger_lock.
+static void write_pending(void) {
+    int i = 0;
+    while (i < n_pending) {
+        uint64_t pos = written;
+        int k = pos / LEDGER_SEGMENT_ENTRIES;
+        if (k == n_segs && seg_create(k) < 0) { perror("ledger segment"); exit(1); }
+        int n = LEDGER_SEGMENT_ENTRIES - pos % LEDGER_SEGMENT_ENTRIES;
+        if (n > n_pending - i) n = n_pending - i;
+        size_t len = sizeof(LedgerEntry) * n;
+        if (pwrite(seg_fd[k], pending + i, len, (off_t)(pos % LEDGER_SEGMENT_ENTRIES) * sizeof(LedgerEntry)) != (ssize_t)len) {
+            perror("ledger write");
+            exit(1);
+        }
+        written += n;
+        i += n;
+    }
+    n_pending = 0;
+}
+
+/* Link e into its account's chain and queue it.  The jump pointer follows
+   Myers' skew-binary scheme: when the previous entry's last two jumps span
+   the same distance, jump over both, else jump to the previous entry. */
+static void append(LedgerEntry *e) {
+    if (n_pending == LEDGER_BATCH) write_pending();
+    uint64_t seq = written + n_pending + 1;
+    uint64_t p = (size_t)e->id < n_heads ? heads[e->id] : 0;
+    LedgerEntry pe, je;
+    e->prev = e->jump = 0;
+    e->depth = e->jump_depth = 0;
+    if (p && entry_get(p, &pe) == 0) {
+        e->prev = p;
+        e->depth = pe.depth + 1;
+        if (e->time < pe.time) e->time = pe.time;
+        if (pe.jump && entry_get(pe.jump, &je) == 0 && je.jump &&
+            pe.depth - pe.jump_depth == pe.jump_depth - je.jump_depth) {
+            e->jump = je.jump;
+            e->jump_depth = je.jump_depth;
+        } else {
+            e->jump = p;
+            e->jump_depth = pe.depth;
+        }
+    }
+    pending[n_pending++] = *e;
+    heads_set(e->id, e->kind == LEDGER_CLOSED ? 0 : seq);
+}
+
+/* One WAL record.  Its kind comes from the whole transaction: a loan or a
+   two-phase transfer step travels with the balance change it causes, and a
+   local transfer is a debit and a credit together. */
+static void consume(const char *rec) {
+    const WalRecord *h = (const WalRecord *)rec;
+    const char *ops = rec + sizeof(*h), *end = ops + h->len;
+    int64_t loan = 0;
+    WalXa xa;
+    int has_xa = 0, debits = 0, credits = 0, others = 0, debit_id = 0, credit_id = 0;
+    for (const char *q = ops; q + sizeof(WalOp) <= end; q += sizeof(WalOp) + ((const WalOp *)q)->len) {
+        const WalOp *op = (const WalOp *)q;
+        switch (op->type) {
+        case WAL_LOAN: {
+            Loan l;
+            memcpy(&l, q + sizeof(WalOp), sizeof(l));
+            loan = l.loan_id;
+            break;
+        }
+        case WAL_XA: memcpy(&xa, q + sizeof(WalOp), sizeof(xa)); has_xa = 1; break;
+        case WAL_DEBIT: debits++; debit_id = op->id; break;
+        case WAL_CREDIT: credits++; credit_id = op->id; break;
+        default: others++; break;
+        }
+    }
+    int transfer = !loan && !has_xa && !others && debits == 1 && credits == 1;
+
+    LedgerEntry out[MAX_RECORD_OPS];
+    int n = 0;
+    for (const char *q = ops; q + sizeof(WalOp) <= end; q += sizeof(WalOp) + ((const WalOp *)q)->len) {
+        const WalOp *op = (const WalOp *)q;
+        LedgerEntry e = { .lsn = h->lsn, .id = op->id };
+        if (op->id <= 0 || n == (int)MAX_RECORD_OPS) continue;
+        if (op->type == WAL_DELETE) {
+            // Ends the chain, so a new account with the same id starts afresh.
+            if ((size_t)op->id >= n_heads || !heads[op->id]) continue;
+            e.kind = LEDGER_CLOSED;
+            e.time = log_clock ? log_clock : time(NULL);
+            out[n++] = e;
+            continue;
+        }
+        if (op->type != WAL_DEBIT && op->type != WAL_CREDIT && op->type != WAL_EOD) continue;
+        WalBalance b;
+        memcpy(&b, q + sizeof(WalOp), sizeof(b));
+        if (b.time > log_clock) log_clock = b.time;
+        e.amount = b.amount;
+        e.balance = b.balance;
+        e.time = b.time ? b.time : log_clock ? log_clock : time(NULL);
+        int debit = op->type == WAL_DEBIT;
+        if (op->type == WAL_EOD) {
+            e.kind = LEDGER_END_OF_DAY;
+        } else if (has_xa) {
+            e.kind = xa.state == XA_PREPARED ? LEDGER_SHARD_OUT :
+                     xa.state == XA_COMMITTED ? LEDGER_SHARD_IN : LEDGER_REFUND;
+            e.other = (int64_t)xa.txid;
+        } else if (loan) {
+            e.kind = LEDGER_LOAN;
+            e.other = loan;
+        } else if (transfer) {
+            e.kind = debit ? LEDGER_TRANSFER_OUT : LEDGER_TRANSFER_IN;
+            e.other = debit ? credit_id : debit_id;
+        } else {
+            e.kind = debit ? LEDGER_WITHDRAW : LEDGER_DEPOSIT;
+        }
+        out[n++] = e;
+    }
+    for (int i = 0; i < n; i++) {
+        out[i].last = i == n - 1;
+        append(&out[i]);
+    }
+}
+
+// ---------------- syncing and recovery ----------------
+
+/* Segments first, then the heads that point into them, then the header
+   saying how far both go; only then may the log behind them be dropped. */
+static void ledger_sync(void) {
+    uint64_t entries = written, next = reader.next;
+    if (entries == synced && next == synced_lsn) return;
+    for (int k = synced_seg; k < n_segs; k++)
+        if (fdatasync(seg_fd[k]) < 0) { perror("ledger sync"); return; }
+    if (new_files) {
+        int dir = open(LEDGER_DIR, O_RDONLY | O_DIRECTORY);
+        if (dir >= 0) { fsync(dir); close(dir); }
+        new_files = 0;
+    }
+    for (size_t p = 0; p < n_heads / HEADS_PAGE_IDS; p++) {
+        if (!heads_dirty[p]) continue;
+        size_t len = sizeof(uint64_t) * HEADS_PAGE_IDS;
+        off_t off = HEADS_HEADER + (off_t)p * len;
+        if (pwrite(heads_fd, heads + p * HEADS_PAGE_IDS, len, off) != (ssize_t)len) {
+            perror("write " LEDGER_HEADS_FILE);
+            return;
+        }
+        heads_dirty[p] = 0;
+    }
+    HeadsHeader hh = { .magic = HEADS_MAGIC, .entries = entries, .next_lsn = next, .n_ids = n_heads };
+    if (fdatasync(heads_fd) < 0 || pwrite(heads_fd, &hh, sizeof(hh), 0) != sizeof(hh) ||
+        fdatasync(heads_fd) < 0) {
+        perror("write " LEDGER_HEADS_FILE);
+        return;
+    }
+    synced = entries;
+    synced_lsn = next;
+    synced_seg = n_segs ? n_segs - 1 : 0;
+    wal_retain_move(retain, next);
+}
+
+/* The heads file covers hh.entries.  Entries written after it are kept up
+   to the last complete WAL record and their heads rolled forward; the rest
+   of the files, and the records they came from, are done again. */
+int ledger_open(void) {
+    if (mkdir(LEDGER_DIR, 0755) < 0 && errno != EEXIST) { perror(LEDGER_DIR); return -1; }
+    heads_fd = open(LEDGER_HEADS_FILE, O_RDWR | O_CREAT, 0644);
+    if (heads_fd < 0) { perror(LEDGER_HEADS_FILE); return -1; }
+    HeadsHeader hh;
+    if (pread(heads_fd, &hh, sizeof(hh), 0) != sizeof(hh) || hh.magic != HEADS_MAGIC)
+        memset(&hh, 0, sizeof(hh));
+    if (hh.n_ids) {
+        if (heads_reserve(hh.n_ids - 1) < 0) { perror("ledger heads"); return -1; }
+        // Only dirty pages are ever written, so the file may end early; the rest are 0.
+        if (pread(heads_fd, heads, sizeof(uint64_t) * hh.n_ids, HEADS_HEADER) < 0) {
+            perror(LEDGER_HEADS_FILE);
+            return -1;
+        }
+    }
+
+    for (int k = 0; k < LEDGER_MAX_SEGMENTS; k++) {
+        char path[256];
+        seg_path(path, sizeof(path), k);
+        int fd = open(path, O_RDWR);
+        if (fd < 0) break;
+        seg_fd[k] = fd;
+        n_segs = k + 1;
+    }
+    uint64_t end = 0;
+    if (n_segs) {
+        struct stat st;
+        if (fstat(seg_fd[n_segs - 1], &st) < 0) { perror("ledger segment"); return -1; }
+        end = (uint64_t)(n_segs - 1) * LEDGER_SEGMENT_ENTRIES + st.st_size / sizeof(LedgerEntry);
+    }
+    if (end < hh.entries) {
+        fprintf(stderr, "Ledger: %s covers %llu entries but only %llu are on disk\n", LEDGER_HEADS_FILE,
+                (unsigned long long)hh.entries, (unsigned long long)end);
+        hh.entries = end;
+    }
+
+    written = end;
+    uint64_t good = hh.entries, last_lsn = 0;
+    LedgerEntry e;
+    for (uint64_t seq = hh.entries + 1; seq <= end && entry_get(seq, &e) == 0; seq++)
+        if (e.last) good = seq;
+    for (uint64_t seq = hh.entries + 1; seq <= good && entry_get(seq, &e) == 0; seq++)
+        heads_set(e.id, e.kind == LEDGER_CLOSED ? 0 : seq);
+    if (good && entry_get(good, &e) == 0) {
+        last_lsn = e.lsn;
+        log_clock = e.time;
+    }
+
+    int keep = (good + LEDGER_SEGMENT_ENTRIES - 1) / LEDGER_SEGMENT_ENTRIES;
+    for (int k = keep; k < n_segs; k++) {
+        char path[256];
+        seg_path(path, sizeof(path), k);
+        close(seg_fd[k]);
+        unlink(path);
+    }
+    n_segs = keep;
+    if (good % LEDGER_SEGMENT_ENTRIES && ftruncate(seg_fd[keep - 1], (off_t)(good % LEDGER_SEGMENT_ENTRIES) * sizeof(LedgerEntry)) < 0) {
+        perror("ledger segment");
+        return -1;
+    }
+    written = synced = good;
+    synced_seg = keep ? keep - 1 : 0;
+    resume_lsn = hh.next_lsn > last_lsn + 1 ? hh.next_lsn : last_lsn + 1;
+    if (end > good)
+        printf("Ledger: dropped %llu entries of an unfinished write\n", (unsigned long long)(end - good));
+
+    // Before the write-back thread may drop the log behind us.
+    retain = wal_retain(resume_lsn);
+    if (retain < 0) { fprintf(stderr, "Ledger: too many log readers\n"); return -1; }
+    return 0;
+}
+
+// ---------------- the ledger thread ----------------
+
+static void *ledger_main(void *arg) {
+    char *rec = malloc(MAX_RECORD);
+    if (!rec) { perror("ledger"); exit(1); }
+    uint64_t last_sync = stats_now();
+    for (;;) {
+        int n = 1, k = 0;
+        pthread_mutex_lock(&ledger_lock);
+        while (k++ < LEDGER_RECORDS && (n = wal_reader_next(&reader, rec, MAX_RECORD)) > 0)
+            consume(rec);
+        write_pending();
+        done_lsn = reader.next - 1;
+        pthread_cond_broadcast(&ledger_moved);
+        pthread_mutex_unlock(&ledger_lock);
+
+        if (n < 0) {
+            fprintf(stderr, "Ledger: unreadable log at LSN %llu; history stops here\n",
+                    (unsigned long long)reader.next);
+            ledger_sync();
+            wal_retain_drop(retain);
+            break;
+        }
+        uint64_t now = stats_now();
+        if (now - last_sync >= LEDGER_SYNC_MS * 1000000ull) {
+            ledger_sync();
+            last_sync = now;
+        }
+        if (n == 0) wal_wait_ack_for(reader.next, LEDGER_SYNC_MS);
+    }
+    free(rec);
+    return NULL;
+}
+
+int ledger_start(void) {
+    uint64_t from = resume_lsn;
+    if (wal_reader_open(&reader, from) < 0) {
+        // Not in the log any more (or never was: a ledger new to this data
+        // directory).  Start with the oldest record there is.
+        from = wal_checkpoint_lsn();
+        if (!from || wal_reader_open(&reader, from) < 0) {
+            from = wal_ack_lsn() + 1;
+            if (wal_reader_open(&reader, from) < 0) { fprintf(stderr, "Ledger: cannot read the log\n"); return -1; }
+        }
+        if (resume_lsn > 1 || written)
+            fprintf(stderr, "Ledger: log records %llu to %llu are gone; their changes are not in the history\n",
+                    (unsigned long long)resume_lsn, (unsigned long long)from - 1);
+    }
+    synced_lsn = from;
+    done_lsn = from - 1;
+    wal_retain_move(retain, from);
+    stats_add_report_hook(ledger_report);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, ledger_main, NULL) != 0) { perror("pthread_create"); return -1; }
+    pthread_detach(tid);
+    enabled = 1;
+    return 0;
+}
+
+// ---------------- statements ----------------
+
+// Newest entry of the chain from x (loaded in *e) with time <= to, or 0.
+static uint64_t seek_time(uint64_t x, uint32_t to, LedgerEntry *e) {
+    while (x && e->time > to) {
+        LedgerEntry j;
+        if (e->jump && entry_get(e->jump, &j) == 0 && j.time > to) {
+            x = e->jump;
+            *e = j;
+        } else {
+            x = e->prev;
+            if (x && entry_get(x, e) < 0) x = 0;
+        }
+    }
+    return x;
+}
+
+int ledger_statement(int id, uint32_t from, uint32_t to, uint64_t before,
+                     LedgerRow *out, int max, int *more) {
+    if (more) *more = 0;
+    if (!enabled) return -1;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LEDGER_WAIT_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+    uint64_t want = wal_ack_lsn();
+    pthread_mutex_lock(&ledger_lock);
+    while (done_lsn < want && pthread_cond_timedwait(&ledger_moved, &ledger_lock, &deadline) == 0);
+    uint64_t x = id > 0 && (size_t)id < n_heads ? heads[id] : 0;
+    uint64_t end = written;
+    pthread_mutex_unlock(&ledger_lock);
+
+    LedgerEntry e;
+    if (before) {
+        // The next page: the caller's oldest row, if it is one of this account's.
+        x = before <= end && entry_get(before, &e) == 0 && e.id == id ? e.prev : 0;
+    }
+    if (x && entry_get(x, &e) < 0) x = 0;
+    if (to) x = seek_time(x, to, &e);
+    int n = 0;
+    while (x && (!from || e.time >= from)) {
+        if (n == max) {
+            if (more) *more = 1;
+            break;
+        }
+        out[n++] = (LedgerRow){ .seq = x, .other = e.other, .amount = e.amount, .balance = e.balance,
+                                .time = e.time, .kind = e.kind, .id = e.id };
+        x = e.prev;
+        if (x && entry_get(x, &e) < 0) x = 0;
+    }
+    return n;
+}
+
+const char *ledger_kind_name(int kind) {
+    switch (kind) {
+    case LEDGER_DEPOSIT:      return "DEPOSIT";
+    case LEDGER_WITHDRAW:     return "WITHDRAW";
+    case LEDGER_TRANSFER_OUT: return "TRANSFER_OUT";
+    case LEDGER_TRANSFER_IN:  return "TRANSFER_IN";
+    case LEDGER_LOAN:         return "LOAN";
+    case LEDGER_END_OF_DAY:   return "END_OF_DAY";
+    case LEDGER_SHARD_OUT:    return "TRANSFER_OUT";
+    case LEDGER_SHARD_IN:     return "TRANSFER_IN";
+    case LEDGER_REFUND:       return "REFUND";
+    case LEDGER_CLOSED:       return "CLOSED";
+    }
+    return "?";
+}
+
+size_t ledger_report(char *buf, size_t cap) {
+    pthread_mutex_lock(&ledger_lock);
+    uint64_t entries = written, done = done_lsn;
+    int segs = n_segs;
+    pthread_mutex_unlock(&ledger_lock);
+    uint64_t ack = wal_ack_lsn();
+    int len = snprintf(buf, cap, "ledger: entries=%llu segments=%d behind_lsn=%llu\n",
+                       (unsigned long long)entries, segs,
+                       (unsigned long long)(ack > done ? ack - done : 0));
+    return len < 0 ? 0 : (size_t)len < cap ? (size_t)len : cap;
+}
@@ -0,0 +1,73 @@
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stdint.h>
+
+/*
+ * Transaction history.
+ *
+ * Every balance change (deposits, withdrawals, transfers, loan credits,
+ * end-of-day interest and fees) becomes one ledger entry.  Sessions do not
+ * write it: a ledger thread follows the WAL like a follower does, turns
+ * each DEBIT, CREDIT or EOD operation into an entry, and works out its
+ * kind and counterparty from the rest of the transaction.
+ *
+ * Entries are fixed-size and append-only, in segment files of
+ * LEDGER_SEGMENT_ENTRIES under data/ledger, so an entry's sequence number
+ * is its position.  Each one points to the same account's previous entry
+ * and to an older one picked so that any entry of the account is a
+ * logarithmic number of hops away (skew-binary jump pointers); data/ledger/
+ * heads keeps each account's newest entry.  The last N entries are N reads
+ * back along the chain, and a date range costs O(log n) reads to find its
+ * newest entry, then one per entry returned.
+ *
+ * The ledger syncs its segments before the heads file, and keeps the WAL
+ * from being dropped (wal_retain) until both are synced, so after a crash
+ * it rolls the heads forward over the entries on disk and picks up the
+ * log where they end.  Replicas keep no ledger.
+ */
+
+#define LEDGER_SEGMENT_ENTRIES (1 << 20)        // 64 MB per segment file
+#define LEDGER_SYNC_MS 1000                     // how often the files are synced
+#define LEDGER_WAIT_MS 100                      // statements wait this long to catch up
+
+/* Entry kinds */
+#define LEDGER_DEPOSIT      1
+#define LEDGER_WITHDRAW     2
+#define LEDGER_TRANSFER_OUT 3                   // other = payee
+#define LEDGER_TRANSFER_IN  4                   // other = payer
+#define LEDGER_LOAN         5                   // other = loan id
+#define LEDGER_END_OF_DAY   6                   // interest less fees (batch.h)
+#define LEDGER_SHARD_OUT    7                   // cross-shard transfer (shard.h), other = its id
+#define LEDGER_SHARD_IN     8                   // same, paid in
+#define LEDGER_REFUND       9                   // same, aborted and given back
+#define LEDGER_CLOSED      10                   // account deleted; its history ends here
+
+/* One entry as returned to callers, newest first. */
+typedef struct {
+    uint64_t seq;                               // 1-based position in the ledger
+    int64_t  other;
+    double   amount;                            // signed
+    float    balance;                           // after the change
+    uint32_t time;                              // unix seconds
+    int32_t  kind;
+    int32_t  id;
+} LedgerRow;
+
+int  ledger_open(void);         // before the write-back thread starts: recover, hold the log
+int  ledger_start(void);        // after recovery: start following the log
+
+/* Entries of account id, newest first: those older than entry `before`
+   (0 = from the newest), with time in [from, to] (0 = unbounded).  Fills
+   up to max rows and returns how many, or -1 if there is no ledger; *more
+   (if given) is set when older matching entries remain.  Waits up to
+   LEDGER_WAIT_MS for the ledger to reach every acknowledged change. */
+int  ledger_statement(int id, uint32_t from, uint32_t to, uint64_t before,
+                      LedgerRow *out, int max, int *more);
+
+const char *ledger_kind_name(int kind);
+
+/* Ledger part of the STATS report; returns the bytes written. */
+size_t ledger_report(char *buf, size_t cap);
+
+#endif
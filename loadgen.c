@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include "common.h"
+#include "proto.h"
+#include "hist.h"
+
+/*
+ * Load generator for the server's binary protocol (proto.h).
+ *
+ * Opens N sessions spread over a few threads.  Each session logs in with the
+ * users seeded by create_accounts (one connection per role its commands
+ * need) and issues a weighted mix of commands, either as fast as the server
+ * answers (closed loop, --depth requests in flight per session) or at a
+ * fixed total --rate (open loop).  In open-loop mode latency is measured
+ * from the time a request was due, not when it was sent, so a stalled
+ * server cannot hide its queueing delay.
+ *
+ * Prints throughput and p50/p99/p99.9 latency per command.
+ */
+
+#define SERVER_IP "127.0.0.1"
+#define MAX_INFLIGHT 4096       // per connection
+#define N_ROLES 3
+
+enum { R_CUSTOMER, R_EMPLOYEE, R_ADMIN };
+
+typedef struct {
+    const char *name;
+    int op;
+    int role;
+    int weight;
+} Cmd;
+
+static Cmd cmds[] = {
+    { "DEPOSIT",      OP_DEPOSIT,      R_CUSTOMER, 40 },
+    { "WITHDRAW",     OP_WITHDRAW,     R_CUSTOMER, 20 },
+    { "BALANCE",      OP_BALANCE,      R_CUSTOMER, 30 },
+    { "VIEW_PENDING", OP_VIEW_PENDING, R_EMPLOYEE,  5 },
+    { "VIEW_ALL",     OP_VIEW_ALL,     R_ADMIN,     5 },
+    { "TRANSFER",     OP_TRANSFER,     R_CUSTOMER,  0 },  // to the other customer
+};
+#define N_CMDS (int)(sizeof(cmds) / sizeof(cmds[0]))
+
+/* Users seeded by create_accounts. */
+static const struct { int role; const char *user, *pass; } customers[] = {
+    { 1, "cust101", "pass101" },
+    { 1, "cust102", "pass102" },
+};
+static const struct { int role; const char *user, *pass; } staff[N_ROLES] = {
+    [R_EMPLOYEE] = { 2, "emp201", "emp201" },
+    [R_ADMIN]    = { 4, "admin123", "1234" },
+};
+
+typedef struct {
+    uint32_t req_id;
+    uint8_t cmd;
+    uint64_t t0;                // ns; when the request was due
+} Inflight;
+
+typedef struct Session Session;
+
+typedef struct {
+    int fd;
+    Session *s;
+    char *in;
+    size_t in_len, in_cap;
+    Inflight q[MAX_INFLIGHT];   // in request order, matching responses
+    int q_head, q_len;
+} LgConn;
+
+struct Session {
+    LgConn *conn[N_ROLES];      // NULL when the mix never uses the role
+    int customer;               // index into customers[]
+    int inflight;
+    uint64_t next_due;          // open loop: when the next request is due
+};
+
+typedef struct {
+    int id;
+    int n_sessions;
+    pthread_t tid;
+    Hist hist[N_CMDS];
+    uint64_t ok[N_CMDS], errors[N_CMDS];
+} Worker;
+
+static const char *host = SERVER_IP;
+static int port = BIN_PORT;
+static int n_sessions = 64, n_threads = 4, depth = 1;
+static int use_keys;            // tag money ops with a fresh idempotency key
+static double duration = 10, rate = 0;
+static int total_weight;
+static int customer_ids[2];     // account ids, learnt at login
+static volatile uint64_t start_ns, end_ns;     // measurement window
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *p, size_t len) {
+    const char *b = p;
+    while (len > 0) {
+        ssize_t n = write(fd, b, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) { usleep(50); continue; }
+            return -1;
+        }
+        b += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, uint32_t req_id, int op, const void *body, uint32_t len) {
+    char buf[sizeof(Frame) + BIN_MAX_BODY];
+    Frame h = { .len = len, .req_id = req_id, .op = op };
+    memcpy(buf, &h, sizeof(h));
+    if (len) memcpy(buf + sizeof(h), body, len);
+    return write_all(fd, buf, sizeof(h) + len);
+}
+
+// Blocking connect + login; the socket is switched to non-blocking afterwards.
+static LgConn *open_conn(Session *s, int role, const char *user, const char *pass) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); return NULL; }
+    struct sockaddr_in srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(port);
+    inet_pton(AF_INET, host, &srv.sin_addr);
+    if (connect(fd, (struct sockaddr *)&srv, sizeof(srv)) < 0) { perror("connect"); close(fd); return NULL; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    BinLogin l;
+    memset(&l, 0, sizeof(l));
+    l.role = role;
+    snprintf(l.username, sizeof(l.username), "%s", user);
+    snprintf(l.password, sizeof(l.password), "%s", pass);
+    Frame h;
+    char body[sizeof(BinAccount)];
+    if (send_frame(fd, 0, OP_LOGIN, &l, sizeof(l)) < 0 ||
+        read(fd, &h, sizeof(h)) != sizeof(h) || h.status != RS_OK ||
+        h.len > sizeof(body) || read(fd, body, h.len) != (ssize_t)h.len) {
+        fprintf(stderr, "login as %s failed\n", user);
+        close(fd);
+        return NULL;
+    }
+    if (role == 1) {
+        BinAccount a;
+        memcpy(&a, body, sizeof(a));
+        for (int i = 0; i < 2; i++)
+            if (strcmp(customers[i].user, user) == 0) __atomic_store_n(&customer_ids[i], a.id, __ATOMIC_RELAXED);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    LgConn *c = calloc(1, sizeof(LgConn));
+    c->fd = fd;
+    c->s = s;
+    return c;
+}
+
+static int pick_cmd(unsigned *seed) {
+    int r = rand_r(seed) % total_weight;
+    for (int i = 0; i < N_CMDS; i++) {
+        if (r < cmds[i].weight) return i;
+        r -= cmds[i].weight;
+    }
+    return 0;
+}
+
+static void issue(Worker *w, Session *s, unsigned *seed, uint64_t due) {
+    static __thread uint32_t next_id;
+    int k = pick_cmd(seed);
+    LgConn *c = s->conn[cmds[k].role];
+    if (c->q_len == MAX_INFLIGHT) { w->errors[k]++; return; }
+
+    // Deposits and withdrawals of the same amount keep balances steady, and
+    // so do transfers between the two customers.
+    struct { BinArgs a; char key[32]; } b = { .a = { .id = 0, .amount = 1.0 } };
+    uint32_t len = (cmds[k].op == OP_DEPOSIT || cmds[k].op == OP_WITHDRAW) ? sizeof(b.a) : 0;
+    if (cmds[k].op == OP_TRANSFER) {
+        b.a.id = __atomic_load_n(&customer_ids[s->customer ^ 1], __ATOMIC_RELAXED);
+        len = sizeof(b.a);
+    }
+    uint32_t id = ++next_id;
+    if (use_keys && len)
+        len += snprintf(b.key, sizeof(b.key), "lg-%d-%d-%u", (int)getpid(), w->id, id) + 1;
+    Inflight *f = &c->q[(c->q_head + c->q_len) % MAX_INFLIGHT];
+    f->req_id = id;
+    f->cmd = k;
+    f->t0 = due ? due : now_ns();
+    c->q_len++;
+    s->inflight++;
+    if (send_frame(c->fd, id, cmds[k].op, &b, len) < 0) {
+        perror("send");
+        exit(1);
+    }
+}
+
+// Consume complete responses; returns how many were completed.
+static int on_readable(Worker *w, LgConn *c) {
+    int done = 0;
+    for (;;) {
+        if (c->in_cap - c->in_len < 65536) {
+            size_t cap = c->in_cap ? c->in_cap * 2 : 131072;
+            c->in = realloc(c->in, cap);
+            c->in_cap = cap;
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n == 0) { fprintf(stderr, "server closed a connection\n"); exit(1); }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            perror("read");
+            exit(1);
+        }
+        c->in_len += n;
+    }
+
+    uint64_t t = now_ns();
+    size_t off = 0;
+    while (c->in_len - off >= sizeof(Frame)) {
+        Frame h;
+        memcpy(&h, c->in + off, sizeof(h));
+        if (c->in_len - off < sizeof(h) + h.len) break;
+        off += sizeof(h) + h.len;
+
+        Inflight *f = &c->q[c->q_head];
+        if (c->q_len == 0 || f->req_id != h.req_id) {
+            fprintf(stderr, "response %u out of order\n", h.req_id);
+            exit(1);
+        }
+        c->q_head = (c->q_head + 1) % MAX_INFLIGHT;
+        c->q_len--;
+        c->s->inflight--;
+        // Insufficient balance is an expected answer, not a failure.
+        if (h.status == RS_OK || h.status == RS_INSUFFICIENT) {
+            w->ok[f->cmd]++;
+            if (f->t0 >= start_ns && t <= end_ns) hist_record(&w->hist[f->cmd], t - f->t0);
+        } else {
+            w->errors[f->cmd]++;
+        }
+        done++;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return done;
+}
+
+static void *worker_loop(void *arg) {
+    Worker *w = arg;
+    unsigned seed = 12345u + w->id;
+    int epfd = epoll_create1(0);
+    Session *ss = calloc(w->n_sessions, sizeof(Session));
+
+    int used[N_ROLES] = { 0 };
+    for (int k = 0; k < N_CMDS; k++) if (cmds[k].weight > 0) used[cmds[k].role] = 1;
+
+    for (int i = 0; i < w->n_sessions; i++) {
+        Session *s = &ss[i];
+        for (int r = 0; r < N_ROLES; r++) {
+            if (!used[r]) continue;
+            int cu = (w->id + i) % 2;
+            s->customer = cu;
+            s->conn[r] = r == R_CUSTOMER
+                ? open_conn(s, customers[cu].role, customers[cu].user, customers[cu].pass)
+                : open_conn(s, staff[r].role, staff[r].user, staff[r].pass);
+            if (!s->conn[r]) exit(1);
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s->conn[r] };
+            epoll_ctl(epfd, EPOLL_CTL_ADD, s->conn[r]->fd, &ev);
+        }
+    }
+
+    // Open loop: each session issues rate / n_sessions requests per second.
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 * n_sessions / rate) : 0;
+    while (!start_ns) usleep(100);
+    for (int i = 0; i < w->n_sessions; i++) {
+        if (interval) ss[i].next_due = start_ns + (uint64_t)rand_r(&seed) % interval;
+        else for (int d = 0; d < depth; d++) issue(w, &ss[i], &seed, 0);
+    }
+
+    struct epoll_event ev[64];
+    for (;;) {
+        uint64_t t = now_ns();
+        int stop = t >= end_ns;
+        int timeout = 10;
+        if (interval && !stop) {
+            uint64_t next = UINT64_MAX;
+            for (int i = 0; i < w->n_sessions; i++) {
+                while (ss[i].next_due <= t && ss[i].next_due < end_ns) {
+                    issue(w, &ss[i], &seed, ss[i].next_due);
+                    ss[i].next_due += interval;
+                }
+                if (ss[i].next_due < next) next = ss[i].next_due;
+            }
+            timeout = next > t ? (int)((next - t) / 1000000) : 0;
+        }
+        if (stop) {
+            int left = 0;
+            for (int i = 0; i < w->n_sessions; i++) left += ss[i].inflight;
+            if (left == 0 || t > end_ns + 2000000000ull) break;
+        }
+
+        int n = epoll_wait(epfd, ev, 64, timeout);
+        for (int i = 0; i < n; i++) {
+            LgConn *c = ev[i].data.ptr;
+            int done = on_readable(w, c);
+            if (!interval && !stop)
+                for (int d = 0; d < done; d++) issue(w, c->s, &seed, 0);
+        }
+    }
+    return NULL;
+}
+
+// --mix deposit=40,withdraw=20,...  (names are case-insensitive)
+static int parse_mix(char *spec) {
+    for (int i = 0; i < N_CMDS; i++) cmds[i].weight = 0;
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return -1;
+        *eq = 0;
+        int k;
+        for (k = 0; k < N_CMDS && strcasecmp(cmds[k].name, tok) != 0; k++);
+        if (k == N_CMDS) { fprintf(stderr, "unknown command %s\n", tok); return -1; }
+        cmds[k].weight = atoi(eq + 1);
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--host IP] [--port N] [--sessions N] [--threads N] [--duration SEC]\n"
+        "          [--rate REQ_PER_SEC (0 = closed loop)] [--depth N] [--mix deposit=40,withdraw=20,...]\n"
+        "          [--keys (an idempotency key on every deposit, withdrawal and transfer)]\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "sessions", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "rate", required_argument, NULL, 'r' },
+        { "depth", required_argument, NULL, 'q' },
+        { "mix", required_argument, NULL, 'm' },
+        { "keys", no_argument, NULL, 'k' },
+        { NULL, 0, NULL, 0 }
+    };
+    int o;
+    while ((o = getopt_long(argc, argv, "H:p:c:t:d:r:q:m:k", opts, NULL)) != -1) {
+        switch (o) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': n_sessions = atoi(optarg); break;
+            case 't': n_threads = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'm': if (parse_mix(optarg) < 0) { usage(argv[0]); return 1; } break;
+            case 'k': use_keys = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    for (int i = 0; i < N_CMDS; i++) total_weight += cmds[i].weight;
+    if (n_sessions < 1 || n_threads < 1 || depth < 1 || total_weight <= 0) { usage(argv[0]); return 1; }
+    if (depth > MAX_INFLIGHT) depth = MAX_INFLIGHT;
+    if (n_threads > n_sessions) n_threads = n_sessions;
+
+    Worker *w = calloc(n_threads, sizeof(Worker));
+    for (int i = 0; i < n_threads; i++) {
+        w[i].id = i;
+        w[i].n_sessions = n_sessions / n_threads + (i < n_sessions % n_threads);
+        pthread_create(&w[i].tid, NULL, worker_loop, &w[i]);
+    }
+    usleep(200000);     // let the sessions connect and log in
+    end_ns = now_ns() + (uint64_t)(duration * 1e9) + 200000000ull;
+    start_ns = end_ns - (uint64_t)(duration * 1e9);
+    for (int i = 0; i < n_threads; i++) pthread_join(w[i].tid, NULL);
+
+    printf("%d sessions, %d threads, %.1fs, %s\n", n_sessions, n_threads, duration,
+           rate > 0 ? "open loop" : "closed loop");
+    if (rate > 0) printf("target rate %.0f req/s\n", rate);
+    printf("%-13s %10s %8s %10s %10s %10s %10s %10s\n",
+           "command", "ok", "errors", "req/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    Hist all;
+    hist_reset(&all);
+    uint64_t all_ok = 0, all_err = 0;
+    for (int k = 0; k < N_CMDS; k++) {
+        if (cmds[k].weight == 0) continue;
+        Hist h;
+        hist_reset(&h);
+        uint64_t ok = 0, err = 0;
+        for (int i = 0; i < n_threads; i++) {
+            hist_merge(&h, &w[i].hist[k]);
+            ok += w[i].ok[k];
+            err += w[i].errors[k];
+        }
+        hist_merge(&all, &h);
+        all_ok += ok;
+        all_err += err;
+        printf("%-13s %10llu %8llu %10.0f %10.1f %10.1f %10.1f %10.1f\n", cmds[k].name,
+               (unsigned long long)ok, (unsigned long long)err, h.total / duration,
+               hist_quantile(&h, 0.50) / 1e3, hist_quantile(&h, 0.99) / 1e3,
+               hist_quantile(&h, 0.999) / 1e3, h.max / 1e3);
+    }
+    printf("%-13s %10llu %8llu %10.0f %10.1f %10.1f %10.1f %10.1f\n", "TOTAL",
+           (unsigned long long)all_ok, (unsigned long long)all_err, all.total / duration,
+           hist_quantile(&all, 0.50) / 1e3, hist_quantile(&all, 0.99) / 1e3,
+           hist_quantile(&all, 0.999) / 1e3, all.max / 1e3);
+    return all_err ? 2 : 0;
+}
@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "loans.h"
+#include "store.h"
+#include "wal.h"
+#include "stats.h"
+#include "shard.h"
+
+#define IDX_EMPTY -1
+#define OPEN_STATES 2           // LOAN_PENDING and LOAN_REVIEWED have queues
+#define LEGACY_AMOUNT 1000.0    // what APPROVE used to credit before loans.dat
+#define COMPACT_MIN_BYTES (1 << 20)     // smallest file worth rewriting
+
+/*
+ * loan_lock protects everything below except the file itself.  It is taken
+ * before any store lock (approval credits the applicant while holding it).
+ * file_lock serializes appends and rewrites of the file and is never held
+ * together with loan_lock.
+ */
+static pthread_mutex_t loan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int loan_fd = -1;
+static off_t file_size;
+static char loan_path[256];
+
+typedef struct {
+    uint64_t lsn;               // last WAL record that changed this loan
+    uint64_t redo;              // first one since it was last appended
+    off_t file_off;             // its newest version in the file, or -1
+    int dirty;
+    int next_of_acc;            // previous loan of the same applicant, or -1
+    int prev, next;             // links in its status queue
+} LoanMeta;
+
+static Loan *loans;             // loans[i].loan_id == i + 1, or 0 if unused
+static LoanMeta *lmeta;
+static int n_loans, cap_loans;
+
+static int *dirty;              // loan indexes with lmeta.dirty set
+static int n_dirty, cap_dirty;
+
+static int q_head[OPEN_STATES], q_tail[OPEN_STATES];
+
+// Applicant index: acc_no -> index of that account's newest loan.
+static int *acc_keys, *acc_heads;
+static int acc_size, acc_used;
+
+static inline uint32_t hash_acc(int acc_no) {
+    return (uint32_t)acc_no * 2654435761u;
+}
+
+static int loans_reserve(int want) {
+    if (want <= cap_loans) return 0;
+    if (want > MAX_LOAN_ID) { errno = EOVERFLOW; return -1; }
+    int cap = cap_loans ? cap_loans : 256;
+    while (cap < want) cap = cap > MAX_LOAN_ID / 2 ? MAX_LOAN_ID : cap * 2;
+    Loan *l = realloc(loans, sizeof(Loan) * cap);
+    if (!l) return -1;
+    loans = l;
+    LoanMeta *m = realloc(lmeta, sizeof(LoanMeta) * cap);
+    if (!m) return -1;
+    lmeta = m;
+    memset(loans + cap_loans, 0, sizeof(Loan) * (cap - cap_loans));
+    memset(lmeta + cap_loans, 0, sizeof(LoanMeta) * (cap - cap_loans));
+    cap_loans = cap;
+    return 0;
+}
+
+// Returns the applicant index position for acc_no, or -1.
+static int acc_lookup(int acc_no) {
+    if (acc_size == 0) return -1;
+    uint32_t mask = acc_size - 1;
+    for (uint32_t i = hash_acc(acc_no) & mask;; i = (i + 1) & mask) {
+        if (acc_keys[i] == IDX_EMPTY) return -1;
+        if (acc_keys[i] == acc_no) return i;
+    }
+}
+
+static void acc_put(int acc_no, int head) {
+    uint32_t mask = acc_size - 1;
+    uint32_t i;
+    for (i = hash_acc(acc_no) & mask; acc_keys[i] != IDX_EMPTY; i = (i + 1) & mask);
+    acc_keys[i] = acc_no;
+    acc_heads[i] = head;
+    acc_used++;
+}
+
+static int acc_grow(void) {
+    int old_size = acc_size, *old_keys = acc_keys, *old_heads = acc_heads;
+    int size = acc_size ? acc_size * 2 : 64;
+    int *keys = malloc(sizeof(int) * size), *heads = malloc(sizeof(int) * size);
+    if (!keys || !heads) { free(keys); free(heads); return -1; }
+    for (int i = 0; i < size; i++) keys[i] = IDX_EMPTY;
+    acc_keys = keys; acc_heads = heads;
+    acc_size = size;
+    acc_used = 0;
+    for (int i = 0; i < old_size; i++)
+        if (old_keys[i] != IDX_EMPTY) acc_put(old_keys[i], old_heads[i]);
+    free(old_keys); free(old_heads);
+    return 0;
+}
+
+// Push loan idx onto the front of its applicant's chain.
+static void acc_link(int idx) {
+    int pos = acc_lookup(loans[idx].acc_no);
+    if (pos >= 0) {
+        lmeta[idx].next_of_acc = acc_heads[pos];
+        acc_heads[pos] = idx;
+        return;
+    }
+    if ((acc_used + 1) * 2 > acc_size && acc_grow() < 0) { perror("loan index"); exit(1); }
+    lmeta[idx].next_of_acc = -1;
+    acc_put(loans[idx].acc_no, idx);
+}
+
+static inline int queue_of(int status) {
+    return status == LOAN_PENDING ? 0 : status == LOAN_REVIEWED ? 1 : -1;
+}
+
+static void q_link(int idx) {
+    int q = queue_of(loans[idx].status);
+    if (q < 0) return;
+    lmeta[idx].prev = q_tail[q];
+    lmeta[idx].next = -1;
+    if (q_tail[q] >= 0) lmeta[q_tail[q]].next = idx;
+    else q_head[q] = idx;
+    q_tail[q] = idx;
+}
+
+static void q_unlink(int idx) {
+    int q = queue_of(loans[idx].status);
+    if (q < 0) return;
+    LoanMeta *m = &lmeta[idx];
+    if (m->prev >= 0) lmeta[m->prev].next = m->next;
+    else q_head[q] = m->next;
+    if (m->next >= 0) lmeta[m->next].prev = m->prev;
+    else q_tail[q] = m->prev;
+}
+
+// Make *l the current version of its loan and update every index.
+static int install(const Loan *l) {
+    if (l->loan_id <= 0) return -1;
+    if (loans_reserve(l->loan_id) < 0) { perror("loan table"); exit(1); }
+    int idx = l->loan_id - 1;
+    if (loans[idx].loan_id) {
+        q_unlink(idx);
+        loans[idx] = *l;
+    } else {
+        loans[idx] = *l;
+        lmeta[idx].file_off = -1;
+        acc_link(idx);
+    }
+    q_link(idx);
+    if (l->loan_id > n_loans) n_loans = l->loan_id;
+    return idx;
+}
+
+static void loan_dirty(int idx, uint64_t lsn) {
+    lmeta[idx].lsn = lsn;
+    if (lmeta[idx].dirty) return;
+    lmeta[idx].redo = lsn;
+    if (n_dirty == cap_dirty) {
+        int cap = cap_dirty ? cap_dirty * 2 : 64;
+        int *p = realloc(dirty, sizeof(int) * cap);
+        if (!p) { perror("loan dirty list"); exit(1); }
+        dirty = p;
+        cap_dirty = cap;
+    }
+    lmeta[idx].dirty = 1;
+    dirty[n_dirty++] = idx;
+}
+
+/* Sharded, a copied data directory also holds the loans of applicants
+   another shard owns; they are left alone and never shown. */
+static Loan *find_loan(int loan_id) {
+    if (loan_id <= 0 || loan_id > n_loans || loans[loan_id - 1].loan_id == 0) return NULL;
+    if (!shard_owns(loans[loan_id - 1].acc_no)) return NULL;
+    return &loans[loan_id - 1];
+}
+
+// Next loan id; sharded, one with this shard's residue (shard.h).
+static int new_loan_id(void) {
+    int id = n_loans + 1;
+    while (!shard_owns(id)) id++;
+    return id;
+}
+
+int loans_load(const char *path) {
+    for (int q = 0; q < OPEN_STATES; q++) q_head[q] = q_tail[q] = -1;
+
+    snprintf(loan_path, sizeof(loan_path), "%s", path);
+    loan_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (loan_fd < 0) { perror(path); return -1; }
+    off_t size = lseek(loan_fd, 0, SEEK_END);
+    off_t whole = size - size % sizeof(Loan);
+    if (whole != size) {
+        // A torn append: it was never acknowledged, the WAL still has it.
+        fprintf(stderr, "%s: dropping %lld torn bytes\n", path, (long long)(size - whole));
+        if (ftruncate(loan_fd, whole) < 0) { perror("ftruncate"); return -1; }
+    }
+    file_size = whole;
+
+    Loan buf[256];
+    for (off_t off = 0; off < whole;) {
+        ssize_t n = pread(loan_fd, buf, sizeof(buf), off);
+        if (n <= 0) { perror("read loans"); return -1; }
+        n -= n % sizeof(Loan);
+        for (int i = 0; i < n / (ssize_t)sizeof(Loan); i++) {
+            int idx = install(&buf[i]);     // last wins
+            if (idx >= 0) lmeta[idx].file_off = off + i * (off_t)sizeof(Loan);
+        }
+        off += n;
+    }
+    return 0;
+}
+
+void loans_replay(uint64_t lsn, const Loan *loan) {
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    int idx = install(loan);
+    if (idx >= 0) loan_dirty(idx, lsn);
+    pthread_mutex_unlock(&loan_lock);
+}
+
+typedef struct {
+    int idx;
+    uint64_t lsn, redo;
+} LoanWb;
+
+static void sync_parent(const char *path) {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = 0;
+    else snprintf(dir, sizeof(dir), ".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) { fsync(fd); close(fd); }
+}
+
+/* Once the file is mostly superseded versions, rewrite it with one version
+   per loan so loading stays proportional to the number of loans.  A loan
+   whose newest version is not durable in the WAL yet keeps the version the
+   file already has.  Runs on the write-back thread, which does the appends. */
+static void loans_compact(uint64_t durable) {
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", loan_path);
+
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    int n = n_loans > 0 ? n_loans : 1;
+    Loan *snap = malloc(sizeof(Loan) * n);
+    off_t *from = malloc(sizeof(off_t) * n);    // version to copy from the file, or -1
+    int k = 0;
+    for (int idx = 0; snap && from && idx < n_loans; idx++) {
+        if (!loans[idx].loan_id) continue;
+        if (lmeta[idx].dirty && lmeta[idx].lsn > durable) {
+            if (lmeta[idx].file_off < 0) continue;
+            from[k] = lmeta[idx].file_off;
+        } else {
+            from[k] = -1;
+            snap[k] = loans[idx];
+        }
+        k++;
+    }
+    pthread_mutex_unlock(&loan_lock);
+    if (!snap || !from) { free(snap); free(from); return; }
+
+    pthread_mutex_lock(&file_lock);
+    int ok = 1;
+    for (int i = 0; i < k && ok; i++)
+        if (from[i] >= 0) ok = pread(loan_fd, &snap[i], sizeof(Loan), from[i]) == sizeof(Loan);
+    size_t len = sizeof(Loan) * k;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ok = ok && fd >= 0 && pwrite(fd, snap, len, 0) == (ssize_t)len &&
+         fdatasync(fd) == 0 && rename(tmp, loan_path) == 0;
+    if (ok) {
+        sync_parent(loan_path);
+        close(loan_fd);
+        loan_fd = fd;
+        file_size = len;
+    } else {
+        perror("compact loans");
+        if (fd >= 0) { close(fd); unlink(tmp); }
+    }
+    pthread_mutex_unlock(&file_lock);
+
+    if (ok) {
+        stats_mutex_lock(&loan_lock, LOCK_LOAN);
+        for (int i = 0; i < k; i++) lmeta[snap[i].loan_id - 1].file_off = i * (off_t)sizeof(Loan);
+        pthread_mutex_unlock(&loan_lock);
+    }
+    free(snap);
+    free(from);
+}
+
+uint64_t loans_writeback(uint64_t durable) {
+    static Loan *batch;
+    static LoanWb *which;
+    static int cap;
+    uint64_t keep_from = 0;
+    int n = 0;
+
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    if (n_dirty > cap) {
+        Loan *b = realloc(batch, sizeof(Loan) * n_dirty);
+        if (b) batch = b;
+        LoanWb *w = realloc(which, sizeof(LoanWb) * n_dirty);
+        if (w) which = w;
+        if (b && w) cap = n_dirty;
+    }
+    int kept = 0;
+    for (int i = 0; i < n_dirty; i++) {
+        int idx = dirty[i];
+        // WAL rule: a version may reach the file only after its log record.
+        if (lmeta[idx].lsn <= durable && n < cap) {
+            batch[n] = loans[idx];
+            which[n].idx = idx;
+            which[n].lsn = lmeta[idx].lsn;
+            which[n].redo = lmeta[idx].redo;
+            lmeta[idx].dirty = 0;
+            n++;
+        } else {
+            if (!keep_from || lmeta[idx].redo < keep_from) keep_from = lmeta[idx].redo;
+            dirty[kept++] = idx;
+        }
+    }
+    n_dirty = kept;
+    pthread_mutex_unlock(&loan_lock);
+    if (n == 0) return keep_from;
+
+    pthread_mutex_lock(&file_lock);
+    size_t len = sizeof(Loan) * n;
+    off_t at = file_size;
+    ssize_t w = pwrite(loan_fd, batch, len, at);
+    int ok = w == (ssize_t)len && fdatasync(loan_fd) == 0;
+    if (ok) file_size += len;
+    else if (ftruncate(loan_fd, file_size) < 0) perror("ftruncate loans");
+    pthread_mutex_unlock(&file_lock);
+    if (ok) {
+        stats_mutex_lock(&loan_lock, LOCK_LOAN);
+        for (int i = 0; i < n; i++) lmeta[which[i].idx].file_off = at + i * (off_t)sizeof(Loan);
+        int live = n_loans;
+        pthread_mutex_unlock(&loan_lock);
+        if (file_size >= COMPACT_MIN_BYTES && file_size > 2 * (off_t)sizeof(Loan) * live)
+            loans_compact(durable);
+        return keep_from;
+    }
+
+    perror("append loans");
+    // Put them back so the next round retries and the WAL is kept.
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    for (int i = 0; i < n; i++) {
+        if (!lmeta[which[i].idx].dirty) loan_dirty(which[i].idx, which[i].lsn);
+        lmeta[which[i].idx].redo = which[i].redo;
+        if (!keep_from || which[i].redo < keep_from) keep_from = which[i].redo;
+    }
+    pthread_mutex_unlock(&loan_lock);
+    return keep_from;
+}
+
+// Log a new version of a loan on its own; caller holds loan_lock.
+static void commit_loan(const Loan *l) {
+    WalTx tx;
+    wal_tx_begin(&tx);
+    wal_tx_loan(&tx, l);
+    uint64_t lsn = wal_commit(&tx);
+    loan_dirty(install(l), lsn);
+}
+
+int loan_apply(int acc_no, double amount, const char *purpose) {
+    if (!(amount > 0)) return LOAN_INVALID;
+    if (!find_account_by_id(acc_no, NULL)) return LOAN_NOT_FOUND;
+
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    Loan l;
+    memset(&l, 0, sizeof(l));
+    l.loan_id = new_loan_id();
+    l.acc_no = acc_no;
+    l.amount = amount;
+    l.status = LOAN_PENDING;
+    snprintf(l.purpose, sizeof(l.purpose), "%s", purpose);
+    commit_loan(&l);
+    pthread_mutex_unlock(&loan_lock);
+    return l.loan_id;
+}
+
+static int set_status(int loan_id, int from, int to) {
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    Loan *cur = find_loan(loan_id);
+    int rc = !cur ? LOAN_NOT_FOUND : cur->status != from ? LOAN_BAD_STATE : LOAN_OK;
+    if (rc == LOAN_OK) {
+        Loan l = *cur;
+        l.status = to;
+        commit_loan(&l);
+    }
+    pthread_mutex_unlock(&loan_lock);
+    return rc;
+}
+
+int loan_review(int loan_id) {
+    return set_status(loan_id, LOAN_PENDING, LOAN_REVIEWED);
+}
+
+int loan_reject(int loan_id) {
+    return set_status(loan_id, LOAN_REVIEWED, LOAN_REJECTED);
+}
+
+static int credit_fn(Account *acc, void *arg) {
+    acc->balance += *(double *)arg;
+    return 0;
+}
+
+int loan_approve(int loan_id, Loan *out) {
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    Loan *cur = find_loan(loan_id);
+    int rc = !cur ? LOAN_NOT_FOUND : cur->status != LOAN_REVIEWED ? LOAN_BAD_STATE : LOAN_OK;
+    if (rc == LOAN_OK) {
+        Loan l = *cur;
+        l.status = LOAN_APPROVED;
+        WalTx tx;
+        wal_tx_begin(&tx);
+        wal_tx_loan(&tx, &l);
+        uint64_t lsn;
+        // The credit and the status change commit as one transaction.
+        if (modify_account_in_tx(l.acc_no, credit_fn, &l.amount, &tx, &lsn) == 0) {
+            loan_dirty(install(&l), lsn);
+            if (out) *out = l;
+        } else {
+            rc = LOAN_NOT_FOUND;
+        }
+    }
+    pthread_mutex_unlock(&loan_lock);
+    return rc;
+}
+
+int loan_get(int loan_id, Loan *out) {
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    Loan *cur = find_loan(loan_id);
+    if (cur) *out = *cur;
+    pthread_mutex_unlock(&loan_lock);
+    return cur ? LOAN_OK : LOAN_NOT_FOUND;
+}
+
+void for_each_loan_in_state(int status, loan_visit_fn fn, void *arg) {
+    int q = queue_of(status);
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    if (q >= 0) {
+        for (int i = q_head[q]; i >= 0; i = lmeta[i].next)
+            if (shard_owns(loans[i].acc_no) && fn(&loans[i], arg)) break;
+    } else {
+        for (int i = 0; i < n_loans; i++)
+            if (loans[i].loan_id && loans[i].status == status && shard_owns(loans[i].acc_no) &&
+                fn(&loans[i], arg)) break;
+    }
+    pthread_mutex_unlock(&loan_lock);
+}
+
+void for_each_loan_of(int acc_no, loan_visit_fn fn, void *arg) {
+    stats_mutex_lock(&loan_lock, LOCK_LOAN);
+    int pos = acc_lookup(acc_no);
+    for (int i = pos >= 0 ? acc_heads[pos] : -1; i >= 0; i = lmeta[i].next_of_acc)
+        if (fn(&loans[i], arg)) break;
+    pthread_mutex_unlock(&loan_lock);
+}
+
+const char *loan_status_name(int status) {
+    switch (status) {
+    case LOAN_PENDING:  return "PENDING";
+    case LOAN_REVIEWED: return "REVIEWED";
+    case LOAN_APPROVED: return "APPROVED";
+    case LOAN_REJECTED: return "REJECTED";
+    }
+    return "UNKNOWN";
+}
+
+// ---------------- migration ----------------
+
+/* Before loans.dat, an open request lived in Account.loan_pending
+   (1 = requested, 2 = reviewed).  Turn each into a Loan and clear the flag
+   in the same transaction, so this is safe to run on every start. */
+
+typedef struct {
+    int *ids, *states;
+    int n, cap;
+} Legacy;
+
+static int collect_legacy(const Account *a, void *arg) {
+    Legacy *lg = arg;
+    if (a->loan_pending != 1 && a->loan_pending != 2) return 0;
+    if (lg->n == lg->cap) {
+        int cap = lg->cap ? lg->cap * 2 : 16;
+        int *i = realloc(lg->ids, sizeof(int) * cap);
+        if (i) lg->ids = i;
+        int *s = realloc(lg->states, sizeof(int) * cap);
+        if (s) lg->states = s;
+        if (!i || !s) return 1;
+        lg->cap = cap;
+    }
+    lg->ids[lg->n] = a->id;
+    lg->states[lg->n] = a->loan_pending;
+    lg->n++;
+    return 0;
+}
+
+static int clear_legacy(Account *a, void *arg) {
+    if (a->loan_pending != *(int *)arg) return 1;
+    a->loan_pending = 0;
+    return 0;
+}
+
+int loans_migrate_accounts(void) {
+    Legacy lg = { NULL, NULL, 0, 0 };
+    for_each_account(collect_legacy, &lg);
+
+    int moved = 0;
+    for (int i = 0; i < lg.n; i++) {
+        stats_mutex_lock(&loan_lock, LOCK_LOAN);
+        Loan l;
+        memset(&l, 0, sizeof(l));
+        l.loan_id = new_loan_id();
+        l.acc_no = lg.ids[i];
+        l.amount = LEGACY_AMOUNT;
+        l.status = lg.states[i] == 1 ? LOAN_PENDING : LOAN_REVIEWED;
+        snprintf(l.purpose, sizeof(l.purpose), "Migrated loan request");
+        WalTx tx;
+        wal_tx_begin(&tx);
+        wal_tx_loan(&tx, &l);
+        uint64_t lsn;
+        if (modify_account_in_tx(l.acc_no, clear_legacy, &lg.states[i], &tx, &lsn) == 0) {
+            loan_dirty(install(&l), lsn);
+            moved++;
+        }
+        pthread_mutex_unlock(&loan_lock);
+    }
+    free(lg.ids);
+    free(lg.states);
+    return moved;
+}
@@ -0,0 +1,54 @@
+#ifndef LOANS_H
+#define LOANS_H
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Loan store backed by DB_LOAN_FILE.
+ *
+ * The file is append-only: every change to a loan appends its full Loan
+ * record and the last record for a loan_id wins when the file is loaded.
+ * Once superseded versions make up most of it, the write-back thread
+ * rewrites it with one version per loan.
+ * In memory, loans are indexed by loan_id (a dense array), by applicant,
+ * and by status for the open states, so the employee and manager queues
+ * cost O(results) and never touch the accounts table.
+ *
+ * Changes are logged to the WAL as WAL_LOAN operations and appended to the
+ * file lazily, once the log covering them is durable, exactly like account
+ * records.  Approving a loan credits the applicant in the same transaction.
+ */
+
+/* Result codes */
+#define LOAN_OK          0
+#define LOAN_NOT_FOUND  -1    // no such loan (or applicant account)
+#define LOAN_BAD_STATE  -2    // not in the state the action requires
+#define LOAN_INVALID    -3    // bad amount
+
+/* Loan ids index a dense in-memory array; larger ids are refused. */
+#define MAX_LOAN_ID (1 << 26)
+
+int  loans_load(const char *path);
+void loans_replay(uint64_t lsn, const Loan *loan);    // WAL_LOAN during recovery
+int  loans_migrate_accounts(void);            // legacy Account.loan_pending flags
+
+/* Append versions covered by `durable` to the file and fdatasync it.
+   Returns the oldest LSN still only in the WAL (0 if none). */
+uint64_t loans_writeback(uint64_t durable);
+
+/* Returns the new loan id, or a negative LOAN_* code. */
+int  loan_apply(int acc_no, double amount, const char *purpose);
+int  loan_review(int loan_id);                // PENDING -> REVIEWED
+int  loan_reject(int loan_id);                // REVIEWED -> REJECTED
+int  loan_approve(int loan_id, Loan *out);    // REVIEWED -> APPROVED, credits amount
+int  loan_get(int loan_id, Loan *out);        // LOAN_OK or LOAN_NOT_FOUND
+
+/* Visitors run under the loan lock and may stop early by returning non-zero. */
+typedef int (*loan_visit_fn)(const Loan *loan, void *arg);
+void for_each_loan_in_state(int status, loan_visit_fn fn, void *arg);
+void for_each_loan_of(int acc_no, loan_visit_fn fn, void *arg);
+
+const char *loan_status_name(int status);
+
+#endif
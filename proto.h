@@ -0,0 +1,156 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Binary wire protocol, served on its own port next to the text dialogue.
+ *
+ * Every message is a Frame header followed by `len` bytes of body.  A client
+ * may send any number of requests without waiting; each one is answered by
+ * exactly one response carrying the same req_id and op, in request order.
+ * Responses to mutations are sent once their WAL record is durable, like the
+ * text replies.  Integers and floats use the host byte order (the server and
+ * its tools run on the same machines, as with the .dat files).
+ *
+ * A session starts with OP_LOGIN; the ops allowed afterwards depend on the
+ * role, exactly as in the text menus.
+ *
+ * OP_VIEW_ALL is paged: it returns up to `count` accounts with ids above
+ * BinArgs.id, in id order.  Pass the last id received to get the next page;
+ * a page shorter than requested is the last one.
+ *
+ * OP_STATEMENT pages the same way through the session's ledger entries
+ * (ledger.h), newest first: pass the seq of the oldest entry received as
+ * BinStatement.before.
+ *
+ * OP_DEPOSIT, OP_WITHDRAW and OP_TRANSFER may carry an idempotency key
+ * (idem.h) as the text after BinArgs.  A repeat with the same key gets the
+ * first one's status and balance back instead of running again, RS_RUNNING
+ * if the first has not been answered yet, or RS_KEY_REUSED if the key was
+ * used for a different request.
+ *
+ * A connection the server closes on its own (too many connections, or
+ * the login or idle timeout in conn.h) is sent one last frame first, with
+ * req_id and op 0 and status RS_BUSY or RS_TIMED_OUT.
+ */
+
+/*
+ * Shards (shard.h) also accept a router session: OP_SHARD_LOGIN with the
+ * shared --shard-key.  It may run every employee, manager and admin op,
+ * and the two-phase transfer ops, which nothing else may.
+ */
+
+#define BIN_PORT 8081
+#define BIN_MAX_BODY 512            // larger requests close the connection
+#define BIN_PAGE_ROWS 100           // OP_VIEW_ALL page size when none is given
+#define BIN_MAX_PAGE_ROWS 1000      // larger page sizes are cut to this
+
+typedef struct {
+    uint32_t len;                   // body bytes following the header
+    uint32_t req_id;                // chosen by the client, echoed back
+    uint16_t op;
+    uint16_t status;                // 0 in requests, RS_* in responses
+} Frame;
+
+/* Ops and their request bodies */
+#define OP_LOGIN          1         // BinLogin                -> BinAccount
+#define OP_LOGOUT         2         // -                       -> -, then close
+#define OP_BALANCE       10         // -                       -> BinAmount (balance)
+#define OP_DEPOSIT       11         // BinArgs.amount [+ key]  -> BinAmount (new balance)
+#define OP_WITHDRAW      12         // BinArgs.amount [+ key]  -> BinAmount (new balance)
+#define OP_TRANSFER      13         // BinArgs.id (to), amount [+ key] -> BinAmount (new balance)
+#define OP_APPLY_LOAN    14         // BinArgs.amount + purpose text -> BinArgs.id (loan id)
+#define OP_MY_LOANS      15         // -                       -> Loan[]
+#define OP_STATEMENT     16         // BinStatement            -> BinEntry[] (RS_FAILED: no ledger here)
+#define OP_VIEW_PENDING  20         // -                       -> Loan[]
+#define OP_MARK_REVIEW   21         // BinArgs.id (loan)       -> -
+#define OP_VIEW_ACCOUNT  22         // BinArgs.id (account)    -> BinAccount
+#define OP_LIST_REVIEWED 30         // -                       -> Loan[]
+#define OP_APPROVE       31         // BinArgs.id (loan)       -> Loan
+#define OP_REJECT        32         // BinArgs.id (loan)       -> -
+#define OP_ADD_ACCOUNT   40         // Account                 -> -
+#define OP_DELETE        41         // BinArgs.id              -> -
+#define OP_SET_PASSWORD  42         // BinArgs.id + password text -> -
+#define OP_SEARCH        43         // BinArgs.id              -> BinAccount
+#define OP_VIEW_ALL      44         // BinArgs.id (after), count   -> BinAccount[] (one page)
+#define OP_STATS         45         // -                       -> report text (as STATS)
+#define OP_RUN_EOD       46         // -                       -> message text (RS_BAD_STATE: not started)
+#define OP_SHARD_LOGIN   50         // BinShardLogin           -> -
+#define OP_XA_PREPARE    51         // BinXa                   -> -
+#define OP_XA_COMMIT     52         // BinXa.txid              -> - (RS_NOT_FOUND: not prepared here)
+#define OP_XA_ABORT      53         // BinXa.txid              -> - (same)
+#define OP_XA_LIST       54         // -                       -> uint64_t[] prepared txids
+
+/* Response status */
+#define RS_OK             0
+#define RS_BAD_REQUEST    1         // unknown op or malformed body
+#define RS_DENIED         2         // not logged in, or op not allowed for the role
+#define RS_AUTH_FAILED    3
+#define RS_NOT_FOUND      4
+#define RS_INSUFFICIENT   5
+#define RS_BAD_STATE      6         // loan not in the required state
+#define RS_EXISTS         7
+#define RS_FAILED         8
+#define RS_READ_ONLY      9         // mutating op sent to a replica (repl.h)
+#define RS_WRONG_SHARD   10         // account id owned by another shard
+#define RS_BUSY          11         // connection refused: too many open; try again later
+#define RS_TIMED_OUT     12         // connection closed for inactivity
+#define RS_RUNNING       13         // same idempotency key still being handled; retry
+#define RS_KEY_REUSED    14         // idempotency key already used for another request
+
+typedef struct {
+    int32_t role;                   // 1 customer, 2 employee, 3 manager, 4 admin
+    char username[50];
+    char password[50];
+} BinLogin;
+
+typedef struct {
+    int32_t id;
+    int32_t count;                  // page size for OP_VIEW_ALL (0 = BIN_PAGE_ROWS)
+    double amount;
+    // optional NUL-terminated text follows (purpose, password)
+} BinArgs;
+
+typedef struct {
+    double amount;
+} BinAmount;
+
+typedef struct {
+    char key[64];
+} BinShardLogin;
+
+typedef struct {
+    uint64_t txid;
+    int32_t id;                     // account on this shard
+    int32_t pad;
+    double amount;                  // < 0 debit, > 0 credit
+} BinXa;
+
+typedef struct {
+    uint64_t before;                // 0 = from the newest entry
+    uint32_t from, to;              // unix seconds; 0 = unbounded
+    int32_t  count;                 // page size (0 = BIN_PAGE_ROWS)
+    int32_t  pad;
+} BinStatement;
+
+typedef struct {
+    uint64_t seq;
+    int64_t  other;                 // payee/payer, loan id or transfer id, by kind
+    double   amount;                // signed
+    float    balance;               // after the change
+    uint32_t time;                  // unix seconds
+    int32_t  kind;                  // LEDGER_*
+    int32_t  pad;
+} BinEntry;
+
+/* Account as shown to clients: no password. */
+typedef struct {
+    int32_t id;
+    char username[50];
+    char role[20];
+    float balance;
+} BinAccount;
+
+#endif
@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "conn.h"
+#include "wal.h"
+
+/*
+ * Event-driven front end: a fixed set of reactor threads, each with its own
+ * epoll instance.  Accepted sockets are spread round-robin over the
+ * reactors and stay with the same thread until they are closed.
+ *
+ * Replies to mutations are not sent until the WAL record behind them may
+ * be acknowledged (wal_ack_lsn, per the durability mode): such connections
+ * sit on their reactor's held list and are flushed when the group-commit
+ * thread signals the reactor's eventfd.
+ *
+ * Long replies are streamed: the protocol layer sets Conn.on_drain and the
+ * reactor calls it for the next chunk each time the socket has taken the
+ * previous one.  Input from that client waits until the stream ends.
+ *
+ * conn_write only queues.  The queue goes out in one write after each read's
+ * worth of lines or frames has been handled (so pipelined requests share
+ * it), after each streamed chunk and when it reaches OUT_FLUSH_BYTES; a
+ * reply that overflows it is sent straight from the caller's buffer behind
+ * the queue with writev, and only what the socket refuses is copied.
+ * While the socket refuses that much, the client's input is not read.
+ *
+ * Past --max-conns, new connections are told the server is busy and
+ * closed at once, so the sessions already admitted keep their latency.
+ * Each reactor keeps its connections on two lists, by last activity and
+ * (until they log in) by accept time; both are in deadline order, so the
+ * idle and login timeouts only ever look at the list heads.
+ */
+
+#define MAX_EVENTS 64
+#define PUMP_BURST 8            // streamed chunks per wakeup before yielding
+#define OUT_FLUSH_BYTES (64 * 1024)
+#define SWEEP_MS 1000           // timeouts are checked at least this often
+
+typedef struct Reactor {
+    int epfd;
+    int wakefd;             // eventfd poked when the acknowledged LSN advances
+    Conn *held;             // connections with output waiting on the WAL
+    Conn *q_head[N_QUEUES], *q_tail[N_QUEUES];
+    uint64_t now;           // when epoll_wait last returned
+    pthread_t tid;
+} Reactor;
+
+static Reactor *reactors;
+static int n_reactors;
+static unsigned next_reactor;
+
+static int max_conns = MAX_CONNS;
+static uint64_t timeout_ns[N_QUEUES] = {
+    [Q_IDLE]  = IDLE_TIMEOUT_S * 1000000000ull,
+    [Q_LOGIN] = LOGIN_TIMEOUT_S * 1000000000ull,
+};
+static int open_conns;          // accepted and not yet freed
+
+void reactor_set_limits(int max, int login_timeout_s, int idle_timeout_s) {
+    max_conns = max;
+    timeout_ns[Q_LOGIN] = login_timeout_s * 1000000000ull;
+    timeout_ns[Q_IDLE] = idle_timeout_s * 1000000000ull;
+}
+
+static void hold_remove(Conn *c) {
+    if (!c->held) return;
+    if (c->hold_prev) c->hold_prev->hold_next = c->hold_next;
+    else c->r->held = c->hold_next;
+    if (c->hold_next) c->hold_next->hold_prev = c->hold_prev;
+    c->hold_prev = c->hold_next = NULL;
+    c->held = 0;
+}
+
+static void hold_add(Conn *c) {
+    if (c->held) return;
+    c->hold_prev = NULL;
+    c->hold_next = c->r->held;
+    if (c->r->held) c->r->held->hold_prev = c;
+    c->r->held = c;
+    c->held = 1;
+    c->held_since = stats_now();
+}
+
+static void queue_remove(Conn *c, int q) {
+    if (!(c->queued & 1 << q)) return;
+    if (c->q_prev[q]) c->q_prev[q]->q_next[q] = c->q_next[q];
+    else c->r->q_head[q] = c->q_next[q];
+    if (c->q_next[q]) c->q_next[q]->q_prev[q] = c->q_prev[q];
+    else c->r->q_tail[q] = c->q_prev[q];
+    c->q_prev[q] = c->q_next[q] = NULL;
+    c->queued &= ~(1 << q);
+}
+
+static void queue_push(Conn *c, int q) {
+    if (!timeout_ns[q]) return;
+    c->q_prev[q] = c->r->q_tail[q];
+    c->q_next[q] = NULL;
+    if (c->r->q_tail[q]) c->r->q_tail[q]->q_next[q] = c;
+    else c->r->q_head[q] = c;
+    c->r->q_tail[q] = c;
+    c->queued |= 1 << q;
+}
+
+// Move to the back of the idle list.
+static void conn_touch(Conn *c) {
+    c->active_at = c->r->now;
+    queue_remove(c, Q_IDLE);
+    if (!c->keep_alive) queue_push(c, Q_IDLE);
+}
+
+static int conn_waiting_on_wal(Conn *c) {
+    return c->hold_lsn > wal_ack_lsn();
+}
+
+static void conn_free(Conn *c) {
+    if (c->r) {
+        hold_remove(c);
+        for (int q = 0; q < N_QUEUES; q++) queue_remove(c, q);
+    }
+    __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+    stats_conn(-1);
+    if (c->state == ST_SESSION) stats_session(-1);
+    close(c->fd);           // also removes it from the epoll set
+    free(c->out);
+    free(c);
+}
+
+// A client that is not taking its replies gets no more read until it does.
+static int conn_backed_up(Conn *c) {
+    return c->epout && c->out_len - c->out_off >= OUT_FLUSH_BYTES;
+}
+
+// Input unless a reply is being streamed or backed up; output while the
+// socket is full or a stream can go on.
+static void conn_events(Conn *c) {
+    uint32_t events = (c->on_drain || conn_backed_up(c) ? 0 : EPOLLIN) |
+                      (c->epout || (c->on_drain && !c->held) ? EPOLLOUT : 0);
+    if (events == c->events) return;
+    c->events = events;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    // Fails with ENOENT before reactor_add registers the socket; the flags
+    // are picked up there instead.
+    if (c->r) epoll_ctl(c->r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_want_write(Conn *c, int on) {
+    c->epout = on;
+    conn_events(c);
+}
+
+// Push queued output to the socket. Returns -1 if the connection is dead.
+static int conn_flush(Conn *c) {
+    if (conn_waiting_on_wal(c)) {
+        if (c->r) hold_add(c);
+        conn_want_write(c, 0);
+        return 0;
+    }
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_want_write(c, 1);
+                return 0;
+            }
+            c->broken = 1;
+            return -1;
+        }
+        c->out_off += n;
+        stats_bytes(0, n);
+    }
+    c->out_off = c->out_len = 0;
+    conn_want_write(c, 0);
+    return 0;
+}
+
+/* Write the queue and then buf with one writev per try, until the socket is
+   full.  Returns how much of buf was sent. */
+static size_t conn_writev(Conn *c, const char *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        size_t queued = c->out_len - c->out_off;
+        struct iovec iov[2] = {
+            { c->out + c->out_off, queued },
+            { (char *)buf + sent, len - sent },
+        };
+        ssize_t n = writev(c->fd, iov + (queued == 0), 2 - (queued == 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) conn_want_write(c, 1);
+            else c->broken = 1;
+            break;
+        }
+        stats_bytes(0, n);
+        if ((size_t)n < queued) {
+            c->out_off += n;
+            continue;
+        }
+        c->out_off = c->out_len = 0;
+        sent += n - queued;
+    }
+    return sent;
+}
+
+void conn_write(Conn *c, const void *buf, size_t len) {
+    if (c->broken) return;
+    // A reply written after a mutation must wait for that mutation's commit.
+    uint64_t lsn = wal_thread_lsn();
+    if (lsn > c->hold_lsn) c->hold_lsn = lsn;
+    if (c->out_len - c->out_off + len >= OUT_FLUSH_BYTES && !c->epout && !conn_waiting_on_wal(c)) {
+        size_t sent = conn_writev(c, buf, len);
+        buf = (const char *)buf + sent;
+        len -= sent;
+        if (!len || c->broken) return;
+    }
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 1024;
+        while (cap < c->out_len + len) cap *= 2;
+        char *p = realloc(c->out, cap);
+        if (!p) { c->broken = 1; return; }
+        c->out = p;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, buf, len);
+    c->out_len += len;
+}
+
+// Helper to send full message to the client (queued if the socket is full)
+void send_msg(Conn *c, const char *msg) {
+    conn_write(c, msg, strlen(msg));
+}
+
+void conn_close_after_flush(Conn *c) {
+    c->closing = 1;
+}
+
+// Run one line or frame through the protocol layer, timing the command it
+// completes (if any).
+static void on_line(Conn *c, char *line) {
+    wal_thread_reset();
+    c->stat_cmd = STAT_NONE;
+    uint64_t t0 = stats_now();
+    conn_on_line(c, line);
+    if (c->stat_cmd) stats_command(c->stat_cmd, stats_now() - t0, c->stat_err);
+}
+
+static void on_frame(Conn *c, const Frame *f, const char *body) {
+    wal_thread_reset();
+    c->stat_cmd = STAT_NONE;
+    uint64_t t0 = stats_now();
+    conn_on_frame(c, f, body);
+    if (c->stat_cmd) stats_command(c->stat_cmd, stats_now() - t0, c->stat_err);
+}
+
+// Hand every complete frame in the input buffer to the binary protocol.
+// Returns the number of bytes consumed, or -1 on a malformed frame.
+static ssize_t conn_frames(Conn *c) {
+    size_t off = 0;
+    while (!c->closing && !c->on_drain && c->in_len - off >= sizeof(Frame)) {
+        Frame f;
+        memcpy(&f, c->in + off, sizeof(f));
+        if (f.len > BIN_MAX_BODY) return -1;
+        if (c->in_len - off < sizeof(f) + f.len) break;
+        // Copy the body out so it is aligned and NUL-padded for the handler.
+        char body[BIN_MAX_BODY + 1];
+        memcpy(body, c->in + off + sizeof(f), f.len);
+        memset(body + f.len, 0, sizeof(body) - f.len);
+        on_frame(c, &f, body);
+        off += sizeof(f) + f.len;
+    }
+    return off;
+}
+
+// Hand the complete lines (or frames) in the input buffer to the protocol
+// layer, stopping if one of them starts a streamed reply.
+static int conn_input(Conn *c) {
+    if (c->binary) {
+        ssize_t used = conn_frames(c);
+        if (used < 0) return -1;
+        memmove(c->in, c->in + used, c->in_len - used);
+        c->in_len -= used;
+        return 0;
+    }
+
+    char *p = c->in, *end = c->in + c->in_len, *nl;
+    while (!c->closing && !c->on_drain && (nl = memchr(p, '\n', end - p))) {
+        *nl = 0;
+        if (nl > p && nl[-1] == '\r') nl[-1] = 0;
+        on_line(c, p);
+        p = nl + 1;
+    }
+    size_t rest = end - p;
+    if (rest == CONN_INBUF - 1 && !c->closing && !c->on_drain) {
+        // Overlong line: treat the full buffer as one line.
+        c->in[rest] = 0;
+        on_line(c, c->in);
+        rest = 0;
+    }
+    memmove(c->in, p, rest);
+    c->in_len = rest;
+    return 0;
+}
+
+// Read what is available and hand complete lines (or frames) to the protocol layer.
+static int conn_read(Conn *c) {
+    for (;;) {
+        if (c->on_drain) return 0;
+        ssize_t n = read(c->fd, c->in + c->in_len, CONN_INBUF - 1 - c->in_len);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->in_len += n;
+        stats_bytes(n, 0);
+        if (conn_input(c) < 0 || conn_flush(c) < 0) return -1;
+        if (c->closing || c->broken || conn_backed_up(c)) return 0;
+    }
+}
+
+// Produce more of a streamed reply while the socket keeps taking it.
+static int conn_pump(Conn *c) {
+    for (int k = 0; k < PUMP_BURST && c->on_drain && !c->held && c->out_off == c->out_len; k++) {
+        wal_thread_reset();
+        c->on_drain(c);
+        if (conn_flush(c) < 0) return -1;
+    }
+    if (c->broken) return -1;
+    // Once it is done, carry on with anything that arrived meanwhile.
+    if (!c->on_drain && (conn_input(c) < 0 || conn_flush(c) < 0)) return -1;
+    conn_events(c);
+    return 0;
+}
+
+// Flush connections whose WAL records may now be acknowledged.
+static void release_held(Reactor *r) {
+    uint64_t v;
+    if (read(r->wakefd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("eventfd read");
+    Conn *c = r->held;
+    while (c) {
+        Conn *next = c->hold_next;
+        if (!conn_waiting_on_wal(c)) {
+            stats_wal_hold(stats_now() - c->held_since);
+            hold_remove(c);
+            if (conn_flush(c) < 0 || (c->on_drain && conn_pump(c) < 0) ||
+                (c->closing && c->out_off == c->out_len))
+                conn_free(c);
+        }
+        c = next;
+    }
+}
+
+// Runs on the group-commit thread.  Every reactor is poked: checking its
+// held list from here would race with the reactor adding to it.
+static void wake_reactors(void) {
+    uint64_t one = 1;
+    for (int i = 0; i < n_reactors; i++) {
+        if (write(reactors[i].wakefd, &one, sizeof(one)) < 0)
+            perror("eventfd write");
+    }
+}
+
+// Say why and close, without waiting for the socket to take all of it.
+static void conn_drop(Conn *c, int why) {
+    if (why != DROP_BUSY) stats_timed_out();
+    wal_thread_reset();
+    conn_on_drop(c, why);
+    conn_flush(c);
+    conn_free(c);
+}
+
+static void expire(Reactor *r) {
+    Conn *c;
+    while ((c = r->q_head[Q_LOGIN]) && r->now - c->opened_at >= timeout_ns[Q_LOGIN])
+        conn_drop(c, DROP_LOGIN_TIMEOUT);
+    while ((c = r->q_head[Q_IDLE]) && r->now - c->active_at >= timeout_ns[Q_IDLE]) {
+        // A reply held for the WAL is the server's wait, not the client's.
+        if (c->held) conn_touch(c);
+        else conn_drop(c, DROP_IDLE_TIMEOUT);
+    }
+}
+
+static void *reactor_loop(void *arg) {
+    Reactor *r = arg;
+    struct epoll_event ev[MAX_EVENTS];
+    int wait_ms = timeout_ns[Q_IDLE] || timeout_ns[Q_LOGIN] ? SWEEP_MS : -1;
+    for (;;) {
+        int n = epoll_wait(r->epfd, ev, MAX_EVENTS, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        r->now = stats_now();
+        for (int i = 0; i < n; i++) {
+            Conn *c = ev[i].data.ptr;
+            if (!c) { release_held(r); continue; }
+            if (!c->opened_at) {
+                c->opened_at = r->now;
+                if (c->state != ST_SESSION) queue_push(c, Q_LOGIN);
+            }
+            conn_touch(c);
+            int dead = 0;
+            if (ev[i].events & EPOLLIN) dead = conn_read(c) < 0;
+            else if (ev[i].events & (EPOLLERR | EPOLLHUP)) dead = 1;
+            if (!dead && (ev[i].events & EPOLLOUT)) dead = conn_flush(c) < 0;
+            if (!dead && c->on_drain) dead = conn_pump(c) < 0;
+            if (c->broken || (c->closing && c->out_off == c->out_len && !c->held)) dead = 1;
+            if (dead) conn_free(c);
+            else if (c->state == ST_SESSION) queue_remove(c, Q_LOGIN);
+        }
+        if (wait_ms > 0) expire(r);
+    }
+    return NULL;
+}
+
+int reactor_start(int nthreads) {
+    reactors = calloc(nthreads, sizeof(Reactor));
+    if (!reactors) return -1;
+    for (int i = 0; i < nthreads; i++) {
+        reactors[i].epfd = epoll_create1(0);
+        reactors[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        if (reactors[i].epfd < 0 || reactors[i].wakefd < 0) { perror("epoll_create1"); return -1; }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, reactors[i].wakefd, &ev);
+        if (pthread_create(&reactors[i].tid, NULL, reactor_loop, &reactors[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    n_reactors = nthreads;
+    wal_set_durable_hook(wake_reactors);
+    return 0;
+}
+
+// Called from the accept loop; ownership passes to a reactor thread.
+void reactor_add(int fd, int binary) {
+    int one = 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    Conn *c = calloc(1, sizeof(Conn));
+    if (!c) { close(fd); return; }
+    c->fd = fd;
+    c->binary = binary;
+    stats_conn(1);
+    if (max_conns > 0 && __atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED) > max_conns) {
+        stats_refused();
+        conn_drop(c, DROP_BUSY);
+        return;
+    }
+    if (max_conns <= 0) __atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+
+    wal_thread_reset();
+    conn_on_open(c);
+    conn_flush(c);
+    if (c->broken) { conn_free(c); return; }
+
+    Reactor *r = &reactors[next_reactor++ % n_reactors];
+    c->r = r;
+    // The timeout lists belong to the reactor thread: EPOLLOUT fires at
+    // once on a new socket, and reactor_loop queues it from there.
+    c->events = EPOLLIN | EPOLLOUT;
+    struct epoll_event ev = { .events = c->events, .data.ptr = c };
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        conn_free(c);
+    }
+}
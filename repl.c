@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include "repl.h"
+#include "store.h"
+#include "loans.h"
+#include "wal.h"
+#include "stats.h"
+#include "hist.h"
+
+#define SEED_MARKER "data/replica.seeding"  // present while a snapshot is half applied
+#define CHUNK_BYTES (64 * 1024)             // batch of records / snapshot ops per send
+#define MAX_FRAME (2 * CHUNK_BYTES)         // largest payload a follower accepts
+#define MAX_FOLLOWERS WAL_MAX_RETAIN        // each holds one WAL retain pin
+
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;   // everything below
+
+/* Primary side: one slot per connected follower, indexed by its retain pin. */
+typedef struct {
+    int used;
+    char addr[64];
+    uint64_t sent_lsn, acked_lsn;
+} Follower;
+
+static int serving;
+static Follower followers[MAX_FOLLOWERS];
+
+/* Follower side. */
+static const char *primary;             // NULL on a primary
+static int connected;
+static uint64_t applied_lsn;            // last LSN applied to the tables
+static uint64_t primary_lsn;            // primary's acknowledged LSN, from the stream
+static Hist lag;                        // ns from the primary sending a record to applying it
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int send_all(int fd, const void *p, size_t len) {
+    const char *c = p;
+    while (len > 0) {
+        ssize_t n = send(fd, c, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *p, size_t len) {
+    char *c = p;
+    while (len > 0) {
+        ssize_t n = recv(fd, c, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Growable byte buffer for outgoing frames. */
+typedef struct {
+    char *p;
+    size_t len, cap;
+} Out;
+
+static void out_put(Out *o, const void *data, size_t len) {
+    if (o->len + len > o->cap) {
+        size_t cap = o->cap ? o->cap : CHUNK_BYTES;
+        while (cap < o->len + len) cap *= 2;
+        char *p = realloc(o->p, cap);
+        if (!p) { perror("repl buffer"); exit(1); }
+        o->p = p;
+        o->cap = cap;
+    }
+    memcpy(o->p + o->len, data, len);
+    o->len += len;
+}
+
+static void out_frame(Out *o, int type, uint64_t lsn, const void *body, uint32_t len) {
+    ReplFrame f = { .type = type, .len = len, .lsn = lsn, .time_ns = wall_ns() };
+    out_put(o, &f, sizeof(f));
+    if (len) out_put(o, body, len);
+}
+
+static int out_send(int fd, Out *o) {
+    int rc = send_all(fd, o->p, o->len);
+    o->len = 0;
+    return rc;
+}
+
+// ---------------- primary ----------------
+
+static void op_put(Out *o, int type, int id, const void *body, uint16_t len) {
+    WalOp op = { .type = type, .len = len, .id = id };
+    out_put(o, &op, sizeof(op));
+    out_put(o, body, len);
+}
+
+static int snap_loan(const Loan *l, void *arg) {
+    op_put(arg, WAL_LOAN, l->loan_id, l, sizeof(*l));
+    return 0;
+}
+
+/* Send ops[0..len) as SNAP_DATA frames of about CHUNK_BYTES, cut between ops. */
+static int send_ops(int fd, const char *ops, size_t len) {
+    Out o = { 0 };
+    size_t start = 0, at = 0;
+    int rc = 0;
+    while (rc == 0 && start < len) {
+        while (at < len && (at == start || at - start < CHUNK_BYTES)) {
+            const WalOp *op = (const WalOp *)(ops + at);
+            at += sizeof(*op) + op->len;
+        }
+        out_frame(&o, REPL_SNAP_DATA, 0, ops + start, at - start);
+        rc = out_send(fd, &o);
+        start = at;
+    }
+    free(o.p);
+    return rc;
+}
+
+/* The tables as of now, for an empty follower.  The stream resumes at
+   `from`, which was acknowledged before the first page was read, so every
+   change the pages might have missed is sent again after them. */
+static int send_snapshot(int fd, uint64_t from) {
+    Out o = { 0 }, ops = { 0 };
+    out_frame(&o, REPL_SNAPSHOT, from, NULL, 0);
+    int rc = out_send(fd, &o);
+
+    Account page[256];
+    int after = 0, more = 1, accounts = 0;
+    while (rc == 0 && more) {
+        int n = list_accounts(after, page, 256, &more);
+        ops.len = 0;
+        for (int i = 0; i < n; i++) op_put(&ops, WAL_PUT, page[i].id, &page[i], sizeof(Account));
+        if (n > 0) after = page[n - 1].id;
+        accounts += n;
+        rc = send_ops(fd, ops.p, ops.len);
+        if (n == 0) break;
+    }
+
+    // Loans are copied under the loan lock, then sent.
+    ops.len = 0;
+    for (int s = LOAN_PENDING; s <= LOAN_REJECTED; s++) for_each_loan_in_state(s, snap_loan, &ops);
+    if (rc == 0) rc = send_ops(fd, ops.p, ops.len);
+    size_t loan_bytes = ops.len;
+
+    // Whatever the pages saw must not be lost by a crash of this primary.
+    wal_wait_ack(wal_last_lsn());
+    if (rc == 0) {
+        out_frame(&o, REPL_SNAP_END, from, NULL, 0);
+        rc = out_send(fd, &o);
+    }
+    if (rc == 0)
+        printf("Replication: sent a snapshot of %d accounts and %zu loans, stream from LSN %llu\n",
+               accounts, loan_bytes / (sizeof(WalOp) + sizeof(Loan)), (unsigned long long)from);
+    free(o.p);
+    free(ops.p);
+    return rc;
+}
+
+// Drain the follower's acks without blocking; -1 once it has gone.
+static int read_acks(int fd, int h) {
+    ReplAck a;
+    uint64_t acked = 0;
+    for (;;) {
+        ssize_t n = recv(fd, &a, sizeof(a), MSG_DONTWAIT | MSG_PEEK);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            return -1;
+        }
+        if (n == 0) return -1;
+        if ((size_t)n < sizeof(a)) break;
+        if (recv_all(fd, &a, sizeof(a)) < 0) return -1;
+        acked = a.applied_lsn;
+    }
+    if (acked) {
+        // The follower will ask for acked + 1 if it reconnects.
+        wal_retain_move(h, acked + 1);
+        pthread_mutex_lock(&repl_lock);
+        if (acked > followers[h].acked_lsn) followers[h].acked_lsn = acked;
+        pthread_mutex_unlock(&repl_lock);
+    }
+    return 0;
+}
+
+struct shipper {
+    int fd;
+    char addr[64];
+};
+
+static void *ship_loop(void *arg) {
+    struct shipper *s = arg;
+    int fd = s->fd;
+    int h = -1;
+    WalReader r = { .fd = -1 };
+    Out o = { 0 };
+    char *rec = malloc(MAX_FRAME);
+    if (!rec) { perror("repl"); exit(1); }
+
+    ReplHello hello;
+    if (recv_all(fd, &hello, sizeof(hello)) < 0 || hello.magic != REPL_MAGIC) goto out;
+    uint64_t from = hello.from_lsn ? hello.from_lsn : 1;
+    if (hello.empty) from = wal_ack_lsn() + 1;
+    h = wal_retain(from);
+    if (h < 0) { fprintf(stderr, "Replication: too many followers, refusing %s\n", s->addr); goto out; }
+
+    pthread_mutex_lock(&repl_lock);
+    followers[h] = (Follower){ .used = 1, .sent_lsn = from - 1, .acked_lsn = from - 1 };
+    snprintf(followers[h].addr, sizeof(followers[h].addr), "%s", s->addr);
+    pthread_mutex_unlock(&repl_lock);
+
+    /* An empty follower always starts from a snapshot: the data file may
+       hold accounts that never went through the log (create_accounts). */
+    if (wal_reader_open(&r, from) < 0) {
+        fprintf(stderr, "Replication: %s needs LSN %llu, which is no longer in the log; "
+                "re-seed it from an empty --workdir\n", s->addr, (unsigned long long)from);
+        out_frame(&o, REPL_REFUSED, from, NULL, 0);
+        out_send(fd, &o);
+        goto out;
+    }
+    if (hello.empty && send_snapshot(fd, from) < 0) goto out;
+    printf("Replication: follower %s streaming from LSN %llu\n", s->addr, (unsigned long long)from);
+
+    uint64_t beat = 0;
+    for (;;) {
+        int n = 0;
+        while (o.len < CHUNK_BYTES && (n = wal_reader_next(&r, rec, MAX_FRAME)) > 0)
+            out_frame(&o, REPL_RECORD, ((WalRecord *)rec)->lsn, rec, n);
+        if (n < 0) { fprintf(stderr, "Replication: unreadable log at LSN %llu\n",
+                             (unsigned long long)r.next); goto out; }
+
+        uint64_t now = stats_now();
+        if (now - beat >= REPL_HEARTBEAT_MS * 1000000ull) {
+            out_frame(&o, REPL_HEARTBEAT, wal_ack_lsn(), NULL, 0);
+            beat = now;
+        }
+        if (o.len) {
+            if (out_send(fd, &o) < 0) goto out;
+            pthread_mutex_lock(&repl_lock);
+            followers[h].sent_lsn = r.next - 1;
+            pthread_mutex_unlock(&repl_lock);
+        }
+        if (read_acks(fd, h) < 0) goto out;
+        if (n == 0) wal_wait_ack_for(r.next, REPL_HEARTBEAT_MS);
+    }
+
+out:
+    printf("Replication: follower %s disconnected\n", s->addr);
+    if (h >= 0) {
+        pthread_mutex_lock(&repl_lock);
+        followers[h].used = 0;
+        pthread_mutex_unlock(&repl_lock);
+        wal_retain_drop(h);
+    }
+    wal_reader_close(&r);
+    close(fd);
+    free(o.p);
+    free(rec);
+    free(s);
+    return NULL;
+}
+
+static void *accept_loop(void *arg) {
+    int lfd = (int)(long)arg;
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t plen = sizeof(peer);
+        int fd = accept(lfd, (struct sockaddr *)&peer, &plen);
+        if (fd < 0) { if (errno != EINTR) perror("repl accept"); continue; }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct shipper *s = malloc(sizeof(*s));
+        if (!s) { close(fd); continue; }
+        s->fd = fd;
+        snprintf(s->addr, sizeof(s->addr), "%s:%d", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+        pthread_t t;
+        if (pthread_create(&t, NULL, ship_loop, s) != 0) { close(fd); free(s); continue; }
+        pthread_detach(t);
+    }
+    return NULL;
+}
+
+int repl_serve(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("repl socket"); return -1; }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in a = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(port) };
+    if (bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(fd, 16) < 0) {
+        perror("repl listen");
+        close(fd);
+        return -1;
+    }
+    serving = 1;
+    stats_add_report_hook(repl_report);
+    pthread_t t;
+    if (pthread_create(&t, NULL, accept_loop, (void *)(long)fd) != 0) return -1;
+    pthread_detach(t);
+    return 0;
+}
+
+// ---------------- follower ----------------
+
+int repl_read_only(void) {
+    return primary != NULL;
+}
+
+/* A follower that died while applying a snapshot holds part of the tables
+   and a log that does not describe them; start it over from empty. */
+int repl_prepare_follower(void) {
+    if (access(SEED_MARKER, F_OK) != 0) return 0;
+    DIR *d = opendir("data");
+    if (!d) return -1;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.') continue;
+        char path[300];
+        snprintf(path, sizeof(path), "data/%s", e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    printf("Replication: dropped a half-applied snapshot\n");
+    return 0;
+}
+
+static void mark_seeding(int on) {
+    if (on) {
+        int fd = open(SEED_MARKER, O_CREAT | O_WRONLY, 0644);
+        if (fd >= 0) { fsync(fd); close(fd); }
+    } else {
+        unlink(SEED_MARKER);
+    }
+    int dfd = open("data", O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+}
+
+static void apply_ops(uint64_t lsn, const char *p, size_t len) {
+    size_t at = 0;
+    while (at + sizeof(WalOp) <= len) {
+        const WalOp *op = (const WalOp *)(p + at);
+        if (at + sizeof(*op) + op->len > len) break;
+        store_apply(lsn, op, op + 1);
+        at += sizeof(*op) + op->len;
+    }
+}
+
+static void set_applied(uint64_t lsn, uint64_t sent_ns) {
+    uint64_t now = wall_ns();
+    pthread_mutex_lock(&repl_lock);
+    applied_lsn = lsn;
+    if (lsn > primary_lsn) primary_lsn = lsn;
+    if (sent_ns) hist_record(&lag, now > sent_ns ? now - sent_ns : 0);
+    pthread_mutex_unlock(&repl_lock);
+}
+
+static int connect_primary(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) { close(fd); fd = -1; }
+    freeaddrinfo(ai);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/* One connection: hello, then frames until the primary goes away.
+   Returns -1 if following cannot go on at all. */
+static int follow_stream(int fd) {
+    int empty = wal_last_lsn() == 0 && store_count() == 0;
+    ReplHello hello = { .magic = REPL_MAGIC, .empty = empty, .from_lsn = wal_last_lsn() + 1 };
+    if (send_all(fd, &hello, sizeof(hello)) < 0) return 0;
+
+    char *buf = malloc(MAX_FRAME + sizeof(ReplFrame));
+    if (!buf) { perror("repl"); exit(1); }
+    size_t have = 0;
+    uint64_t seeding = 0, last_ack = 0, acked = 0;
+    int rc = 0;
+
+    for (;;) {
+        uint64_t now = stats_now();
+        if (now - last_ack >= REPL_ACK_MS * 1000000ull) {
+            uint64_t applied = wal_last_lsn();
+            if (!seeding && applied != acked) {
+                ReplAck a = { applied };
+                if (send_all(fd, &a, sizeof(a)) < 0) break;
+                acked = applied;
+            }
+            last_ack = now;
+        }
+
+        struct pollfd p = { .fd = fd, .events = POLLIN };
+        if (poll(&p, 1, REPL_ACK_MS) <= 0) continue;
+        ssize_t n = recv(fd, buf + have, MAX_FRAME + sizeof(ReplFrame) - have, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += n;
+
+        size_t at = 0;
+        while (have - at >= sizeof(ReplFrame)) {
+            ReplFrame f;
+            memcpy(&f, buf + at, sizeof(f));
+            if (f.len > MAX_FRAME) { fprintf(stderr, "Replication: oversized frame\n"); goto done; }
+            if (have - at < sizeof(f) + f.len) break;
+            const char *body = buf + at + sizeof(f);
+            at += sizeof(f) + f.len;
+
+            switch (f.type) {
+            case REPL_RECORD: {
+                const WalRecord *h = (const WalRecord *)body;
+                if (f.len < sizeof(*h) || h->lsn <= wal_last_lsn()) break;     // already have it
+                if (!wal_append(h, h + 1)) {
+                    fprintf(stderr, "Replication: bad record at LSN %llu\n", (unsigned long long)h->lsn);
+                    goto done;
+                }
+                apply_ops(h->lsn, (const char *)(h + 1), h->len);
+                set_applied(h->lsn, f.time_ns);
+                break;
+            }
+            case REPL_SNAPSHOT:
+                if (!empty) { rc = -1; goto done; }
+                mark_seeding(1);
+                seeding = f.lsn;
+                break;
+            case REPL_SNAP_DATA:
+                if (seeding) apply_ops(0, body, f.len);
+                break;
+            case REPL_SNAP_END:
+                if (!seeding) break;
+                // The snapshot goes to the data files, then the log restarts after it.
+                if (store_flush() < 0) { rc = -1; goto done; }
+                loans_writeback(UINT64_MAX);
+                wal_wait(wal_last_lsn());
+                if (wal_reset(seeding) < 0) { fprintf(stderr, "Replication: cannot reset the log\n"); rc = -1; goto done; }
+                mark_seeding(0);
+                printf("Replication: seeded %d accounts, following from LSN %llu\n",
+                       store_count(), (unsigned long long)seeding);
+                set_applied(seeding - 1, 0);
+                seeding = 0;
+                break;
+            case REPL_HEARTBEAT:
+                pthread_mutex_lock(&repl_lock);
+                primary_lsn = f.lsn;
+                pthread_mutex_unlock(&repl_lock);
+                break;
+            case REPL_REFUSED:
+                fprintf(stderr, "Replication: the primary no longer has LSN %llu; "
+                        "re-seed this follower from an empty --workdir\n", (unsigned long long)f.lsn);
+                rc = -1;
+                goto done;
+            }
+        }
+        memmove(buf, buf + at, have - at);
+        have -= at;
+    }
+done:
+    free(buf);
+    return rc;
+}
+
+static void *follow_loop(void *arg) {
+    char host[256];
+    snprintf(host, sizeof(host), "%s", primary);
+    char *port = strrchr(host, ':');
+    *port++ = 0;
+
+    for (;;) {
+        int fd = connect_primary(host, port);
+        if (fd >= 0) {
+            printf("Replication: connected to %s, from LSN %llu\n", primary,
+                   (unsigned long long)wal_last_lsn() + 1);
+            pthread_mutex_lock(&repl_lock);
+            connected = 1;
+            pthread_mutex_unlock(&repl_lock);
+            int rc = follow_stream(fd);
+            close(fd);
+            pthread_mutex_lock(&repl_lock);
+            connected = 0;
+            pthread_mutex_unlock(&repl_lock);
+            if (rc < 0) {
+                fprintf(stderr, "Replication: stopped following %s\n", primary);
+                return NULL;
+            }
+            printf("Replication: lost %s, retrying\n", primary);
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+int repl_follow(const char *host_port) {
+    if (!strchr(host_port, ':')) return -1;
+    primary = host_port;
+    pthread_mutex_lock(&repl_lock);
+    applied_lsn = primary_lsn = wal_last_lsn();
+    hist_reset(&lag);
+    pthread_mutex_unlock(&repl_lock);
+    stats_add_report_hook(repl_report);
+    pthread_t t;
+    if (pthread_create(&t, NULL, follow_loop, NULL) != 0) return -1;
+    pthread_detach(t);
+    return 0;
+}
+
+// ---------------- STATS ----------------
+
+size_t repl_report(char *buf, size_t cap) {
+    size_t len = 0;
+    int n;
+    pthread_mutex_lock(&repl_lock);
+    if (primary) {
+        n = snprintf(buf, cap, "replication: follower of %s connected=%d applied_lsn=%llu primary_lsn=%llu "
+                     "lag_lsn=%llu lag_p50_ms=%.2f lag_p99_ms=%.2f lag_max_ms=%.2f\n",
+                     primary, connected, (unsigned long long)applied_lsn, (unsigned long long)primary_lsn,
+                     (unsigned long long)(primary_lsn > applied_lsn ? primary_lsn - applied_lsn : 0),
+                     hist_quantile(&lag, 0.50) / 1e6, hist_quantile(&lag, 0.99) / 1e6, lag.max / 1e6);
+        if (n > 0) len = (size_t)n < cap ? (size_t)n : cap - 1;
+    } else if (serving) {
+        uint64_t ack = wal_ack_lsn();
+        int count = 0;
+        for (int i = 0; i < MAX_FOLLOWERS; i++) count += followers[i].used;
+        n = snprintf(buf, cap, "replication: primary ack_lsn=%llu followers=%d\n",
+                     (unsigned long long)ack, count);
+        if (n > 0) len = (size_t)n < cap ? (size_t)n : cap - 1;
+        for (int i = 0; i < MAX_FOLLOWERS && len < cap - 1; i++) {
+            if (!followers[i].used) continue;
+            n = snprintf(buf + len, cap - len, "  follower %s sent_lsn=%llu acked_lsn=%llu lag_lsn=%llu\n",
+                         followers[i].addr, (unsigned long long)followers[i].sent_lsn,
+                         (unsigned long long)followers[i].acked_lsn,
+                         (unsigned long long)(ack > followers[i].acked_lsn ? ack - followers[i].acked_lsn : 0));
+            if (n > 0) len += (size_t)n < cap - len ? (size_t)n : cap - len - 1;
+        }
+    }
+    pthread_mutex_unlock(&repl_lock);
+    return len;
+}
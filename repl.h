@@ -0,0 +1,66 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hot standby by log shipping.
+ *
+ * The primary (--repl-port) streams its WAL to every follower that connects,
+ * one record at a time once the record may be acknowledged, straight from
+ * the segment files.  A follower (--follow HOST:PORT) appends each record to
+ * its own WAL under the same LSN and applies it to its tables, so its data
+ * directory is always a valid primary one: restarting it without --follow
+ * promotes it.  Followers serve logins and read-only commands and refuse
+ * everything that would change an account or loan.
+ *
+ * A follower reconnects asking for the LSN after the last one in its own
+ * log.  If the primary no longer has that on disk and the follower is
+ * empty, it is seeded from a snapshot of the tables taken while the primary
+ * keeps running: the snapshot starts at the primary's acknowledged LSN + 1
+ * and the stream carries on from there, so any change the snapshot half
+ * saw is applied again (operations are after-images).
+ */
+
+#define REPL_MAGIC 0x5245504cu          // "REPL"
+#define REPL_HEARTBEAT_MS 100           // primary -> follower when idle
+#define REPL_ACK_MS 100                 // follower -> primary
+
+/* Follower -> primary, once after connecting. */
+typedef struct {
+    uint32_t magic;
+    uint32_t empty;                     // holds no data: may be sent a snapshot
+    uint64_t from_lsn;                  // first LSN it needs
+} ReplHello;
+
+/* Primary -> follower: frames, each followed by len payload bytes. */
+typedef struct {
+    uint16_t type;
+    uint16_t pad;
+    uint32_t len;
+    uint64_t lsn;
+    uint64_t time_ns;                   // primary's wall clock when sent
+} ReplFrame;
+
+#define REPL_RECORD     1               // one WAL record (WalRecord + ops)
+#define REPL_SNAPSHOT   2               // snapshot follows; stream resumes at lsn
+#define REPL_SNAP_DATA  3               // WalOps: account PUTs and loans
+#define REPL_SNAP_END   4
+#define REPL_HEARTBEAT  5               // lsn = primary's acknowledged LSN
+#define REPL_REFUSED    6               // from_lsn is gone and the follower is not empty
+
+/* Follower -> primary, every REPL_ACK_MS while connected. */
+typedef struct {
+    uint64_t applied_lsn;
+} ReplAck;
+
+int  repl_serve(int port);                      // primary: accept followers
+int  repl_prepare_follower(void);               // before store_load: drop a half-seeded copy
+int  repl_follow(const char *host_port);        // follower: start the apply thread
+int  repl_read_only(void);                      // this server is a follower
+
+/* Replication part of the STATS report; returns the bytes written. */
+size_t repl_report(char *buf, size_t cap);
+
+#endif
@@ -0,0 +1,907 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include "common.h"
+#include "proto.h"
+#include "shard.h"
+#include "idem.h"
+
+/*
+ * Router in front of sharded servers (shard.h), speaking the binary
+ * protocol (proto.h) on both sides.
+ *
+ * Each client session gets its own thread.  OP_LOGIN is tried on every
+ * shard until one accepts; that shard is the session's home and its
+ * customer ops go there over the login connection.  Those are passed on
+ * as they are: a run of them that has arrived together is sent in one
+ * write and the answers relayed as they come, so a pipelining client keeps
+ * that many requests in flight on the shard.  Everything else is one round
+ * trip at a time.  Employee, manager and
+ * admin ops go to the shard owning the account id in them, or to every
+ * shard (queues, VIEW_ALL, STATS) over router sessions opened with
+ * --shard-key, with the results merged.  Loan ids are unique across shards,
+ * so loan ops go to whichever shard has the loan.
+ *
+ * A transfer to an account on another shard is a two-phase commit: prepare
+ * the debit on the home shard, the credit on the target's, append the
+ * transfer id to the decision log (fdatasync) and commit both.  If either
+ * prepare fails, both participants are told to abort, since a call that
+ * failed on the way back may still have prepared.  A resolver thread lists
+ * what each shard holds prepared every RESOLVE_S seconds: it commits what
+ * was decided, aborts what no session is working on any more, and trims the
+ * decision log once every decision in it has been committed on both sides.
+ * On startup the router commits every prepared transfer found in the log
+ * on the shards and aborts the rest.
+ *
+ * Idempotency keys (idem.h) on ops that go to one shard are checked there;
+ * the router keeps its own cache for cross-shard transfers.
+ *
+ * Sessions past --max-conns get an RS_BUSY frame and are closed, and a
+ * session that sends nothing for --idle-timeout seconds gets RS_TIMED_OUT.
+ */
+
+#define DEFAULT_LOG "router.log"
+#define COMMIT_TRIES 3
+#define RESOLVE_S 1                     // resolver pass interval
+#define LOG_TRIM_BYTES (1 << 20)        // rewrite the decision log past this
+#define MAX_SESSIONS 1000               // default --max-conns; a thread each
+#define IN_BUF (16 << 10)               // client input read ahead, per session
+#define PIPE_MAX 256                    // requests relayed to the home shard at once
+#define IDLE_TIMEOUT_S 600
+
+typedef struct {
+    char host[128];
+    char port[16];
+} ShardAddr;
+
+static ShardAddr shards[MAX_SHARDS];
+static int n_shards;
+static const char *shard_key = "";
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *log_path = DEFAULT_LOG;
+static int log_fd = -1;
+static off_t log_size;
+static uint64_t txid_base;
+static uint32_t txid_seq;
+
+/* Cross-shard transfers this router is not done with, under log_lock.  A
+   prepared transfer a shard lists that is not here is left over from a
+   failure, and the resolver aborts it. */
+enum {
+    TX_PREPARING,                   // a session is preparing (or aborting) it
+    TX_COMMITTING,                  // decided; the session is committing it
+    TX_DECIDED                      // decided; left to the resolver
+};
+typedef struct {
+    uint64_t txid;
+    int state;
+} Tx;
+static Tx *txs;
+static int n_txs, cap_txs;
+
+static uint64_t n_local, n_cross, n_aborted;    // transfers, under log_lock
+static uint64_t n_resolved;                     // by the resolver, under log_lock
+static int n_sessions;                          // atomic
+static uint64_t n_refused, n_timed_out;         // atomic
+
+typedef struct {
+    int fd;                         // client
+    int user;                       // login connection on the home shard, or -1
+    int home;
+    int role;
+    int acc_id;
+    int conn[MAX_SHARDS];           // router sessions, opened on first use
+    uint32_t in_start, in_end;      // unread client input in in[]
+    char in[IN_BUF];
+} Session;
+
+// ---------------- frames ----------------
+
+static int send_all(int fd, const void *p, size_t len) {
+    const char *c = p;
+    while (len > 0) {
+        ssize_t n = send(fd, c, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *p, size_t len) {
+    char *c = p;
+    while (len > 0) {
+        ssize_t n = recv(fd, c, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, uint32_t req_id, int op, int status, const void *body, uint32_t len) {
+    Frame f = { .len = len, .req_id = req_id, .op = op, .status = status };
+    if (send_all(fd, &f, sizeof(f)) < 0) return -1;
+    return len ? send_all(fd, body, len) : 0;
+}
+
+// Read one frame; *body is malloc'ed (NULL when empty), caller frees.
+static int recv_frame(int fd, Frame *f, char **body, uint32_t max) {
+    *body = NULL;
+    if (recv_all(fd, f, sizeof(*f)) < 0 || f->len > max) return -1;
+    if (f->len == 0) return 0;
+    *body = malloc(f->len);
+    if (!*body) return -1;
+    if (recv_all(fd, *body, f->len) < 0) { free(*body); *body = NULL; return -1; }
+    return 0;
+}
+
+/* One request to a shard, waiting for its response.  Returns the RS_*
+   status, or -1 if the connection failed. */
+static int call(int fd, int op, const void *body, uint32_t len, char **out, uint32_t *out_len) {
+    Frame r;
+    char *b;
+    if (out) *out = NULL;
+    if (fd < 0 || send_frame(fd, 0, op, 0, body, len) < 0 || recv_frame(fd, &r, &b, 64 << 20) < 0) return -1;
+    if (out) { *out = b; *out_len = r.len; }
+    else free(b);
+    return r.status;
+}
+
+static int connect_shard(int k) {
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    if (getaddrinfo(shards[k].host, shards[k].port, &hints, &ai) != 0) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) { close(fd); fd = -1; }
+    freeaddrinfo(ai);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// A router session on shard k; -1 if it is unreachable or refuses the key.
+static int open_router_conn(int k) {
+    int fd = connect_shard(k);
+    if (fd < 0) return -1;
+    BinShardLogin l;
+    memset(&l, 0, sizeof(l));
+    snprintf(l.key, sizeof(l.key), "%s", shard_key);
+    if (call(fd, OP_SHARD_LOGIN, &l, sizeof(l), NULL, NULL) != RS_OK) { close(fd); return -1; }
+    return fd;
+}
+
+static int shard_conn(Session *s, int k) {
+    if (s->conn[k] < 0) s->conn[k] = open_router_conn(k);
+    return s->conn[k];
+}
+
+// ---------------- two-phase transfers ----------------
+
+static int xa(int fd, int op, uint64_t txid, int id, double amount) {
+    BinXa x = { .txid = txid, .id = id, .amount = amount };
+    return call(fd, op, &x, sizeof(x), NULL, NULL);
+}
+
+// Caller holds log_lock.
+static int tx_find(uint64_t txid) {
+    for (int i = 0; i < n_txs; i++)
+        if (txs[i].txid == txid) return i;
+    return -1;
+}
+
+// A new transfer id, registered before any shard hears of it.
+static uint64_t tx_begin(void) {
+    pthread_mutex_lock(&log_lock);
+    uint64_t txid = txid_base + ++txid_seq;
+    if (n_txs == cap_txs) {
+        int cap = cap_txs ? cap_txs * 2 : 64;
+        Tx *t = realloc(txs, sizeof(Tx) * cap);
+        if (!t) { perror("transfers"); exit(1); }
+        txs = t;
+        cap_txs = cap;
+    }
+    txs[n_txs++] = (Tx){ txid, TX_PREPARING };
+    pthread_mutex_unlock(&log_lock);
+    return txid;
+}
+
+// The session is done with txid: forget it, or leave it to the resolver.
+static void tx_end(uint64_t txid, int unresolved) {
+    pthread_mutex_lock(&log_lock);
+    int i = tx_find(txid);
+    if (i >= 0 && unresolved) txs[i].state = TX_DECIDED;
+    else if (i >= 0) txs[i] = txs[--n_txs];
+    pthread_mutex_unlock(&log_lock);
+}
+
+// The commit point: once the id is durable here, the transfer happens.
+static int log_decision(uint64_t txid) {
+    pthread_mutex_lock(&log_lock);
+    int ok = write(log_fd, &txid, sizeof(txid)) == sizeof(txid) && fdatasync(log_fd) == 0;
+    if (ok) {
+        int i = tx_find(txid);
+        txs[i].state = TX_COMMITTING;
+        log_size += sizeof(txid);
+        n_cross++;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return ok ? 0 : -1;
+}
+
+// Commit or abort on shard k, reconnecting if needed.  Returns 0 once the
+// shard has answered, -1 if it could not be reached.
+static int finish(Session *s, int k, int op, uint64_t txid) {
+    for (int i = 0; i < COMMIT_TRIES; i++) {
+        int rc = xa(shard_conn(s, k), op, txid, 0, 0);
+        if (rc >= 0) return 0;
+        if (s->conn[k] >= 0) { close(s->conn[k]); s->conn[k] = -1; }
+    }
+    fprintf(stderr, "Transfer %llu: shard %d unreachable, left to the resolver\n",
+            (unsigned long long)txid, k);
+    return -1;
+}
+
+static int transfer_2pc(Session *s, int to, double amount) {
+    int src = s->home, dst = shard_of(to, n_shards);
+    int a = shard_conn(s, src), b = shard_conn(s, dst);
+    if (a < 0 || b < 0) return RS_FAILED;
+
+    uint64_t txid = tx_begin();
+    int rc = xa(a, OP_XA_PREPARE, txid, s->acc_id, -amount), lost = rc < 0 ? src : -1;
+    if (rc == RS_OK && (rc = xa(b, OP_XA_PREPARE, txid, to, amount)) < 0) lost = dst;
+    if (rc != RS_OK || log_decision(txid) < 0) {
+        // A prepare whose answer was lost may still have gone through, so
+        // abort on both; the resolver aborts anything this does not reach.
+        if (lost >= 0) { close(s->conn[lost]); s->conn[lost] = -1; }
+        finish(s, src, OP_XA_ABORT, txid);
+        finish(s, dst, OP_XA_ABORT, txid);
+        tx_end(txid, 0);
+        pthread_mutex_lock(&log_lock);
+        n_aborted++;
+        pthread_mutex_unlock(&log_lock);
+        return rc == RS_OK || rc < 0 ? RS_FAILED : rc;
+    }
+    int unresolved = finish(s, dst, OP_XA_COMMIT, txid) < 0;
+    unresolved |= finish(s, src, OP_XA_COMMIT, txid) < 0;
+    tx_end(txid, unresolved);
+    return RS_OK;
+}
+
+// Rewrite the decision log with just the decisions still needed; caller
+// holds log_lock.  Dropping a decision early would abort a transfer that
+// already happened, so the new log is durable before it replaces the old.
+static void trim_log(void) {
+    int keep = 0;
+    for (int i = 0; i < n_txs; i++) keep += txs[i].state != TX_PREPARING;
+    if (keep == 0) {
+        // Nothing outstanding: stale ids left by a lost truncate are harmless.
+        if (log_size > 0 && ftruncate(log_fd, 0) == 0) log_size = 0;
+        return;
+    }
+    if (log_size < LOG_TRIM_BYTES) return;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", log_path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) { perror(tmp); return; }
+    int ok = 1;
+    for (int i = 0; i < n_txs && ok; i++)
+        if (txs[i].state != TX_PREPARING)
+            ok = write(fd, &txs[i].txid, sizeof(uint64_t)) == sizeof(uint64_t);
+    if (!ok || fdatasync(fd) < 0 || rename(tmp, log_path) < 0) {
+        perror(tmp);
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(log_fd);
+    log_fd = fd;
+    log_size = (off_t)keep * sizeof(uint64_t);
+}
+
+/* One resolver pass over every shard.  A decided transfer is forgotten once
+   a pass that began after it was left to the resolver finds no shard
+   holding it prepared. */
+static void resolve_pass(int *conn) {
+    pthread_mutex_lock(&log_lock);
+    int n_old = 0;
+    uint64_t *old = malloc(sizeof(uint64_t) * (n_txs + 1));
+    for (int i = 0; old && i < n_txs; i++)
+        if (txs[i].state == TX_DECIDED) old[n_old++] = txs[i].txid;
+    pthread_mutex_unlock(&log_lock);
+    if (!old) return;
+
+    int settled = 1;                // every shard listed and answered
+    for (int k = 0; k < n_shards; k++) {
+        if (conn[k] < 0) conn[k] = open_router_conn(k);
+        char *body = NULL;
+        uint32_t len = 0;
+        if (conn[k] < 0 || call(conn[k], OP_XA_LIST, NULL, 0, &body, &len) != RS_OK) {
+            if (conn[k] >= 0) { close(conn[k]); conn[k] = -1; }
+            free(body);
+            settled = 0;
+            continue;
+        }
+        for (uint32_t i = 0; i < len / sizeof(uint64_t); i++) {
+            uint64_t txid;
+            memcpy(&txid, body + i * sizeof(uint64_t), sizeof(txid));
+            pthread_mutex_lock(&log_lock);
+            int j = tx_find(txid);
+            int state = j >= 0 ? txs[j].state : -1;
+            pthread_mutex_unlock(&log_lock);
+            if (state == TX_PREPARING || state == TX_COMMITTING) continue;    // a session has it
+            if (xa(conn[k], state == TX_DECIDED ? OP_XA_COMMIT : OP_XA_ABORT, txid, 0, 0) < 0) {
+                close(conn[k]);
+                conn[k] = -1;
+                settled = 0;
+                break;
+            }
+            pthread_mutex_lock(&log_lock);
+            n_resolved++;
+            pthread_mutex_unlock(&log_lock);
+        }
+        free(body);
+    }
+
+    pthread_mutex_lock(&log_lock);
+    for (int i = 0; settled && i < n_old; i++) {
+        int j = tx_find(old[i]);
+        if (j >= 0) txs[j] = txs[--n_txs];
+    }
+    trim_log();
+    pthread_mutex_unlock(&log_lock);
+    free(old);
+}
+
+static void *resolver(void *arg) {
+    int conn[MAX_SHARDS];
+    for (int k = 0; k < n_shards; k++) conn[k] = -1;
+    for (;;) {
+        sleep(RESOLVE_S);
+        resolve_pass(conn);
+    }
+    return NULL;
+}
+
+/* Resolve what a previous router left prepared: commit what its log
+   decided, abort the rest (nothing was acknowledged for those). */
+static int recover(void) {
+    const char *path = log_path;
+    log_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) { perror(path); return -1; }
+    off_t size = lseek(log_fd, 0, SEEK_END);
+    int n_logged = size / sizeof(uint64_t);
+    uint64_t *logged = malloc(sizeof(uint64_t) * (n_logged + 1));
+    if (!logged || pread(log_fd, logged, n_logged * sizeof(uint64_t), 0) != (ssize_t)(n_logged * sizeof(uint64_t))) {
+        perror(path);
+        return -1;
+    }
+
+    int committed = 0, aborted = 0;
+    for (int k = 0; k < n_shards; k++) {
+        int fd = open_router_conn(k);
+        if (fd < 0) {
+            fprintf(stderr, "Shard %d (%s:%s) is unreachable or refuses the shard key\n",
+                    k, shards[k].host, shards[k].port);
+            return -1;
+        }
+        char *body;
+        uint32_t len;
+        if (call(fd, OP_XA_LIST, NULL, 0, &body, &len) != RS_OK) { close(fd); return -1; }
+        for (uint32_t i = 0; i < len / sizeof(uint64_t); i++) {
+            uint64_t txid;
+            memcpy(&txid, body + i * sizeof(uint64_t), sizeof(txid));
+            int decided = 0;
+            for (int j = 0; j < n_logged && !decided; j++) decided = logged[j] == txid;
+            // The log is cut below, so a decision must not be left undone.
+            if (xa(fd, decided ? OP_XA_COMMIT : OP_XA_ABORT, txid, 0, 0) < 0) {
+                fprintf(stderr, "Shard %d (%s:%s) went away while resolving transfers\n",
+                        k, shards[k].host, shards[k].port);
+                return -1;
+            }
+            if (decided) committed++;
+            else aborted++;
+        }
+        free(body);
+        close(fd);
+    }
+    free(logged);
+    // Every shard has resolved everything: the decisions are no longer needed.
+    if (ftruncate(log_fd, 0) < 0 || fdatasync(log_fd) < 0) { perror(path); return -1; }
+    if (committed || aborted)
+        printf("Resolved prepared transfers: %d committed, %d aborted\n", committed, aborted);
+    return 0;
+}
+
+// ---------------- sessions ----------------
+
+// Same rule as the shards apply (binproto.c); 0 = any logged-in session.
+static int op_role(int op) {
+    if (op >= OP_BALANCE && op <= OP_STATEMENT) return 1;
+    if (op >= OP_VIEW_PENDING && op <= OP_VIEW_ACCOUNT) return 2;
+    if (op >= OP_LIST_REVIEWED && op <= OP_REJECT) return 3;
+    if (op >= OP_ADD_ACCOUNT && op <= OP_RUN_EOD) return 4;
+    return 0;
+}
+
+static int do_login(Session *s, const Frame *f, const char *body) {
+    if (f->len < sizeof(BinLogin)) return send_frame(s->fd, f->req_id, f->op, RS_BAD_REQUEST, NULL, 0);
+    for (int k = 0; k < n_shards; k++) {
+        int fd = connect_shard(k);
+        if (fd < 0) continue;
+        char *out;
+        uint32_t len;
+        int rc = call(fd, OP_LOGIN, body, f->len, &out, &len);
+        if (rc == RS_OK && len >= sizeof(BinAccount)) {
+            if (s->user >= 0) close(s->user);
+            BinAccount a;
+            memcpy(&a, out, sizeof(a));
+            s->user = fd;
+            s->home = k;
+            s->role = ((const BinLogin *)body)->role;
+            s->acc_id = a.id;
+            rc = send_frame(s->fd, f->req_id, f->op, RS_OK, out, len);
+            free(out);
+            return rc;
+        }
+        free(out);
+        close(fd);
+    }
+    return send_frame(s->fd, f->req_id, f->op, RS_AUTH_FAILED, NULL, 0);
+}
+
+// Pass the request to one shard connection and its response back.
+static int forward(Session *s, int fd, const Frame *f, const char *body) {
+    char *out;
+    uint32_t len = 0;
+    int rc = call(fd, f->op, body, f->len, &out, &len);
+    if (rc < 0) return send_frame(s->fd, f->req_id, f->op, RS_FAILED, NULL, 0);
+    rc = send_frame(s->fd, f->req_id, f->op, rc, out, len);
+    free(out);
+    return rc;
+}
+
+// Loan lists, STATS and RUN_EOD: every shard's answer, one after the other.
+// Each shard runs its own end-of-day batch; the reply carries the first
+// refusal if any shard did not start one.
+static int gather(Session *s, const Frame *f, const char *body) {
+    int text = f->op == OP_STATS || f->op == OP_RUN_EOD;
+    int status = RS_OK;
+    char *all = NULL;
+    size_t n = 0;
+    for (int k = 0; k < n_shards; k++) {
+        char *out;
+        uint32_t len;
+        int rc = call(shard_conn(s, k), f->op, body, f->len, &out, &len);
+        if (rc < 0 || (rc != RS_OK && f->op != OP_RUN_EOD)) {
+            free(out);
+            free(all);
+            return send_frame(s->fd, f->req_id, f->op, RS_FAILED, NULL, 0);
+        }
+        if (status == RS_OK) status = rc;
+        char head[48];
+        int h = text ? snprintf(head, sizeof(head), "== shard %d ==\n", k) : 0;
+        int nl = f->op == OP_RUN_EOD;
+        char *p = realloc(all, n + h + len + nl + 1);
+        if (!p) { free(out); free(all); return -1; }
+        all = p;
+        memcpy(all + n, head, h);
+        if (len) memcpy(all + n + h, out, len);
+        if (nl) all[n + h + len] = '\n';
+        n += h + len + nl;
+        free(out);
+    }
+    if (f->op == OP_STATS) {
+        char line[512];
+        pthread_mutex_lock(&log_lock);
+        int in_doubt = 0;
+        for (int i = 0; i < n_txs; i++) in_doubt += txs[i].state == TX_DECIDED;
+        int h = snprintf(line, sizeof(line), "== router ==\ntransfers local=%llu cross_shard=%llu aborted=%llu"
+                         " resolved=%llu in_doubt=%d\nsessions=%d refused=%llu timed_out=%llu\n",
+                         (unsigned long long)n_local, (unsigned long long)n_cross,
+                         (unsigned long long)n_aborted, (unsigned long long)n_resolved, in_doubt,
+                         __atomic_load_n(&n_sessions, __ATOMIC_RELAXED),
+                         (unsigned long long)__atomic_load_n(&n_refused, __ATOMIC_RELAXED),
+                         (unsigned long long)__atomic_load_n(&n_timed_out, __ATOMIC_RELAXED));
+        pthread_mutex_unlock(&log_lock);
+        h += idem_report(line + h, sizeof(line) - h);
+        char *p = realloc(all, n + h);
+        if (p) { all = p; memcpy(all + n, line, h); n += h; }
+    }
+    int rc = send_frame(s->fd, f->req_id, f->op, status, all, n);
+    free(all);
+    return rc;
+}
+
+static int cmp_row(const void *a, const void *b) {
+    int x = ((const BinAccount *)a)->id, y = ((const BinAccount *)b)->id;
+    return (x > y) - (x < y);
+}
+
+// One VIEW_ALL page: the first `count` ids after BinArgs.id over all shards.
+static int view_all(Session *s, const Frame *f, const BinArgs *a) {
+    int want = a->count <= 0 ? BIN_PAGE_ROWS : a->count > BIN_MAX_PAGE_ROWS ? BIN_MAX_PAGE_ROWS : a->count;
+    BinAccount *rows = malloc(sizeof(BinAccount) * want * n_shards);
+    int n = 0;
+    for (int k = 0; rows && k < n_shards; k++) {
+        char *out;
+        uint32_t len;
+        BinArgs q = { .id = a->id, .count = want };
+        if (call(shard_conn(s, k), OP_VIEW_ALL, &q, sizeof(q), &out, &len) != RS_OK) {
+            free(rows);
+            return send_frame(s->fd, f->req_id, f->op, RS_FAILED, NULL, 0);
+        }
+        int got = len / sizeof(BinAccount);
+        if (got > want) got = want;
+        memcpy(rows + n, out, got * sizeof(BinAccount));
+        n += got;
+        free(out);
+    }
+    if (!rows) return -1;
+    qsort(rows, n, sizeof(BinAccount), cmp_row);
+    if (n > want) n = want;
+    int rc = send_frame(s->fd, f->req_id, f->op, RS_OK, rows, n * sizeof(BinAccount));
+    free(rows);
+    return rc;
+}
+
+// Loan ops: the shard whose residue the id has first (every loan made
+// since sharding), then the others (loans from before).
+static int loan_op(Session *s, const Frame *f, const char *body, int loan_id) {
+    int first = shard_of(loan_id, n_shards);
+    for (int i = 0; i < n_shards; i++) {
+        int k = (first + i) % n_shards;
+        char *out;
+        uint32_t len = 0;
+        int rc = call(shard_conn(s, k), f->op, body, f->len, &out, &len);
+        if (rc != RS_NOT_FOUND || i == n_shards - 1) {
+            rc = send_frame(s->fd, f->req_id, f->op, rc < 0 ? RS_FAILED : rc, out, len);
+            free(out);
+            return rc;
+        }
+        free(out);
+    }
+    return send_frame(s->fd, f->req_id, f->op, RS_NOT_FOUND, NULL, 0);
+}
+
+static int handle(Session *s, const Frame *f, const char *body) {
+    if (f->op == OP_LOGIN) return do_login(s, f, body);
+    if (s->user < 0) return send_frame(s->fd, f->req_id, f->op, RS_DENIED, NULL, 0);
+    int need = op_role(f->op);
+    if (need && need != s->role) return send_frame(s->fd, f->req_id, f->op, RS_DENIED, NULL, 0);
+
+    BinArgs a;
+    memset(&a, 0, sizeof(a));
+    memcpy(&a, body, f->len < sizeof(a) ? f->len : sizeof(a));
+
+    switch (f->op) {
+    case OP_LOGOUT:
+        send_frame(s->fd, f->req_id, f->op, RS_OK, NULL, 0);
+        return -1;
+
+    case OP_TRANSFER: {
+        // Local transfers went to the home shard with the other customer ops.
+        char key[IDEM_KEY_MAX + 1] = "";
+        size_t klen = f->len > sizeof(BinArgs) ? strnlen(body + sizeof(BinArgs), f->len - sizeof(BinArgs)) : 0;
+        if (klen > IDEM_KEY_MAX) return send_frame(s->fd, f->req_id, f->op, RS_BAD_REQUEST, NULL, 0);
+        memcpy(key, body + sizeof(BinArgs), klen);
+        IdemKey k;
+        IdemResult r;
+        int seen = idem_begin(&k, s->acc_id, key, OP_TRANSFER, a.id, a.amount, &r);
+        if (seen == IDEM_DONE) {
+            BinAmount b = { r.balance };
+            return send_frame(s->fd, f->req_id, f->op, r.status, &b, r.status == RS_OK ? sizeof(b) : 0);
+        }
+        if (seen != IDEM_NEW)
+            return send_frame(s->fd, f->req_id, f->op, seen == IDEM_RUNNING ? RS_RUNNING : RS_KEY_REUSED, NULL, 0);
+
+        int rc = transfer_2pc(s, a.id, a.amount);
+        if (rc != RS_OK) {
+            // RS_FAILED: aborted before anything happened, so a retry may run.
+            if (rc == RS_FAILED) idem_cancel(&k);
+            else idem_finish(&k, &(IdemResult){ rc, 0, 0 });
+            return send_frame(s->fd, f->req_id, f->op, rc, NULL, 0);
+        }
+        // The new balance, as a local transfer would answer.
+        char *out;
+        uint32_t len = 0;
+        rc = call(s->user, OP_BALANCE, NULL, 0, &out, &len);
+        BinAmount b = { 0 };
+        if (rc == RS_OK && len >= sizeof(b)) memcpy(&b, out, sizeof(b));
+        idem_finish(&k, &(IdemResult){ RS_OK, b.amount, 0 });
+        rc = send_frame(s->fd, f->req_id, f->op, rc == RS_OK ? RS_OK : RS_FAILED, out, len);
+        free(out);
+        return rc;
+    }
+
+    case OP_VIEW_PENDING: case OP_LIST_REVIEWED: case OP_STATS: case OP_RUN_EOD:
+        return gather(s, f, body);
+
+    case OP_MARK_REVIEW: case OP_APPROVE: case OP_REJECT:
+        return loan_op(s, f, body, a.id);
+
+    case OP_VIEW_ACCOUNT: case OP_SEARCH: case OP_DELETE: case OP_SET_PASSWORD:
+        return forward(s, shard_conn(s, shard_of(a.id, n_shards)), f, body);
+
+    case OP_ADD_ACCOUNT: {
+        if (f->len < sizeof(Account)) return send_frame(s->fd, f->req_id, f->op, RS_BAD_REQUEST, NULL, 0);
+        Account acc;
+        memcpy(&acc, body, sizeof(acc));
+        return forward(s, shard_conn(s, shard_of(acc.id, n_shards)), f, body);
+    }
+
+    case OP_VIEW_ALL:
+        return view_all(s, f, &a);
+
+    default:
+        return send_frame(s->fd, f->req_id, f->op, RS_BAD_REQUEST, NULL, 0);
+    }
+}
+
+// ---------------- pipelined customer ops ----------------
+
+// Length of the complete frame at pos in the client input; 0 if it is not
+// all there yet, -1 if it is too large.
+static long frame_at(const Session *s, uint32_t pos) {
+    Frame f;
+    if (s->in_end - pos < sizeof(f)) return 0;
+    memcpy(&f, s->in + pos, sizeof(f));
+    if (f.len > BIN_MAX_BODY) return -1;
+    return s->in_end - pos >= sizeof(f) + f.len ? (long)(sizeof(f) + f.len) : 0;
+}
+
+/* Read client input; with wait, block (up to the idle timeout) after
+   moving what is unread to the front.  Returns bytes read, 0 if nothing was
+   there (or there is no room) without wait, -1 on close or timeout. */
+static ssize_t read_more(Session *s, int wait) {
+    if (wait && s->in_start > 0) {
+        memmove(s->in, s->in + s->in_start, s->in_end - s->in_start);
+        s->in_end -= s->in_start;
+        s->in_start = 0;
+    }
+    if (s->in_end == IN_BUF) return 0;
+    ssize_t n;
+    do n = recv(s->fd, s->in + s->in_end, IN_BUF - s->in_end, wait ? 0 : MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+    if (n < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return -1;
+    s->in_end += n;
+    return n;
+}
+
+// Customer ops the home shard answers by itself (every one but a transfer
+// to another shard).  The shard echoes req_id, so they go as they are.
+static int for_home(const Session *s, const Frame *f, const char *body) {
+    if (s->user < 0 || op_role(f->op) != 1 || s->role != 1) return 0;
+    if (f->op != OP_TRANSFER) return 1;
+    BinArgs a;
+    memset(&a, 0, sizeof(a));
+    memcpy(&a, body, f->len < sizeof(a) ? f->len : sizeof(a));
+    return shard_of(a.id, n_shards) == s->home || !(a.amount > 0);
+}
+
+/* Copy n responses from the home shard to the client as they arrive.
+   Returns 0, -1 to end the session, or how many are still owed if the
+   shard went away between two responses. */
+static int relay(Session *s, int n) {
+    char buf[1 << 16];
+    Frame h;
+    size_t have = 0;                // header bytes of the current response
+    uint32_t body = 0;              // its body bytes still to come
+    while (n > 0) {
+        ssize_t got = recv(s->user, buf, sizeof(buf), 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return have ? -1 : n;     // half a response sent: the stream is lost
+        size_t i = 0;
+        while (i < (size_t)got && n > 0) {
+            if (have < sizeof(h)) {
+                size_t k = sizeof(h) - have < got - i ? sizeof(h) - have : got - i;
+                memcpy((char *)&h + have, buf + i, k);
+                have += k;
+                i += k;
+                if (have == sizeof(h)) body = h.len;
+            } else {
+                size_t k = body < got - i ? body : got - i;
+                i += k;
+                body -= k;
+            }
+            if (have == sizeof(h) && body == 0) { n--; have = 0; }
+        }
+        if (i < (size_t)got) return -1;         // answers nobody asked for
+        if (send_all(s->fd, buf, got) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Pass the run of home-shard frames starting at the unread input to the
+   home shard, taking in whatever more has already arrived, then relay the
+   answers.  Returns -1 to end the session. */
+static int pipeline(Session *s) {
+    uint32_t req_id[PIPE_MAX];
+    uint16_t op[PIPE_MAX];
+    int n = 0, local = 0;
+    uint32_t start = s->in_start, pos = start;
+    for (int tried = 0; n < PIPE_MAX; ) {
+        long len = frame_at(s, pos);
+        if (len < 0) return -1;
+        if (len == 0) {
+            if (tried++ || read_more(s, 0) <= 0) break;
+            continue;
+        }
+        Frame f;
+        memcpy(&f, s->in + pos, sizeof(f));
+        if (!for_home(s, &f, s->in + pos + sizeof(f))) break;
+        req_id[n] = f.req_id;
+        op[n++] = f.op;
+        local += f.op == OP_TRANSFER;
+        pos += len;
+    }
+    s->in_start = pos;
+    if (local) {
+        pthread_mutex_lock(&log_lock);
+        n_local += local;
+        pthread_mutex_unlock(&log_lock);
+    }
+
+    int owed = send_all(s->user, s->in + start, pos - start) < 0 ? n : relay(s, n);
+    if (owed < 0) return -1;
+    // The home shard went away: fail what it did not answer.
+    for (int i = n - owed; i < n; i++)
+        if (send_frame(s->fd, req_id[i], op[i], RS_FAILED, NULL, 0) < 0) return -1;
+    return 0;
+}
+
+static void *session_loop(void *arg) {
+    Session *s = arg;
+    for (;;) {
+        long len;
+        errno = 0;
+        while ((len = frame_at(s, s->in_start)) == 0 && read_more(s, 1) > 0) {}
+        if (len <= 0) {
+            // SO_RCVTIMEO ran out
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                __atomic_add_fetch(&n_timed_out, 1, __ATOMIC_RELAXED);
+                send_frame(s->fd, 0, 0, RS_TIMED_OUT, NULL, 0);
+            }
+            break;
+        }
+        Frame f;
+        memcpy(&f, s->in + s->in_start, sizeof(f));
+        const char *body = s->in + s->in_start + sizeof(f);
+        int rc;
+        if (for_home(s, &f, body)) rc = pipeline(s);
+        else {
+            s->in_start += len;     // handle() never reads more input
+            rc = handle(s, &f, body);
+        }
+        if (rc < 0) break;
+    }
+    close(s->fd);
+    if (s->user >= 0) close(s->user);
+    for (int k = 0; k < n_shards; k++) if (s->conn[k] >= 0) close(s->conn[k]);
+    free(s);
+    __atomic_sub_fetch(&n_sessions, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// ---------------- main ----------------
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --shards HOST:PORT,HOST:PORT,... --shard-key KEY\n"
+                    "          [--bin-port PORT] [--log FILE] [--max-conns N] [--idle-timeout SEC]\n"
+                    "          [--backlog N] [--idem-entries N] [--idem-ttl SEC] (0 = no limit / no keys)\n"
+                    "Shards are listed by index: the i-th one runs with --shard i/N.\n", prog);
+}
+
+static int parse_shards(char *list) {
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        char *colon = strrchr(tok, ':');
+        if (!colon || n_shards == MAX_SHARDS) return -1;
+        *colon = 0;
+        snprintf(shards[n_shards].host, sizeof(shards[n_shards].host), "%s", tok);
+        snprintf(shards[n_shards].port, sizeof(shards[n_shards].port), "%s", colon + 1);
+        n_shards++;
+    }
+    return n_shards > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int port = BIN_PORT;
+    int max_conns = MAX_SESSIONS, idle_timeout = IDLE_TIMEOUT_S, backlog = SOMAXCONN;
+    int idem_entries = IDEM_ENTRIES, idem_ttl = IDEM_TTL_S;
+    static const struct option opts[] = {
+        { "shards", required_argument, NULL, 's' },
+        { "shard-key", required_argument, NULL, 'k' },
+        { "bin-port", required_argument, NULL, 'b' },
+        { "log", required_argument, NULL, 'l' },
+        { "max-conns", required_argument, NULL, 'm' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "backlog", required_argument, NULL, 'B' },
+        { "idem-entries", required_argument, NULL, 'I' },
+        { "idem-ttl", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+    int o;
+    while ((o = getopt_long(argc, argv, "s:k:b:l:m:i:B:I:T:", opts, NULL)) != -1) {
+        switch (o) {
+            case 's': if (parse_shards(optarg) < 0) { usage(argv[0]); exit(1); } break;
+            case 'k': shard_key = optarg; break;
+            case 'b': port = atoi(optarg); break;
+            case 'l': log_path = optarg; break;
+            case 'm': max_conns = atoi(optarg); break;
+            case 'i': idle_timeout = atoi(optarg); break;
+            case 'B': backlog = atoi(optarg); break;
+            case 'I': idem_entries = atoi(optarg); break;
+            case 'T': idem_ttl = atoi(optarg); break;
+            default: usage(argv[0]); exit(1);
+        }
+    }
+    if (n_shards == 0 || !shard_key[0] || max_conns < 0 || idle_timeout < 0 || backlog < 1 ||
+        idem_entries < 0 || idem_ttl < 1) {
+        usage(argv[0]); exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (recover() < 0) exit(1);
+    if (idem_init(idem_entries, idem_ttl) < 0) { fprintf(stderr, "Failed to allocate the idempotency cache\n"); exit(1); }
+    txid_base = (uint64_t)time(NULL) << 32;
+    pthread_t rt;
+    if (pthread_create(&rt, NULL, resolver, NULL) != 0) { perror("resolver"); exit(1); }
+    pthread_detach(rt);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd == -1) { perror("socket"); exit(1); }
+    int opt = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY,
+                                   .sin_port = htons(port) };
+    if (bind(lfd, (struct sockaddr *)&address, sizeof(address)) < 0) { perror("bind"); exit(1); }
+    if (listen(lfd, backlog) < 0) { perror("listen"); exit(1); }
+    printf("Router on port %d over %d shards\n", port, n_shards);
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) { perror("accept"); continue; }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (max_conns > 0 && __atomic_load_n(&n_sessions, __ATOMIC_RELAXED) >= max_conns) {
+            __atomic_add_fetch(&n_refused, 1, __ATOMIC_RELAXED);
+            send_frame(fd, 0, 0, RS_BUSY, NULL, 0);
+            close(fd);
+            continue;
+        }
+        struct timeval tv = { .tv_sec = idle_timeout };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        Session *s = malloc(sizeof(Session));
+        if (!s) { close(fd); continue; }
+        s->fd = fd;
+        s->user = s->home = -1;
+        s->role = s->acc_id = 0;
+        s->in_start = s->in_end = 0;
+        for (int k = 0; k < MAX_SHARDS; k++) s->conn[k] = -1;
+        pthread_t t;
+        __atomic_add_fetch(&n_sessions, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&t, NULL, session_loop, s) != 0) {
+            __atomic_sub_fetch(&n_sessions, 1, __ATOMIC_RELAXED);
+            close(fd); free(s); continue;
+        }
+        pthread_detach(t);
+    }
+    return 0;
+}
@@ -1,140 +1,267 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
 #include <arpa/inet.h>
-#include <fcntl.h>
-#include <sys/file.h>
+#include <sys/resource.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "common.h"
+#include "store.h"
+#include "conn.h"
+#include "wal.h"
+#include "loans.h"
+#include "proto.h"
+#include "stats.h"
+#include "repl.h"
+#include "shard.h"
+#include "batch.h"
+#include "ledger.h"
+#include "idem.h"
 
 //note initial : admin username: admin123 password: 1234
 
-// Forward declarations for handlers
-void handle_customer(int sock, Account *acc);
-void handle_employee(int sock, Account *acc);
-void handle_manager(int sock, Account *acc);
-void handle_admin(int sock, Account *acc);
+// Role dialogues; each is fed one line at a time by the reactor
+void handle_customer(Conn *c, char *line);
+void handle_employee(Conn *c, char *line);
+void handle_manager(Conn *c, char *line);
+void handle_admin(Conn *c, char *line);
 
 
 #define PORT 8080
 
-
-// typedef struct {
-//     int id;
-//     char username[50];
-//     char password[50];
-//     char role[20];       // CUSTOMER, EMPLOYEE, MANAGER, ADMIN
-//     float balance;
-//     int loan_pending;    // 0 = none, 1 = requested, 2 = approved
-// } Account;
-
-
-// Helper to send full message safely to socket (with newline support)
-void send_msg(int sock, const char *msg) {
-    size_t len = strlen(msg);
-    ssize_t sent = 0;
-    while (sent < (ssize_t)len) {
-        ssize_t n = write(sock, msg + sent, len - sent);
-        if (n <= 0) break;
-        sent += n;
+/* Commands that are waiting for an argument line */
+enum {
+    CMD_NONE,
+    CMD_DEPOSIT,
+    CMD_WITHDRAW,
+    CMD_TRANSFER,
+    CMD_APPLY_LOAN,
+    CMD_STATEMENT,
+    CMD_MARK_REVIEW,
+    CMD_VIEW_ACCOUNT,
+    CMD_APPROVE,
+    CMD_REJECT,
+    CMD_ADD_ACCOUNT,
+    CMD_DELETE_ACCOUNT,
+    CMD_MODIFY_ACCOUNT,
+    CMD_SEARCH_ACCOUNT
+};
+
+
+#define FD_RESERVE 64   // descriptors kept for data files, logs and replication
+
+// Raise the descriptor limit so thousands of idle sessions fit; returns it.
+static long raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return -1;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
     }
+    return rl.rlim_cur == RLIM_INFINITY ? -1 : (long)rl.rlim_cur;
 }
 
-
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-
-int find_account_by_username(const char *username, Account *acc) {
-    FILE *fp = fopen(DB_ACC_FILE, "rb");
-    if (!fp) return 0;
-    while (fread(acc, sizeof(Account), 1, fp)) {
-        if (strcmp(acc->username, username) == 0) {
-            fclose(fp);
-            return 1;
-        }
-    }
-    fclose(fp);
-    return 0;
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--threads N] [--port PORT] [--bin-port PORT (0 = off)] [--recovery-threads N]\n"
+                    "          [--durability strict|group[:USEC]|relaxed] [--workdir DIR]\n"
+                    "          [--repl-port PORT | --follow HOST:PORT] [--shard K/N --shard-key KEY]\n"
+                    "          [--eod interest=PCT,fee=AMOUNT,waive=BALANCE,at=HH:MM,threads=N,statements]\n"
+                    "          [--max-conns N] [--login-timeout SEC] [--idle-timeout SEC] [--backlog N]\n"
+                    "          [--idem-entries N] [--idem-ttl SEC]\n"
+                    "          (0 = no limit for --max-conns and the timeouts; --idem-entries 0 ignores keys)\n", prog);
 }
 
-// Validate username, password, and role
-#include <stdio.h>
-#include <string.h>
-#include <stdbool.h>
-#include "common.h"
+static int listen_on(int port, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) { perror("socket"); exit(1); }
 
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-bool check_credentials(const char *username, const char *password, const char *role, Account *acc) {
-   FILE *fp = fopen(DB_ACC_FILE, "rb");
-    if (!fp) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
 
-        perror("Error opening accounts.db");
-        return false;
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind"); exit(1);
     }
-
-    Account a;
-    while (fread(&a, sizeof(Account), 1, fp) == 1) {
-        if (strcmp(a.username, username) == 0 &&
-            strcmp(a.password, password) == 0 &&
-            strcmp(a.role, role) == 0) {
-            *acc = a;
-            fclose(fp);
-            return true;
-        }
+    if (listen(fd, backlog) < 0) {
+        perror("listen"); exit(1);
     }
-
-    fclose(fp);
-    return false;
+    return fd;
 }
 
+int main(int argc, char **argv) {
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int recovery_threads = nthreads;
+    int port = PORT;
+    int bin_port = BIN_PORT;
+    int repl_port = 0;
+    const char *follow = NULL;
+    const char *workdir = NULL;
+    int max_conns = MAX_CONNS;
+    int login_timeout = LOGIN_TIMEOUT_S, idle_timeout = IDLE_TIMEOUT_S;
+    int backlog = SOMAXCONN;
+    int idem_entries = IDEM_ENTRIES, idem_ttl = IDEM_TTL_S;
+
+    static const struct option opts[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "port", required_argument, NULL, 'p' },
+        { "bin-port", required_argument, NULL, 'b' },
+        { "recovery-threads", required_argument, NULL, 'r' },
+        { "durability", required_argument, NULL, 'd' },
+        { "workdir", required_argument, NULL, 'w' },
+        { "repl-port", required_argument, NULL, 'R' },
+        { "follow", required_argument, NULL, 'f' },
+        { "shard", required_argument, NULL, 's' },
+        { "shard-key", required_argument, NULL, 'k' },
+        { "eod", required_argument, NULL, 'e' },
+        { "max-conns", required_argument, NULL, 'm' },
+        { "login-timeout", required_argument, NULL, 'L' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "backlog", required_argument, NULL, 'B' },
+        { "idem-entries", required_argument, NULL, 'I' },
+        { "idem-ttl", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+    int shard = 0, n_shards = 1;
+    const char *shard_key = NULL;
+    int o;
+    while ((o = getopt_long(argc, argv, "t:p:b:r:d:w:R:f:s:k:e:m:L:i:B:I:T:", opts, NULL)) != -1) {
+        switch (o) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 'b': bin_port = atoi(optarg); break;
+            case 'w': workdir = optarg; break;
+            case 'R': repl_port = atoi(optarg); break;
+            case 'f': follow = optarg; break;
+            case 's':
+                if (sscanf(optarg, "%d/%d", &shard, &n_shards) != 2 || n_shards < 1 ||
+                    n_shards > MAX_SHARDS || shard < 0 || shard >= n_shards) { usage(argv[0]); exit(1); }
+                break;
+            case 'k': shard_key = optarg; break;
+            case 'e':
+                if (batch_configure(optarg) < 0) { usage(argv[0]); exit(1); }
+                break;
+            case 'r': recovery_threads = atoi(optarg); break;
+            case 'm': max_conns = atoi(optarg); break;
+            case 'L': login_timeout = atoi(optarg); break;
+            case 'i': idle_timeout = atoi(optarg); break;
+            case 'B': backlog = atoi(optarg); break;
+            case 'I': idem_entries = atoi(optarg); break;
+            case 'T': idem_ttl = atoi(optarg); break;
+            case 'd':
+                if (wal_set_durability(optarg) < 0) { usage(argv[0]); exit(1); }
+                break;
+            default: usage(argv[0]); exit(1);
+        }
+    }
+    if (nthreads < 1) nthreads = 1;
+    if ((follow && (repl_port > 0 || !strchr(follow, ':'))) || port <= 0 || max_conns < 0 ||
+        login_timeout < 0 || idle_timeout < 0 || backlog < 1 || idem_entries < 0 || idem_ttl < 1) {
+        usage(argv[0]); exit(1);
+    }
+    shard_configure(shard, n_shards, shard_key);
+
+    // Data paths are relative, so a second server just needs its own directory.
+    if (workdir && chdir(workdir) < 0) { perror(workdir); exit(1); }
+    if (mkdir("data", 0755) < 0 && errno != EEXIST) { perror("data"); exit(1); }
+    if (follow && repl_prepare_follower() < 0) { perror("data"); exit(1); }
+    if (access(IMPORT_MARKER, F_OK) == 0) {
+        fprintf(stderr, "An import into this directory was interrupted (%s); restore it from a copy\n", IMPORT_MARKER);
+        exit(1);
+    }
+    if (!follow) batch_open();
 
-void *client_handler(void *arg);
-
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) { perror("socket"); exit(1); }
-
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    signal(SIGPIPE, SIG_IGN);
+    long fds = raise_fd_limit();
+    if (fds > 0 && (max_conns == 0 || max_conns > fds - FD_RESERVE)) {
+        max_conns = fds > 2 * FD_RESERVE ? fds - FD_RESERVE : fds / 2;
+        printf("Connections limited to %d by the descriptor limit\n", max_conns);
+    }
+    reactor_set_limits(max_conns, login_timeout, idle_timeout);
+    if (!follow && ledger_open() < 0) { fprintf(stderr, "Failed to open the ledger\n"); exit(1); }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    // Text dialogue on port, framed binary protocol (proto.h) on bin_port.
+    struct pollfd lfd[2] = { { .fd = listen_on(port, backlog), .events = POLLIN } };
+    int n_listen = 1;
+    if (bin_port > 0) lfd[n_listen++] = (struct pollfd){ .fd = listen_on(bin_port, backlog), .events = POLLIN };
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind"); exit(1);
+    uint64_t t0 = stats_now();
+    if (store_load(DB_ACC_FILE, recovery_threads) < 0) {
+        fprintf(stderr, "Failed to load %s\n", DB_ACC_FILE); exit(1);
+    }
+    if (loans_load(DB_LOAN_FILE) < 0) {
+        fprintf(stderr, "Failed to load %s\n", DB_LOAN_FILE); exit(1);
+    }
+    // A follower's log and tables only change by what the primary ships,
+    // so it neither compacts nor migrates on its own.
+    if (store_recover(recovery_threads) < 0 || wal_start() < 0 || store_start_writeback() < 0 ||
+        (!follow && store_start_compactor() < 0)) {
+        fprintf(stderr, "Failed to open the write-ahead log\n"); exit(1);
+    }
+    printf("Loaded %d accounts from %s in %.0f ms\n", store_count(), DB_ACC_FILE,
+           (stats_now() - t0) / 1e6);
+    if (!follow) {
+        if (n_shards > 1) {
+            int dropped = shard_drop_foreign();
+            if (dropped > 0) printf("Dropped %d accounts owned by other shards\n", dropped);
+        }
+        int migrated = loans_migrate_accounts();
+        if (migrated > 0) printf("Moved %d open loan requests into %s\n", migrated, DB_LOAN_FILE);
+        if (ledger_start() < 0) { fprintf(stderr, "Failed to start the ledger\n"); exit(1); }
+        if (batch_start() < 0) { fprintf(stderr, "Failed to start the end-of-day batch\n"); exit(1); }
     }
 
-    if (listen(server_fd, 10) < 0) {
-        perror("listen"); exit(1);
+    stats_init();
+    if (idem_init(idem_entries, idem_ttl) < 0) { fprintf(stderr, "Failed to allocate the idempotency cache\n"); exit(1); }
+    stats_add_report_hook(idem_report);
+    if (reactor_start(nthreads) < 0) {
+        fprintf(stderr, "Failed to start reactor threads\n"); exit(1);
     }
 
-    printf("Server started on port %d...\n", PORT);
+    printf("Server started on port %d (%d reactor threads)...\n", port, nthreads);
+    printf("Durability: %s\n", wal_durability_name());
+    printf("Limits: %d connections, login timeout %d s, idle timeout %d s (0 = none)\n",
+           max_conns, login_timeout, idle_timeout);
+    if (bin_port > 0) printf("Binary protocol on port %d\n", bin_port);
+    if (n_shards > 1) printf("Shard %d of %d (account id %% %d == %d)\n", shard, n_shards, n_shards, shard);
+    if (repl_port > 0) {
+        if (repl_serve(repl_port) < 0) { fprintf(stderr, "Failed to open the replication port\n"); exit(1); }
+        printf("Replication: shipping the log on port %d\n", repl_port);
+    }
+    if (follow) {
+        if (repl_follow(follow) < 0) { fprintf(stderr, "Failed to start following %s\n", follow); exit(1); }
+        printf("Replication: read-only follower of %s\n", follow);
+    }
 
     while (1) {
-        client_fd = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-        if (client_fd < 0) { perror("accept"); continue; }
-
-        pthread_t tid;
-        pthread_create(&tid, NULL, client_handler, (void *)(intptr_t)client_fd);
-        pthread_detach(tid);
+        if (poll(lfd, n_listen, -1) < 0) continue;
+        for (int i = 0; i < n_listen; i++) {
+            if (!(lfd[i].revents & POLLIN)) continue;
+            int client_fd = accept(lfd[i].fd, NULL, NULL);
+            if (client_fd < 0) { perror("accept"); continue; }
+            reactor_add(client_fd, i == 1);
+        }
     }
-    close(server_fd);
     return 0;
 }
 
-void *client_handler(void *arg) {
-    int sock = (intptr_t)arg;
-    char buf[1024];
-    Account acc;
-    char username[50], password[50], role[20];
 
+// ---------------- LOGIN ----------------
+
+void conn_on_open(Conn *c) {
+    if (c->binary) return;      // binary sessions start with an OP_LOGIN frame
     // --- Step 1: Ask for role selection first ---
     const char *role_menu =
         "Select role:\n"
@@ -143,408 +270,517 @@ void *client_handler(void *arg) {
         "3. MANAGER\n"
         "4. ADMIN\n"
         "Enter choice:\n";
-    send_msg(sock, role_menu);
-
-    int n = read(sock, buf, sizeof(buf) - 1);
-    if (n <= 0) { close(sock); return NULL; }
-    buf[n] = '\0';
-    int choice = atoi(buf);
-
-    switch (choice) {
-        case 1: strcpy(role, "CUSTOMER"); break;
-        case 2: strcpy(role, "EMPLOYEE"); break;
-        case 3: strcpy(role, "MANAGER"); break;
-        case 4: strcpy(role, "ADMIN"); break;
-        default:
-            send_msg(sock, "Invalid role choice. Connection closing.\n");
-            close(sock);
-            return NULL;
-    }
-
-    // --- Step 2: Ask username and password ---
-    send_msg(sock, "Enter username:\n");
-    n = read(sock, buf, sizeof(buf) - 1);
-    if (n <= 0) { close(sock); return NULL; }
-    buf[n] = '\0';
-    buf[strcspn(buf, "\r\n")] = 0;
-    strcpy(username, buf);
-
-    send_msg(sock, "Enter password:\n");
-    n = read(sock, buf, sizeof(buf) - 1);
-    if (n <= 0) { close(sock); return NULL; }
-    buf[n] = '\0';
-    buf[strcspn(buf, "\r\n")] = 0;
-    strcpy(password, buf);
+    send_msg(c, role_menu);
+    c->state = ST_ROLE;
+}
 
+void conn_on_drop(Conn *c, int why) {
+    if (c->binary) {
+        Frame h = { .status = why == DROP_BUSY ? RS_BUSY : RS_TIMED_OUT };
+        conn_write(c, &h, sizeof(h));
+        return;
+    }
+    send_msg(c, why == DROP_BUSY ? "Server busy, please try again later.\n" :
+                why == DROP_LOGIN_TIMEOUT ? "\nLogin timed out. Connection closing.\n" :
+                "\nSession timed out after inactivity. Connection closing.\n");
+}
+
+static void login(Conn *c, const char *password) {
     // --- Step 3: Verify credentials ---
-    if (!check_credentials(username, password, role, &acc)) {
-        send_msg(sock, "Invalid credentials or role.\nConnection closed.\n");
-        close(sock);
-        return NULL;
+    if (!check_credentials(c->username, password, c->role, &c->acc)) {
+        conn_stat(c, STAT_LOGIN, 1);
+        send_msg(c, "Invalid credentials or role.\nConnection closed.\n");
+        conn_close_after_flush(c);
+        return;
     }
 
     // --- Step 4: Login success ---
-    send_msg(sock, "Login successful!\n");
+    send_msg(c, "Login successful!\n");
     char role_msg[64];
-    sprintf(role_msg, "ROLE:%s\n", acc.role);
-    send_msg(sock, role_msg);
+    snprintf(role_msg, sizeof(role_msg), "ROLE:%s\n", c->acc.role);
+    send_msg(c, role_msg);
 
     // --- Step 5: Role-specific handler ---
-    if (strcmp(acc.role, "CUSTOMER") == 0) {
-    send_msg(sock, "MENU\n");
-    handle_customer(sock, &acc);
-} else if (strcmp(acc.role, "EMPLOYEE") == 0) {
-    send_msg(sock, "MENU\n");
-    handle_employee(sock, &acc);
-} else if (strcmp(acc.role, "MANAGER") == 0) {
-    send_msg(sock, "MENU\n");
-    handle_manager(sock, &acc);
-} else if (strcmp(acc.role, "ADMIN") == 0) {
-    send_msg(sock, "MENU\n");
-    handle_admin(sock, &acc);
+    if (strcmp(c->acc.role, "CUSTOMER") == 0) c->handler = handle_customer;
+    else if (strcmp(c->acc.role, "EMPLOYEE") == 0) c->handler = handle_employee;
+    else if (strcmp(c->acc.role, "MANAGER") == 0) c->handler = handle_manager;
+    else if (strcmp(c->acc.role, "ADMIN") == 0) c->handler = handle_admin;
+    else { conn_close_after_flush(c); return; }
+    conn_stat(c, STAT_LOGIN, 0);
+    stats_session(1);
+
+    send_msg(c, "MENU\n");
+    if (c->handler == handle_admin) {
+        //  Send the admin menu when login is successful
+        send_msg(c,
+            "ROLE:ADMIN\n"
+            "MENU:\n"
+            "1. ADD_ACCOUNT\n"
+            "2. DELETE_ACCOUNT\n"
+            "3. MODIFY_ACCOUNT\n"
+            "4. SEARCH_ACCOUNT\n"
+            "5. VIEW_ALL\n"
+            "6. STATS\n"
+            "7. RUN_EOD\n"
+            "8. LOGOUT\n"
+            "Enter your command (e.g., ADD_ACCOUNT):"
+        );
+    }
+    c->state = ST_SESSION;
 }
 
+// Commands that change an account or loan; a replica refuses them.
+static int write_command(const char *line) {
+    static const struct { const char *name; int stat; } writes[] = {
+        { "DEPOSIT", STAT_DEPOSIT }, { "WITHDRAW", STAT_WITHDRAW }, { "TRANSFER", STAT_TRANSFER },
+        { "APPLY_LOAN", STAT_APPLY_LOAN }, { "MARK_REVIEW", STAT_MARK_REVIEW },
+        { "APPROVE", STAT_APPROVE }, { "REJECT", STAT_REJECT },
+        { "ADD_ACCOUNT", STAT_ADD_ACCOUNT }, { "DELETE_ACCOUNT", STAT_DELETE_ACCOUNT },
+        { "MODIFY_ACCOUNT", STAT_MODIFY_ACCOUNT }, { "RUN_EOD", STAT_RUN_EOD },
+    };
+    for (size_t i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+        size_t n = strlen(writes[i].name);
+        if (strncmp(line, writes[i].name, n) == 0 && (line[n] == 0 || line[n] == ' '))
+            return writes[i].stat;
+    }
+    return STAT_NONE;
+}
 
-    close(sock);
-    return NULL;
+void conn_on_line(Conn *c, char *line) {
+    switch (c->state) {
+    case ST_ROLE:
+        switch (atoi(line)) {
+            case 1: strcpy(c->role, "CUSTOMER"); break;
+            case 2: strcpy(c->role, "EMPLOYEE"); break;
+            case 3: strcpy(c->role, "MANAGER"); break;
+            case 4: strcpy(c->role, "ADMIN"); break;
+            default:
+                send_msg(c, "Invalid role choice. Connection closing.\n");
+                conn_close_after_flush(c);
+                return;
+        }
+        // --- Step 2: Ask username and password ---
+        send_msg(c, "Enter username:\n");
+        c->state = ST_USER;
+        break;
+
+    case ST_USER:
+        snprintf(c->username, sizeof(c->username), "%s", line);
+        send_msg(c, "Enter password:\n");
+        c->state = ST_PASS;
+        break;
+
+    case ST_PASS:
+        login(c, line);
+        break;
+
+    case ST_SESSION:
+        if (c->cmd == CMD_NONE && repl_read_only()) {
+            int cmd = write_command(line);
+            if (cmd != STAT_NONE) {
+                conn_stat(c, cmd, 1);
+                send_msg(c, "Read-only replica: send changes to the primary.");
+                break;
+            }
+        }
+        c->handler(c, line);
+        break;
+    }
 }
 
 
+// ---------------- CUSTOMER ROLE ----------------
 
+static int withdraw_fn(Account *a, void *arg) {
+    float amt = *(float *)arg;
+    if (a->balance < amt) return 1;     // insufficient funds, leave record untouched
+    a->balance -= amt;
+    return 0;
+}
 
-// ---------------- CUSTOMER ROLE ----------------
+static int deposit_fn(Account *a, void *arg) {
+    a->balance += *(float *)arg;
+    return 0;
+}
 
-void update_account(Account *acc) {
-    pthread_mutex_lock(&file_mutex);
-    //FILE *fp = fopen(DATA_FILE, "r+b");
-    FILE *fp = fopen(DB_ACC_FILE, "r+b");
-    if (!fp) { pthread_mutex_unlock(&file_mutex); return; }
-    Account tmp;
-    while (fread(&tmp, sizeof(Account), 1, fp)) {
-        if (tmp.id == acc->id) {
-            fseek(fp, -sizeof(Account), SEEK_CUR);
-            fwrite(acc, sizeof(Account), 1, fp);
-            fflush(fp);
-            break;
-        }
+// Text reply to a money command, by op and RS_* result.
+static const char *money_reply(int op, int status) {
+    switch (status) {
+    case RS_OK:
+        return op == OP_DEPOSIT ? "Deposit successful." :
+               op == OP_WITHDRAW ? "Withdrawal successful." : "Transfer successful.";
+    case RS_INSUFFICIENT: return "Insufficient balance.";
+    case RS_NOT_FOUND:    return op == OP_TRANSFER ? "Target account not found." : "Account not found.";
+    case RS_RUNNING:      return "The first request with this key is still running; try again.";
+    case RS_KEY_REUSED:   return "This key was already used for a different request.";
+    default:              return "Invalid transfer.";
     }
-    fclose(fp);
-    pthread_mutex_unlock(&file_mutex);
 }
 
-void handle_customer(int sock, Account *acc) {
-    char buf[1024];
-    while (1) {
-        ssize_t n = read(sock, buf, sizeof(buf) - 1);
-        if (n <= 0) break;
-        buf[n] = 0;
-        buf[strcspn(buf, "\r\n")] = 0;
-        
-         printf("\n====== CUSTOMER MENU ======\n");
-        printf("1. Deposit\n2. Withdraw\n3. Balance Enquiry\n4. Apply Loan\n5. View Details\n6. Logout\n");
-        printf("============================\nEnter choice: ");
-        
-
-        if (strcmp(buf, "DEPOSIT") == 0) {
-            read(sock, buf, sizeof(buf));
-            float amt = atof(buf);
-            //int fd = open(DATA_FILE, O_RDWR);
-            int fd = open(DB_ACC_FILE, O_RDWR);
-            flock(fd, LOCK_EX);             // write lock
-            acc->balance += amt;
-            update_account(acc);
-            flock(fd, LOCK_UN);
-            close(fd);
-            send_msg(sock, "Deposit successful.");
-        }
-
-        else if (strcmp(buf, "WITHDRAW") == 0) {
-            read(sock, buf, sizeof(buf));
-            float amt = atof(buf);
-            int fd = open(DB_ACC_FILE, O_RDWR);
-            flock(fd, LOCK_EX);
-            if (acc->balance >= amt) {
-                acc->balance -= amt;
-                update_account(acc);
-                send_msg(sock, "Withdrawal successful.");
-            } else {
-                send_msg(sock, "Insufficient balance.");
+// DEPOSIT, WITHDRAW or TRANSFER; with an idempotency key, a repeat is
+// answered from the cache (idem.h) instead.
+static void money_command(Conn *c, int op, int to, float amt) {
+    Account *acc = &c->acc;
+    IdemKey k;
+    IdemResult r = { 0 };
+    // Refused before the key is looked at, as on the binary port.
+    if (!(amt > 0) || isinf(amt)) {
+        c->idem_key[0] = 0;
+        conn_stat(c, op == OP_DEPOSIT ? STAT_DEPOSIT : op == OP_WITHDRAW ? STAT_WITHDRAW : STAT_TRANSFER, 1);
+        send_msg(c, "Invalid amount.");
+        return;
+    }
+    int seen = idem_begin(&k, acc->id, c->idem_key, op, to, amt, &r);
+    if (seen == IDEM_NEW) {
+        if (op == OP_TRANSFER) {
+            int rc = transfer_funds(acc->id, to, amt);
+            if (rc == XFER_NO_SOURCE) {
+                // Our own account was deleted since login: nothing moved, and
+                // "Target account not found." would blame the wrong one.
+                idem_cancel(&k);
+                c->idem_key[0] = 0;
+                conn_stat(c, STAT_TRANSFER, 1);
+                send_msg(c, "Account not found.");
+                return;
             }
-            flock(fd, LOCK_UN);
-            close(fd);
+            r.status = rc == XFER_OK ? RS_OK : rc == XFER_INSUFFICIENT ? RS_INSUFFICIENT :
+                       rc == XFER_NO_ACCOUNT ? RS_NOT_FOUND : RS_BAD_REQUEST;
+        } else {
+            int rc = modify_account_by_id(acc->id, op == OP_DEPOSIT ? deposit_fn : withdraw_fn, &amt);
+            r.status = rc == 0 ? RS_OK : rc > 0 ? RS_INSUFFICIENT : RS_NOT_FOUND;
         }
+        if (r.status == RS_OK) find_account_by_id(acc->id, acc);
+        r.balance = acc->balance;
+        r.lsn = wal_thread_lsn();
+        idem_finish(&k, &r);
+    }
+    else if (seen == IDEM_DONE) conn_hold_until(c, r.lsn);    // the original's reply may still be held
+    else r.status = seen == IDEM_RUNNING ? RS_RUNNING : RS_KEY_REUSED;
+    c->idem_key[0] = 0;
+    conn_stat(c, op == OP_DEPOSIT ? STAT_DEPOSIT : op == OP_WITHDRAW ? STAT_WITHDRAW : STAT_TRANSFER,
+              r.status != RS_OK);
+    send_msg(c, money_reply(op, r.status));
+}
 
-        else if (strcmp(buf, "BALANCE") == 0) {
-            char msg[100];
-            snprintf(msg, sizeof(msg), "Current Balance: ₹%.2f", acc->balance);
-            send_msg(sock, msg);
-        }
+// "DEPOSIT", "WITHDRAW" or "TRANSFER", optionally followed by an
+// idempotency key.  Returns its CMD_*, -1 if the key is too long, or
+// CMD_NONE for any other line.
+static int money_line(Conn *c, const char *line) {
+    static const struct { const char *name; int cmd; } cmds[] = {
+        { "DEPOSIT", CMD_DEPOSIT }, { "WITHDRAW", CMD_WITHDRAW }, { "TRANSFER", CMD_TRANSFER },
+    };
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        size_t n = strlen(cmds[i].name);
+        if (strncmp(line, cmds[i].name, n) != 0 || (line[n] && line[n] != ' ')) continue;
+        const char *key = line[n] ? line + n + 1 : "";
+        if (strlen(key) > IDEM_KEY_MAX) return -1;
+        strcpy(c->idem_key, key);
+        return cmds[i].cmd;
+    }
+    return CMD_NONE;
+}
 
-        else if (strcmp(buf, "APPLY_LOAN") == 0) {
-            if (acc->loan_pending == 0) {
-                acc->loan_pending = 1;
-                update_account(acc);
-                send_msg(sock, "Loan request submitted for review.");
-            } else {
-                send_msg(sock, "Loan already pending or approved.");
-            }
-        }
+// Appends one "Loan #id" line per loan to the buffer passed as arg.
+struct loan_text { char *buf; size_t cap; int count; };
 
-        else if (strcmp(buf, "VIEW") == 0) {
-            char msg[256];
-            snprintf(msg, sizeof(msg),
-                     "Account ID: %d\nUsername: %s\nBalance: ₹%.2f\nLoan Status: %s",
-                     acc->id, acc->username, acc->balance,
-                     acc->loan_pending == 0 ? "None" :
-                     acc->loan_pending == 1 ? "Pending" : "Approved");
-            send_msg(sock, msg);
-        }
+static int append_loan_line(const Loan *l, void *arg) {
+    struct loan_text *t = arg;
+    size_t len = strlen(t->buf);
+    snprintf(t->buf + len, t->cap - len, "\nLoan #%d: ₹%.2f %s (%s)",
+             l->loan_id, l->amount, loan_status_name(l->status), l->purpose);
+    t->count++;
+    return strlen(t->buf) + 1 >= t->cap;
+}
 
-        else if (strcmp(buf, "LOGOUT") == 0) {
-            send_msg(sock, "Logging out...");
-            break;
-        }
+#define STATEMENT_ROWS 10           // entries shown when no count is given
+#define STATEMENT_MAX_ROWS 100      // most one STATEMENT prints
+
+// Local midnight at the start of "YYYY-MM-DD" plus days, or -1.
+static time_t parse_day(const char *s, int days) {
+    struct tm tm = { 0 };
+    if (sscanf(s, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3) return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_mday += days;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
 
-        else {
-            send_msg(sock, "Invalid customer command.");
+// STATEMENT -> next line: how many entries (empty = STATEMENT_ROWS), or FROM TO dates.
+static void send_statement(Conn *c, const char *line) {
+    char a[32], b[32];
+    int args = sscanf(line, "%31s %31s", a, b);
+    int max = STATEMENT_ROWS;
+    uint32_t from = 0, to = 0;
+    if (args == 2) {
+        time_t f = parse_day(a, 0), t = parse_day(b, 1);
+        if (f < 0 || t <= f) {
+            conn_stat(c, STAT_STATEMENT, 1);
+            send_msg(c, "Give a number of entries, or two dates as YYYY-MM-DD YYYY-MM-DD.");
+            return;
+        }
+        from = f;
+        to = t - 1;
+        max = STATEMENT_MAX_ROWS;
+    } else if (args == 1) {
+        max = atoi(a);
+        if (max <= 0) {
+            conn_stat(c, STAT_STATEMENT, 1);
+            send_msg(c, "Give a number of entries, or two dates as YYYY-MM-DD YYYY-MM-DD.");
+            return;
         }
+        if (max > STATEMENT_MAX_ROWS) max = STATEMENT_MAX_ROWS;
     }
-}
 
-// Find account by numeric id (returns 1 if found and fills acc_out, 0 otherwise)
-int find_account_by_id(int id, Account *acc_out) {
-    pthread_mutex_lock(&file_mutex);
-    FILE *fp = fopen(DB_ACC_FILE, "rb");
-    if (!fp) { pthread_mutex_unlock(&file_mutex); return 0; }
-    Account tmp;
-    int found = 0;
-    while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
-        if (tmp.id == id) {
-            if (acc_out) *acc_out = tmp;
-            found = 1;
+    LedgerRow rows[STATEMENT_MAX_ROWS];
+    int more;
+    int n = ledger_statement(c->acc.id, from, to, 0, rows, max, &more);
+    conn_stat(c, STAT_STATEMENT, n < 0);
+    if (n < 0) { send_msg(c, "Statements are not kept on replicas."); return; }
+
+    char out[STATEMENT_MAX_ROWS * 128 + 256];
+    size_t len = snprintf(out, sizeof(out), "Statement for account %d, newest first:", c->acc.id);
+    for (int i = 0; i < n; i++) {
+        const LedgerRow *r = &rows[i];
+        time_t t = r->time;
+        struct tm tm;
+        char when[32], detail[48] = "";
+        localtime_r(&t, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        switch (r->kind) {
+        case LEDGER_TRANSFER_OUT: snprintf(detail, sizeof(detail), "  to account %lld", (long long)r->other); break;
+        case LEDGER_TRANSFER_IN:  snprintf(detail, sizeof(detail), "  from account %lld", (long long)r->other); break;
+        case LEDGER_LOAN:         snprintf(detail, sizeof(detail), "  loan #%lld", (long long)r->other); break;
+        case LEDGER_SHARD_OUT:
+        case LEDGER_SHARD_IN:
+        case LEDGER_REFUND:       snprintf(detail, sizeof(detail), "  transfer #%lld", (long long)r->other); break;
+        }
+        size_t start = len;
+        len += snprintf(out + len, sizeof(out) - len, "\n%s  %-12s %+12.2f  balance ₹%.2f%s",
+                        when, ledger_kind_name(r->kind), r->amount, r->balance, detail);
+        // Huge amounts make rows longer than the 128 bytes budgeted: drop the
+        // row that does not fit, keeping room for the closing line.
+        if (len >= sizeof(out) - 64) {
+            len = start;
+            more = 1;
             break;
         }
     }
-    fclose(fp);
-    pthread_mutex_unlock(&file_mutex);
-    return found;
+    if (n == 0) len += snprintf(out + len, sizeof(out) - len, "\nNo transactions.");
+    // Always the last line, so the client knows the statement is complete.
+    snprintf(out + len, sizeof(out) - len, more ? "\nOlder entries not shown." : "\nEnd of statement.");
+    send_msg(c, out);
 }
 
-// Credit an account by id (uses file lock and update_account)
-int credit_account_by_id(int id, double amount) {
-    // load account, lock and update
-    pthread_mutex_lock(&file_mutex);
-    FILE *fp = fopen(DB_ACC_FILE, "r+b");
-    if (!fp) { pthread_mutex_unlock(&file_mutex); return -1; }
-    Account tmp;
-    int success = 0;
-    while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
-        if (tmp.id == id) {
-            // Move back and update
-            tmp.balance += amount;
-            fseek(fp, -sizeof(Account), SEEK_CUR);
-            fwrite(&tmp, sizeof(Account), 1, fp);
-            fflush(fp);
-            success = 1;
-            break;
+void handle_customer(Conn *c, char *line) {
+    Account *acc = &c->acc;
+    int cmd = c->cmd, money;
+    c->cmd = CMD_NONE;
+
+    if (cmd == CMD_DEPOSIT) money_command(c, OP_DEPOSIT, 0, atof(line));
+    else if (cmd == CMD_WITHDRAW) money_command(c, OP_WITHDRAW, 0, atof(line));
+
+    else if (cmd == CMD_TRANSFER) {
+        // TRANSFER -> next line: target account id, then the amount
+        if (c->step++ == 0) {
+            c->arg_id = atoi(line);
+            c->cmd = CMD_TRANSFER;
+            return;
         }
+        money_command(c, OP_TRANSFER, c->arg_id, atof(line));
     }
-    fclose(fp);
-    pthread_mutex_unlock(&file_mutex);
-    return success ? 0 : -1;
-}
 
+    else if (cmd == CMD_STATEMENT) send_statement(c, line);
 
-// ---------------- EMPLOYEE ROLE ----------------
-void handle_employee(int sock, Account *self) {
-    // self is the employee account object (not used heavily here)
-    char buf[1024];
-    while (1) {
-        ssize_t n = read(sock, buf, sizeof(buf) - 1);
-        if (n <= 0) break;
-        buf[n] = 0;
-        buf[strcspn(buf, "\r\n")] = 0;
-
-        // Commands expected from client (menu-driven client can send):
-        // "VIEW_PENDING"      -> list accounts with loan_pending == 1
-        // "MARK_REVIEW"       -> next line: account id to mark as reviewed (set loan_pending=2)
-        // "VIEW_ACCOUNT"      -> next line: account id to display
-        // "LOGOUT"
-         printf("\n====== CUSTOMER MENU ======\n");
-        printf("1. VIEW_PENDING\n2. MARK_REVIEW \n3.VIEW_ACCOUNT\n4. LOGOUT\n");
-        printf("============================\nEnter choice: like(VIEW_PENDING)");
-        
-        if (strcmp(buf, "VIEW_PENDING") == 0) {
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "rb");
-            if (!fp) {
-                pthread_mutex_unlock(&file_mutex);
-                send_msg(sock, "Failed to open accounts file.");
-                continue;
-            }
-            Account tmp;
-            int any = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
-                if (tmp.loan_pending == 1) {
-                    char out[256];
-                    snprintf(out, sizeof(out), "AccID=%d Name=%s Balance=%.2f", tmp.id, tmp.username, tmp.balance);
-                    send_msg(sock, out);
-                    any = 1;
-                }
-            }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
-            if (!any) send_msg(sock, "No pending loans found.");
+    else if (cmd == CMD_APPLY_LOAN) {
+        // APPLY_LOAN -> next line: amount, then the purpose
+        if (c->step++ == 0) {
+            c->arg_amount = atof(line);
+            c->cmd = CMD_APPLY_LOAN;
+            return;
         }
-        else if (strcmp(buf, "MARK_REVIEW") == 0) {
-            // expect account id on next line
-            if (read(sock, buf, sizeof(buf)) <= 0) break;
-            buf[strcspn(buf, "\r\n")] = 0;
-            int id = atoi(buf);
-            Account target;
-            if (!find_account_by_id(id, &target)) {
-                send_msg(sock, "Account not found.");
-                continue;
-            }
-            // lock file and update target.loan_pending -> 2 (reviewed)
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "r+b");
-            if (!fp) { pthread_mutex_unlock(&file_mutex); send_msg(sock, "Failed to open file."); continue; }
-            Account tmp;
-            int done = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
-                if (tmp.id == id) {
-                    tmp.loan_pending = 2; // reviewed
-                    fseek(fp, -sizeof(Account), SEEK_CUR);
-                    fwrite(&tmp, sizeof(Account), 1, fp);
-                    fflush(fp);
-                    done = 1;
-                    break;
-                }
-            }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
-            if (done) send_msg(sock, "Marked loan as REVIEWED (forwarded to manager).");
-            else send_msg(sock, "Failed to update account.");
+        int id = loan_apply(acc->id, c->arg_amount, line);
+        conn_stat(c, STAT_APPLY_LOAN, id <= 0);
+        if (id > 0) {
+            char msg[100];
+            snprintf(msg, sizeof(msg), "Loan request #%d submitted for review.", id);
+            send_msg(c, msg);
         }
-        else if (strcmp(buf, "VIEW_ACCOUNT") == 0) {
-            // expect account id on next line
-            if (read(sock, buf, sizeof(buf)) <= 0) break;
-            buf[strcspn(buf, "\r\n")] = 0;
-            int id = atoi(buf);
-            Account t;
-            if (!find_account_by_id(id, &t)) {
-                send_msg(sock, "Account not found.");
-            } else {
-                char out[512];
-                snprintf(out, sizeof(out), "AccID=%d Name=%s Role=%s Balance=%.2f LoanStatus=%d",
-                         t.id, t.username, t.role, t.balance, t.loan_pending);
-                send_msg(sock, out);
-            }
+        else if (id == LOAN_INVALID) send_msg(c, "Invalid loan amount.");
+        else send_msg(c, "Account not found.");
+    }
+
+    // The amount follows (for TRANSFER, after the target account id).
+    else if ((money = money_line(c, line)) != CMD_NONE) {
+        if (money > 0) { c->cmd = money; c->step = 0; }
+        else {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Idempotency keys are at most %d characters.", IDEM_KEY_MAX);
+            conn_stat(c, STAT_INVALID, 1);
+            send_msg(c, msg);
         }
-        else if (strcmp(buf, "LOGOUT") == 0) {
-            send_msg(sock, "Logging out.");
-            break;
+    }
+
+    else if (strcmp(line, "BALANCE") == 0) {
+        // Other sessions may have paid in since login; read the live record.
+        int found = find_account_by_id(acc->id, acc);
+        conn_stat(c, STAT_BALANCE, !found);
+        if (!found) {
+            send_msg(c, "Account not found.");
+        } else {
+            char msg[100];
+            snprintf(msg, sizeof(msg), "Current Balance: ₹%.2f", acc->balance);
+            send_msg(c, msg);
         }
-        else {
-            send_msg(sock, "Unknown employee command.");
+    }
+
+    else if (strcmp(line, "APPLY_LOAN") == 0) { c->cmd = CMD_APPLY_LOAN; c->step = 0; }
+    else if (strcmp(line, "STATEMENT") == 0) c->cmd = CMD_STATEMENT;  // count or dates follow
+
+    else if (strcmp(line, "VIEW") == 0) {
+        conn_stat(c, STAT_MY_LOANS, 0);
+        find_account_by_id(acc->id, acc);
+        char msg[1024];
+        snprintf(msg, sizeof(msg), "Account ID: %d\nUsername: %s\nBalance: ₹%.2f\nLoans:",
+                 acc->id, acc->username, acc->balance);
+        struct loan_text t = { msg, sizeof(msg), 0 };
+        for_each_loan_of(acc->id, append_loan_line, &t);
+        if (t.count == 0) strcat(msg, " None");
+        send_msg(c, msg);
+    }
+
+    else if (strcmp(line, "LOGOUT") == 0) {
+        conn_stat(c, STAT_LOGOUT, 0);
+        send_msg(c, "Logging out...");
+        conn_close_after_flush(c);
+    }
+
+    else {
+        conn_stat(c, STAT_INVALID, 1);
+        send_msg(c, "Invalid customer command.");
+    }
+}
+
+
+// ---------------- LOAN HELPERS ----------------
+
+struct loan_list { Conn *c; int any; };
+
+static int send_loan_row(const Loan *l, void *arg) {
+    struct loan_list *ll = arg;
+    char out[256];
+    snprintf(out, sizeof(out), "LoanID=%d AccID=%d Amount=%.2f Purpose=%s\n",
+             l->loan_id, l->acc_no, l->amount, l->purpose);
+    send_msg(ll->c, out);
+    ll->any = 1;
+    return 0;
+}
+
+static int count_loan(const Loan *l, void *arg) {
+    (*(int *)arg)++;
+    return 0;
+}
+
+
+// ---------------- EMPLOYEE ROLE ----------------
+
+// Commands expected from client (menu-driven client can send):
+// "VIEW_PENDING"      -> list loans waiting for review
+// "MARK_REVIEW"       -> next line: loan id to mark as reviewed (forwarded to the manager)
+// "VIEW_ACCOUNT"      -> next line: account id to display
+// "LOGOUT"
+void handle_employee(Conn *c, char *line) {
+    int cmd = c->cmd;
+    c->cmd = CMD_NONE;
+
+    if (cmd == CMD_MARK_REVIEW) {
+        int rc = loan_review(atoi(line));
+        conn_stat(c, STAT_MARK_REVIEW, rc != LOAN_OK);
+        if (rc == LOAN_OK) send_msg(c, "Marked loan as REVIEWED (forwarded to manager).");
+        else if (rc == LOAN_BAD_STATE) send_msg(c, "Loan is not pending.");
+        else send_msg(c, "Loan not found.");
+    }
+    else if (cmd == CMD_VIEW_ACCOUNT) {
+        int id = atoi(line);
+        Account t;
+        int found = find_account_by_id(id, &t);
+        conn_stat(c, STAT_VIEW_ACCOUNT, !found);
+        if (!found) {
+            send_msg(c, "Account not found.");
+        } else {
+            int n_loans = 0;
+            for_each_loan_of(t.id, count_loan, &n_loans);
+            char out[512];
+            snprintf(out, sizeof(out), "AccID=%d Name=%s Role=%s Balance=%.2f Loans=%d",
+                     t.id, t.username, t.role, t.balance, n_loans);
+            send_msg(c, out);
         }
-    } // end while
+    }
+    else if (strcmp(line, "VIEW_PENDING") == 0) {
+        conn_stat(c, STAT_VIEW_PENDING, 0);
+        struct loan_list l = { c, 0 };
+        for_each_loan_in_state(LOAN_PENDING, send_loan_row, &l);
+        if (!l.any) send_msg(c, "No pending loans found.");
+    }
+    else if (strcmp(line, "MARK_REVIEW") == 0) c->cmd = CMD_MARK_REVIEW;   // loan id follows
+    else if (strcmp(line, "VIEW_ACCOUNT") == 0) c->cmd = CMD_VIEW_ACCOUNT;
+    else if (strcmp(line, "LOGOUT") == 0) {
+        conn_stat(c, STAT_LOGOUT, 0);
+        send_msg(c, "Logging out.");
+        conn_close_after_flush(c);
+    }
+    else {
+        conn_stat(c, STAT_INVALID, 1);
+        send_msg(c, "Unknown employee command.");
+    }
 }
 
 
 // ---------------- MANAGER ROLE ----------------
-void handle_manager(int sock, Account *self) {
-    char buf[1024];
-    while (1) {
-        ssize_t n = read(sock, buf, sizeof(buf) - 1);
-        if (n <= 0) break;
-        buf[n] = 0;
-        buf[strcspn(buf, "\r\n")] = 0;
-
-        // Commands:
-        // "LIST_REVIEWED"  -> list accounts with loan_pending == 2
-        // "APPROVE"        -> next line: account id to approve (set loan_pending=3 and credit amount)
-        // "REJECT"         -> next line: account id to reject (set loan_pending=4)
-        // "LOGOUT"
-
-        if (strcmp(buf, "LIST_REVIEWED") == 0) {
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "rb");
-            if (!fp) { pthread_mutex_unlock(&file_mutex); send_msg(sock, "Failed to open file."); continue; }
-            Account tmp; int any = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
-                if (tmp.loan_pending == 2) {
-                    char out[256];
-                    snprintf(out, sizeof(out), "AccID=%d Name=%s Balance=%.2f", tmp.id, tmp.username, tmp.balance);
-                    send_msg(sock, out); any = 1;
-                }
-            }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
-            if (!any) send_msg(sock, "No reviewed loans found.");
-        }
-        else if (strcmp(buf, "APPROVE") == 0) {
-            if (read(sock, buf, sizeof(buf)) <= 0) break;
-            buf[strcspn(buf, "\r\n")] = 0;
-            int id = atoi(buf);
-            Account t;
-            if (!find_account_by_id(id, &t)) { send_msg(sock, "Account not found."); continue; }
-            // For demo we don't have loan amount stored; assume a fixed loan amount or
-            // use e.g. a separate 'requested_amount' in account — but since we used acc->loan_pending only,
-            // we'll credit a demo amount, e.g., 1000.0 (you can change to real amount if stored).
-            double credit_amt = 1000.0;
-
-            // update account: set loan_pending=3 (approved) and credit amount
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "r+b");
-            if (!fp) { pthread_mutex_unlock(&file_mutex); send_msg(sock, "Failed to open file."); continue; }
-            Account tmp; int done = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
-                if (tmp.id == id) {
-                    tmp.loan_pending = 3;
-                    tmp.balance += credit_amt;
-                    fseek(fp, -sizeof(Account), SEEK_CUR);
-                    fwrite(&tmp, sizeof(Account), 1, fp);
-                    fflush(fp);
-                    done = 1;
-                    break;
-                }
-            }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
-            if (done) {
-                char out[128]; snprintf(out, sizeof(out), "Loan approved and ₹%.2f credited to account %d", credit_amt, id);
-                send_msg(sock, out);
-            } else send_msg(sock, "Failed to approve loan.");
-        }
-        else if (strcmp(buf, "REJECT") == 0) {
-            if (read(sock, buf, sizeof(buf)) <= 0) break;
-            buf[strcspn(buf, "\r\n")] = 0;
-            int id = atoi(buf);
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "r+b");
-            if (!fp) { pthread_mutex_unlock(&file_mutex); send_msg(sock, "Failed to open file."); continue; }
-            Account tmp; int done = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp) == 1) {
-                if (tmp.id == id) {
-                    tmp.loan_pending = 4; // rejected
-                    fseek(fp, -sizeof(Account), SEEK_CUR);
-                    fwrite(&tmp, sizeof(Account), 1, fp);
-                    fflush(fp);
-                    done = 1; break;
-                }
-            }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
-            if (done) send_msg(sock, "Loan rejected.");
-            else send_msg(sock, "Failed to reject loan.");
-        }
-        else if (strcmp(buf, "LOGOUT") == 0) {
-            send_msg(sock, "Logging out.");
-            break;
+
+// Commands:
+// "LIST_REVIEWED"  -> list loans reviewed by an employee
+// "APPROVE"        -> next line: loan id to approve (credits the requested amount)
+// "REJECT"         -> next line: loan id to reject
+// "LOGOUT"
+void handle_manager(Conn *c, char *line) {
+    int cmd = c->cmd;
+    c->cmd = CMD_NONE;
+
+    if (cmd == CMD_APPROVE) {
+        Loan l;
+        int rc = loan_approve(atoi(line), &l);
+        conn_stat(c, STAT_APPROVE, rc != LOAN_OK);
+        if (rc == LOAN_OK) {
+            char out[128];
+            snprintf(out, sizeof(out), "Loan approved and ₹%.2f credited to account %d", l.amount, l.acc_no);
+            send_msg(c, out);
         }
-        else send_msg(sock, "Unknown manager command.");
+        else if (rc == LOAN_BAD_STATE) send_msg(c, "Loan has not been reviewed.");
+        else send_msg(c, "Loan or account not found.");
+    }
+    else if (cmd == CMD_REJECT) {
+        int rc = loan_reject(atoi(line));
+        conn_stat(c, STAT_REJECT, rc != LOAN_OK);
+        if (rc == LOAN_OK) send_msg(c, "Loan rejected.");
+        else send_msg(c, "Failed to reject loan.");
+    }
+    else if (strcmp(line, "LIST_REVIEWED") == 0) {
+        conn_stat(c, STAT_LIST_REVIEWED, 0);
+        struct loan_list l = { c, 0 };
+        for_each_loan_in_state(LOAN_REVIEWED, send_loan_row, &l);
+        if (!l.any) send_msg(c, "No reviewed loans found.");
+    }
+    else if (strcmp(line, "APPROVE") == 0) c->cmd = CMD_APPROVE;     // loan id follows
+    else if (strcmp(line, "REJECT") == 0) c->cmd = CMD_REJECT;
+    else if (strcmp(line, "LOGOUT") == 0) {
+        conn_stat(c, STAT_LOGOUT, 0);
+        send_msg(c, "Logging out.");
+        conn_close_after_flush(c);
+    }
+    else {
+        conn_stat(c, STAT_INVALID, 1);
+        send_msg(c, "Unknown manager command.");
     }
 }
 
@@ -552,182 +788,234 @@ void handle_manager(int sock, Account *self) {
 
 // ---------------- ADMINISTRATOR ROLE ----------------
 
-void handle_admin(int sock, Account *acc) {
-    char buf[1024];
+static int set_password(Account *a, void *arg) {
+    snprintf(a->password, sizeof(a->password), "%s", (const char *)arg);
+    return 0;
+}
 
-    //  Send the admin menu when login is successful
-    send_msg(sock,
-        "ROLE:ADMIN\n"
-        "MENU:\n"
+static void admin_menu(Conn *c) {
+    send_msg(c,
+        "\nMENU:\n"
         "1. ADD_ACCOUNT\n"
         "2. DELETE_ACCOUNT\n"
         "3. MODIFY_ACCOUNT\n"
         "4. SEARCH_ACCOUNT\n"
         "5. VIEW_ALL\n"
-        "6. LOGOUT\n"
-        "Enter your command (e.g., ADD_ACCOUNT):"
+        "6. STATS\n"
+        "7. RUN_EOD\n"
+        "8. LOGOUT\n"
+        "Enter your command:"
     );
+}
 
-    while (1) {
-        ssize_t n = read(sock, buf, sizeof(buf) - 1);
-        if (n <= 0) break;
-        buf[n] = 0;
-        buf[strcspn(buf, "\r\n")] = 0;
-
-        if (strcmp(buf, "ADD_ACCOUNT") == 0) {
-            Account newAcc;
-            // FIX 1: Initialize the struct to all zeros.
-            // This prevents garbage data if a read fails.
-            memset(&newAcc, 0, sizeof(Account));
-
-            send_msg(sock, "Enter ID:");
-            // FIX 2: Use a safe read
-            ssize_t n = read(sock, buf, sizeof(buf) - 1);
-            if (n <= 0) break;
-            buf[n] = '\0';
-            newAcc.id = atoi(buf);
-
-            send_msg(sock, "Enter Username:");
-            // FIX 3: Read directly into the struct, -1 for null terminator
-            n = read(sock, newAcc.username, sizeof(newAcc.username) - 1);
-            if (n <= 0) break;
-            newAcc.username[n] = '\0'; // Manually null-terminate
-            newAcc.username[strcspn(newAcc.username, "\r\n")] = 0; // Clean newline
-
-            send_msg(sock, "Enter Password:");
-            // FIX 4: Safe read
-            n = read(sock, newAcc.password, sizeof(newAcc.password) - 1);
-            if (n <= 0) break;
-            newAcc.password[n] = '\0';
-            newAcc.password[strcspn(newAcc.password, "\r\n")] = 0;
-
-            send_msg(sock, "Enter Role (CUSTOMER/EMPLOYEE/MANAGER):");
-            // FIX 5: Safe read
-            n = read(sock, newAcc.role, sizeof(newAcc.role) - 1);
-            if (n <= 0) break;
-            newAcc.role[n] = '\0';
-            newAcc.role[strcspn(newAcc.role, "\r\n")] = 0;
-
-            // newAcc.balance and loan_pending are already 0 from the memset
-
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "ab");
-            fwrite(&newAcc, sizeof(Account), 1, fp);
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
-
-            send_msg(sock, "Account added successfully.");
-        }
+#define LIST_BATCH 256          // VIEW_ALL rows per streamed chunk
 
-        else if (strcmp(buf, "DELETE_ACCOUNT") == 0) {
-            send_msg(sock, "Enter Account ID to delete:");
-            read(sock, buf, sizeof(buf));
-            int delId = atoi(buf);
-
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "rb");
-            FILE *temp = fopen("temp.dat", "wb");
-            Account tmp; int found = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp)) {
-                if (tmp.id == delId) found = 1;
-                else fwrite(&tmp, sizeof(tmp), 1, temp);
-            }
-            fclose(fp); fclose(temp);
-            remove(DB_ACC_FILE); rename("temp.dat", DB_ACC_FILE);
-            pthread_mutex_unlock(&file_mutex);
+// An account's loans by state, from the loan store (Account.loan_pending
+// is cleared by the migration and no longer says anything).
+struct loan_count { int open, approved; };
 
-            send_msg(sock, found ? "Account deleted." : "Account not found.");
-        }
+static int count_loan_state(const Loan *l, void *arg) {
+    struct loan_count *n = arg;
+    if (l->status == LOAN_PENDING || l->status == LOAN_REVIEWED) n->open++;
+    else if (l->status == LOAN_APPROVED) n->approved++;
+    return 0;
+}
 
-        else if (strcmp(buf, "MODIFY_ACCOUNT") == 0) {
-            send_msg(sock, "Enter Account ID to modify:");
-            read(sock, buf, sizeof(buf));
-            int id = atoi(buf);
-
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "r+b");
-            Account tmp; int found = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp)) {
-                if (tmp.id == id) {
-                    found = 1;
-                    send_msg(sock, "Enter new password:");
-                    read(sock, tmp.password, sizeof(tmp.password));
-                    tmp.password[strcspn(tmp.password, "\r\n")] = 0;
-                    fseek(fp, -sizeof(Account), SEEK_CUR);
-                    fwrite(&tmp, sizeof(Account), 1, fp);
-                    break;
-                }
-            }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
+static struct loan_count loans_of(int acc_no) {
+    struct loan_count n = { 0, 0 };
+    for_each_loan_of(acc_no, count_loan_state, &n);
+    return n;
+}
 
-            send_msg(sock, found ? "Account updated." : "Account not found.");
-        }
+// Send the next chunk of a VIEW_ALL listing; runs as Conn.on_drain, so a
+// chunk is only produced once the socket has taken the previous one.
+static void view_all_more(Conn *c) {
+    Account rows[LIST_BATCH];
+    int want = c->list_left >= 0 && c->list_left < LIST_BATCH ? c->list_left : LIST_BATCH;
+    int more = 0;
+    int n = want > 0 ? list_accounts(c->list_after, rows, want, &more) : 0;
+
+    char chunk[LIST_BATCH * 192];
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        // Loan: how many of the account's loans are still open.
+        len += snprintf(chunk + len, sizeof(chunk) - len, "ID:%d User:%s Role:%s Bal:₹%.2f Loan:%d\n",
+                        rows[i].id, rows[i].username, rows[i].role, rows[i].balance,
+                        loans_of(rows[i].id).open);
+    }
+    if (len) conn_write(c, chunk, len);
+    if (n > 0) c->list_after = rows[n - 1].id;
+    c->list_rows += n;
+    if (c->list_left > 0) c->list_left -= n;
+    if (more && c->list_left != 0) return;
+
+    char msg[128];
+    if (c->list_rows == 0) snprintf(msg, sizeof(msg), "No accounts found.");
+    else if (more) snprintf(msg, sizeof(msg), "-- %d accounts; next page: VIEW_ALL %d %d --",
+                            c->list_rows, c->list_after, c->list_rows);
+    else snprintf(msg, sizeof(msg), "-- %d accounts --", c->list_rows);
+    send_msg(c, msg);
+    c->on_drain = NULL;
+    stats_command(STAT_VIEW_ALL, stats_now() - c->list_started, 0);   // whole stream
+    admin_menu(c);
+}
 
-        else if (strcmp(buf, "SEARCH_ACCOUNT") == 0) {
-            send_msg(sock, "Enter Account ID to search:");
-            read(sock, buf, sizeof(buf));
-            int id = atoi(buf);
-
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "rb");
-            Account tmp; int found = 0;
-            while (fread(&tmp, sizeof(Account), 1, fp)) {
-                if (tmp.id == id) {
-                    char msg[256];
-                    snprintf(msg, sizeof(msg),
-                             "Account ID: %d\nUser: %s\nRole: %s\nBalance: ₹%.2f\nLoan: %s",
-                             tmp.id, tmp.username, tmp.role, tmp.balance,
-                             tmp.loan_pending ? "Pending/Approved" : "None");
-                    send_msg(sock, msg);
-                    found = 1;
-                    break;
-                }
-            }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
+// Continue a multi-line admin command. Returns 1 while more input is needed.
+static int admin_step(Conn *c, int cmd, char *line) {
+    Account *newAcc = &c->pending;
 
-            if (!found) send_msg(sock, "Account not found.");
+    switch (cmd) {
+    case CMD_ADD_ACCOUNT:
+        switch (c->step++) {
+        case 0:
+            newAcc->id = atoi(line);
+            send_msg(c, "Enter Username:");
+            return 1;
+        case 1:
+            snprintf(newAcc->username, sizeof(newAcc->username), "%s", line);
+            send_msg(c, "Enter Password:");
+            return 1;
+        case 2:
+            snprintf(newAcc->password, sizeof(newAcc->password), "%s", line);
+            send_msg(c, "Enter Role (CUSTOMER/EMPLOYEE/MANAGER):");
+            return 1;
         }
+        snprintf(newAcc->role, sizeof(newAcc->role), "%s", line);
+        // newAcc->balance and loan_pending are already 0 from the memset
+        {
+            int rc = shard_owns(newAcc->id) ? add_account(newAcc) : -3;
+            conn_stat(c, STAT_ADD_ACCOUNT, rc != 0);
+            send_msg(c, rc == 0 ? "Account added successfully." :
+                        rc == -1 ? "Account ID or username already exists." :
+                        rc == -3 ? "Account ID belongs to another shard." :
+                                   "Failed to add account.");
+        }
+        return 0;
 
-        else if (strcmp(buf, "VIEW_ALL") == 0) {
-            pthread_mutex_lock(&file_mutex);
-            FILE *fp = fopen(DB_ACC_FILE, "rb");
-            Account tmp;
-            char msg[1024] = "";
-            while (fread(&tmp, sizeof(Account), 1, fp)) {
-                char line[256];
-                snprintf(line, sizeof(line), "ID:%d User:%s Role:%s Bal:₹%.2f Loan:%d\n",
-                         tmp.id, tmp.username, tmp.role, tmp.balance, tmp.loan_pending);
-                strcat(msg, line);
+    case CMD_DELETE_ACCOUNT: {
+        int ok = delete_account(atoi(line));
+        conn_stat(c, STAT_DELETE_ACCOUNT, !ok);
+        send_msg(c, ok ? "Account deleted." : "Account not found.");
+        return 0;
+    }
+
+    case CMD_MODIFY_ACCOUNT:
+        if (c->step++ == 0) {
+            c->arg_id = atoi(line);
+            if (!find_account_by_id(c->arg_id, NULL)) {
+                conn_stat(c, STAT_MODIFY_ACCOUNT, 1);
+                send_msg(c, "Account not found.");
+                return 0;
             }
-            fclose(fp);
-            pthread_mutex_unlock(&file_mutex);
-            send_msg(sock, msg[0] ? msg : "No accounts found.");
+            send_msg(c, "Enter new password:");
+            return 1;
         }
-
-        else if (strcmp(buf, "LOGOUT") == 0) {
-            send_msg(sock, "Logging out...");
-            break;
+        {
+            int rc = modify_account_by_id(c->arg_id, set_password, line);
+            conn_stat(c, STAT_MODIFY_ACCOUNT, rc != 0);
+            send_msg(c, rc == 0 ? "Account updated." : "Account not found.");
+        }
+        return 0;
+
+    case CMD_SEARCH_ACCOUNT: {
+        Account tmp;
+        int found = find_account_by_id(atoi(line), &tmp);
+        conn_stat(c, STAT_SEARCH_ACCOUNT, !found);
+        if (found) {
+            struct loan_count loans = loans_of(tmp.id);
+            char msg[256];
+            int len = snprintf(msg, sizeof(msg), "Account ID: %d\nUser: %s\nRole: %s\nBalance: ₹%.2f\nLoan: ",
+                               tmp.id, tmp.username, tmp.role, tmp.balance);
+            if (!loans.open && !loans.approved) snprintf(msg + len, sizeof(msg) - len, "None");
+            else snprintf(msg + len, sizeof(msg) - len, "%d open, %d approved", loans.open, loans.approved);
+            send_msg(c, msg);
+        } else {
+            send_msg(c, "Account not found.");
         }
+        return 0;
+    }
+    }
+    return 0;
+}
 
-        else {
-            send_msg(sock, "Invalid admin command. Please choose from the menu.");
+void handle_admin(Conn *c, char *line) {
+    int cmd = c->cmd;
+    c->cmd = CMD_NONE;
+
+    if (cmd != CMD_NONE) {
+        if (admin_step(c, cmd, line)) {
+            c->cmd = cmd;
+            return;
         }
+    }
 
-        // Re-show menu after each command
-        send_msg(sock,
-            "\nMENU:\n"
-            "1. ADD_ACCOUNT\n"
-            "2. DELETE_ACCOUNT\n"
-            "3. MODIFY_ACCOUNT\n"
-            "4. SEARCH_ACCOUNT\n"
-            "5. VIEW_ALL\n"
-            "6. LOGOUT\n"
-            "Enter your command:"
-        );
+    else if (strcmp(line, "ADD_ACCOUNT") == 0) {
+        // Initialize the struct to all zeros so unset fields are clean.
+        memset(&c->pending, 0, sizeof(Account));
+        c->cmd = CMD_ADD_ACCOUNT;
+        c->step = 0;
+        send_msg(c, "Enter ID:");
+        return;
+    }
+
+    else if (strcmp(line, "DELETE_ACCOUNT") == 0) {
+        c->cmd = CMD_DELETE_ACCOUNT;
+        send_msg(c, "Enter Account ID to delete:");
+        return;
     }
-}
 
+    else if (strcmp(line, "MODIFY_ACCOUNT") == 0) {
+        c->cmd = CMD_MODIFY_ACCOUNT;
+        c->step = 0;
+        send_msg(c, "Enter Account ID to modify:");
+        return;
+    }
+
+    else if (strcmp(line, "SEARCH_ACCOUNT") == 0) {
+        c->cmd = CMD_SEARCH_ACCOUNT;
+        send_msg(c, "Enter Account ID to search:");
+        return;
+    }
 
+    // VIEW_ALL [after_id [limit]]: accounts in id order, streamed in chunks.
+    else if (strcmp(line, "VIEW_ALL") == 0 || strncmp(line, "VIEW_ALL ", 9) == 0) {
+        int after = 0, limit = 0;
+        sscanf(line + 8, "%d %d", &after, &limit);
+        c->list_started = stats_now();
+        c->list_after = after;
+        c->list_left = limit > 0 ? limit : -1;
+        c->list_rows = 0;
+        c->on_drain = view_all_more;
+        return;     // the menu follows the last chunk
+    }
 
+    else if (strcmp(line, "STATS") == 0) {
+        conn_stat(c, STAT_STATS, 0);
+        char *report = stats_report();
+        send_msg(c, report ? report : "Statistics unavailable.");
+        free(report);
+    }
+
+    // Starts the batch in the background; STATS shows how it is going.
+    else if (strcmp(line, "RUN_EOD") == 0) {
+        char msg[128];
+        int rc = batch_run_eod(msg, sizeof(msg));
+        conn_stat(c, STAT_RUN_EOD, rc != 0);
+        send_msg(c, msg);
+    }
+
+    else if (strcmp(line, "LOGOUT") == 0) {
+        conn_stat(c, STAT_LOGOUT, 0);
+        send_msg(c, "Logging out...");
+        conn_close_after_flush(c);
+        return;
+    }
+
+    else {
+        conn_stat(c, STAT_INVALID, 1);
+        send_msg(c, "Invalid admin command. Please choose from the menu.");
+    }
+
+    // Re-show menu after each command
+    admin_menu(c);
+}
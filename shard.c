@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "shard.h"
+#include "store.h"
+
+static int shard_index, n_shards = 1;
+static char shard_key[64];
+
+void shard_configure(int index, int count, const char *key) {
+    shard_index = index;
+    n_shards = count;
+    snprintf(shard_key, sizeof(shard_key), "%s", key ? key : "");
+}
+
+int shard_count(void) {
+    return n_shards;
+}
+
+int shard_owns(int id) {
+    return n_shards == 1 || shard_of(id, n_shards) == shard_index;
+}
+
+int shard_key_ok(const char *key) {
+    return n_shards > 1 && shard_key[0] && strcmp(key, shard_key) == 0;
+}
+
+struct id_list { int *ids; int n, cap; };
+
+static int collect_foreign(const Account *a, void *arg) {
+    struct id_list *l = arg;
+    if (shard_owns(a->id)) return 0;
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 1024;
+        int *p = realloc(l->ids, sizeof(int) * cap);
+        if (!p) return 1;
+        l->ids = p;
+        l->cap = cap;
+    }
+    l->ids[l->n++] = a->id;
+    return 0;
+}
+
+int shard_drop_foreign(void) {
+    struct id_list l = { NULL, 0, 0 };
+    for_each_account(collect_foreign, &l);
+    int dropped = 0;
+    for (int i = 0; i < l.n; i++) dropped += delete_account(l.ids[i]);
+    free(l.ids);
+    return dropped;
+}
+
+// ---------------- transfer participant ----------------
+
+typedef struct {
+    uint64_t txid;
+    uint64_t lsn;           // its prepare record (a lower bound while committing)
+    int id;
+    int busy;               // being committed or aborted
+    double amount;
+} Prepared;
+
+static pthread_mutex_t xa_lock = PTHREAD_MUTEX_INITIALIZER;
+static Prepared *prepared;
+static int n_prepared, cap_prepared;
+
+static int xa_find(uint64_t txid) {
+    for (int i = 0; i < n_prepared; i++)
+        if (prepared[i].txid == txid) return i;
+    return -1;
+}
+
+static void xa_add(const Prepared *p) {
+    if (n_prepared == cap_prepared) {
+        int cap = cap_prepared ? cap_prepared * 2 : 64;
+        Prepared *q = realloc(prepared, sizeof(Prepared) * cap);
+        if (!q) { perror("prepared transfers"); exit(1); }
+        prepared = q;
+        cap_prepared = cap;
+    }
+    prepared[n_prepared++] = *p;
+}
+
+// Remove entry i; caller holds xa_lock.
+static void xa_take(int i) {
+    prepared[i] = prepared[--n_prepared];
+}
+
+static int hold_fn(Account *a, void *arg) {
+    double amount = *(double *)arg;
+    if (a->balance + amount < 0) return 1;
+    a->balance += amount;
+    return 0;
+}
+
+static int exists_fn(Account *a, void *arg) {
+    return 0;
+}
+
+int xa_prepare(uint64_t txid, int id, double amount) {
+    if (!(amount != 0) || !shard_owns(id)) return XFER_INVALID;
+
+    // Entered before its record is committed, so the checkpoint can never
+    // pass a prepare that is not in the table yet.
+    pthread_mutex_lock(&xa_lock);
+    if (xa_find(txid) >= 0) { pthread_mutex_unlock(&xa_lock); return XFER_INVALID; }
+    Prepared p = { .txid = txid, .lsn = wal_last_lsn() + 1, .id = id, .amount = amount };
+    xa_add(&p);
+    pthread_mutex_unlock(&xa_lock);
+
+    WalXa x = { .txid = txid, .state = XA_PREPARED, .id = id, .amount = amount };
+    WalTx tx;
+    wal_tx_begin(&tx);
+    wal_tx_xa(&tx, &x);
+    double hold = amount < 0 ? amount : 0;
+    int rc = modify_account_in_tx(id, amount < 0 ? hold_fn : exists_fn, &hold, &tx, NULL);
+    if (rc != 0) {
+        pthread_mutex_lock(&xa_lock);
+        int i = xa_find(txid);
+        if (i >= 0) xa_take(i);
+        pthread_mutex_unlock(&xa_lock);
+        return rc < 0 ? XFER_NO_ACCOUNT : XFER_INSUFFICIENT;
+    }
+    return XFER_OK;
+}
+
+/* Resolve a prepared transfer.  The entry stays (busy, so a repeated commit
+   or abort finds nothing to do) until the outcome is logged, so its prepare
+   record holds the checkpoint back until then. */
+static int resolve(uint64_t txid, int state) {
+    pthread_mutex_lock(&xa_lock);
+    int i = xa_find(txid);
+    if (i < 0 || prepared[i].busy) { pthread_mutex_unlock(&xa_lock); return XFER_NO_ACCOUNT; }
+    prepared[i].busy = 1;
+    Prepared p = prepared[i];
+    pthread_mutex_unlock(&xa_lock);
+
+    WalXa x = { .txid = txid, .state = state, .id = p.id, .amount = p.amount };
+    WalTx tx;
+    wal_tx_begin(&tx);
+    wal_tx_xa(&tx, &x);
+    // A credit is paid on commit, a held debit given back on abort.
+    double pay = state == XA_COMMITTED ? (p.amount > 0 ? p.amount : 0) : (p.amount < 0 ? -p.amount : 0);
+    if (modify_account_in_tx(p.id, pay ? hold_fn : exists_fn, &pay, &tx, NULL) < 0) {
+        // The account went away after the prepare; log the outcome alone.
+        wal_tx_begin(&tx);
+        wal_tx_xa(&tx, &x);
+        wal_commit(&tx);
+    }
+
+    pthread_mutex_lock(&xa_lock);
+    i = xa_find(txid);
+    if (i >= 0) xa_take(i);
+    pthread_mutex_unlock(&xa_lock);
+    return XFER_OK;
+}
+
+int xa_commit(uint64_t txid) {
+    return resolve(txid, XA_COMMITTED);
+}
+
+int xa_abort(uint64_t txid) {
+    return resolve(txid, XA_ABORTED);
+}
+
+int xa_list(uint64_t *out, int max) {
+    pthread_mutex_lock(&xa_lock);
+    int n = 0;
+    for (int i = 0; i < n_prepared && n < max; i++)
+        if (!prepared[i].busy) out[n++] = prepared[i].txid;
+    pthread_mutex_unlock(&xa_lock);
+    return n;
+}
+
+void xa_replay(uint64_t lsn, const WalXa *x) {
+    pthread_mutex_lock(&xa_lock);
+    int i = xa_find(x->txid);
+    if (x->state == XA_PREPARED) {
+        Prepared p = { .txid = x->txid, .lsn = lsn, .id = x->id, .amount = x->amount };
+        if (i < 0) xa_add(&p);
+    } else if (i >= 0) {
+        xa_take(i);
+    }
+    pthread_mutex_unlock(&xa_lock);
+}
+
+uint64_t xa_oldest_lsn(void) {
+    pthread_mutex_lock(&xa_lock);
+    uint64_t oldest = 0;
+    for (int i = 0; i < n_prepared; i++)
+        if (!oldest || prepared[i].lsn < oldest) oldest = prepared[i].lsn;
+    pthread_mutex_unlock(&xa_lock);
+    return oldest;
+}
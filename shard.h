@@ -0,0 +1,55 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include "wal.h"
+
+/*
+ * Horizontal sharding.
+ *
+ * With --shard K/N a server owns the accounts with id % N == K, each shard
+ * in its own data directory; new loans get ids with the same residue so
+ * loan ids stay unique across shards.  The router (router.c) sends each
+ * session to the shard that owns it and coordinates transfers between
+ * shards with two-phase commit, for which every shard is a participant:
+ *
+ *   prepare  debit side: take the amount out now (held, not spendable);
+ *            credit side: check the account exists.  Logged with the
+ *            transfer id, so a prepared transfer survives a crash.
+ *   commit   credit side: pay the amount in.  Debit side: forget the hold.
+ *   abort    debit side: give the amount back.  Credit side: forget it.
+ *
+ * The WAL keeps every prepared transfer's record until it is resolved
+ * (xa_oldest_lsn() holds back the checkpoint), so recovery rebuilds the
+ * in-doubt set; the router resolves it from its own decision log.
+ */
+
+#define MAX_SHARDS 64
+
+static inline int shard_of(int id, int count) {
+    return (int)((unsigned)id % (unsigned)count);
+}
+
+void shard_configure(int index, int count, const char *key);
+int  shard_count(void);                 // 1 when not sharded
+int  shard_owns(int id);
+int  shard_key_ok(const char *key);     // router login; never true without --shard-key
+
+/* Startup: delete the accounts another shard owns (a data directory copied
+   from an unsharded server).  Returns how many. */
+int  shard_drop_foreign(void);
+
+/* Transfer participant.  Return XFER_* codes (store.h). */
+#define XA_PREPARED  1
+#define XA_COMMITTED 2
+#define XA_ABORTED   3
+
+int  xa_prepare(uint64_t txid, int id, double amount);  // amount < 0 debit, > 0 credit
+int  xa_commit(uint64_t txid);          // XFER_OK, or XFER_NO_ACCOUNT if not prepared here
+int  xa_abort(uint64_t txid);
+int  xa_list(uint64_t *out, int max);   // prepared transfer ids
+
+void xa_replay(uint64_t lsn, const WalXa *xa);     // WAL_XA during recovery
+uint64_t xa_oldest_lsn(void);           // 0 if nothing is prepared
+
+#endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "stats.h"
+#include "hist.h"
+
+/*
+ * One ThreadStats per thread that records anything.  Only its own thread
+ * writes to it, so an update is a relaxed load + store instead of a locked
+ * read-modify-write; readers merge all slots with relaxed loads.
+ */
+
+typedef struct ThreadStats {
+    Hist cmd[N_STAT_CMDS];
+    uint64_t errors[N_STAT_CMDS];
+    Hist lock[N_STAT_LOCKS];
+    Hist hold;
+    uint64_t conns_opened, conns_closed;
+    uint64_t sessions_opened, sessions_closed;
+    uint64_t refused, timed_out;
+    uint64_t bytes_in, bytes_out;
+    uint64_t writes;            // socket write calls that sent bytes_out
+    struct ThreadStats *next;
+} ThreadStats;
+
+static const char *const cmd_names[N_STAT_CMDS] = {
+    "-", "LOGIN", "LOGOUT", "BALANCE", "DEPOSIT", "WITHDRAW", "TRANSFER",
+    "APPLY_LOAN", "MY_LOANS", "VIEW_PENDING", "MARK_REVIEW", "VIEW_ACCOUNT",
+    "LIST_REVIEWED", "APPROVE", "REJECT", "ADD_ACCOUNT", "DELETE_ACCOUNT",
+    "MODIFY_ACCOUNT", "SEARCH_ACCOUNT", "VIEW_ALL", "STATS", "XA", "RUN_EOD",
+    "STATEMENT", "INVALID",
+};
+
+static const char *const lock_names[N_STAT_LOCKS] = { "table", "stripe", "loan", "wal" };
+
+static ThreadStats *all_threads;         // pushed once per thread, never removed
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadStats *mine;
+static uint64_t started;
+#define MAX_REPORT_HOOKS 8
+static size_t (*report_hooks[MAX_REPORT_HOOKS])(char *buf, size_t cap);
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_init(void) {
+    started = stats_now();
+}
+
+void stats_add_report_hook(size_t (*fn)(char *buf, size_t cap)) {
+    pthread_mutex_lock(&register_lock);
+    for (int i = 0; i < MAX_REPORT_HOOKS; i++) {
+        if (report_hooks[i] == fn) break;
+        if (!report_hooks[i]) { report_hooks[i] = fn; break; }
+    }
+    pthread_mutex_unlock(&register_lock);
+}
+
+static ThreadStats *slot(void) {
+    if (mine) return mine;
+    ThreadStats *t = calloc(1, sizeof(ThreadStats));
+    if (!t) { perror("stats"); exit(1); }
+    pthread_mutex_lock(&register_lock);
+    t->next = all_threads;
+    __atomic_store_n(&all_threads, t, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&register_lock);
+    return mine = t;
+}
+
+// Single-writer add: no lock prefix, but readers never see a torn value.
+static inline void add(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static void record(Hist *h, uint64_t v) {
+    add(&h->counts[hist_index(v)], 1);
+    add(&h->total, 1);
+    add(&h->sum, v);
+    if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static void merge(Hist *into, const Hist *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) into->max = max;
+}
+
+static uint64_t sum(size_t field) {
+    uint64_t v = 0;
+    for (ThreadStats *t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t; t = t->next)
+        v += __atomic_load_n((uint64_t *)((char *)t + field), __ATOMIC_RELAXED);
+    return v;
+}
+
+void stats_command(int cmd, uint64_t ns, int error) {
+    if (cmd <= STAT_NONE || cmd >= N_STAT_CMDS) return;
+    ThreadStats *t = slot();
+    record(&t->cmd[cmd], ns);
+    if (error) add(&t->errors[cmd], 1);
+}
+
+void stats_lock_wait(int lock, uint64_t ns) {
+    record(&slot()->lock[lock], ns);
+}
+
+void stats_wal_hold(uint64_t ns) {
+    record(&slot()->hold, ns);
+}
+
+void stats_conn(int opened) {
+    ThreadStats *t = slot();
+    add(opened > 0 ? &t->conns_opened : &t->conns_closed, 1);
+}
+
+void stats_session(int opened) {
+    ThreadStats *t = slot();
+    add(opened > 0 ? &t->sessions_opened : &t->sessions_closed, 1);
+}
+
+void stats_refused(void) {
+    add(&slot()->refused, 1);
+}
+
+void stats_timed_out(void) {
+    add(&slot()->timed_out, 1);
+}
+
+void stats_bytes(size_t in, size_t out) {
+    ThreadStats *t = slot();
+    if (in) add(&t->bytes_in, in);
+    if (out) {
+        add(&t->bytes_out, out);
+        add(&t->writes, 1);
+    }
+}
+
+#define REPORT_CAP 8192
+
+__attribute__((format(printf, 3, 4)))
+static void appendf(char *buf, size_t *len, const char *fmt, ...) {
+    if (*len >= REPORT_CAP) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, REPORT_CAP - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0) *len += n;
+    if (*len > REPORT_CAP - 1) *len = REPORT_CAP - 1;
+}
+
+static void merge_all(Hist *out, size_t field) {
+    hist_reset(out);
+    for (ThreadStats *t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t; t = t->next)
+        merge(out, (const Hist *)((const char *)t + field));
+}
+
+char *stats_report(void) {
+    char *buf = malloc(REPORT_CAP);
+    if (!buf) return NULL;
+    size_t len = 0;
+    static __thread Hist h;     // ~15 KB; kept off the reactor stack
+
+    appendf(buf, &len, "uptime_s=%.0f connections=%lld sessions=%lld bytes_in=%llu bytes_out=%llu writes=%llu"
+                       " refused=%llu timed_out=%llu\n",
+            (stats_now() - started) / 1e9,
+            (long long)(sum(offsetof(ThreadStats, conns_opened)) - sum(offsetof(ThreadStats, conns_closed))),
+            (long long)(sum(offsetof(ThreadStats, sessions_opened)) - sum(offsetof(ThreadStats, sessions_closed))),
+            (unsigned long long)sum(offsetof(ThreadStats, bytes_in)),
+            (unsigned long long)sum(offsetof(ThreadStats, bytes_out)),
+            (unsigned long long)sum(offsetof(ThreadStats, writes)),
+            (unsigned long long)sum(offsetof(ThreadStats, refused)),
+            (unsigned long long)sum(offsetof(ThreadStats, timed_out)));
+
+    appendf(buf, &len, "%-15s %9s %7s %9s %9s %9s %9s\n",
+            "command", "count", "errors", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int k = STAT_NONE + 1; k < N_STAT_CMDS; k++) {
+        merge_all(&h, offsetof(ThreadStats, cmd) + k * sizeof(Hist));
+        if (h.total == 0) continue;
+        appendf(buf, &len, "%-15s %9llu %7llu %9.1f %9.1f %9.1f %9.1f\n", cmd_names[k],
+                (unsigned long long)h.total,
+                (unsigned long long)sum(offsetof(ThreadStats, errors) + k * sizeof(uint64_t)),
+                hist_quantile(&h, 0.50) / 1e3, hist_quantile(&h, 0.99) / 1e3,
+                hist_quantile(&h, 0.999) / 1e3, h.max / 1e3);
+    }
+
+    appendf(buf, &len, "%-15s %9s %9s %9s %9s %9s\n",
+            "lock_wait", "waits", "total_ms", "p50_us", "p99_us", "max_us");
+    for (int k = 0; k < N_STAT_LOCKS; k++) {
+        merge_all(&h, offsetof(ThreadStats, lock) + k * sizeof(Hist));
+        appendf(buf, &len, "%-15s %9llu %9.1f %9.1f %9.1f %9.1f\n", lock_names[k],
+                (unsigned long long)h.total, h.sum / 1e6,
+                hist_quantile(&h, 0.50) / 1e3, hist_quantile(&h, 0.99) / 1e3, h.max / 1e3);
+    }
+    merge_all(&h, offsetof(ThreadStats, hold));
+    appendf(buf, &len, "%-15s %9llu %9.1f %9.1f %9.1f %9.1f\n", "wal_hold",
+            (unsigned long long)h.total, h.sum / 1e6,
+            hist_quantile(&h, 0.50) / 1e3, hist_quantile(&h, 0.99) / 1e3, h.max / 1e3);
+    for (int i = 0; i < MAX_REPORT_HOOKS && report_hooks[i] && len < REPORT_CAP - 1; i++) {
+        len += report_hooks[i](buf + len, REPORT_CAP - 1 - len);
+        buf[len] = 0;
+    }
+    return buf;
+}
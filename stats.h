@@ -0,0 +1,99 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Server instrumentation: per-command counts, errors and latency histograms
+ * (hist.h), lock wait times, WAL hold times, connections and bytes moved.
+ *
+ * Every thread records into its own slot, created on first use, with plain
+ * (relaxed atomic) stores and no locks; stats_report() sums the slots while
+ * they are being written, so a report may be a few events behind.
+ */
+
+/* Commands, shared by the text dialogue and the binary protocol. */
+enum {
+    STAT_NONE,
+    STAT_LOGIN,
+    STAT_LOGOUT,
+    STAT_BALANCE,
+    STAT_DEPOSIT,
+    STAT_WITHDRAW,
+    STAT_TRANSFER,
+    STAT_APPLY_LOAN,
+    STAT_MY_LOANS,
+    STAT_VIEW_PENDING,
+    STAT_MARK_REVIEW,
+    STAT_VIEW_ACCOUNT,
+    STAT_LIST_REVIEWED,
+    STAT_APPROVE,
+    STAT_REJECT,
+    STAT_ADD_ACCOUNT,
+    STAT_DELETE_ACCOUNT,
+    STAT_MODIFY_ACCOUNT,
+    STAT_SEARCH_ACCOUNT,
+    STAT_VIEW_ALL,
+    STAT_STATS,
+    STAT_XA,                // two-phase transfer steps from a router (shard.h)
+    STAT_RUN_EOD,
+    STAT_STATEMENT,
+    STAT_INVALID,           // unknown command or malformed request
+    N_STAT_CMDS
+};
+
+/* Locks whose wait time is measured. */
+enum {
+    LOCK_TABLE,             // store struct_lock
+    LOCK_STRIPE,            // store record stripes
+    LOCK_LOAN,              // loan store
+    LOCK_WAL,               // WAL append buffer
+    N_STAT_LOCKS
+};
+
+uint64_t stats_now(void);
+
+void stats_command(int cmd, uint64_t ns, int error);
+void stats_lock_wait(int lock, uint64_t ns);
+void stats_wal_hold(uint64_t ns);        // reply held back until its WAL record was durable
+void stats_conn(int opened);             // +1 accepted, -1 closed
+void stats_session(int opened);          // +1 logged in, -1 logged-in connection closed
+void stats_refused(void);                // turned away at accept (server busy)
+void stats_timed_out(void);              // closed by the login or idle timeout
+void stats_bytes(size_t in, size_t out);  // out: one socket write of that many bytes
+
+void stats_init(void);                   // marks the start of the uptime
+
+/* Plain-text report of everything above; malloc'ed, caller frees. */
+char *stats_report(void);
+
+/* Lines appended to every report by other modules (replication, batches):
+   fn writes at most cap bytes and returns how many.  Adding the same fn
+   again does nothing. */
+void stats_add_report_hook(size_t (*fn)(char *buf, size_t cap));
+
+/* Lock helpers: uncontended acquisitions cost one trylock and are not timed. */
+static inline void stats_mutex_lock(pthread_mutex_t *m, int lock) {
+    if (pthread_mutex_trylock(m) == 0) return;
+    uint64_t t0 = stats_now();
+    pthread_mutex_lock(m);
+    stats_lock_wait(lock, stats_now() - t0);
+}
+
+static inline void stats_rdlock(pthread_rwlock_t *l, int lock) {
+    if (pthread_rwlock_tryrdlock(l) == 0) return;
+    uint64_t t0 = stats_now();
+    pthread_rwlock_rdlock(l);
+    stats_lock_wait(lock, stats_now() - t0);
+}
+
+static inline void stats_wrlock(pthread_rwlock_t *l, int lock) {
+    if (pthread_rwlock_trywrlock(l) == 0) return;
+    uint64_t t0 = stats_now();
+    pthread_rwlock_wrlock(l);
+    stats_lock_wait(lock, stats_now() - t0);
+}
+
+#endif
@@ -0,0 +1,1567 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "store.h"
+#include "wal.h"
+#include "loans.h"
+#include "shard.h"
+#include "batch.h"
+#include "stats.h"
+
+#define IDX_EMPTY  -1
+#define IDX_DELETED -2          // probe chains continue past it
+#define WRITEBACK_MS 200        // how often dirty records are written back
+#define STRIPE_BITS 10          // 1024 record lock stripes
+#define MAX_SLOTS (1 << 27)     // address space reserved for the mapping
+#define ORDER_BLOCK 4096        // ids per block of the sorted id list
+#define COMPACT_MS 100          // how often the compactor looks for holes
+#define COMPACT_SLICE_US 500    // longest the compactor holds struct_lock
+#define COMPACT_PAUSE_US 1000   // gap between slices while it has work
+#define MAX_RECOVERY_THREADS 64
+#define PARALLEL_MIN_SLOTS 65536    // smaller tables are indexed on one thread
+#define BATCH_CHUNK 32768           // slots per unit of store_batch work
+#define BATCH_TX_OPS (TX_BUF / (sizeof(WalOp) + sizeof(WalBalance)))
+
+/*
+ * Locking:
+ *   struct_lock  - read-held by every operation on existing records, write-held
+ *                  by inserts, deletes and compactor slices (which claim,
+ *                  free or move slots and resize the table and indexes).
+ *                  Slot ids and usernames never change while it is
+ *                  read-held, so index probes need nothing else.
+ *   stripes[]    - protect the mutable fields of the records whose id hashes
+ *                  to the stripe, plus that stripe's dirty list.
+ * Order: struct_lock, then at most one stripe, then the WAL's own mutex.
+ * The loan store (loans.c) takes its own lock before any of these.
+ *
+ * find_account_by_id/_by_username take neither.  Every store into a record
+ * is bracketed by its stripe's sequence count (odd while a write is under
+ * way), so a reader copies the record and retries if the count moved; a
+ * slot changing hands bumps the stripes of both the old and the new record.
+ * Readers probe the indexes through index_view, and whatever they might
+ * still be looking at (old index arrays, the tail of a shrinking mapping)
+ * is only released once every reader that entered earlier has left.
+ */
+static pthread_rwlock_t struct_lock;
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned seq;               // odd while one of its records is being written
+    int *dirty;                 // slots with meta.dirty set
+    int n_dirty, cap_dirty;
+} __attribute__((aligned(64))) Stripe;
+
+static Stripe stripes[1 << STRIPE_BITS];
+
+static int data_fd = -1;
+
+/*
+ * The data file is mapped MAP_SHARED at a fixed address: slot i is record i
+ * of the file, reads are plain loads and updates are stores into the page
+ * cache.  MAX_SLOTS worth of address space is reserved up front so growing
+ * the file only remaps in place and `table` never moves.  The file is kept
+ * at cap_slots records; the tail past n_slots is unused.
+ *
+ * A delete leaves a tombstone in place (the id negated) and puts the slot on
+ * free_slots, where add_account picks it up again.  The compactor thread
+ * moves records from the end of the table into the lowest holes, a few at a
+ * time, so n_slots shrinks back towards the live count, and gives file
+ * space back once the table is mostly empty.
+ */
+static Account *table;
+static int n_slots, cap_slots;
+static size_t page_size;
+
+// Min-heap of free slots.  Entries go stale once a slot is reused or
+// trimmed off the end; they are dropped when they reach the top.
+static int *free_slots;
+static int n_free, cap_free;
+
+/* Write-back state.  Mutations only touch memory and the WAL; the write-back
+   thread msyncs a page once the WAL covering every dirty record on it is
+   durable.  The kernel may still write a page early under memory pressure,
+   so the data file alone is not crash-consistent; recovery always replays
+   the WAL over it. */
+typedef struct {
+    uint64_t lsn;               // last WAL record that changed this slot
+    uint64_t redo;              // first one since it was last written back
+    uint64_t flushed;           // write-back round: 1 + the LSN it went out at, else 0
+    int dirty;
+} SlotMeta;
+
+static SlotMeta *meta;
+static unsigned file_gen;       // bumped when the whole mapping is flushed
+
+// Both indexes map a key to a slot number; size is a power of two.
+static int *id_index, *name_index;
+static int index_size, index_used;
+static int id_dead, name_dead;  // IDX_DELETED entries in each, until a rebuild
+
+// The arrays above as lock-free readers see them.  Entries change in place;
+// a resize publishes a new view and retires the old one.
+typedef struct IndexView {
+    int *ids, *names;
+    int size;
+    uint64_t epoch;             // grace period it was retired in
+    struct IndexView *next;     // on index_retired
+} IndexView;
+
+static IndexView *index_view;
+static IndexView *index_retired;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* One per thread that has read without locks, never freed.  While inside a
+   read, epoch holds the grace epoch seen on entry; 0 otherwise. */
+typedef struct Reader {
+    uint64_t epoch;
+    struct Reader *next;
+} __attribute__((aligned(64))) Reader;
+
+static Reader *readers;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Reader *my_reader;
+static uint64_t grace_epoch = 1;
+
+static inline uint32_t hash_id(int id) {
+    return (uint32_t)id * 2654435761u;
+}
+
+static inline uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;               // FNV-1a
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+static inline Stripe *stripe_of(int id) {
+    return &stripes[hash_id(id) >> (32 - STRIPE_BITS)];
+}
+
+static inline int slot_live(int slot) {
+    return table[slot].id > 0;              // 0 is never used, < 0 a tombstone
+}
+
+// The stripe owning a slot's dirty entry: its record's, or for a tombstone
+// the deleted record's.
+static inline Stripe *slot_stripe(int slot) {
+    int id = table[slot].id;
+    return stripe_of(id < 0 ? -id : id);
+}
+
+// Writers bracket every store into a record with these, holding the
+// record's stripe lock or struct_lock for writing.
+static inline void write_begin(Stripe *st) {
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_end(Stripe *st) {
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+}
+
+static Reader *reader_enter(void) {
+    Reader *r = my_reader;
+    if (!r) {
+        r = aligned_alloc(64, sizeof(Reader));
+        if (!r) { perror("reader"); exit(1); }
+        r->epoch = 0;
+        pthread_mutex_lock(&readers_lock);
+        r->next = readers;
+        __atomic_store_n(&readers, r, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&readers_lock);
+        my_reader = r;
+    }
+    __atomic_store_n(&r->epoch, __atomic_load_n(&grace_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    // The entry must be visible before anything is read, or a concurrent
+    // grace_over() could miss this reader.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return r;
+}
+
+static inline void reader_exit(Reader *r) {
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Start a grace period, after unpublishing something readers may hold.
+static uint64_t grace_begin(void) {
+    return __atomic_add_fetch(&grace_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+// 1 once every reader that entered before grace period e has left.
+static int grace_over(uint64_t e) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (Reader *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t re = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (re && re < e) return 0;
+    }
+    return 1;
+}
+
+static void grace_wait(uint64_t e) {
+    while (!grace_over(e)) sched_yield();
+}
+
+// Returns the index position holding id, or -1.
+static int id_lookup(int id) {
+    uint32_t mask = index_size - 1;
+    for (uint32_t i = hash_id(id) & mask;; i = (i + 1) & mask) {
+        int s = id_index[i];
+        if (s == IDX_EMPTY) return -1;
+        if (s >= 0 && table[s].id == id) return i;
+    }
+}
+
+static int name_lookup(const char *username) {
+    uint32_t mask = index_size - 1;
+    for (uint32_t i = hash_name(username) & mask;; i = (i + 1) & mask) {
+        int s = name_index[i];
+        if (s == IDX_EMPTY) return -1;
+        if (s >= 0 && strcmp(table[s].username, username) == 0) return i;
+    }
+}
+
+static void index_put(int slot) {
+    uint32_t mask = index_size - 1;
+    uint32_t i;
+    for (i = hash_id(table[slot].id) & mask; id_index[i] >= 0; i = (i + 1) & mask);
+    if (id_index[i] == IDX_DELETED) id_dead--;
+    __atomic_store_n(&id_index[i], slot, __ATOMIC_RELEASE);
+    for (i = hash_name(table[slot].username) & mask; name_index[i] >= 0; i = (i + 1) & mask);
+    if (name_index[i] == IDX_DELETED) name_dead--;
+    __atomic_store_n(&name_index[i], slot, __ATOMIC_RELEASE);
+    index_used++;
+}
+
+// Index positions holding this slot (it must be indexed).
+static int id_pos(int slot) {
+    uint32_t mask = index_size - 1;
+    uint32_t i = hash_id(table[slot].id) & mask;
+    while (id_index[i] != slot) i = (i + 1) & mask;
+    return i;
+}
+
+static int name_pos(int slot) {
+    uint32_t mask = index_size - 1;
+    uint32_t i = hash_name(table[slot].username) & mask;
+    while (name_index[i] != slot) i = (i + 1) & mask;
+    return i;
+}
+
+// Free index arrays nobody else can see; published ones are retired by
+// index_publish instead.
+static void index_drop(int *ids, int *names) {
+    if (index_view && ids == index_view->ids) return;
+    free(ids); free(names);
+}
+
+// Show readers the current arrays.  The view they replace is freed by
+// index_reclaim once no reader can still be probing it.
+static int index_publish(void) {
+    IndexView *v = malloc(sizeof(IndexView));
+    if (!v) return -1;
+    *v = (IndexView){ id_index, name_index, index_size, 0, NULL };
+    IndexView *old = index_view;
+    __atomic_store_n(&index_view, v, __ATOMIC_RELEASE);
+    if (old && old->ids != id_index) {
+        old->epoch = grace_begin();
+        pthread_mutex_lock(&retired_lock);
+        old->next = index_retired;
+        index_retired = old;
+        pthread_mutex_unlock(&retired_lock);
+    } else {
+        free(old);
+    }
+    return 0;
+}
+
+static void index_reclaim(void) {
+    pthread_mutex_lock(&retired_lock);
+    for (IndexView **p = &index_retired; *p;) {
+        IndexView *v = *p;
+        if (!grace_over(v->epoch)) { p = &v->next; continue; }
+        *p = v->next;
+        free(v->ids); free(v->names); free(v);
+    }
+    pthread_mutex_unlock(&retired_lock);
+}
+
+// Replace both indexes with empty ones sized for at least `want` records;
+// readers keep the old ones until index_publish.
+static int index_alloc(int want) {
+    int size = 64;
+    while (size < want * 2) size <<= 1;
+    int *ids = malloc(sizeof(int) * size);
+    int *names = malloc(sizeof(int) * size);
+    if (!ids || !names) { free(ids); free(names); return -1; }
+    index_drop(id_index, name_index);
+    id_index = ids; name_index = names;
+    index_size = size;
+    index_used = id_dead = name_dead = 0;
+    for (int i = 0; i < size; i++) id_index[i] = name_index[i] = IDX_EMPTY;
+    return 0;
+}
+
+// Resize for `want` records, keeping exactly the entries indexed now.
+static int index_grow(int want) {
+    int *old_ids = id_index, *old_names = name_index, old_size = index_size;
+    id_index = name_index = NULL;
+    if (index_alloc(want) < 0) {
+        id_index = old_ids; name_index = old_names; index_size = old_size;
+        return -1;
+    }
+    uint32_t mask = index_size - 1;
+    for (int k = 0; k < old_size; k++) {
+        uint32_t i;
+        int s = old_ids[k];
+        if (s >= 0) {
+            for (i = hash_id(table[s].id) & mask; id_index[i] != IDX_EMPTY; i = (i + 1) & mask);
+            id_index[i] = s;
+            index_used++;
+        }
+        s = old_names[k];
+        if (s >= 0) {
+            for (i = hash_name(table[s].username) & mask; name_index[i] != IDX_EMPTY; i = (i + 1) & mask);
+            name_index[i] = s;
+        }
+    }
+    index_drop(old_ids, old_names);
+    return index_publish();
+}
+
+// Rebuild both indexes from the slots, sized for at least `want` records.
+static int index_rebuild(int want) {
+    if (index_alloc(want) < 0) return -1;
+    for (int s = 0; s < n_slots; s++) {
+        // First occurrence wins, as with the old linear scan.
+        if (!slot_live(s) || id_lookup(table[s].id) >= 0 ||
+            name_lookup(table[s].username) >= 0)
+            continue;
+        index_put(s);
+    }
+    return index_publish();
+}
+
+typedef struct {
+    void (*fn)(int part, void *arg);
+    int part;
+    void *arg;
+} Worker;
+
+static void *worker_main(void *p) {
+    Worker *w = p;
+    w->fn(w->part, w->arg);
+    return NULL;
+}
+
+// Run fn for parts 0..parts-1 on that many threads, the caller's included.
+static void run_parts(int parts, void (*fn)(int part, void *arg), void *arg) {
+    pthread_t tid[MAX_RECOVERY_THREADS];
+    Worker w[MAX_RECOVERY_THREADS];
+    int started[MAX_RECOVERY_THREADS] = { 0 };
+    for (int k = 1; k < parts; k++) {
+        w[k] = (Worker){ fn, k, arg };
+        started[k] = pthread_create(&tid[k], NULL, worker_main, &w[k]) == 0;
+    }
+    fn(0, arg);
+    for (int k = 1; k < parts; k++) {
+        if (started[k]) pthread_join(tid[k], NULL);
+        else fn(k, arg);
+    }
+}
+
+// Insert slot into an index shared with other loader threads.  Returns 0
+// if an equal key is already there.
+static int index_cas(int *index, uint32_t i, int slot, int by_name) {
+    uint32_t mask = index_size - 1;
+    for (;; i = (i + 1) & mask) {
+        int c = __atomic_load_n(&index[i], __ATOMIC_ACQUIRE);
+        if (c == IDX_EMPTY &&
+            __atomic_compare_exchange_n(&index[i], &c, slot, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+        // c is the slot in this position now.
+        if (by_name ? strcmp(table[c].username, table[slot].username) == 0
+                    : table[c].id == table[slot].id)
+            return 0;
+    }
+}
+
+typedef struct {
+    int parts;
+    int dups;
+    int live[MAX_RECOVERY_THREADS];
+} IndexLoad;
+
+static void index_load_part(int part, void *arg) {
+    IndexLoad *L = arg;
+    int from = (long)n_slots * part / L->parts, to = (long)n_slots * (part + 1) / L->parts;
+    uint32_t mask = index_size - 1;
+    int live = 0, dup = 0;
+    for (int s = from; s < to; s++) {
+        if (!slot_live(s)) continue;
+        live++;
+        if (!index_cas(id_index, hash_id(table[s].id) & mask, s, 0)) dup = 1;
+        if (!index_cas(name_index, hash_name(table[s].username) & mask, s, 1)) dup = 1;
+    }
+    L->live[part] = live;
+    if (dup) __atomic_store_n(&L->dups, 1, __ATOMIC_RELAXED);
+}
+
+// Index the freshly loaded table on `threads` threads.  Returns 1 if some
+// id or username occurs twice: the table is then indexed again on one
+// thread so that the first occurrence wins.  -1 on failure.
+static int index_load(int threads) {
+    IndexLoad L = { .parts = threads };
+    if (L.parts > MAX_RECOVERY_THREADS) L.parts = MAX_RECOVERY_THREADS;
+    if (L.parts < 1 || n_slots < PARALLEL_MIN_SLOTS) L.parts = 1;
+    if (index_alloc(n_slots) < 0) return -1;
+    run_parts(L.parts, index_load_part, &L);
+    if (L.dups) return index_rebuild(n_slots) < 0 ? -1 : 1;
+    for (int k = 0; k < L.parts; k++) index_used += L.live[k];
+    return index_publish() < 0 ? -1 : 0;
+}
+
+// Indexed ids in ascending order, for paged listings: a list of sorted
+// blocks, so an insert or delete shifts at most one block rather than the
+// whole list.  Kept in step with id_index by slot_claim and slot_free.
+typedef struct {
+    int n;
+    int ids[ORDER_BLOCK];
+} OrderBlock;
+
+static OrderBlock **order_blocks;
+static int n_blocks, cap_blocks;
+
+// Position of the first id >= id: block *b, offset *i.  *b == n_blocks if
+// every id is smaller.
+static void order_find(int id, int *b, int *i) {
+    int lo = 0, hi = n_blocks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        OrderBlock *ob = order_blocks[mid];
+        if (ob->ids[ob->n - 1] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    *b = lo;
+    *i = 0;
+    if (lo == n_blocks) return;
+    OrderBlock *ob = order_blocks[lo];
+    int l = 0, h = ob->n;
+    while (l < h) {
+        int mid = l + (h - l) / 2;
+        if (ob->ids[mid] < id) l = mid + 1;
+        else h = mid;
+    }
+    *i = l;
+}
+
+// Make room for a block at position b.
+static OrderBlock *order_new_block(int b) {
+    if (n_blocks == cap_blocks) {
+        int cap = cap_blocks ? cap_blocks * 2 : 64;
+        OrderBlock **p = realloc(order_blocks, sizeof(OrderBlock *) * cap);
+        if (!p) { perror("id order"); exit(1); }
+        order_blocks = p;
+        cap_blocks = cap;
+    }
+    OrderBlock *ob = malloc(sizeof(OrderBlock));
+    if (!ob) { perror("id order"); exit(1); }
+    ob->n = 0;
+    memmove(&order_blocks[b + 1], &order_blocks[b], sizeof(OrderBlock *) * (n_blocks - b));
+    order_blocks[b] = ob;
+    n_blocks++;
+    return ob;
+}
+
+static void order_insert(int id) {
+    int b, i;
+    order_find(id, &b, &i);
+    if (b < n_blocks && order_blocks[b]->ids[i] == id) return;
+    if (b == n_blocks) {
+        // Past the last id: the usual case, as ids mostly grow.
+        if (b == 0 || order_blocks[b - 1]->n == ORDER_BLOCK) {
+            order_new_block(b);
+        } else {
+            b--;
+            i = order_blocks[b]->n;
+        }
+    }
+    OrderBlock *ob = order_blocks[b];
+    if (ob->n == ORDER_BLOCK) {
+        // Split in half and insert into whichever half covers the id.
+        OrderBlock *next = order_new_block(b + 1);
+        int half = ORDER_BLOCK / 2;
+        memcpy(next->ids, &ob->ids[half], sizeof(int) * (ORDER_BLOCK - half));
+        next->n = ORDER_BLOCK - half;
+        ob->n = half;
+        if (i > half) { ob = next; i -= half; }
+    }
+    memmove(&ob->ids[i + 1], &ob->ids[i], sizeof(int) * (ob->n - i));
+    ob->ids[i] = id;
+    ob->n++;
+}
+
+static void order_remove(int id) {
+    int b, i;
+    order_find(id, &b, &i);
+    if (b == n_blocks || order_blocks[b]->ids[i] != id) return;
+    OrderBlock *ob = order_blocks[b];
+    memmove(&ob->ids[i], &ob->ids[i + 1], sizeof(int) * (ob->n - i - 1));
+    ob->n--;
+    if (ob->n == 0) {
+        free(ob);
+        memmove(&order_blocks[b], &order_blocks[b + 1], sizeof(OrderBlock *) * (n_blocks - b - 1));
+        n_blocks--;
+    }
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Fill the order list with the n indexed ids after loading; takes ids.
+static void order_build(int *ids, int n, int sorted) {
+    if (!sorted) qsort(ids, n, sizeof(int), cmp_int);
+    for (int b = 0; b < n_blocks; b++) free(order_blocks[b]);
+    n_blocks = 0;
+    for (int k = 0; k < n; k += ORDER_BLOCK) {
+        OrderBlock *ob = order_new_block(n_blocks);
+        ob->n = n - k < ORDER_BLOCK ? n - k : ORDER_BLOCK;
+        memcpy(ob->ids, &ids[k], sizeof(int) * ob->n);
+    }
+    free(ids);
+}
+
+// Grow the file to at least `want` records and extend the mapping over it.
+// Caller holds struct_lock for writing (or is still single-threaded).
+static int table_reserve(int want) {
+    if (want <= cap_slots) return 0;
+    if (want > MAX_SLOTS) return -1;
+    int cap = cap_slots ? cap_slots : 1024;    // 1024 records == 33 whole pages
+    while (cap < want) cap *= 2;
+    if (cap > MAX_SLOTS) cap = MAX_SLOTS;
+    size_t len = (size_t)cap * sizeof(Account);
+    size_t old = (size_t)cap_slots * sizeof(Account);     // whole pages
+    if (ftruncate(data_fd, len) < 0) { perror("grow accounts"); return -1; }
+    // Map only the new part: lock-free readers may be in the old one.
+    if (mmap((char *)table + old, len - old, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             data_fd, old) == MAP_FAILED) {
+        perror("mmap accounts");
+        return -1;
+    }
+    SlotMeta *m = realloc(meta, sizeof(SlotMeta) * cap);
+    if (!m) return -1;
+    memset(m + cap_slots, 0, sizeof(SlotMeta) * (cap - cap_slots));
+    meta = m;
+    cap_slots = cap;
+    return 0;
+}
+
+// Caller holds the slot's stripe lock.
+static void mark_dirty(int slot, uint64_t lsn) {
+    meta[slot].lsn = lsn;
+    if (meta[slot].dirty) return;
+    meta[slot].redo = lsn;
+    Stripe *st = slot_stripe(slot);
+    if (st->n_dirty == st->cap_dirty) {
+        int cap = st->cap_dirty ? st->cap_dirty * 2 : 64;
+        int *p = realloc(st->dirty, sizeof(int) * cap);
+        if (!p) { perror("dirty list"); exit(1); }
+        st->dirty = p;
+        st->cap_dirty = cap;
+    }
+    meta[slot].dirty = 1;
+    st->dirty[st->n_dirty++] = slot;
+}
+
+// Add the new image of a slot to tx and commit it; caller holds its stripe
+// (or struct_lock for writing).
+static uint64_t log_slot_tx(int slot, const Account *before, WalTx *tx) {
+    const Account *a = &table[slot];
+    if (before && a->balance != before->balance &&
+        memcmp(a, before, offsetof(Account, balance)) == 0 &&
+        a->loan_pending == before->loan_pending)
+        wal_tx_balance(tx, a->id, (double)a->balance - before->balance, a->balance);
+    else
+        wal_tx_put(tx, a);
+    uint64_t lsn = wal_commit(tx);
+    mark_dirty(slot, lsn);
+    return lsn;
+}
+
+static void log_slot(int slot, const Account *before) {
+    WalTx tx;
+    wal_tx_begin(&tx);
+    log_slot_tx(slot, before, &tx);
+}
+
+// Everything up to lsn is in the files; the log still has to keep every
+// prepared transfer's record (shard.h) and an unfinished batch's changes
+// (batch.h) for recovery to find them.
+static void release_log(uint64_t lsn) {
+    uint64_t held = xa_oldest_lsn();
+    if (held && held - 1 < lsn) lsn = held - 1;
+    held = batch_oldest_lsn();
+    if (held && held - 1 < lsn) lsn = held - 1;
+    wal_release(lsn);
+}
+
+// Flush the whole mapping; every change in it must already be durable in
+// the WAL.  Caller holds struct_lock for writing (or is single-threaded).
+static int sync_file(void) {
+    file_gen++;
+    if (msync(table, (size_t)cap_slots * sizeof(Account), MS_SYNC) < 0) {
+        perror("msync accounts");
+        return -1;
+    }
+    for (int s = 0; s < cap_slots; s++) meta[s].dirty = 0;
+    for (int i = 0; i < (1 << STRIPE_BITS); i++) stripes[i].n_dirty = 0;
+    return 0;
+}
+
+static void free_push(int slot) {
+    if (n_free == cap_free) {
+        int cap = cap_free ? cap_free * 2 : 1024;
+        int *p = realloc(free_slots, sizeof(int) * cap);
+        if (!p) { perror("free slots"); exit(1); }
+        free_slots = p;
+        cap_free = cap;
+    }
+    int i = n_free++;
+    for (; i > 0 && free_slots[(i - 1) / 2] > slot; i = (i - 1) / 2)
+        free_slots[i] = free_slots[(i - 1) / 2];
+    free_slots[i] = slot;
+}
+
+static void free_pop(void) {
+    int last = free_slots[--n_free];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n_free) break;
+        if (c + 1 < n_free && free_slots[c + 1] < free_slots[c]) c++;
+        if (free_slots[c] >= last) break;
+        free_slots[i] = free_slots[c];
+        i = c;
+    }
+    if (n_free > 0) free_slots[i] = last;
+}
+
+// Lowest free slot below n_slots, or -1.
+static int free_lowest(void) {
+    while (n_free > 0) {
+        int s = free_slots[0];
+        if (s < n_slots && !slot_live(s)) return s;
+        free_pop();
+    }
+    return -1;
+}
+
+// Overwrite a free slot (a tombstone, or at/past n_slots) with acc.  Caller
+// holds struct_lock for writing.
+static void slot_set(int slot, const Account *acc) {
+    Stripe *from = slot_stripe(slot);
+    Stripe *to = stripe_of(acc->id);
+    write_begin(from);
+    if (to != from) write_begin(to);
+    table[slot] = *acc;
+    if (to != from) write_end(to);
+    write_end(from);
+    if (meta[slot].dirty && from != to) {
+        // Still queued for write-back under the old record's stripe.
+        for (int i = 0; i < from->n_dirty; i++) {
+            if (from->dirty[i] == slot) {
+                from->dirty[i] = from->dirty[--from->n_dirty];
+                break;
+            }
+        }
+        uint64_t redo = meta[slot].redo;
+        meta[slot].dirty = 0;
+        mark_dirty(slot, meta[slot].lsn);
+        meta[slot].redo = redo;
+    }
+    if (slot >= n_slots) n_slots = slot + 1;
+}
+
+// Store acc in a free slot and index it.
+static void slot_claim(int slot, const Account *acc) {
+    slot_set(slot, acc);
+    int dead = id_dead > name_dead ? id_dead : name_dead;
+    if ((index_used + dead + 1) * 2 > index_size && index_grow(index_used + 1) < 0) {
+        perror("account index");
+        exit(1);
+    }
+    index_put(slot);
+    order_insert(acc->id);
+}
+
+// Slot for a new record: the lowest hole, else one past the end.
+static int slot_alloc(void) {
+    int slot = free_lowest();
+    if (slot >= 0) {
+        free_pop();
+        return slot;
+    }
+    return table_reserve(n_slots + 1) < 0 ? -1 : n_slots;
+}
+
+// Turn a live slot into a tombstone and offer it for reuse.  Caller holds
+// struct_lock for writing and marks the slot dirty.
+static void slot_free(int slot) {
+    int id = table[slot].id;
+    __atomic_store_n(&id_index[id_pos(slot)], IDX_DELETED, __ATOMIC_RELAXED);
+    __atomic_store_n(&name_index[name_pos(slot)], IDX_DELETED, __ATOMIC_RELAXED);
+    index_used--;
+    id_dead++;
+    name_dead++;
+    order_remove(id);
+    Stripe *st = stripe_of(id);
+    write_begin(st);
+    table[slot].id = -id;
+    write_end(st);
+    free_push(slot);
+}
+
+int store_load(const char *path, int threads) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // Inserts and deletes must not starve behind a steady stream of readers.
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&struct_lock, &attr);
+    for (int i = 0; i < (1 << STRIPE_BITS); i++) pthread_mutex_init(&stripes[i].lock, NULL);
+
+    data_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (data_fd < 0) { perror(path); return -1; }
+    // One process per data directory: a second server, or bulk (bulk.c).
+    if (flock(data_fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "%s is in use by another process\n", path);
+        return -1;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    table = mmap(NULL, (size_t)MAX_SLOTS * sizeof(Account), PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) { perror("reserve accounts mapping"); return -1; }
+
+    off_t size = lseek(data_fd, 0, SEEK_END);
+    int n = size / sizeof(Account);
+    if (table_reserve(n > 0 ? n : 1) < 0) return -1;
+    // Drop the unused tail left by an earlier preallocation or compaction.
+    while (n > 0 && !slot_live(n - 1)) n--;
+    n_slots = n;
+    int dups = index_load(threads);
+    int *ids = malloc(sizeof(int) * (index_used > 0 ? index_used : 1));
+    if (dups < 0 || !ids) return -1;
+    int n_ids = 0, sorted = 1;
+    for (int s = 0; s < n_slots; s++) {
+        if (slot_live(s)) {
+            if (!dups || id_index[id_lookup(table[s].id)] == s) {
+                ids[n_ids] = table[s].id;
+                if (n_ids > 0 && ids[n_ids - 1] > ids[n_ids]) sorted = 0;
+                n_ids++;
+                continue;
+            }
+            // A duplicate the index ignores, e.g. the old copy of a record the
+            // compactor moved before a crash; the WAL still holds the move.
+            table[s].id = -table[s].id;
+            mark_dirty(s, 0);
+        }
+        free_push(s);
+    }
+    order_build(ids, n_ids, sorted);
+    return 0;
+}
+
+// ---------------- recovery and write-back ----------------
+
+/*
+ * Recovery reads the log once, queueing every operation on one of `parts`
+ * partitions by record id, then applies each partition on its own thread.
+ * The changes to one record stay in log order within its partition, and
+ * operations carry after-images, so the order between records is free.
+ */
+typedef struct {
+    uint64_t lsn;
+    WalOp op;                   // followed by op.len payload bytes, padded to 8
+} ReplayEntry;
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} ReplayQueue;
+
+typedef struct {
+    int parts;
+    long ops;
+    uint64_t first, last;       // LSNs replayed
+    ReplayQueue q[MAX_RECOVERY_THREADS];
+} Replay;
+
+static void replay_queue(uint64_t lsn, const WalOp *op, const void *payload, void *arg) {
+    Replay *R = arg;
+    ReplayQueue *q = &R->q[hash_id(op->id) % R->parts];
+    size_t need = sizeof(ReplayEntry) + ((op->len + 7) & ~(size_t)7);
+    if (q->len + need > q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 1 << 16;
+        while (cap < q->len + need) cap *= 2;
+        char *p = realloc(q->buf, cap);
+        if (!p) { perror("replay queue"); exit(1); }
+        q->buf = p;
+        q->cap = cap;
+    }
+    ReplayEntry *e = (ReplayEntry *)(q->buf + q->len);
+    e->lsn = lsn;
+    e->op = *op;
+    memcpy(e + 1, payload, op->len);
+    q->len += need;
+    if (!R->first) R->first = lsn;
+    R->last = lsn;
+    R->ops++;
+}
+
+// Only the calling partition ever touches op->id, so a record found (or
+// found missing) under the read lock stays that way.
+static void replay_op(uint64_t lsn, const WalOp *op, const void *payload) {
+    if (op->type == WAL_LOAN) {
+        loans_replay(lsn, payload);
+        return;
+    }
+    if (op->type == WAL_XA) {
+        xa_replay(lsn, payload);
+        return;
+    }
+    int excl = op->type == WAL_DELETE;
+    if (excl) stats_wrlock(&struct_lock, LOCK_TABLE);
+    else stats_rdlock(&struct_lock, LOCK_TABLE);
+    int i = id_lookup(op->id);
+    if (op->type == WAL_PUT && i < 0) {
+        pthread_rwlock_unlock(&struct_lock);
+        stats_wrlock(&struct_lock, LOCK_TABLE);
+    }
+    switch (op->type) {
+    case WAL_EOD:
+        batch_replay(op->id, lsn);
+        // fall through
+    case WAL_DEBIT:
+    case WAL_CREDIT:
+        if (i >= 0) table[id_index[i]].balance = ((const WalBalance *)payload)->balance;
+        break;
+    case WAL_PUT:
+        if (i >= 0) {
+            table[id_index[i]] = *(const Account *)payload;
+        } else {
+            int slot = slot_alloc();
+            if (slot >= 0) slot_claim(slot, payload);
+        }
+        break;
+    case WAL_DELETE:
+        if (i >= 0) slot_free(id_index[i]);
+        break;
+    }
+    pthread_rwlock_unlock(&struct_lock);
+}
+
+static void replay_part(int part, void *arg) {
+    ReplayQueue *q = &((Replay *)arg)->q[part];
+    for (size_t off = 0; off < q->len;) {
+        const ReplayEntry *e = (const ReplayEntry *)(q->buf + off);
+        replay_op(e->lsn, &e->op, e + 1);
+        off += sizeof(ReplayEntry) + ((e->op.len + 7) & ~(size_t)7);
+    }
+    free(q->buf);
+    q->buf = NULL;
+}
+
+// Apply the WAL from the last checkpoint on top of the loaded files and
+// make the result durable.
+int store_recover(int threads) {
+    static Replay R;
+    R.parts = threads < 1 ? 1 : threads > MAX_RECOVERY_THREADS ? MAX_RECOVERY_THREADS : threads;
+    uint64_t t0 = stats_now();
+    if (wal_open(replay_queue, &R) < 0) return -1;
+    run_parts(R.parts, replay_part, &R);
+    if (R.ops) {
+        if (sync_file() < 0 || loans_writeback(wal_last_lsn()) != 0) return -1;
+        release_log(wal_last_lsn());
+        printf("Replayed %ld WAL operations (LSN %llu to %llu) on %d thread%s in %.0f ms\n",
+               R.ops, (unsigned long long)R.first, (unsigned long long)R.last, R.parts,
+               R.parts == 1 ? "" : "s", (stats_now() - t0) / 1e6);
+    }
+    return 0;
+}
+
+// Followers apply operations one at a time as they arrive, with readers and
+// write-back running; the record is already in the local WAL at lsn.
+void store_apply(uint64_t lsn, const WalOp *op, const void *payload) {
+    if (op->type == WAL_LOAN) {
+        loans_replay(lsn, payload);
+        return;
+    }
+    if (op->type == WAL_XA) {
+        xa_replay(lsn, payload);
+        return;
+    }
+    stats_wrlock(&struct_lock, LOCK_TABLE);
+    int i = id_lookup(op->id);
+    int slot = i >= 0 ? id_index[i] : -1;
+    Stripe *st = stripe_of(op->id);
+    switch (op->type) {
+    case WAL_DEBIT:
+    case WAL_CREDIT:
+    case WAL_EOD:
+        if (slot < 0) break;
+        write_begin(st);
+        table[slot].balance = ((const WalBalance *)payload)->balance;
+        write_end(st);
+        mark_dirty(slot, lsn);
+        break;
+    case WAL_PUT: {
+        const Account *a = payload;
+        if (slot >= 0 && strcmp(table[slot].username, a->username) != 0) {
+            mark_dirty(slot, lsn);      // renamed: index it again
+            slot_free(slot);
+            slot = -1;
+        }
+        if (slot >= 0) {
+            write_begin(st);
+            table[slot] = *a;
+            write_end(st);
+        } else if (name_lookup(a->username) < 0 && (slot = slot_alloc()) >= 0) {
+            slot_claim(slot, a);
+        }
+        if (slot >= 0) mark_dirty(slot, lsn);
+        break;
+    }
+    case WAL_DELETE:
+        if (slot < 0) break;
+        mark_dirty(slot, lsn);
+        slot_free(slot);
+        break;
+    }
+    pthread_rwlock_unlock(&struct_lock);
+}
+
+int store_flush(void) {
+    stats_wrlock(&struct_lock, LOCK_TABLE);
+    int rc = sync_file();
+    pthread_rwlock_unlock(&struct_lock);
+    return rc;
+}
+
+typedef struct {
+    int slot;
+    int flushed;                // its pages went out in this round
+    uint64_t lsn;               // meta.lsn when the round started
+} WbEntry;
+
+// Per page of the mapping, for one write-back round.
+#define PAGE_DIRTY 1            // holds a dirty record
+#define PAGE_HELD  2            // holds one whose log is not durable yet
+static unsigned char *wb_pages;
+static size_t wb_pages_cap;
+
+static size_t first_page(int slot) { return (size_t)slot * sizeof(Account) / page_size; }
+static size_t last_page(int slot) { return ((size_t)slot * sizeof(Account) + sizeof(Account) - 1) / page_size; }
+
+static void sync_pages(size_t first, size_t last) {
+    if (msync((char *)table + first * page_size, (last - first + 1) * page_size, MS_SYNC) < 0)
+        perror("msync accounts");
+}
+
+/* msync is page-granular, and a page may also hold records whose log is
+   not durable yet (WAL rule).  Mark the pages every dirty slot touches,
+   holding back those touched by one the WAL does not cover yet, and flush
+   the rest in runs of consecutive pages.  A slot went out if none of its
+   pages was held.  Linear in the slots, so a batch that dirtied the whole
+   table costs one pass rather than a sort. */
+static void flush_pages(WbEntry *batch, int n, uint64_t durable) {
+    size_t lo = SIZE_MAX, hi = 0;
+    for (int i = 0; i < n; i++) {
+        if (first_page(batch[i].slot) < lo) lo = first_page(batch[i].slot);
+        if (last_page(batch[i].slot) > hi) hi = last_page(batch[i].slot);
+    }
+    if (hi >= wb_pages_cap) {
+        size_t cap = wb_pages_cap ? wb_pages_cap : 1024;
+        while (cap <= hi) cap *= 2;
+        unsigned char *p = realloc(wb_pages, cap);
+        if (!p) return;                 // nothing goes out this round
+        wb_pages = p;
+        wb_pages_cap = cap;
+    }
+    memset(wb_pages + lo, 0, hi - lo + 1);
+    for (int i = 0; i < n; i++) {
+        unsigned char mark = batch[i].lsn > durable ? PAGE_HELD : PAGE_DIRTY;
+        for (size_t p = first_page(batch[i].slot); p <= last_page(batch[i].slot); p++) wb_pages[p] |= mark;
+    }
+    for (size_t p = lo; p <= hi; p++) {
+        if (wb_pages[p] != PAGE_DIRTY) continue;
+        size_t q = p;
+        while (q < hi && wb_pages[q + 1] == PAGE_DIRTY) q++;
+        sync_pages(p, q);
+        p = q;
+    }
+    for (int i = 0; i < n; i++)
+        batch[i].flushed = wb_pages[first_page(batch[i].slot)] == PAGE_DIRTY &&
+                           wb_pages[last_page(batch[i].slot)] == PAGE_DIRTY;
+}
+
+static void *writeback_loop(void *arg) {
+    WbEntry *batch = NULL;
+    int cap = 0;
+    struct timespec ts = { WRITEBACK_MS / 1000, (WRITEBACK_MS % 1000) * 1000000L };
+
+    for (;;) {
+        nanosleep(&ts, NULL);
+        uint64_t newest = 0;
+        int n = 0;
+
+        // Pass 1: snapshot the dirty slots and the LSN each one is at.
+        stats_rdlock(&struct_lock, LOCK_TABLE);
+        unsigned gen = file_gen;
+        for (int k = 0; k < (1 << STRIPE_BITS); k++) {
+            Stripe *st = &stripes[k];
+            stats_mutex_lock(&st->lock, LOCK_STRIPE);
+            if (n + st->n_dirty > cap) {
+                int want = cap ? cap : 1024;
+                while (want < n + st->n_dirty) want *= 2;
+                WbEntry *p = realloc(batch, sizeof(WbEntry) * want);
+                if (p) { batch = p; cap = want; }
+            }
+            for (int i = 0; i < st->n_dirty && n < cap; i++) {
+                int slot = st->dirty[i];
+                batch[n].slot = slot;
+                batch[n].flushed = 0;
+                batch[n].lsn = meta[slot].lsn;
+                if (batch[n].lsn > newest) newest = batch[n].lsn;
+                n++;
+            }
+            pthread_mutex_unlock(&st->lock);
+        }
+        pthread_rwlock_unlock(&struct_lock);
+
+        // Let the log catch up with the snapshot, so no page in it has to
+        // wait for a later round; hot pages would never get a turn otherwise.
+        wal_wait(newest);
+        uint64_t durable = wal_durable_lsn();
+        uint64_t loans_from = loans_writeback(durable);
+        if (n == 0) {
+            release_log(loans_from ? loans_from - 1 : durable);
+            continue;
+        }
+
+        flush_pages(batch, n, durable);
+
+        // Pass 2: clear what went out unchanged; the rest waits for a later round.
+        uint64_t keep_from = loans_from;    // oldest LSN still only in the WAL
+        stats_rdlock(&struct_lock, LOCK_TABLE);
+        if (gen != file_gen) {
+            // The compactor flushed the whole mapping and may have shrunk it.
+            pthread_rwlock_unlock(&struct_lock);
+            continue;
+        }
+        // Only this thread touches meta.flushed; struct_lock keeps meta in place.
+        for (int i = 0; i < n; i++)
+            if (batch[i].flushed) meta[batch[i].slot].flushed = batch[i].lsn + 1;
+        for (int k = 0; k < (1 << STRIPE_BITS); k++) {
+            Stripe *st = &stripes[k];
+            stats_mutex_lock(&st->lock, LOCK_STRIPE);
+            int kept = 0;
+            for (int i = 0; i < st->n_dirty; i++) {
+                int slot = st->dirty[i];
+                uint64_t went = meta[slot].flushed;
+                if (went && meta[slot].lsn + 1 == went) {
+                    meta[slot].dirty = 0;
+                } else {
+                    // Changed again meanwhile: the file has it up to went - 1.
+                    if (went && meta[slot].redo < went) meta[slot].redo = went;
+                    if (!keep_from || meta[slot].redo < keep_from) keep_from = meta[slot].redo;
+                    st->dirty[kept++] = slot;
+                }
+            }
+            st->n_dirty = kept;
+            pthread_mutex_unlock(&st->lock);
+        }
+        for (int i = 0; i < n; i++) meta[batch[i].slot].flushed = 0;
+        pthread_rwlock_unlock(&struct_lock);
+        release_log(keep_from ? keep_from - 1 : durable);
+    }
+    return NULL;
+}
+
+int store_start_writeback(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writeback_loop, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// ---------------- compaction ----------------
+
+// Move the record in slot `from` into the hole `to`.  The move is logged as
+// a full image, so recovery is right whichever of the two slots reached the
+// file first (store_load drops the stale copy).
+static int batch_running;       // store_batch calls under way; set under struct_lock
+
+static void compact_move(int from, int to) {
+    Account rec = table[from];
+    WalTx tx;
+    wal_tx_begin(&tx);
+    wal_tx_put(&tx, &rec);
+    uint64_t lsn = wal_commit(&tx);
+    int i = id_pos(from), j = name_pos(from);
+    slot_set(to, &rec);
+    __atomic_store_n(&id_index[i], to, __ATOMIC_RELEASE);
+    __atomic_store_n(&name_index[j], to, __ATOMIC_RELEASE);
+    Stripe *st = stripe_of(rec.id);
+    write_begin(st);
+    table[from].id = -rec.id;
+    write_end(st);
+    mark_dirty(from, lsn);
+    mark_dirty(to, lsn);
+}
+
+// Give file space back once the table fills under a quarter of it.  The
+// whole mapping is flushed first so no dirty slot is left past the new end,
+// which is only allowed once every dirty record is durable in the WAL.
+static void compact_shrink(void) {
+    int cap = 1024;
+    while (cap < n_slots * 2) cap *= 2;
+    if (cap > cap_slots / 2) return;
+    uint64_t durable = wal_durable_lsn();
+    for (int k = 0; k < (1 << STRIPE_BITS); k++)
+        for (int i = 0; i < stripes[k].n_dirty; i++)
+            if (meta[stripes[k].dirty[i]].lsn > durable) return;     // next round
+    if (sync_file() < 0) return;
+    // A reader that probed before the last moves may still be in the tail.
+    grace_wait(grace_begin());
+    size_t len = (size_t)cap * sizeof(Account);
+    size_t old = (size_t)cap_slots * sizeof(Account);
+    if (mmap((char *)table + len, old - len, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        perror("unmap accounts tail");
+        return;
+    }
+    cap_slots = cap;
+    if (ftruncate(data_fd, len) < 0) perror("shrink accounts");
+}
+
+// One bounded slice under struct_lock; returns 1 if there is more to do.
+static int compact_slice(void) {
+    stats_rdlock(&struct_lock, LOCK_TABLE);
+    int idle = n_slots == index_used && (cap_slots < 2048 || n_slots * 4 > cap_slots);
+    pthread_rwlock_unlock(&struct_lock);
+    if (idle) return 0;
+
+    stats_wrlock(&struct_lock, LOCK_TABLE);
+    // A batch walking the table by slot would miss a record moved behind it.
+    if (batch_running) { pthread_rwlock_unlock(&struct_lock); return 0; }
+    uint64_t t0 = stats_now();
+    int more = 0;
+    for (;;) {
+        while (n_slots > 0 && !slot_live(n_slots - 1)) n_slots--;
+        int hole = free_lowest();
+        if (hole < 0) break;
+        if (stats_now() - t0 > COMPACT_SLICE_US * 1000ull) { more = 1; break; }
+        compact_move(n_slots - 1, hole);
+    }
+    if (!more) compact_shrink();
+    pthread_rwlock_unlock(&struct_lock);
+    return more;
+}
+
+static void *compact_loop(void *arg) {
+    struct timespec idle = { COMPACT_MS / 1000, (COMPACT_MS % 1000) * 1000000L };
+    struct timespec pause = { 0, COMPACT_PAUSE_US * 1000L };
+    for (;;) {
+        nanosleep(&idle, NULL);
+        index_reclaim();
+        while (compact_slice()) nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+int store_start_compactor(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, compact_loop, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int store_count(void) {
+    stats_rdlock(&struct_lock, LOCK_TABLE);
+    int n = index_used;
+    pthread_rwlock_unlock(&struct_lock);
+    return n;
+}
+
+// Copy a record under its stripe lock; caller holds struct_lock.
+static void read_slot(int slot, Account *out) {
+    Stripe *st = stripe_of(table[slot].id);
+    stats_mutex_lock(&st->lock, LOCK_STRIPE);
+    *out = table[slot];
+    pthread_mutex_unlock(&st->lock);
+}
+
+// Copy a record without locking, retrying until no write to its stripe
+// overlapped the copy.  0 if the slot holds no live record (any more).
+static int copy_slot(int slot, Account *out) {
+    for (int spins = 0;; spins++) {
+        int id = __atomic_load_n(&table[slot].id, __ATOMIC_ACQUIRE);
+        if (id <= 0) return 0;
+        Stripe *st = stripe_of(id);
+        unsigned seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            memcpy(out, &table[slot], sizeof(Account));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&st->seq, __ATOMIC_RELAXED) == seq && out->id == id) return 1;
+        }
+        if (spins >= 64) sched_yield();     // the writer may have been preempted
+    }
+}
+
+// Lock-free lookups: probe the published index, copy the slot, and start
+// over if the slot was freed or reused between the two.
+static int view_find_id(const IndexView *v, int id) {
+    uint32_t mask = v->size - 1;
+    for (uint32_t i = hash_id(id) & mask;; i = (i + 1) & mask) {
+        int s = __atomic_load_n(&v->ids[i], __ATOMIC_ACQUIRE);
+        if (s == IDX_EMPTY) return -1;
+        if (s >= 0 && __atomic_load_n(&table[s].id, __ATOMIC_RELAXED) == id) return s;
+    }
+}
+
+static int view_find_name(const IndexView *v, const char *username) {
+    uint32_t mask = v->size - 1;
+    for (uint32_t i = hash_name(username) & mask;; i = (i + 1) & mask) {
+        int s = __atomic_load_n(&v->names[i], __ATOMIC_ACQUIRE);
+        if (s == IDX_EMPTY) return -1;
+        // Racing a write at worst sends us to the check in read_lockfree.
+        if (s >= 0 && strncmp(table[s].username, username, sizeof(table[s].username)) == 0) return s;
+    }
+}
+
+static int read_lockfree(int id, const char *username, Account *out) {
+    if (!username && id <= 0) return 0;     // would match tombstones
+    Account a;
+    int found = 0;
+    Reader *r = reader_enter();
+    for (;;) {
+        const IndexView *v = __atomic_load_n(&index_view, __ATOMIC_ACQUIRE);
+        int s = username ? view_find_name(v, username) : view_find_id(v, id);
+        if (s < 0) break;
+        if (!copy_slot(s, &a)) continue;
+        if (username ? strncmp(a.username, username, sizeof(a.username)) == 0 : a.id == id) {
+            found = 1;
+            break;
+        }
+    }
+    reader_exit(r);
+    if (found && out) *out = a;
+    return found;
+}
+
+int find_account_by_username(const char *username, Account *acc) {
+    return read_lockfree(0, username, acc);
+}
+
+// Find account by numeric id (returns 1 if found and fills acc_out, 0 otherwise)
+int find_account_by_id(int id, Account *acc_out) {
+    return read_lockfree(id, NULL, acc_out);
+}
+
+// Validate username, password, and role
+bool check_credentials(const char *username, const char *password, const char *role, Account *acc) {
+    Account a;
+    if (!find_account_by_username(username, &a)) return false;
+    if (strcmp(a.password, password) != 0 || strcmp(a.role, role) != 0) return false;
+    *acc = a;
+    return true;
+}
+
+void update_account(Account *acc) {
+    stats_rdlock(&struct_lock, LOCK_TABLE);
+    int i = id_lookup(acc->id);
+    if (i >= 0) {
+        int slot = id_index[i];
+        Stripe *st = stripe_of(acc->id);
+        stats_mutex_lock(&st->lock, LOCK_STRIPE);
+        // Username is indexed; keep the stored one so the index stays valid.
+        Account tmp = *acc;
+        memcpy(tmp.username, table[slot].username, sizeof(tmp.username));
+        write_begin(st);
+        table[slot] = tmp;
+        write_end(st);
+        log_slot(slot, NULL);
+        pthread_mutex_unlock(&st->lock);
+    }
+    pthread_rwlock_unlock(&struct_lock);
+}
+
+int modify_account_by_id(int id, account_fn fn, void *arg) {
+    WalTx tx;
+    wal_tx_begin(&tx);
+    return modify_account_in_tx(id, fn, arg, &tx, NULL);
+}
+
+int modify_account_in_tx(int id, account_fn fn, void *arg, WalTx *tx, uint64_t *lsn) {
+    stats_rdlock(&struct_lock, LOCK_TABLE);
+    int i = id_lookup(id);
+    if (i < 0) { pthread_rwlock_unlock(&struct_lock); return -1; }
+    int slot = id_index[i];
+    Stripe *st = stripe_of(id);
+    stats_mutex_lock(&st->lock, LOCK_STRIPE);
+    Account before = table[slot];
+    Account tmp = before;
+    int rc = fn(&tmp, arg);
+    if (rc == 0) {
+        memcpy(tmp.username, before.username, sizeof(tmp.username));
+        tmp.id = id;
+        write_begin(st);
+        table[slot] = tmp;
+        write_end(st);
+        uint64_t l = log_slot_tx(slot, &before, tx);
+        if (lsn) *lsn = l;
+    }
+    pthread_mutex_unlock(&st->lock);
+    pthread_rwlock_unlock(&struct_lock);
+    return rc;
+}
+
+static int credit_fn(Account *acc, void *arg) {
+    acc->balance += *(double *)arg;
+    return 0;
+}
+
+// Credit an account by id
+int credit_account_by_id(int id, double amount) {
+    return modify_account_by_id(id, credit_fn, &amount) == 0 ? 0 : -1;
+}
+
+int transfer_funds(int from_id, int to_id, double amount) {
+    if (from_id == to_id || !(amount > 0)) return XFER_INVALID;
+
+    stats_rdlock(&struct_lock, LOCK_TABLE);
+    int i = id_lookup(from_id), j = id_lookup(to_id);
+    if (i < 0 || j < 0) { pthread_rwlock_unlock(&struct_lock); return i < 0 ? XFER_NO_SOURCE : XFER_NO_ACCOUNT; }
+    int from = id_index[i], to = id_index[j];
+
+    // Always lock the lower stripe first so opposing transfers cannot deadlock.
+    Stripe *a = stripe_of(from_id), *b = stripe_of(to_id);
+    if (a > b) { Stripe *t = a; a = b; b = t; }
+    stats_mutex_lock(&a->lock, LOCK_STRIPE);
+    if (b != a) stats_mutex_lock(&b->lock, LOCK_STRIPE);
+
+    int rc = XFER_INSUFFICIENT;
+    if (table[from].balance >= amount) {
+        write_begin(a);
+        if (b != a) write_begin(b);
+        table[from].balance -= amount;
+        table[to].balance += amount;
+        if (b != a) write_end(b);
+        write_end(a);
+
+        WalTx tx;
+        wal_tx_begin(&tx);
+        wal_tx_balance(&tx, from_id, -amount, table[from].balance);
+        wal_tx_balance(&tx, to_id, amount, table[to].balance);
+        uint64_t lsn = wal_commit(&tx);
+        mark_dirty(from, lsn);
+        mark_dirty(to, lsn);
+        rc = XFER_OK;
+    }
+
+    if (b != a) pthread_mutex_unlock(&b->lock);
+    pthread_mutex_unlock(&a->lock);
+    pthread_rwlock_unlock(&struct_lock);
+    return rc;
+}
+
+int add_account(const Account *acc) {
+    int rc = 0;
+    stats_wrlock(&struct_lock, LOCK_TABLE);
+    if (acc->id <= 0 || id_lookup(acc->id) >= 0 || name_lookup(acc->username) >= 0) {
+        rc = -1;
+    } else {
+        int slot = slot_alloc();
+        if (slot < 0) {
+            rc = -2;
+        } else {
+            slot_claim(slot, acc);
+            log_slot(slot, NULL);
+        }
+    }
+    pthread_rwlock_unlock(&struct_lock);
+    return rc;
+}
+
+// Leave a tombstone in the record's slot; write-back and the compactor
+// deal with the rest in the background.
+int delete_account(int id) {
+    stats_wrlock(&struct_lock, LOCK_TABLE);
+    int i = id_lookup(id);
+    if (i < 0) { pthread_rwlock_unlock(&struct_lock); return 0; }
+    int slot = id_index[i];
+    WalTx tx;
+    wal_tx_begin(&tx);
+    wal_tx_delete(&tx, id);
+    mark_dirty(slot, wal_commit(&tx));
+    slot_free(slot);
+    pthread_rwlock_unlock(&struct_lock);
+    return 1;
+}
+
+int list_accounts(int after_id, Account *out, int max, int *more) {
+    stats_rdlock(&struct_lock, LOCK_TABLE);
+    int b = n_blocks, i = 0;
+    if (after_id != INT_MAX) order_find(after_id + 1, &b, &i);
+    int n = 0;
+    for (; n < max && b < n_blocks; n++) {
+        read_slot(id_index[id_lookup(order_blocks[b]->ids[i])], &out[n]);
+        if (++i == order_blocks[b]->n) { b++; i = 0; }
+    }
+    if (more) *more = b < n_blocks;
+    pthread_rwlock_unlock(&struct_lock);
+    return n;
+}
+
+// Each record is copied under its stripe lock, so a scan never holds up
+// writers to more than one record at a time.
+void for_each_account(account_visit_fn fn, void *arg) {
+    stats_rdlock(&struct_lock, LOCK_TABLE);
+    for (int s = 0; s < n_slots; s++) {
+        if (!slot_live(s)) continue;
+        Account a;
+        read_slot(s, &a);
+        if (fn(&a, arg)) break;
+    }
+    pthread_rwlock_unlock(&struct_lock);
+}
+
+// ---------------- batches ----------------
+
+/*
+ * Each thread takes the next chunk of slots, buckets its live records by
+ * stripe and then takes every stripe lock once for the chunk, committing
+ * that stripe's changes while it still holds it (as every other change is
+ * committed), so the log has each record's updates in the order made.
+ */
+typedef struct {
+    const StoreBatch *b;
+    int n_chunks;
+    int next;                   // next chunk to take
+    long changed[MAX_RECOVERY_THREADS];
+    uint64_t lsn[MAX_RECOVERY_THREADS];
+} BatchRun;
+
+// Apply and log n changes to records of one stripe; caller holds it.
+static uint64_t batch_commit(Stripe *st, const int *slots, const double *delta, int n) {
+    write_begin(st);
+    for (int i = 0; i < n; i++) table[slots[i]].balance += delta[i];
+    write_end(st);
+    WalTx tx;
+    wal_tx_begin(&tx);
+    for (int i = 0; i < n; i++)
+        wal_tx_eod(&tx, table[slots[i]].id, delta[i], table[slots[i]].balance);
+    uint64_t lsn = wal_commit(&tx);
+    for (int i = 0; i < n; i++) mark_dirty(slots[i], lsn);
+    return lsn;
+}
+
+static void batch_part(int part, void *arg) {
+    BatchRun *R = arg;
+    const StoreBatch *b = R->b;
+    int n_stripes = 1 << STRIPE_BITS;
+    int *order = malloc(sizeof(int) * BATCH_CHUNK);
+    int *start = malloc(sizeof(int) * (n_stripes + 1));
+    int *fill = malloc(sizeof(int) * n_stripes);
+    if (!order || !start || !fill) { perror("batch"); exit(1); }
+    int slots[BATCH_TX_OPS];
+    double delta[BATCH_TX_OPS];
+
+    int c;
+    while ((c = __atomic_fetch_add(&R->next, 1, __ATOMIC_RELAXED)) < R->n_chunks) {
+        stats_rdlock(&struct_lock, LOCK_TABLE);
+        int lo = c * BATCH_CHUNK, hi = lo + BATCH_CHUNK < n_slots ? lo + BATCH_CHUNK : n_slots;
+        memset(start, 0, sizeof(int) * (n_stripes + 1));
+        for (int s = lo; s < hi; s++)
+            if (slot_live(s)) start[stripe_of(table[s].id) - stripes + 1]++;
+        for (int k = 0; k < n_stripes; k++) {
+            start[k + 1] += start[k];
+            fill[k] = start[k];
+        }
+        for (int s = lo; s < hi; s++)
+            if (slot_live(s)) order[fill[stripe_of(table[s].id) - stripes]++] = s;
+
+        for (int k = 0; k < n_stripes; k++) {
+            if (start[k] == start[k + 1]) continue;
+            Stripe *st = &stripes[k];
+            stats_mutex_lock(&st->lock, LOCK_STRIPE);
+            int n = 0;
+            for (int j = start[k]; j < start[k + 1]; j++) {
+                double d = b->delta(&table[order[j]], b->arg, part);
+                if (d == 0) continue;
+                slots[n] = order[j];
+                delta[n++] = d;
+                if (n == BATCH_TX_OPS) {
+                    R->lsn[part] = batch_commit(st, slots, delta, n);
+                    R->changed[part] += n;
+                    n = 0;
+                }
+            }
+            if (n) {
+                R->lsn[part] = batch_commit(st, slots, delta, n);
+                R->changed[part] += n;
+            }
+            pthread_mutex_unlock(&st->lock);
+        }
+        pthread_rwlock_unlock(&struct_lock);
+        if (b->chunk_done) b->chunk_done(b->arg, part);
+    }
+    free(order);
+    free(start);
+    free(fill);
+}
+
+long store_batch(const StoreBatch *b, uint64_t *last_lsn) {
+    BatchRun *R = calloc(1, sizeof(BatchRun));
+    if (!R) return -1;
+    R->b = b;
+    int parts = b->threads < 1 ? 1 : b->threads > MAX_RECOVERY_THREADS ? MAX_RECOVERY_THREADS : b->threads;
+
+    stats_wrlock(&struct_lock, LOCK_TABLE);
+    batch_running++;
+    R->n_chunks = (n_slots + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    pthread_rwlock_unlock(&struct_lock);
+
+    run_parts(parts, batch_part, R);
+
+    stats_wrlock(&struct_lock, LOCK_TABLE);
+    batch_running--;
+    pthread_rwlock_unlock(&struct_lock);
+
+    long changed = 0;
+    uint64_t lsn = 0;
+    for (int k = 0; k < parts; k++) {
+        changed += R->changed[k];
+        if (R->lsn[k] > lsn) lsn = R->lsn[k];
+    }
+    if (last_lsn) *last_lsn = lsn;
+    free(R);
+    return changed;
+}
@@ -0,0 +1,91 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include "common.h"
+#include "wal.h"
+
+/*
+ * In-memory account table.
+ *
+ * All Account records are loaded once at startup; lookups by id and by
+ * username go through open-addressing hash indexes.  Every mutation is
+ * logged to the WAL (wal.h); changed records are written back to the data
+ * file lazily, once the log covering them is durable.
+ */
+
+/* Startup: load the data file, then replay the WAL tail after the last
+   checkpoint over it.  Both spread the work over `threads` threads. */
+int  store_load(const char *path, int threads);
+int  store_recover(int threads);
+int  store_start_writeback(void);   // lazy write-back of dirty records
+int  store_start_compactor(void);   // background reuse of deleted slots
+int  store_count(void);
+
+/* Followers (repl.h): apply one operation shipped from the primary, already
+   in the local WAL at lsn (0 while loading a snapshot).  store_flush()
+   writes every record to the data file. */
+void store_apply(uint64_t lsn, const WalOp *op, const void *payload);
+int  store_flush(void);
+
+int  find_account_by_username(const char *username, Account *acc);
+int  find_account_by_id(int id, Account *acc_out);
+bool check_credentials(const char *username, const char *password, const char *role, Account *acc);
+
+void update_account(Account *acc);
+int  credit_account_by_id(int id, double amount);
+
+/* Read-modify-write of a single record under the table lock.
+   fn may return non-zero to abort without writing; that value is returned.
+   Returns -1 if the account does not exist. */
+typedef int (*account_fn)(Account *acc, void *arg);
+int  modify_account_by_id(int id, account_fn fn, void *arg);
+
+/* Same, but the account change is committed together with the operations
+   already in *tx, so recovery sees all of them or none.  *lsn (if given)
+   receives the transaction's LSN; nothing is committed if fn aborts. */
+int  modify_account_in_tx(int id, account_fn fn, void *arg, WalTx *tx, uint64_t *lsn);
+
+/* Move money between two accounts in one WAL transaction. */
+#define XFER_OK            0
+#define XFER_NO_ACCOUNT   -1    // no target account
+#define XFER_INSUFFICIENT -2
+#define XFER_INVALID      -3    // same account or non-positive amount
+#define XFER_NO_SOURCE    -4    // no source account (deleted since login)
+int  transfer_funds(int from_id, int to_id, double amount);
+
+/* Bulk balance update (end-of-day batches, batch.h).  The table is cut into
+   chunks of slots that `threads` threads take in turn; within a chunk the
+   records are grouped by lock stripe and each group's changes are committed
+   as one transaction of WAL_EOD operations.  delta() runs
+   under the record's stripe lock and returns the amount to add to its
+   balance (0 leaves it alone); chunk_done(), if set, runs after each chunk
+   with no lock held.  part is the calling thread's number, 0..threads-1.
+   Compaction waits until the batch is over; records added meanwhile may be
+   missed.  Returns the number of records changed; *last_lsn (if given)
+   receives the highest LSN the batch committed. */
+typedef struct {
+    double (*delta)(const Account *acc, void *arg, int part);
+    void (*chunk_done)(void *arg, int part);
+    void *arg;
+    int threads;
+} StoreBatch;
+long store_batch(const StoreBatch *b, uint64_t *last_lsn);
+
+int  add_account(const Account *acc);    // 0 ok, -1 id/username taken, -2 I/O error
+int  delete_account(int id);             // 1 deleted, 0 not found
+
+/* A deleted record stays in its slot as a tombstone until add_account
+   reuses the slot or the compactor moves a record into it. */
+
+/* One page of accounts in ascending id order, starting after after_id.
+   Fills up to max records and returns how many; *more (if given) is set
+   when further accounts follow.  Each page is a consistent cut: no insert
+   or delete lands in the middle of it. */
+int  list_accounts(int after_id, Account *out, int max, int *more);
+
+/* Visit every live record in file order; stop early if fn returns non-zero. */
+typedef int (*account_visit_fn)(const Account *acc, void *arg);
+void for_each_account(account_visit_fn fn, void *arg);
+
+#endif
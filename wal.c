@@ -0,0 +1,676 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "stats.h"
+
+#define CHECKPOINT_MAGIC 0x434b5031u    // "CKP1"
+#define CHECKPOINT_MS 1000              // least time between checkpoint writes
+
+/* The checkpoint file names the oldest LSN whose change may be missing from
+   the data files; recovery starts reading the log there. */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;        // crc32 of redo_lsn
+    uint64_t redo_lsn;
+} Checkpoint;
+
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER;     // records waiting for the flusher
+static pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER;   // durable LSN advanced
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;   // checkpoint file; taken before wal_mutex
+
+static int wal_fd = -1;
+static off_t seg_bytes;                 // size of the segment being appended to
+static uint64_t *segs;                  // first LSN of each segment file, ascending
+static int n_segs, cap_segs;
+
+static char *buf;                       // committed records not yet written
+static size_t buf_len, buf_cap;
+static uint64_t buf_last_lsn;
+static uint64_t next_lsn = 1;
+static uint64_t written_lsn;            // handed to the OS
+static uint64_t durable_lsn;            // written and fdatasync'ed
+static uint64_t sync_want;              // highest LSN a wal_wait() caller needs durable
+static void (*durable_hook)(void);
+
+static int durability = WAL_GROUP;
+static int group_window_us;
+
+static uint64_t ckpt_lsn;               // redo LSN in the checkpoint file
+static uint64_t ckpt_written;           // when it was last written (stats_now)
+
+static uint64_t retained[WAL_MAX_RETAIN];   // oldest LSN each holder still needs; 0 = free
+
+static __thread uint64_t thread_lsn;
+
+// Slicing-by-8: eight tables, eight bytes per step (same CRC as bytewise).
+static uint32_t crc_table[8][256];
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            crc_table[t][i] = crc_table[0][crc_table[t - 1][i] & 0xff] ^ (crc_table[t - 1][i] >> 8);
+}
+
+static uint32_t crc32(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t c = 0xffffffffu;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+#endif
+    while (len--) c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+// ---------------- transaction building ----------------
+
+void wal_tx_begin(WalTx *tx) {
+    tx->len = 0;
+    tx->n_ops = 0;
+}
+
+static int tx_add(WalTx *tx, int type, int id, const void *payload, uint16_t len) {
+    if (tx->len + sizeof(WalOp) + len > sizeof(tx->buf)) return -1;
+    WalOp op = { .type = type, .len = len, .id = id };
+    memcpy(tx->buf + tx->len, &op, sizeof(op));
+    if (len) memcpy(tx->buf + tx->len + sizeof(op), payload, len);
+    tx->len += sizeof(op) + len;
+    tx->n_ops++;
+    return 0;
+}
+
+int wal_tx_balance(WalTx *tx, int id, double amount, float balance) {
+    WalBalance b = { .amount = amount, .balance = balance, .time = time(NULL) };
+    return tx_add(tx, amount < 0 ? WAL_DEBIT : WAL_CREDIT, id, &b, sizeof(b));
+}
+
+int wal_tx_put(WalTx *tx, const Account *acc) {
+    return tx_add(tx, WAL_PUT, acc->id, acc, sizeof(Account));
+}
+
+int wal_tx_delete(WalTx *tx, int id) {
+    return tx_add(tx, WAL_DELETE, id, NULL, 0);
+}
+
+int wal_tx_loan(WalTx *tx, const Loan *loan) {
+    return tx_add(tx, WAL_LOAN, loan->loan_id, loan, sizeof(Loan));
+}
+
+int wal_tx_xa(WalTx *tx, const WalXa *xa) {
+    return tx_add(tx, WAL_XA, xa->id, xa, sizeof(*xa));
+}
+
+int wal_tx_eod(WalTx *tx, int id, double amount, float balance) {
+    WalBalance b = { .amount = amount, .balance = balance, .time = time(NULL) };
+    return tx_add(tx, WAL_EOD, id, &b, sizeof(b));
+}
+
+uint64_t wal_commit(WalTx *tx) {
+    if (tx->n_ops == 0) return 0;
+    WalRecord h = { .magic = WAL_MAGIC, .len = tx->len,
+                    .crc = crc32(tx->buf, tx->len), .n_ops = tx->n_ops };
+
+    stats_mutex_lock(&wal_mutex, LOCK_WAL);
+    size_t need = buf_len + sizeof(h) + tx->len;
+    if (need > buf_cap) {
+        size_t cap = buf_cap ? buf_cap : 64 * 1024;
+        while (cap < need) cap *= 2;
+        char *p = realloc(buf, cap);
+        if (!p) { perror("wal buffer"); exit(1); }
+        buf = p;
+        buf_cap = cap;
+    }
+    h.lsn = next_lsn++;
+    memcpy(buf + buf_len, &h, sizeof(h));
+    memcpy(buf + buf_len + sizeof(h), tx->buf, tx->len);
+    buf_len = need;
+    buf_last_lsn = h.lsn;
+    pthread_cond_signal(&wal_work);
+    pthread_mutex_unlock(&wal_mutex);
+
+    if (h.lsn > thread_lsn) thread_lsn = h.lsn;
+    return h.lsn;
+}
+
+uint64_t wal_durable_lsn(void) {
+    return __atomic_load_n(&durable_lsn, __ATOMIC_ACQUIRE);
+}
+
+uint64_t wal_ack_lsn(void) {
+    return durability == WAL_RELAXED ? __atomic_load_n(&written_lsn, __ATOMIC_ACQUIRE)
+                                     : wal_durable_lsn();
+}
+
+uint64_t wal_last_lsn(void) {
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = next_lsn - 1;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+}
+
+void wal_wait(uint64_t lsn) {
+    if (wal_durable_lsn() >= lsn) return;
+    pthread_mutex_lock(&wal_mutex);
+    // In relaxed mode nothing is synced unless somebody asks.
+    if (lsn > sync_want) {
+        sync_want = lsn;
+        pthread_cond_signal(&wal_work);
+    }
+    while (durable_lsn < lsn) pthread_cond_wait(&wal_synced, &wal_mutex);
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+void wal_wait_ack(uint64_t lsn) {
+    if (wal_ack_lsn() >= lsn) return;
+    pthread_mutex_lock(&wal_mutex);
+    while (wal_ack_lsn() < lsn) pthread_cond_wait(&wal_synced, &wal_mutex);
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+int wal_wait_ack_for(uint64_t lsn, int ms) {
+    if (wal_ack_lsn() >= lsn) return 1;
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+    pthread_mutex_lock(&wal_mutex);
+    while (wal_ack_lsn() < lsn)
+        if (pthread_cond_timedwait(&wal_synced, &wal_mutex, &until) != 0) break;
+    pthread_mutex_unlock(&wal_mutex);
+    return wal_ack_lsn() >= lsn;
+}
+
+uint64_t wal_thread_lsn(void) { return thread_lsn; }
+void wal_thread_reset(void) { thread_lsn = 0; }
+
+void wal_set_durable_hook(void (*fn)(void)) {
+    durable_hook = fn;
+}
+
+int wal_set_durability(const char *spec) {
+    char *end;
+    if (strcmp(spec, "strict") == 0) {
+        durability = WAL_STRICT;
+    } else if (strcmp(spec, "relaxed") == 0) {
+        durability = WAL_RELAXED;
+    } else if (strcmp(spec, "group") == 0) {
+        durability = WAL_GROUP;
+        group_window_us = 0;
+    } else if (strncmp(spec, "group:", 6) == 0) {
+        long us = strtol(spec + 6, &end, 10);
+        if (*end || end == spec + 6 || us < 0 || us > MAX_GROUP_WINDOW_US) return -1;
+        durability = WAL_GROUP;
+        group_window_us = us;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *wal_durability_name(void) {
+    static char name[64];
+    switch (durability) {
+    case WAL_STRICT: return "strict (fdatasync per transaction)";
+    case WAL_RELAXED: return "relaxed (OS-buffered, synced only for write-back)";
+    }
+    if (group_window_us == 0) return "group (one fdatasync per batch)";
+    snprintf(name, sizeof(name), "group (one fdatasync per %d us window)", group_window_us);
+    return name;
+}
+
+// ---------------- segment files ----------------
+
+static void seg_path(char *out, size_t n, uint64_t first_lsn) {
+    snprintf(out, n, "%s.%020llu", WAL_FILE, (unsigned long long)first_lsn);
+}
+
+static void wal_dir(char *out, size_t n) {
+    snprintf(out, n, "%s", WAL_FILE);
+    char *slash = strrchr(out, '/');
+    if (slash) *slash = 0;
+    else snprintf(out, n, ".");
+}
+
+static void sync_dir(void) {
+    char dir[256];
+    wal_dir(dir, sizeof(dir));
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) { fsync(fd); close(fd); }
+}
+
+static int seg_push(uint64_t first) {
+    if (n_segs == cap_segs) {
+        int cap = cap_segs ? cap_segs * 2 : 16;
+        uint64_t *p = realloc(segs, sizeof(uint64_t) * cap);
+        if (!p) return -1;
+        segs = p;
+        cap_segs = cap;
+    }
+    segs[n_segs++] = first;
+    return 0;
+}
+
+// Start appending to the segment whose first record will be `first`.
+static int seg_open(uint64_t first) {
+    char path[256];
+    seg_path(path, sizeof(path), first);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) { perror(path); return -1; }
+    if (wal_fd >= 0) close(wal_fd);
+    wal_fd = fd;
+    seg_bytes = lseek(fd, 0, SEEK_END);
+    if (n_segs == 0 || segs[n_segs - 1] != first) seg_push(first);
+    sync_dir();
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int list_segments(void) {
+    char dir[256];
+    wal_dir(dir, sizeof(dir));
+    const char *base = strrchr(WAL_FILE, '/');
+    base = base ? base + 1 : WAL_FILE;
+    size_t blen = strlen(base);
+
+    DIR *d = opendir(dir);
+    if (!d) { perror(dir); return -1; }
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, base, blen) == 0 && e->d_name[blen] == '.')
+            seg_push(strtoull(e->d_name + blen + 1, NULL, 10));
+    }
+    closedir(d);
+    qsort(segs, n_segs, sizeof(uint64_t), cmp_u64);
+    return 0;
+}
+
+// Replay one segment, skipping records before ckpt_lsn.  Returns 0 if it
+// was intact, 1 if a torn tail was cut off.
+static int replay_segment(uint64_t first, uint64_t *last, wal_apply_fn apply, void *arg) {
+    char path[256];
+    seg_path(path, sizeof(path), first);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) { perror(path); return -1; }
+    off_t size = lseek(fd, 0, SEEK_END);
+    char *data = malloc(size ? size : 1);
+    if (!data || pread(fd, data, size, 0) != size) {
+        perror(path); free(data); close(fd); return -1;
+    }
+
+    off_t off = 0;
+    while (off + (off_t)sizeof(WalRecord) <= size) {
+        WalRecord h;
+        memcpy(&h, data + off, sizeof(h));
+        if (h.magic != WAL_MAGIC || off + (off_t)sizeof(h) + h.len > size ||
+            h.lsn <= *last || crc32(data + off + sizeof(h), h.len) != h.crc)
+            break;
+        const char *p = data + off + sizeof(h);
+        for (uint32_t i = 0; i < h.n_ops && h.lsn >= ckpt_lsn; i++) {
+            const WalOp *op = (const WalOp *)p;
+            apply(h.lsn, op, p + sizeof(WalOp), arg);
+            p += sizeof(WalOp) + op->len;
+        }
+        *last = h.lsn;
+        off += sizeof(h) + h.len;
+    }
+
+    int torn = off < size;
+    if (torn) {
+        fprintf(stderr, "WAL: discarding %lld torn bytes at end of %s\n",
+                (long long)(size - off), path);
+        if (ftruncate(fd, off) < 0) perror("ftruncate");
+        fsync(fd);
+    }
+    free(data);
+    close(fd);
+    return torn;
+}
+
+static void checkpoint_path(char *out, size_t n, int tmp) {
+    snprintf(out, n, "%s%s", CHECKPOINT_FILE, tmp ? ".tmp" : "");
+}
+
+static uint64_t checkpoint_read(void) {
+    char path[256];
+    checkpoint_path(path, sizeof(path), 0);
+    Checkpoint c;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, &c, sizeof(c));
+    close(fd);
+    if (n != sizeof(c) || c.magic != CHECKPOINT_MAGIC ||
+        c.crc != crc32(&c.redo_lsn, sizeof(c.redo_lsn))) {
+        fprintf(stderr, "WAL: ignoring damaged %s\n", path);
+        return 0;
+    }
+    return c.redo_lsn;
+}
+
+// Write the file next to it and rename it over, so a crash leaves either
+// the old checkpoint or the new one.
+static void checkpoint_write(uint64_t redo) {
+    char tmp[256], path[256];
+    checkpoint_path(tmp, sizeof(tmp), 1);
+    checkpoint_path(path, sizeof(path), 0);
+    Checkpoint c = { CHECKPOINT_MAGIC, crc32(&redo, sizeof(redo)), redo };
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(tmp); return; }
+    int ok = write(fd, &c, sizeof(c)) == sizeof(c) && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) { perror("write checkpoint"); return; }
+    sync_dir();
+    ckpt_lsn = redo;
+}
+
+int wal_open(wal_apply_fn apply, void *arg) {
+    crc_init();
+    if (list_segments() < 0) return -1;
+    ckpt_lsn = checkpoint_read();
+
+    uint64_t last = 0;
+    int i;
+    for (i = 0; i < n_segs; i++) {
+        if (i + 1 < n_segs && segs[i + 1] <= ckpt_lsn) {
+            // Wholly before the checkpoint; wal_release just had not got to it.
+            last = segs[i + 1] - 1;
+            continue;
+        }
+        int rc = replay_segment(segs[i], &last, apply, arg);
+        if (rc < 0) return -1;
+        if (rc == 1) { i++; break; }
+    }
+    // Anything after a torn record was never acknowledged.
+    for (int j = i; j < n_segs; j++) {
+        char path[256];
+        seg_path(path, sizeof(path), segs[j]);
+        unlink(path);
+    }
+    n_segs = i;
+
+    // LSNs must keep growing past the checkpoint even if no log is left.
+    if (ckpt_lsn > last + 1) last = ckpt_lsn - 1;
+    next_lsn = last + 1;
+    buf_last_lsn = written_lsn = durable_lsn = last;
+    return seg_open(next_lsn);
+}
+
+uint64_t wal_checkpoint_lsn(void) {
+    return ckpt_lsn;
+}
+
+void wal_release(uint64_t lsn) {
+    pthread_mutex_lock(&ckpt_lock);
+    // Record the new starting point before dropping the log behind it.
+    uint64_t now = stats_now();
+    if (lsn + 1 > ckpt_lsn && now - ckpt_written >= CHECKPOINT_MS * 1000000ull) {
+        checkpoint_write(lsn + 1);
+        ckpt_written = now;
+    }
+    if (ckpt_lsn == 0) { pthread_mutex_unlock(&ckpt_lock); return; }
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t keep = ckpt_lsn;
+    for (int k = 0; k < WAL_MAX_RETAIN; k++)
+        if (retained[k] && retained[k] < keep) keep = retained[k];
+    // Segment k holds LSNs [segs[k], segs[k+1]); the last one is still open.
+    while (n_segs >= 2 && segs[1] <= keep) {
+        char path[256];
+        seg_path(path, sizeof(path), segs[0]);
+        unlink(path);
+        memmove(segs, segs + 1, sizeof(uint64_t) * (n_segs - 1));
+        n_segs--;
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    pthread_mutex_unlock(&ckpt_lock);
+}
+
+int wal_retain(uint64_t lsn) {
+    pthread_mutex_lock(&wal_mutex);
+    int h = -1;
+    for (int k = 0; k < WAL_MAX_RETAIN && h < 0; k++)
+        if (!retained[k]) h = k;
+    if (h >= 0) retained[h] = lsn ? lsn : 1;
+    pthread_mutex_unlock(&wal_mutex);
+    return h;
+}
+
+void wal_retain_move(int h, uint64_t lsn) {
+    pthread_mutex_lock(&wal_mutex);
+    if (lsn > retained[h]) retained[h] = lsn;
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+void wal_retain_drop(int h) {
+    pthread_mutex_lock(&wal_mutex);
+    retained[h] = 0;
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+// ---------------- reading the log back ----------------
+
+int wal_reader_open(WalReader *r, uint64_t from) {
+    r->fd = -1;
+    pthread_mutex_lock(&wal_mutex);
+    int k = n_segs - 1;
+    while (k >= 0 && segs[k] > from) k--;
+    uint64_t first = k >= 0 ? segs[k] : 0;
+    int ok = k >= 0 && from <= next_lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    if (!ok) return -1;
+
+    char path[256];
+    seg_path(path, sizeof(path), first);
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) return -1;
+    // Skip the records before `from`; they are all written already.
+    r->off = 0;
+    WalRecord h;
+    while (pread(r->fd, &h, sizeof(h), r->off) == sizeof(h) && h.magic == WAL_MAGIC && h.lsn < from)
+        r->off += sizeof(h) + h.len;
+    r->next = from;
+    return 0;
+}
+
+int wal_reader_next(WalReader *r, void *out, size_t cap) {
+    if (r->next > wal_ack_lsn()) return 0;
+    WalRecord h;
+    if (pread(r->fd, &h, sizeof(h), r->off) != sizeof(h)) {
+        // The end of this segment: the flusher has moved on to the next.
+        char path[256];
+        seg_path(path, sizeof(path), r->next);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return 0;
+        close(r->fd);
+        r->fd = fd;
+        r->off = 0;
+        if (pread(r->fd, &h, sizeof(h), 0) != sizeof(h)) return 0;
+    }
+    if (h.magic != WAL_MAGIC || h.lsn < r->next || sizeof(h) + h.len > cap) return -1;
+    if (h.lsn > wal_ack_lsn()) return 0;
+    memcpy(out, &h, sizeof(h));
+    if (pread(r->fd, (char *)out + sizeof(h), h.len, r->off + sizeof(h)) != h.len) return -1;
+    r->off += sizeof(h) + h.len;
+    r->next = h.lsn + 1;
+    return sizeof(h) + h.len;
+}
+
+void wal_reader_close(WalReader *r) {
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+}
+
+// ---------------- followers ----------------
+
+uint64_t wal_append(const WalRecord *h, const void *ops) {
+    if (h->magic != WAL_MAGIC || crc32(ops, h->len) != h->crc) return 0;
+    stats_mutex_lock(&wal_mutex, LOCK_WAL);
+    if (h->lsn < next_lsn) {
+        pthread_mutex_unlock(&wal_mutex);
+        return 0;
+    }
+    size_t need = buf_len + sizeof(*h) + h->len;
+    if (need > buf_cap) {
+        size_t cap = buf_cap ? buf_cap : 64 * 1024;
+        while (cap < need) cap *= 2;
+        char *p = realloc(buf, cap);
+        if (!p) { perror("wal buffer"); exit(1); }
+        buf = p;
+        buf_cap = cap;
+    }
+    memcpy(buf + buf_len, h, sizeof(*h));
+    memcpy(buf + buf_len + sizeof(*h), ops, h->len);
+    buf_len = need;
+    buf_last_lsn = h->lsn;
+    next_lsn = h->lsn + 1;
+    pthread_cond_signal(&wal_work);
+    pthread_mutex_unlock(&wal_mutex);
+    return h->lsn;
+}
+
+int wal_reset(uint64_t next) {
+    pthread_mutex_lock(&ckpt_lock);
+    pthread_mutex_lock(&wal_mutex);
+    int busy = buf_last_lsn != durable_lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    if (!busy) checkpoint_write(next);
+    if (busy || ckpt_lsn != next) {
+        pthread_mutex_unlock(&ckpt_lock);
+        return -1;
+    }
+    pthread_mutex_lock(&wal_mutex);
+    for (int k = 0; k < n_segs; k++) {
+        char path[256];
+        seg_path(path, sizeof(path), segs[k]);
+        unlink(path);
+    }
+    n_segs = 0;
+    next_lsn = next;
+    buf_last_lsn = written_lsn = durable_lsn = next - 1;
+    seg_bytes = 0;
+    int rc = seg_open(next);
+    pthread_mutex_unlock(&wal_mutex);
+    pthread_mutex_unlock(&ckpt_lock);
+    return rc;
+}
+
+// ---------------- group commit ----------------
+
+static void write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("wal write");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void sync_log(void) {
+    if (fdatasync(wal_fd) < 0) { perror("wal fdatasync"); exit(1); }
+}
+
+// Everything up to upto has been written, and synced if `synced`.  Caller
+// holds wal_mutex and runs the durable hook once it has let go.
+static void advance(uint64_t upto, int synced) {
+    __atomic_store_n(&written_lsn, upto, __ATOMIC_RELEASE);
+    if (synced) __atomic_store_n(&durable_lsn, upto, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&wal_synced);
+}
+
+static void *group_commit_loop(void *arg) {
+    char *mine = NULL;
+    size_t mine_cap = 0;
+
+    pthread_mutex_lock(&wal_mutex);
+    for (;;) {
+        while (buf_len == 0 && sync_want <= durable_lsn) pthread_cond_wait(&wal_work, &wal_mutex);
+        if (durability == WAL_GROUP && group_window_us > 0 && buf_len > 0) {
+            // Give other sessions the window to join this batch.
+            struct timespec ts = { 0, group_window_us * 1000L };
+            pthread_mutex_unlock(&wal_mutex);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&wal_mutex);
+        }
+
+        // Take everything committed so far; new commits go to the other buffer.
+        char *batch = buf;
+        size_t len = buf_len, cap = buf_cap;
+        uint64_t upto = buf_last_lsn;
+        int sync = durability != WAL_RELAXED || sync_want > durable_lsn;
+        buf = mine; buf_cap = mine_cap; buf_len = 0;
+        mine = batch; mine_cap = cap;
+        pthread_mutex_unlock(&wal_mutex);
+
+        if (durability == WAL_STRICT) {
+            // Each transaction is written and synced on its own.
+            for (size_t off = 0; off < len;) {
+                WalRecord h;
+                memcpy(&h, batch + off, sizeof(h));
+                write_all(wal_fd, batch + off, sizeof(h) + h.len);
+                sync_log();
+                off += sizeof(h) + h.len;
+                pthread_mutex_lock(&wal_mutex);
+                advance(h.lsn, 1);
+                pthread_mutex_unlock(&wal_mutex);
+                if (durable_hook) durable_hook();
+            }
+        } else {
+            write_all(wal_fd, batch, len);
+            if (sync) sync_log();
+        }
+        seg_bytes += len;
+
+        pthread_mutex_lock(&wal_mutex);
+        if (durability != WAL_STRICT) advance(upto, sync);
+        if (seg_bytes >= WAL_SEGMENT_BYTES) {
+            // Recovery stops at the first hole, so a segment is complete
+            // on disk before the next one starts.
+            if (!sync) { sync_log(); advance(upto, 1); }
+            seg_open(upto + 1);
+        }
+        pthread_mutex_unlock(&wal_mutex);
+
+        if (durable_hook && durability != WAL_STRICT) durable_hook();
+        pthread_mutex_lock(&wal_mutex);
+    }
+    return NULL;
+}
+
+int wal_start(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, group_commit_loop, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "common.h"
+
+/*
+ * Write-ahead log.
+ *
+ * Each transaction is one framed record: a WalRecord header followed by
+ * n_ops operations.  The CRC covers the operations, so a record torn by a
+ * crash is detected and discarded on replay; that makes the header act as
+ * BEGIN and a valid CRC as COMMIT.  Operations carry after-images, so
+ * replaying a record more than once is harmless.
+ *
+ * wal_commit() only copies the record into the in-memory log buffer.  A
+ * single group-commit thread writes and fdatasyncs everything that has
+ * accumulated since its previous round, so many concurrent sessions share
+ * one fsync.  Callers acknowledge a mutation only once wal_ack_lsn() has
+ * reached the LSN it was given.
+ *
+ * How that thread syncs is the durability mode, chosen at startup:
+ *   strict   every transaction is written and fdatasync'ed on its own
+ *   group    one fdatasync per batch; "group:USEC" first waits USEC for
+ *            more commits to join it
+ *   relaxed  transactions are acknowledged once written to the OS and only
+ *            synced when wal_wait() asks (write-back does, before it writes
+ *            any data page), so a power failure loses the latest ones
+ */
+
+#define WAL_MAGIC 0x57414c31u           // "WAL1"
+#define WAL_SEGMENT_BYTES (64 << 20)    // rotate to a new segment file after this
+#define MAX_GROUP_WINDOW_US 100000
+
+/* Durability modes */
+#define WAL_STRICT  0
+#define WAL_GROUP   1                   // the default
+#define WAL_RELAXED 2
+
+/* Operation types */
+#define WAL_DEBIT   1                   // balance decreased
+#define WAL_CREDIT  2                   // balance increased
+#define WAL_PUT     3                   // full account image (insert / modify)
+#define WAL_DELETE  4
+#define WAL_LOAN    5                   // full Loan image, id = loan_id (loans.h)
+#define WAL_XA      6                   // two-phase transfer state (shard.h)
+#define WAL_EOD     7                   // balance change by an end-of-day batch (batch.h)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;        // bytes of operations following the header
+    uint64_t lsn;
+    uint32_t crc;        // crc32 of the operation bytes
+    uint32_t n_ops;
+} WalRecord;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  pad;
+    uint16_t len;        // payload bytes following this header
+    int32_t  id;         // account id
+} WalOp;
+
+typedef struct {
+    double amount;       // signed delta, kept for auditing
+    float  balance;      // balance after the operation (what replay applies)
+    uint32_t time;       // when it was committed (unix seconds; 0 in older logs)
+} WalBalance;
+
+typedef struct {
+    uint64_t txid;       // chosen by the coordinator
+    int32_t  state;      // XA_PREPARED, XA_COMMITTED or XA_ABORTED
+    int32_t  id;         // account id
+    double   amount;     // < 0 debit, > 0 credit
+} WalXa;
+
+/* A transaction being assembled by one thread (no locking needed). */
+typedef struct {
+    uint32_t len;
+    uint32_t n_ops;
+    unsigned char buf[TX_BUF];
+} WalTx;
+
+void wal_tx_begin(WalTx *tx);
+int  wal_tx_balance(WalTx *tx, int id, double amount, float balance);
+int  wal_tx_put(WalTx *tx, const Account *acc);
+int  wal_tx_delete(WalTx *tx, int id);
+int  wal_tx_loan(WalTx *tx, const Loan *loan);
+int  wal_tx_xa(WalTx *tx, const WalXa *xa);
+int  wal_tx_eod(WalTx *tx, int id, double amount, float balance);
+
+/* Append the transaction to the log buffer and return its LSN (0 if empty).
+   Never blocks on I/O. Also recorded as this thread's wal_thread_lsn(). */
+uint64_t wal_commit(WalTx *tx);
+
+uint64_t wal_durable_lsn(void);
+uint64_t wal_ack_lsn(void);             // durable, or in relaxed mode written
+uint64_t wal_last_lsn(void);
+void     wal_wait(uint64_t lsn);        // block until lsn is durable
+void     wal_wait_ack(uint64_t lsn);    // block until lsn may be acknowledged
+int      wal_wait_ack_for(uint64_t lsn, int ms);   // same, giving up after ms; 1 if reached
+
+/* Pick the durability mode from "strict", "group", "group:USEC" or
+   "relaxed"; -1 if spec is none of those.  Call before wal_start(). */
+int  wal_set_durability(const char *spec);
+const char *wal_durability_name(void);
+
+/* Highest LSN committed by the calling thread since wal_thread_reset(). */
+uint64_t wal_thread_lsn(void);
+void     wal_thread_reset(void);
+
+/* Called by the group-commit thread each time the acknowledged LSN advances. */
+void wal_set_durable_hook(void (*fn)(void));
+
+/* Replay every intact record from the checkpoint's redo LSN on, in LSN
+   order, then prepare for appending.  apply() is called once per operation. */
+typedef void (*wal_apply_fn)(uint64_t lsn, const WalOp *op, const void *payload, void *arg);
+int  wal_open(wal_apply_fn apply, void *arg);
+int  wal_start(void);
+
+/* Log shipping.  A WalReader follows the segment files from a given LSN,
+   returning whole records (header + ops, as in the file) once they may be
+   acknowledged.  wal_retain() keeps wal_release() from dropping segments a
+   reader still needs; each holder moves its LSN forward as it goes. */
+#define WAL_MAX_RETAIN 16
+
+typedef struct {
+    int fd;
+    off_t off;
+    uint64_t next;       // LSN wanted next
+} WalReader;
+
+int  wal_reader_open(WalReader *r, uint64_t from);  // -1 if from is no longer on disk
+int  wal_reader_next(WalReader *r, void *out, size_t cap);  // bytes; 0 = none yet; -1 = broken
+void wal_reader_close(WalReader *r);
+
+int  wal_retain(uint64_t lsn);          // handle, or -1 if all are taken
+void wal_retain_move(int h, uint64_t lsn);
+void wal_retain_drop(int h);
+
+/* Followers: append a record received from the primary under its own LSN,
+   which must be past every local one.  Returns the LSN, or 0 if the record
+   is damaged or out of order.  wal_reset() empties the log, after a
+   snapshot has been made durable in the data files, so that it continues
+   at `next`; it fails unless everything committed is durable. */
+uint64_t wal_append(const WalRecord *h, const void *ops);
+int  wal_reset(uint64_t next);
+
+/* Everything up to lsn is persisted elsewhere.  Records lsn + 1 as the
+   checkpoint (at most once every CHECKPOINT_MS) and drops segments that
+   only contain records before the checkpoint. */
+void wal_release(uint64_t lsn);
+uint64_t wal_checkpoint_lsn(void);      // where the next recovery would start
+
+#endif